@@ -0,0 +1,153 @@
+// backend.h - Request tags, replies and the shared-memory loop of Server A, P and Q
+
+// Server M prefixes each request with a "#<id> " tag; the reply carries the
+// same tag. A backend may serve requests on several threads (--workers, and
+// the shared-memory thread), so everything about the request in progress is
+// per thread. Each server wraps backend_strip_tag() and backend_send_reply()
+// in its own strip_request_tag() and send_reply(), which pass its socket,
+// ring and trace log.
+//
+// --transport=shm: Server M's requests also arrive over a shared-memory ring,
+// served by backend_shm_serve() on a thread of its own; the replies go back
+// through the other ring.
+//
+// Tracing (see trace.h): requests whose tag carries a trace id get a span
+// from receive to reply.
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include "shmring.h"
+#include "trace.h"
+#include "priority.h"
+
+#define BACKEND_SHM_WAIT_NS 1000000000LL  // a reply waits this long for a free slot in Server M's ring
+
+typedef void (*BackendProcess)(const char* message, struct sockaddr_in* client_addr, socklen_t client_len);
+
+// What backend_shm_serve() serves
+struct BackendShm {
+    ShmChannel* channel;
+    TraceLog* trace_log;
+    BackendProcess process;
+    pthread_mutex_t* process_lock;  // held around each process() call, NULL when it is thread-safe
+};
+
+static thread_local std::string backend_reply_tag;
+static thread_local bool backend_reply_via_shm = false;  // the message being processed came from the ring
+static thread_local long long backend_received_ns = 0;   // when this thread's last message arrived
+static thread_local unsigned long long backend_trace_id = 0;  // 0 when the current request is not traced
+static thread_local long long backend_trace_receive_ns = 0;
+static thread_local long long backend_trace_process_ns = 0;
+static thread_local std::string backend_trace_name;     // the request's command word
+static pthread_mutex_t backend_trace_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Remember and skip Server M's "#<id> " request tag, untagged messages pass through
+static inline const char* backend_strip_tag(TraceLog* log, char* message) {
+    backend_reply_tag.clear();
+    backend_trace_id = 0;
+    if (message[0] != '#') {
+        return message;
+    }
+    char* space = strchr(message, ' ');
+    if (space == NULL) {
+        return message;
+    }
+    backend_reply_tag.assign(message, space - message + 1);
+
+    backend_trace_id = trace_id_from_tag(message, space - message);
+    bool trace_open = false;
+    if (backend_trace_id != 0) {
+        pthread_mutex_lock(&backend_trace_open_lock);
+        trace_open = trace_log_open(log, false);
+        pthread_mutex_unlock(&backend_trace_open_lock);
+    }
+    if (trace_open) {
+        backend_trace_receive_ns = backend_received_ns;
+        backend_trace_process_ns = shm_now_ns();
+        backend_trace_name.assign(space + 1, strcspn(space + 1, " "));
+    } else {
+        backend_trace_id = 0;
+    }
+    return space + 1;
+}
+
+// Record the traced request's span, with its receive, process and send times
+static inline void backend_trace_reply_sent(TraceLog* log) {
+    if (backend_trace_id == 0) {
+        return;
+    }
+    long long now = shm_now_ns();
+    char args[128];
+    snprintf(args, sizeof(args), "\"recv_ns\":%lld,\"process_ns\":%lld,\"send_ns\":%lld",
+             backend_trace_receive_ns, backend_trace_process_ns, now);
+    trace_span(log, backend_trace_id, backend_trace_name.c_str(), backend_trace_receive_ns, now, args);
+    backend_trace_id = 0;
+}
+
+// sendto() with the current request's tag in front, or the reply ring when
+// the request came from it
+static inline int backend_send_reply(int sockfd, ShmChannel* channel, TraceLog* log, const char* data, size_t len,
+                                     struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::string reply = backend_reply_tag;
+    reply.append(data, len);
+    backend_trace_reply_sent(log);
+    if (backend_reply_via_shm) {
+        if (reply.size() > SHM_MSG_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        // Server M may be a moment behind, wait for a free slot
+        long long give_up_ns = shm_now_ns() + BACKEND_SHM_WAIT_NS;
+        while (!shm_ring_push(&channel->replies, reply.data(), reply.size())) {
+            if (shm_now_ns() > give_up_ns) {
+                errno = ENOBUFS;
+                return -1;
+            }
+            sched_yield();
+        }
+        return (int)reply.size();
+    }
+    return sendto(sockfd, reply.data(), reply.size(), 0,
+                  (struct sockaddr *)client_addr, client_len);
+}
+
+// Thread body: serve Server M's requests from the shared-memory ring,
+// trades first (see priority.h). `arg` is a BackendShm.
+static inline void* backend_shm_serve(void* arg) {
+    const BackendShm* shm = (const BackendShm*)arg;
+    PriorityBatch batch;
+    struct sockaddr_in ring_addr;
+    memset(&ring_addr, 0, sizeof(ring_addr));
+    ShmSpin spin;
+    shm_spin_init(&spin);
+
+    while (1) {
+        priority_recv_shm(&shm->channel->requests, &batch, &spin);
+
+        for (int i = 0; i < batch.count; i++) {
+            backend_received_ns = batch.received_ns;
+            if (shm->process_lock != NULL) {
+                pthread_mutex_lock(shm->process_lock);
+            }
+            backend_reply_via_shm = true;
+            shm->process(backend_strip_tag(shm->trace_log, batch.data[batch.order[i]]), &ring_addr,
+                         sizeof(ring_addr));
+            backend_reply_via_shm = false;
+            if (shm->process_lock != NULL) {
+                pthread_mutex_unlock(shm->process_lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+#endif
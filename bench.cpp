@@ -0,0 +1,469 @@
+// bench.cpp - Microbenchmarks for the hot paths of the servers
+
+// Usage: make bench, or ./microbench [name filter]
+//
+// The pure logic comes from tradecore.h. Server A, P and Q are compiled in
+// here too, each in its own namespace and without main() (NO_SERVER_MAIN),
+// so the dispatch benchmarks run the real process_message() handlers, logging
+// and sendto() included. Replies go to a local UDP socket that nobody reads
+// (the kernel drops them once it is full) and the servers' stdout goes to
+// /dev/null; the report is written to the original stdout.
+//
+// Each benchmark is calibrated to run for at least BENCH_MIN_RUN_MS, then run
+// BENCH_REPEATS times; the median is reported. Allocations are counted by
+// replacing the global operator new.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <new>
+#include "shmring.h"
+#include "pricetable.h"
+#include "priceengine.h"
+#include "portfolio_snapshot.h"
+#include "tradecore.h"
+#include "trace.h"
+#include "backend.h"
+#include "ledger.h"
+#include "priority.h"
+#include "quotestate.h"
+#include "filewatch.h"
+
+#define NO_SERVER_MAIN
+namespace server_a {
+#include "serverA.cpp"
+}
+namespace server_p {
+#include "serverP.cpp"
+}
+namespace server_q {
+#include "serverQ.cpp"
+}
+
+#define BENCH_MIN_RUN_MS 100
+#define BENCH_REPEATS 5
+#define BENCH_ENGINE_STOCKS 4096
+#define BENCH_LEDGER_TRADES 100000  // ledger/page: trades of BENCH_LEDGER_MEMBERS members in BENCH_LEDGER_STOCKS stocks
+#define BENCH_LEDGER_MEMBERS 100
+#define BENCH_LEDGER_STOCKS 101
+
+// Global allocation counter, the benchmarks are single-threaded
+static long long allocation_count = 0;
+
+// Every form goes through malloc/free, so no allocation slips past the count
+// and no block is freed by an allocator other than its own
+static inline void* counted_alloc(size_t size) {
+    allocation_count++;
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    void* ptr = counted_alloc(size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = counted_alloc(size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+// GCC inlines the operator new above into callers and then flags free() on
+// its result as a new/free mismatch, although both sides are malloc/free
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+#pragma GCC diagnostic pop
+
+typedef void (*BenchFn)(long iterations);
+
+struct Benchmark {
+    const char* name;
+    BenchFn fn;
+};
+
+// Keeps results alive so the compiler cannot drop the work
+static volatile size_t bench_sink;
+
+// Where the servers send their replies
+static struct sockaddr_in sink_addr;
+
+// Parsing
+
+static void bench_split_command(long iterations) {
+    std::string command = "BUY user1 AAPL 10 105.500000";
+    for (long i = 0; i < iterations; i++) {
+        bench_sink += split_string(command, ' ').size();
+    }
+}
+
+static void bench_split_portfolio(long iterations) {
+    std::string portfolio = "PORTFOLIO\nAAPL 10 105.500000\nS2 5 150.000000\nS3 300 75.000000\n";
+    for (long i = 0; i < iterations; i++) {
+        bench_sink += split_string(portfolio, '\n').size();
+    }
+}
+
+static void bench_encrypt_password(long iterations) {
+    char password[32];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(password, "pass456#", 9);
+        encrypt_password(password);
+        bench_sink += password[0];
+    }
+}
+
+// Portfolio updates
+
+static void bench_apply_buy(long iterations) {
+    Portfolio portfolio;
+    apply_buy(portfolio, "AAPL", 10, 105.5);
+    apply_buy(portfolio, "S2", 5, 150.0);
+    for (long i = 0; i < iterations; i++) {
+        apply_buy(portfolio, "AAPL", 1, 100.0 + (i & 7));
+    }
+    bench_sink += portfolio["AAPL"].shares;
+}
+
+static void bench_apply_buy_sell(long iterations) {
+    Portfolio portfolio;
+    apply_buy(portfolio, "AAPL", 10, 105.5);
+    double profit = 0.0;
+    for (long i = 0; i < iterations; i++) {
+        apply_buy(portfolio, "AAPL", 1, 101.0);
+        profit += apply_sell(portfolio, "AAPL", 1, 102.0);
+    }
+    bench_sink += (size_t)profit;
+}
+
+// Quote lookups, as handle_quote() does them
+
+static void bench_quote_lookup(long iterations) {
+    static const char* names[] = { "AAPL", "S2", "S3", "MISSING" };
+    std::string symbols[4];
+    for (int i = 0; i < 4; i++) {
+        symbols[i] = names[i];
+    }
+    double total = 0.0;
+    for (long i = 0; i < iterations; i++) {
+        std::shared_ptr<server_q::QuoteTable> quotes = std::atomic_load(&server_q::stock_quotes);
+        server_q::QuoteTable::const_iterator it = quotes->find(symbols[i & 3]);
+        if (it != quotes->end()) {
+            total += it->second.prices[it->second.current_idx];
+        }
+    }
+    bench_sink += (size_t)total;
+}
+
+static void bench_history_bar(long iterations) {
+    const server_q::StockQuote& quote = server_q::stock_quotes->find("AAPL")->second;
+    double total = 0.0;
+    for (long i = 0; i < iterations; i++) {
+        int from = (int)(i % MAX_PRICES);
+        server_q::PriceBar bar = server_q::query_bar(quote, from, MAX_PRICES - 1);
+        total += bar.high - bar.low + bar.vwap;
+    }
+    bench_sink += (size_t)total;
+}
+
+// Trade ledger
+
+static void bench_ledger_append(long iterations) {
+    static TradeLedger ledger;
+    static const char* stocks[] = { "AAPL", "S2", "S3", "S4" };
+    for (long i = 0; i < iterations; i++) {
+        ledger_append(&ledger, ledger.seq.size() + 1, "benchuser", stocks[i & 3], 'B', 1, 100.0, 0);
+        bench_sink += ledger.seq.size();
+    }
+}
+
+// One member's trades of one stock, first page, out of BENCH_LEDGER_TRADES
+static void bench_ledger_page(long iterations) {
+    static TradeLedger ledger;
+    if (ledger.side.empty()) {
+        for (int i = 0; i < BENCH_LEDGER_TRADES; i++) {
+            ledger_append(&ledger, i + 1, "member" + std::to_string(i % BENCH_LEDGER_MEMBERS),
+                          "STOCK" + std::to_string(i % BENCH_LEDGER_STOCKS), 'B', 1, 100.0, 0);
+        }
+    }
+    for (long i = 0; i < iterations; i++) {
+        bool more;
+        bench_sink += ledger_page(&ledger, "member7", "STOCK7", (unsigned long long)(i & 1023) * (BENCH_LEDGER_TRADES / 1024), 960, &more).size();
+    }
+}
+
+// Backend receive queue: one op orders a full batch, trades and reads mixed
+
+static void bench_priority_order(long iterations) {
+    static PriorityBatch batch;
+    static const char* requests[] = { "#1 PORTFOLIO user1", "#2 BUY user1 AAPL 1 100.0", "#3 QUOTE",
+                                      "#4 BASKET user1 CHECK S2 1 SELL", "#5 ADVANCE AAPL",
+                                      "#6 HISTORY AAPL 0 9", "#7 BASKET user1 APPLY S2 1 SELL 1.0",
+                                      "#8 CHECK user1 S2 1 HOLD" };
+    batch.count = PRIORITY_BATCH;
+    for (int m = 0; m < PRIORITY_BATCH; m++) {
+        strcpy(batch.data[m], requests[m % 8]);
+    }
+    for (long i = 0; i < iterations; i++) {
+        priority_order(&batch);
+        bench_sink += batch.order[(int)(i & 3)];
+    }
+}
+
+// Price engine: one op is one tick of BENCH_ENGINE_STOCKS stocks
+
+static void run_engine(long iterations, EngineModel model) {
+    static PriceEngine engine;
+    engine_init(&engine, model, 0.3, 42);
+    for (int i = 0; i < BENCH_ENGINE_STOCKS; i++) {
+        engine_add(&engine, 50.0 + i % 200, 0.001 + (i % 16) * 0.0001);
+    }
+    engine_ready(&engine);
+    for (long i = 0; i < iterations; i++) {
+        engine_tick(&engine);
+    }
+    bench_sink += (size_t)engine.log_price[0];
+}
+
+static void bench_engine_gbm(long iterations) {
+    run_engine(iterations, ENGINE_GBM);
+}
+
+static void bench_engine_jump(long iterations) {
+    run_engine(iterations, ENGINE_JUMP);
+}
+
+// Dispatch: tag strip, parse, handler and reply, as the servers' receive loops run it
+
+template <typename Dispatch>
+static void run_dispatch(long iterations, const char* message, Dispatch dispatch) {
+    char buffer[BUFFER_SIZE];
+    size_t len = strlen(message);
+    for (long i = 0; i < iterations; i++) {
+        memcpy(buffer, message, len + 1);
+        dispatch(buffer);
+    }
+}
+
+static void dispatch_a(char* buffer) {
+    server_a::process_message(server_a::strip_request_tag(buffer), &sink_addr, sizeof(sink_addr));
+}
+
+static void dispatch_p(char* buffer) {
+    server_p::process_message(server_p::strip_request_tag(buffer), &sink_addr, sizeof(sink_addr));
+}
+
+static void dispatch_q(char* buffer) {
+    server_q::process_message(server_q::strip_request_tag(buffer), &sink_addr, sizeof(sink_addr));
+}
+
+static void bench_dispatch_auth(long iterations) {
+    run_dispatch(iterations, "#17 AUTH user1 sdvv789#", dispatch_a);
+}
+
+static void bench_dispatch_buy(long iterations) {
+    run_dispatch(iterations, "#17 BUY benchuser AAPL 1 100.000000", dispatch_p);
+}
+
+static void bench_dispatch_check(long iterations) {
+    run_dispatch(iterations, "#17 CHECK admin AAPL 1", dispatch_p);
+}
+
+static void bench_dispatch_portfolio(long iterations) {
+    run_dispatch(iterations, "#17 PORTFOLIO admin", dispatch_p);
+}
+
+// A price change for a stock the members hold, a new sequence number each time
+static void bench_dispatch_prices(long iterations) {
+    static unsigned long long seq = 0;
+    char buffer[BUFFER_SIZE];
+    for (long i = 0; i < iterations; i++) {
+        seq++;
+        snprintf(buffer, sizeof(buffer), "PRICES %llu AAPL %s S2 150.000000", seq,
+                 seq % 2 == 0 ? "100.000000" : "101.000000");
+        dispatch_p(buffer);
+    }
+}
+
+static void bench_dispatch_quote(long iterations) {
+    run_dispatch(iterations, "#17 QUOTE AAPL", dispatch_q);
+}
+
+static void bench_dispatch_quote_all(long iterations) {
+    run_dispatch(iterations, "#17 QUOTE", dispatch_q);
+}
+
+static void bench_dispatch_advance(long iterations) {
+    run_dispatch(iterations, "#17 ADVANCE S3", dispatch_q);
+}
+
+static void bench_dispatch_history(long iterations) {
+    run_dispatch(iterations, "#17 HISTORY AAPL 0 9 2", dispatch_q);
+}
+
+static const Benchmark benchmarks[] = {
+    { "parse/split_command",     bench_split_command },
+    { "parse/split_portfolio",   bench_split_portfolio },
+    { "parse/encrypt_password",  bench_encrypt_password },
+    { "portfolio/apply_buy",     bench_apply_buy },
+    { "portfolio/apply_buy_sell", bench_apply_buy_sell },
+    { "quote/lookup",            bench_quote_lookup },
+    { "quote/history_bar",       bench_history_bar },
+    { "ledger/append",           bench_ledger_append },
+    { "ledger/page",             bench_ledger_page },
+    { "priority/order_batch",    bench_priority_order },
+    { "engine/gbm_tick_4096",    bench_engine_gbm },
+    { "engine/jump_tick_4096",   bench_engine_jump },
+    { "dispatch/A_auth",         bench_dispatch_auth },
+    { "dispatch/P_buy",          bench_dispatch_buy },
+    { "dispatch/P_check",        bench_dispatch_check },
+    { "dispatch/P_portfolio",    bench_dispatch_portfolio },
+    { "dispatch/P_prices",       bench_dispatch_prices },
+    { "dispatch/Q_quote",        bench_dispatch_quote },
+    { "dispatch/Q_quote_all",    bench_dispatch_quote_all },
+    { "dispatch/Q_advance",      bench_dispatch_advance },
+    { "dispatch/Q_history",      bench_dispatch_history },
+};
+
+// One timed run of `iterations`, returns elapsed ns and the allocations made
+static long long time_run(BenchFn fn, long iterations, long long* allocations) {
+    long long allocations_before = allocation_count;
+    long long start = shm_now_ns();
+    fn(iterations);
+    long long elapsed = shm_now_ns() - start;
+    *allocations = allocation_count - allocations_before;
+    return elapsed;
+}
+
+static void run_benchmark(const Benchmark& bench, FILE* report) {
+    long long allocations;
+    long iterations = 1;
+    while (time_run(bench.fn, iterations, &allocations) < BENCH_MIN_RUN_MS * 1000000LL) {
+        iterations *= 2;
+    }
+
+    std::vector<double> ns_per_op;
+    double allocs_per_op = 0.0;
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        long long elapsed = time_run(bench.fn, iterations, &allocations);
+        ns_per_op.push_back((double)elapsed / iterations);
+        allocs_per_op = (double)allocations / iterations;
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    fprintf(report, "%-28s %12.1f %12.2f %12ld\n", bench.name, ns_per_op[BENCH_REPEATS / 2],
+            allocs_per_op, iterations);
+    fflush(report);
+}
+
+// Load the data files and point every server at the reply sink
+static bool setup_servers() {
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sink_addr, 0, sizeof(sink_addr));
+    sink_addr.sin_family = AF_INET;
+    sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(sink_addr);
+    if (sink == -1 || bind(sink, (struct sockaddr*)&sink_addr, sizeof(sink_addr)) == -1 ||
+        getsockname(sink, (struct sockaddr*)&sink_addr, &addr_len) == -1) {
+        perror("sink socket");
+        return false;
+    }
+    server_a::sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    server_p::sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    server_q::sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_a::sockfd == -1 || server_p::sockfd == -1 || server_q::sockfd == -1) {
+        perror("socket");
+        return false;
+    }
+
+    server_a::load_members_file();
+    server_p::load_portfolios_file();
+    server_q::load_quotes_file();
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* filter = argc > 1 ? argv[1] : NULL;
+
+    // The handlers log every request; keep that out of the report
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (report == NULL || devnull == -1) {
+        perror("open");
+        return 1;
+    }
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    if (!setup_servers()) {
+        return 1;
+    }
+
+    fprintf(report, "%-28s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "iterations");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (filter == NULL || strstr(benchmarks[i].name, filter) != NULL) {
+            run_benchmark(benchmarks[i], report);
+        }
+    }
+    fclose(report);
+    return 0;
+}
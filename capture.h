@@ -0,0 +1,246 @@
+// capture.h - Traffic capture file written by Server M and read by replay
+
+// ./serverM --capture=<file> records every client message, every reply to a
+// client and every backend datagram, with timestamps. ./replay reads the file
+// back and drives a test stack with the same member traffic (see replay.cpp).
+//
+// File layout:
+//
+//   CaptureHeader
+//   records, each:  kind      1 byte (CaptureKind)
+//                   channel   1 byte: 'A', 'P' or 'Q' for a backend request, 0 otherwise
+//                   delta_ns  varint, CLOCK_MONOTONIC time since the previous record
+//                   session   varint, Server M's session id (0 for none)
+//                   len       varint
+//                   data      len bytes, exactly as sent or received
+//
+// Varints are little-endian base 128 (7 bits per byte, high bit set on all
+// but the last byte). A CAPTURE_DROPPED record's session field is the number
+// of records dropped before it. A file cut short by a crash ends in a partial
+// record, which readers ignore.
+//
+// Server M appends records to an in-memory buffer under a mutex that is only
+// held for the append and for a pointer swap. A writer thread swaps the buffer
+// out and writes it, so the event loop never waits on the disk. If the disk
+// falls behind by CAPTURE_MAX_BUFFERED bytes, records are dropped and counted
+// instead.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <string>
+#include "shmring.h"
+
+#define CAPTURE_MAGIC "EE450CP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ENDIAN_CHECK 0x01020304u
+#define CAPTURE_FLUSH_BYTES (64 * 1024)          // wake the writer once this much is buffered
+#define CAPTURE_FLUSH_MS 100                     // and at least this often
+#define CAPTURE_MAX_BUFFERED (64 * 1024 * 1024)  // drop records beyond this
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    int64_t start_realtime_ns;      // wall clock when the capture started
+    int64_t start_monotonic_ns;     // the first record's delta is relative to this
+};
+
+enum CaptureKind {
+    CAPTURE_OPEN = 1,               // a client session started
+    CAPTURE_CLOSE,                  // it ended
+    CAPTURE_CLIENT_IN,              // one message from the client, without its terminator
+    CAPTURE_CLIENT_OUT,             // bytes sent to the client
+    CAPTURE_BACKEND_OUT,            // a datagram to the backend in `channel`
+    CAPTURE_BACKEND_IN,             // a datagram from a backend
+    CAPTURE_DROPPED                 // records were dropped here
+};
+
+struct CaptureWriter {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    std::string buffer;             // appended to by capture_record()
+    long long last_ns;              // time of the last record appended
+    unsigned long long dropped;     // records dropped since the last CAPTURE_DROPPED
+    bool closing;
+};
+
+static inline void capture_put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+// Read a varint at *pos, false if the data ends first
+static inline bool capture_get_varint(const char* data, size_t size, size_t* pos, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *pos < size; shift += 7) {
+        unsigned char byte = (unsigned char)data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void capture_append(CaptureWriter* w, int kind, char channel, uint64_t session,
+                                  const struct iovec* parts, int count, size_t len) {
+    long long now = shm_now_ns();
+    w->buffer += (char)kind;
+    w->buffer += channel;
+    capture_put_varint(w->buffer, (uint64_t)(now - w->last_ns));
+    capture_put_varint(w->buffer, session);
+    capture_put_varint(w->buffer, len);
+    for (int i = 0; i < count; i++) {
+        w->buffer.append((const char*)parts[i].iov_base, parts[i].iov_len);
+    }
+    w->last_ns = now;
+}
+
+// Hot path: encode one record, its data gathered from `count` parts
+static inline void capture_recordv(CaptureWriter* w, int kind, char channel, unsigned session,
+                                   const struct iovec* parts, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += parts[i].iov_len;
+    }
+    pthread_mutex_lock(&w->lock);
+    if (w->buffer.size() + len > CAPTURE_MAX_BUFFERED) {
+        w->dropped++;
+    } else {
+        if (w->dropped > 0) {
+            capture_append(w, CAPTURE_DROPPED, 0, w->dropped, NULL, 0, 0);
+            w->dropped = 0;
+        }
+        capture_append(w, kind, channel, session, parts, count, len);
+        if (w->buffer.size() >= CAPTURE_FLUSH_BYTES) {
+            pthread_cond_signal(&w->wake);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static inline void capture_record(CaptureWriter* w, int kind, char channel, unsigned session,
+                                  const char* data, size_t len) {
+    struct iovec part;
+    part.iov_base = (void*)data;
+    part.iov_len = len;
+    capture_recordv(w, kind, channel, session, &part, 1);
+}
+
+static inline bool capture_write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writer thread: take the whole buffer every CAPTURE_FLUSH_MS (or sooner
+// when it fills up) and write it outside the lock
+static inline void* capture_writer_main(void* arg) {
+    CaptureWriter* w = (CaptureWriter*)arg;
+    std::string out;
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        if (w->buffer.size() < CAPTURE_FLUSH_BYTES && !w->closing) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&w->wake, &w->lock, &deadline);
+        }
+        out.clear();
+        out.swap(w->buffer);
+        bool closing = w->closing;
+        pthread_mutex_unlock(&w->lock);
+        if (!out.empty() && !capture_write_all(w->fd, out.data(), out.size())) {
+            perror("write capture");
+        }
+        if (closing) {
+            return NULL;
+        }
+        pthread_mutex_lock(&w->lock);
+    }
+}
+
+// Create `path` (mode 0600: it holds members' passwords), write the header
+// and start the writer thread. Returns false with errno set on failure.
+static inline bool capture_open(CaptureWriter* w, const char* path) {
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (w->fd == -1) {
+        return false;
+    }
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.version = CAPTURE_VERSION;
+    header.endian_check = CAPTURE_ENDIAN_CHECK;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.start_realtime_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    header.start_monotonic_ns = shm_now_ns();
+    if (!capture_write_all(w->fd, (const char*)&header, sizeof(header))) {
+        close(w->fd);
+        return false;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    w->last_ns = header.start_monotonic_ns;
+    w->dropped = 0;
+    w->closing = false;
+
+    // Signals stay with the event loop thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&w->thread, NULL, capture_writer_main, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(w->fd);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+// Write out what is buffered and stop the writer. Safe to call from a signal
+// handler on the event loop thread: if the loop was interrupted while holding
+// the lock, the buffered records are given up instead of deadlocking.
+static inline void capture_close(CaptureWriter* w) {
+    if (pthread_mutex_trylock(&w->lock) != 0) {
+        return;
+    }
+    w->closing = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    close(w->fd);
+}
+
+#endif
@@ -34,10 +34,18 @@
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 45654
 #define BUFFER_SIZE 1024
+#define BUSY_MSG "BUSY"
 
 int sockfd = -1;
 std::string current_username;
 
+// Long responses (quote, position) are streamed a line at a time and end with '\0'
+struct LineReader {
+    int sockfd;
+    std::string pending;    // received bytes not handed out yet
+    bool ended;             // the '\0' (or the end of the connection) was seen
+};
+
 // funcs we use
 void sigint_handler(int sig);
 bool authenticate(int sockfd);
@@ -46,6 +54,8 @@ void process_command(int sockfd, const std::string& cmd);
 std::vector<std::string> split_string(const std::string& str, char delimiter);
 int recv_with_retry(int sockfd, char* buffer, size_t buffer_size);
 bool send_with_retry(int sockfd, const char* data, size_t data_length);
+bool report_busy(const char* response);
+bool read_line(LineReader* reader, std::string& line);
 
 // Handle Ctrl+C.. cleanup before exit
 void sigint_handler(int sig) {
@@ -150,6 +160,9 @@ bool authenticate(int sockfd) {
     }
     buffer[bytes_received] = '\0'; // Ensure null termination
     std::string response(buffer);
+    if (report_busy(buffer)) {
+        return false;
+    }
     if (response == "AUTH_SUCCESS") {
         current_username = username;
         printf("[Client] You have been granted access.\n");
@@ -163,7 +176,7 @@ bool authenticate(int sockfd) {
 void handle_commands(int sockfd) {
     std::string command;
     printf("[Client] Please enter the command:\n\n");
-    printf("<quote>\n\n<quote <stock name>>\n\n<buy <stock name> <number of shares>>\n\n<sell <stock name> <number of shares>>\n\n<position>\n\n<exit>\n\n");
+    printf("<quote>\n\n<quote <stock name>>\n\n<buy <stock name> <number of shares>>\n\n<sell <stock name> <number of shares>>\n\n<position>\n\n<history <stock name> <from> <to> [<bar size>]>\n\n<history <stock name>>\n\n<trades [since <trade number>]>\n\n<basket <buy|sell> <stock name> <number of shares> ...>\n\n<exit>\n\n");
     while (true) {
         printf("> ");
         std::getline(std::cin, command);
@@ -186,15 +199,17 @@ void process_command(int sockfd, const std::string& cmd) {
     if (parts[0] == "quote") {
         printf("[Client] Sent a quote request to the main server.\n");
 
-        int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
-        if (bytes_received <= 0) return;
+        LineReader reader = { sockfd, "", false };
+        std::string line;
+        if (!read_line(&reader, line)) return;
+        if (report_busy(line.c_str())) return;
 
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         getsockname(sockfd, (struct sockaddr*)&client_addr, &client_len);
         int client_port = ntohs(client_addr.sin_port);
 
-        bool is_error = strncmp(buffer, "ERROR", 5) == 0;
+        bool is_error = strncmp(line.c_str(), "ERROR", 5) == 0;
         bool specific = (parts.size() == 2);   /* quote <stock> */
 
         printf("[Client] Received the response from the main server using TCP over port %d.\n", client_port);
@@ -204,7 +219,10 @@ void process_command(int sockfd, const std::string& cmd) {
             printf("%s does not exist. Please try again.\n", specific ? parts[1].c_str() : "");
             printf("-—Start a new request—-\n");
         } else {
-            printf("%s\n", buffer);
+            // print each line as it arrives, the full list can be long
+            do {
+                printf("%s\n", line.c_str());
+            } while (read_line(&reader, line));
             if (specific)
                 printf("-—Start a new request—-\n");
             else
@@ -215,6 +233,7 @@ void process_command(int sockfd, const std::string& cmd) {
     else if (parts[0] == "buy" && parts.size() == 3) {
         int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
         if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
         if (strncmp(buffer, "ERROR", 5) == 0) {
             printf("[Client] Error: stock name does not exist. Please check again.\n");
             printf("-—Start a new request—-\n");
@@ -239,6 +258,7 @@ void process_command(int sockfd, const std::string& cmd) {
         }
         bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
         if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
         if (confirm == "Y") {
             printf("[Client] %s successfully bought %d shares of %s.\n", current_username.c_str(), std::stoi(parts[2]), parts[1].c_str());
             printf("—-Start a new request—-\n");
@@ -250,6 +270,7 @@ void process_command(int sockfd, const std::string& cmd) {
     else if (parts[0] == "sell" && parts.size() == 3) {
         int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
         if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
         if (strncmp(buffer, "ERROR", 5) == 0) {
             if (strstr(buffer, "not found")) {
                 printf("[Client] Error: stock name does not exist. Please check again.\n");
@@ -279,6 +300,7 @@ void process_command(int sockfd, const std::string& cmd) {
         }
         bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
         if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
         if (confirm == "Y") {
             printf("[Client] %s successfully sold %d shares of %s.\n", current_username.c_str(), std::stoi(parts[2]), parts[1].c_str());
             printf("—-Start a new request—-\n");
@@ -289,17 +311,17 @@ void process_command(int sockfd, const std::string& cmd) {
     }
     else if (parts[0] == "position") {
         printf("[Client] %s sent a position request to the main server.\n", current_username.c_str());
-        int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
-        if (bytes_received <= 0) return;
+        LineReader reader = { sockfd, "", false };
+        std::string line;
+        if (!read_line(&reader, line)) return;
+        if (report_busy(line.c_str())) return;
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         getsockname(sockfd, (struct sockaddr*)&client_addr, &client_len);
         int client_port = ntohs(client_addr.sin_port);
         printf("[Client] Received the response from the main server using TCP over port %d.\n", client_port);
-        std::istringstream iss(buffer);
-        std::string line;
         bool printed_header = false;
-        while (std::getline(iss, line)) {
+        do {
             if (line.find("Total unrealized gain/loss:") != std::string::npos) {
                 size_t pos = line.find('$');
                 if (pos != std::string::npos) {
@@ -314,7 +336,83 @@ void process_command(int sockfd, const std::string& cmd) {
                 }
                 printf("%s\n", line.c_str());
             }
+        } while (read_line(&reader, line));
+    }
+    else if (parts[0] == "history" && (parts.size() == 4 || parts.size() == 5)) {
+        printf("[Client] Sent a history request for %s to the main server.\n", parts[1].c_str());
+        int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
+        if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
+        if (strncmp(buffer, "ERROR", 5) == 0) {
+            if (strstr(buffer, "not found")) {
+                printf("%s does not exist. Please try again.\n", parts[1].c_str());
+            } else {
+                printf("[Client] %s\n", buffer);
+            }
+            printf("—-Start a new request—-\n");
+            return;
+        }
+        printf("from to open high low close vwap volume\n");
+        printf("%s", buffer);
+        printf("—-Start a new request—-\n");
+    }
+    else if ((parts[0] == "history" && parts.size() == 2) || parts[0] == "trades") {
+        printf("[Client] %s sent a trades request to the main server.\n", current_username.c_str());
+        LineReader reader = { sockfd, "", false };
+        std::string line;
+        if (!read_line(&reader, line)) return;
+        if (report_busy(line.c_str())) return;
+        if (strncmp(line.c_str(), "ERROR", 5) == 0) {
+            printf("[Client] %s\n", line.c_str());
+            printf("—-Start a new request—-\n");
+            return;
+        }
+        bool printed_header = false;
+        do {
+            if (strncmp(line.c_str(), "Trades: ", 8) == 0) {
+                printf("[Client] %s trades listed.\n", line.c_str() + 8);
+                printf("—-Start a new request—-\n");
+            } else {
+                if (!printed_header) {
+                    printf("trade time side stock shares price\n");
+                    printed_header = true;
+                }
+                printf("%s\n", line.c_str());
+            }
+        } while (read_line(&reader, line));
+    }
+    else if (parts[0] == "basket") {
+        int bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
+        if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
+        if (strncmp(buffer, "ERROR", 5) == 0) {
+            printf("[Client] %s\n", buffer);
+            printf("—-Start a new request—-\n");
+            return;
+        }
+        printf("%s", buffer);
+        printf("[Client] Proceed with the basket? (Y/N)\n");
+        std::string confirm;
+        while (true) {
+            std::getline(std::cin, confirm);
+            if (confirm == "Y" || confirm == "N") {
+                break;
+            }
+            printf("[Client] Invalid input. Please respond with 'Y' or 'N': ");
+        }
+        if (!send_with_retry(sockfd, confirm.c_str(), confirm.length())) {
+            return;
+        }
+        bytes_received = recv_with_retry(sockfd, buffer, BUFFER_SIZE);
+        if (bytes_received <= 0) return;
+        if (report_busy(buffer)) return;
+        if (strncmp(buffer, "BASKET_SUCCESS", 14) == 0) {
+            printf("[Client] %s successfully completed the basket: %s\n", current_username.c_str(),
+                   strchr(buffer + 15, ' ') != NULL ? strchr(buffer + 15, ' ') + 1 : buffer);
+        } else if (confirm == "Y") {
+            printf("[Client] %s\n", buffer);
         }
+        printf("—-Start a new request—-\n");
     }
     else {
         printf("[Client] Error: stock name/shares are required. Please specify a stock name to %s.\n", parts[0]=="buy"?"buy":"sell");
@@ -335,6 +433,47 @@ std::vector<std::string> split_string(const std::string& str, char delimiter) {
     return tokens;
 }
 
+// report_busy: serverM sheds load with a BUSY reply, tell the member and move on
+bool report_busy(const char* response) {
+    if (strncmp(response, BUSY_MSG, strlen(BUSY_MSG)) != 0) {
+        return false;
+    }
+    printf("[Client] The main server is busy. Please try again later.\n");
+    printf("—-Start a new request—-\n");
+    return true;
+}
+
+// read_line: next line of a streamed response, false once the response is over
+bool read_line(LineReader* reader, std::string& line) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        size_t end = reader->pending.find_first_of(std::string("\n\0", 2));
+        if (end != std::string::npos) {
+            bool last = reader->pending[end] == '\0';
+            line = reader->pending.substr(0, end);
+            reader->pending.erase(0, end + 1);
+            if (last) {
+                reader->ended = true;
+                reader->pending.clear();
+                return !line.empty();
+            }
+            return true;
+        }
+        if (reader->ended) {
+            return false;
+        }
+        int bytes_received = recv_with_retry(reader->sockfd, buffer, BUFFER_SIZE);
+        if (bytes_received <= 0) {
+            // connection gone: hand out what is left
+            reader->ended = true;
+            line = reader->pending;
+            reader->pending.clear();
+            return !line.empty();
+        }
+        reader->pending.append(buffer, bytes_received);
+    }
+}
+
 // recv_with_retry: try to receive, retry a bit if interrupted
 int recv_with_retry(int sockfd, char* buffer, size_t buffer_size) {
     int bytes_received;
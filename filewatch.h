@@ -0,0 +1,74 @@
+// filewatch.h - Reload a data file when it changes, for Server A and Q
+
+// A thread waits on inotify and calls the reload function whenever the file
+// is rewritten or replaced. The directory is watched, not the file, because
+// editors often save by renaming a new file over the old one. Several
+// changes read in one go cause one reload.
+
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+struct FileWatch {
+    const char* file_name;          // in the current directory
+    void (*reload)();
+};
+
+static inline void* file_watch_thread(void* arg) {
+    const FileWatch* watch = (const FileWatch*)arg;
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        perror("inotify_init1");
+        return NULL;
+    }
+    if (inotify_add_watch(inotify_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        perror("inotify_add_watch");
+        close(inotify_fd);
+        return NULL;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(inotify_fd, events, sizeof(events));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("read inotify");
+            break;
+        }
+
+        bool changed = false;
+        for (char* ptr = events; ptr < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->len > 0 && strcmp(event->name, watch->file_name) == 0) {
+                changed = true;
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed) {
+            watch->reload();
+        }
+    }
+    close(inotify_fd);
+    return NULL;
+}
+
+// Start watching; `watch` must outlive the thread. False if the thread did
+// not start.
+static inline bool file_watch_start(const FileWatch* watch) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, file_watch_thread, (void*)watch) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+#endif
@@ -0,0 +1,158 @@
+// ledger.h - Append-only trade ledger behind Server P's TRADES queries
+
+// Every BUY and SELL that Server P applies (basket legs included) becomes a
+// row. The rows are kept column by column (sequence number, time, member,
+// stock, side, shares, price), with member and stock names interned to
+// 32-bit ids: about 37 bytes a trade, plus 4 in each of the two indexes.
+//
+// Server P keeps one ledger per portfolio stripe, so a member's trades are
+// all in one ledger. Sequence numbers come from one counter shared by every
+// stripe and are passed in; within a ledger they only grow, because rows are
+// appended under the stripe's lock in the order their numbers were taken.
+//
+// by_member[m] and by_stock[s] hold the row numbers of a member's and of a
+// stock's trades, ascending because rows are only appended. A query finds its
+// first row with a binary search on the sequence number, and a query for one
+// member and one stock walks the shorter of the two lists and checks the
+// other id column. Nothing walks the whole ledger.
+//
+// The caller serializes access; Server P holds the stripe's ledger_lock.
+//
+// The ledger is memory only. Nothing is written to disk, so TRADES covers
+// the current Server P process and a restarted one starts empty, like the
+// portfolios, which are not written back either.
+
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+struct TradeLedger {
+    // Columns, one entry per trade
+    std::vector<unsigned long long> seq;  // ascending
+    std::vector<long long> time_s;  // CLOCK_REALTIME seconds
+    std::vector<uint32_t> member;
+    std::vector<uint32_t> stock;
+    std::vector<char> side;         // 'B' or 'S'
+    std::vector<int> shares;
+    std::vector<double> price;
+
+    // Interned names and the row indexes, by id
+    std::vector<std::string> member_names;
+    std::vector<std::string> stock_names;
+    std::map<std::string, uint32_t> member_ids;
+    std::map<std::string, uint32_t> stock_ids;
+    std::vector<std::vector<uint32_t> > by_member;
+    std::vector<std::vector<uint32_t> > by_stock;
+};
+
+// The id of `name`, added with an empty row list the first time
+static inline uint32_t ledger_intern(std::map<std::string, uint32_t>& ids, std::vector<std::string>& names,
+                                     std::vector<std::vector<uint32_t> >& index, const std::string& name) {
+    std::map<std::string, uint32_t>::const_iterator it = ids.find(name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    uint32_t id = (uint32_t)names.size();
+    ids[name] = id;
+    names.push_back(name);
+    index.push_back(std::vector<uint32_t>());
+    return id;
+}
+
+static inline bool ledger_lookup(const std::map<std::string, uint32_t>& ids, const std::string& name, uint32_t* id) {
+    std::map<std::string, uint32_t>::const_iterator it = ids.find(name);
+    if (it == ids.end()) {
+        return false;
+    }
+    *id = it->second;
+    return true;
+}
+
+// Record trade number `seq`, which must be above every number already in the ledger
+static inline void ledger_append(TradeLedger* ledger, unsigned long long seq, const std::string& member_name,
+                                 const std::string& stock_name, char side, int shares, double price,
+                                 long long time_s) {
+    uint32_t row = (uint32_t)ledger->side.size();
+    uint32_t member = ledger_intern(ledger->member_ids, ledger->member_names, ledger->by_member, member_name);
+    uint32_t stock = ledger_intern(ledger->stock_ids, ledger->stock_names, ledger->by_stock, stock_name);
+    ledger->seq.push_back(seq);
+    ledger->time_s.push_back(time_s);
+    ledger->member.push_back(member);
+    ledger->stock.push_back(stock);
+    ledger->side.push_back(side);
+    ledger->shares.push_back(shares);
+    ledger->price.push_back(price);
+    ledger->by_member[member].push_back(row);
+    ledger->by_stock[stock].push_back(row);
+}
+
+// "<seq> <time> BUY|SELL <stock> <shares> <price>\n", time in UTC ISO 8601
+static inline std::string ledger_format_row(const TradeLedger* ledger, uint32_t row) {
+    time_t when = (time_t)ledger->time_s[row];
+    struct tm utc;
+    gmtime_r(&when, &utc);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    char line[256];
+    snprintf(line, sizeof(line), "%llu %s %s %s %d %.6f\n", ledger->seq[row], stamp,
+             ledger->side[row] == 'B' ? "BUY" : "SELL", ledger->stock_names[ledger->stock[row]].c_str(),
+             ledger->shares[row], ledger->price[row]);
+    return line;
+}
+
+// The member's trades after sequence number `since`, only those of `stock`
+// unless it is empty, as lines of at most `max_bytes` in all. *more is set
+// when trades are left over for another call with the last one as `since`.
+static inline std::string ledger_page(const TradeLedger* ledger, const std::string& member_name,
+                                      const std::string& stock_name, unsigned long long since,
+                                      size_t max_bytes, bool* more) {
+    std::string lines;
+    *more = false;
+    uint32_t member, stock = 0;
+    if (!ledger_lookup(ledger->member_ids, member_name, &member) ||
+        (!stock_name.empty() && !ledger_lookup(ledger->stock_ids, stock_name, &stock))) {
+        return lines;
+    }
+
+    // Walk the shorter index, filter on the other id
+    const std::vector<uint32_t>* rows = &ledger->by_member[member];
+    const std::vector<uint32_t>* filter_column = stock_name.empty() ? NULL : &ledger->stock;
+    uint32_t filter_id = stock;
+    if (!stock_name.empty() && ledger->by_stock[stock].size() < rows->size()) {
+        rows = &ledger->by_stock[stock];
+        filter_column = &ledger->member;
+        filter_id = member;
+    }
+
+    // First row with a sequence number above `since`; rows and their numbers ascend together
+    size_t low = 0, high = rows->size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ledger->seq[(*rows)[mid]] <= since) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    std::vector<uint32_t>::const_iterator it = rows->begin() + low;
+    for (; it != rows->end(); ++it) {
+        if (filter_column != NULL && (*filter_column)[*it] != filter_id) {
+            continue;
+        }
+        std::string line = ledger_format_row(ledger, *it);
+        if (!lines.empty() && lines.size() + line.size() > max_bytes) {
+            *more = true;
+            break;
+        }
+        lines += line;
+    }
+    return lines;
+}
+
+#endif
@@ -0,0 +1,829 @@
+// loadbench.cpp - End-to-end load benchmark of the whole stack, checked against a stored baseline
+
+// Usage: make perf, or ./loadbench [--update-baseline] [--threshold=PCT] [--repeats=N]
+//                                  [--baseline=FILE] [--keep] [workload filter]
+//
+// Each run starts serverA, serverP, serverQ and serverM (the binaries in the
+// current directory) in a scratch directory, with a generated members.txt,
+// portfolios.txt and quotes.txt, and drives one workload through the client
+// protocol: LOADBENCH_SESSIONS sessions, LOADBENCH_CONNECTIONS at a time, each
+// logging in as a member of its own and sending the workload's messages. The
+// stack is stopped after every run, so each run starts from the same data and
+// from an empty rate limit table; no member comes near its limit.
+//
+// For each workload the median of LOADBENCH_REPEATS runs is reported: messages
+// per second and reply latency percentiles. These are compared with the
+// baseline file. A workload regresses when its throughput drops by more than
+// the threshold, its p50 latency grows by more than the threshold, or its p99
+// latency (the noisiest figure) by more than LOADBENCH_TAIL_FACTOR times the
+// threshold; a latency must also grow by more than LOADBENCH_NOISE_MS.
+// The baseline names the machine it was recorded on (CPU count and model);
+// on any other machine the results are printed but not compared.
+// Exit status: 0 no regression (or nothing compared), 1 a regression or
+// failed requests, 2 the stack could not be run.
+//
+// --update-baseline writes the results to the baseline file instead (only the
+// measured workloads' lines change, unless the file is from another machine).
+// The servers use their fixed ports, so no other stack may be running on this
+// machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "tradecore.h"
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_M_TCP_PORT 45654
+#define BUFFER_SIZE 4096
+#define LOADBENCH_BASELINE "perf_baseline.txt"
+#define LOADBENCH_THRESHOLD_PCT 20  // default --threshold
+#define LOADBENCH_NOISE_MS 0.05     // latency changes below this are never a regression
+#define LOADBENCH_TAIL_FACTOR 2     // p99 may grow by this many times the threshold
+#define LOADBENCH_REPEATS 5         // runs per workload, the median is reported
+#define LOADBENCH_SESSIONS 1000     // sessions per run, one member each (Server M tracks 1024)
+#define LOADBENCH_CONNECTIONS 16    // sessions open at once, below MAX_INFLIGHT_BACKEND
+#define LOADBENCH_STOCKS 200        // generated stocks, T000 to T199
+#define LOADBENCH_HOLDINGS 5        // stocks in each member's portfolio
+#define LOADBENCH_STEPS 8           // messages per session after AUTH
+#define LOADBENCH_REPLY_TIMEOUT_MS 5000
+#define LOADBENCH_START_TIMEOUT_MS 10000  // for the stack to answer its first quote
+#define LOADBENCH_STOP_TIMEOUT_MS 3000    // for a server to exit on SIGINT
+#define LOADBENCH_MAX_REPORTED 5    // failed replies printed per run
+#define LOADBENCH_PROBE_USER "perfprobe"
+#define LOADBENCH_CPUINFO "/proc/cpuinfo"
+
+enum WorkloadKind {
+    WORKLOAD_LOGIN,
+    WORKLOAD_QUOTE,
+    WORKLOAD_QUOTE_ALL,
+    WORKLOAD_POSITION,
+    WORKLOAD_TRADE
+};
+
+struct Workload {
+    const char* name;
+    int kind;
+};
+
+// Every session logs in first; only the login workload measures the AUTH
+const Workload workloads[] = {
+    { "login", WORKLOAD_LOGIN },            // AUTH, then disconnect
+    { "quote", WORKLOAD_QUOTE },            // 8 x quote <stock>
+    { "quote_all", WORKLOAD_QUOTE_ALL },    // 8 x quote, all 200 stocks in pages
+    { "position", WORKLOAD_POSITION },      // 8 x position, 5 holdings each
+    { "trade", WORKLOAD_TRADE },            // 2 x buy 1, Y, sell 1, Y
+};
+const int workload_count = sizeof(workloads) / sizeof(workloads[0]);
+
+// One message of a session and a string its reply must contain
+struct LoadStep {
+    std::string message;
+    std::string expect;
+};
+
+struct LoadSession {
+    int fd;                         // -1 when the slot is free
+    int member;
+    std::vector<LoadStep> steps;    // steps[0] is the AUTH
+    size_t next_step;               // next step to send
+    std::string received;           // reply bytes up to the next '\0'
+    long long sent_ns;
+};
+
+// Throughput and latency of one run, or the median of several
+struct LoadResult {
+    double ops_per_s;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    int errors;
+};
+
+std::string scratch_dir;
+std::string binary_dir;
+pid_t server_pids[4] = { -1, -1, -1, -1 };
+const char* server_names[4] = { "serverA", "serverP", "serverQ", "serverM" };
+int reported_failures = 0;
+
+// Function prototypes
+long long now_ns();
+std::string member_name(int member);
+std::string member_password(int member);
+bool write_data_files();
+bool stack_port_open();
+bool start_stack();
+void stop_stack();
+bool probe_stack();
+bool exchange(int fd, const std::string& message, std::string* reply, int timeout_ms);
+std::vector<LoadStep> session_steps(const Workload& w, int member);
+bool run_workload(const Workload& w, LoadResult* result);
+bool open_session(LoadSession* s, const Workload& w, int member, long long now);
+void send_step(LoadSession* s, long long now);
+void session_failed(LoadSession* s, const std::string& reason, int* errors);
+LoadResult median_result(std::vector<LoadResult> runs);
+std::string machine_name();
+bool load_baseline(const std::string& path, std::map<std::string, LoadResult>* baseline, std::string* machine);
+bool save_baseline(const std::string& path, const std::map<std::string, LoadResult>& baseline,
+                   const std::string& machine);
+bool compare_result(const LoadResult& r, const LoadResult& base, double threshold, std::string* verdict);
+void remove_scratch_dir();
+
+int main(int argc, char* argv[]) {
+    bool update = false;
+    bool keep = false;
+    double threshold = LOADBENCH_THRESHOLD_PCT;
+    int repeats = LOADBENCH_REPEATS;
+    std::string baseline_path = LOADBENCH_BASELINE;
+    const char* filter = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update-baseline") == 0) {
+            update = true;
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            keep = true;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0 && atof(argv[i] + 12) > 0) {
+            threshold = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--repeats=", 10) == 0 && atoi(argv[i] + 10) > 0) {
+            repeats = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0 && argv[i][11] != '\0') {
+            baseline_path = argv[i] + 11;
+        } else if (argv[i][0] != '-' && filter == NULL) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--update-baseline] [--threshold=PCT] [--repeats=N] "
+                            "[--baseline=FILE] [--keep] [workload filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
+        return 2;
+    }
+    binary_dir = cwd;
+    for (int i = 0; i < 4; i++) {
+        std::string path = binary_dir + "/" + server_names[i];
+        if (access(path.c_str(), X_OK) == -1) {
+            fprintf(stderr, "[Loadbench] %s not found, run make all first\n", path.c_str());
+            return 2;
+        }
+    }
+    if (stack_port_open()) {
+        fprintf(stderr, "[Loadbench] Something already listens on port %d; stop the running stack first\n",
+                SERVER_M_TCP_PORT);
+        return 2;
+    }
+    char dir_template[] = "/tmp/loadbench.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        perror("mkdtemp");
+        return 2;
+    }
+    scratch_dir = dir_template;
+
+    std::map<std::string, LoadResult> baseline;
+    std::string machine = machine_name();
+    std::string baseline_machine;
+    bool have_baseline = load_baseline(baseline_path, &baseline, &baseline_machine);
+    if (have_baseline && baseline_machine != machine) {
+        // Figures from other hardware say nothing about this build
+        if (!update) {
+            printf("[Loadbench] %s was recorded on %s, this machine has %s: results are not compared "
+                   "(make perf-baseline records one here).\n", baseline_path.c_str(),
+                   baseline_machine.empty() ? "an unnamed machine" : baseline_machine.c_str(), machine.c_str());
+        }
+        baseline.clear();
+        have_baseline = false;
+    } else if (!have_baseline && !update) {
+        printf("[Loadbench] No baseline in %s, results are not compared (make perf-baseline records one).\n",
+               baseline_path.c_str());
+    }
+    printf("[Loadbench] %d sessions over %d connections per run, median of %d runs, threshold %.0f%%.\n\n",
+           LOADBENCH_SESSIONS, LOADBENCH_CONNECTIONS, repeats, threshold);
+    printf("%-12s %10s %9s %9s %9s %7s   %s\n", "workload", "ops/s", "p50 ms", "p90 ms", "p99 ms", "errors",
+           update ? "" : "vs baseline");
+    fflush(stdout);
+
+    // The repeats take turns, one run of each workload per round, so a burst
+    // of load from elsewhere on the machine does not land on one workload only
+    std::vector<std::vector<LoadResult> > runs(workload_count);
+    for (int round = 0; round < repeats; round++) {
+        for (int i = 0; i < workload_count; i++) {
+            if (filter != NULL && strstr(workloads[i].name, filter) == NULL) {
+                continue;
+            }
+            LoadResult r;
+            if (!run_workload(workloads[i], &r)) {
+                fprintf(stderr, "[Loadbench] The stack did not start, its logs are in %s\n", scratch_dir.c_str());
+                return 2;
+            }
+            runs[i].push_back(r);
+        }
+    }
+
+    bool failed = false;
+    bool regressed = false;
+    for (int i = 0; i < workload_count; i++) {
+        const Workload& w = workloads[i];
+        if (runs[i].empty()) {
+            continue;
+        }
+        LoadResult result = median_result(runs[i]);
+        std::string verdict;
+        if (result.errors > 0) {
+            failed = true;
+            verdict = "FAILED requests";
+        } else if (update) {
+            baseline[w.name] = result;
+        } else if (baseline.count(w.name) == 0) {
+            verdict = "no baseline";
+        } else if (compare_result(result, baseline[w.name], threshold, &verdict)) {
+            regressed = true;
+        }
+        printf("%-12s %10.1f %9.3f %9.3f %9.3f %7d   %s\n", w.name, result.ops_per_s, result.p50_ms,
+               result.p90_ms, result.p99_ms, result.errors, verdict.c_str());
+        fflush(stdout);
+    }
+    printf("\n");
+
+    if (failed) {
+        printf("[Loadbench] FAILED: some requests did not get the expected reply, server logs are in %s\n",
+               scratch_dir.c_str());
+        return 1;
+    }
+    if (!keep) {
+        remove_scratch_dir();
+    } else {
+        printf("[Loadbench] Server logs and data files kept in %s\n", scratch_dir.c_str());
+    }
+    if (update) {
+        if (!save_baseline(baseline_path, baseline, machine)) {
+            return 2;
+        }
+        printf("[Loadbench] Baseline written to %s.\n", baseline_path.c_str());
+        return 0;
+    }
+    if (regressed) {
+        printf("[Loadbench] REGRESSION: slower than %s by more than %.0f%%.\n", baseline_path.c_str(), threshold);
+        return 1;
+    }
+    if (!have_baseline) {
+        printf("[Loadbench] PASS: nothing to compare against.\n");
+        return 0;
+    }
+    printf("[Loadbench] PASS: no regression against %s.\n", baseline_path.c_str());
+    return 0;
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+std::string member_name(int member) {
+    char name[32];
+    snprintf(name, sizeof(name), "perf%05d", member);
+    return name;
+}
+
+std::string member_password(int member) {
+    char password[32];
+    snprintf(password, sizeof(password), "pw%05d", member);
+    return password;
+}
+
+// members.txt, portfolios.txt and quotes.txt for one run. Member m holds
+// LOADBENCH_HOLDINGS stocks from T<5m mod 200> on, 100 shares each.
+bool write_data_files() {
+    std::ofstream members((scratch_dir + "/members.txt").c_str());
+    std::ofstream portfolios((scratch_dir + "/portfolios.txt").c_str());
+    std::ofstream quotes((scratch_dir + "/quotes.txt").c_str());
+    if (!members.is_open() || !portfolios.is_open() || !quotes.is_open()) {
+        perror("write data files");
+        return false;
+    }
+    for (int m = 0; m <= LOADBENCH_SESSIONS; m++) {
+        std::string name = m < LOADBENCH_SESSIONS ? member_name(m) : LOADBENCH_PROBE_USER;
+        std::string password = m < LOADBENCH_SESSIONS ? member_password(m) : LOADBENCH_PROBE_USER;
+        std::vector<char> encrypted(password.begin(), password.end());
+        encrypted.push_back('\0');
+        encrypt_password(&encrypted[0]);
+        members << name << " " << &encrypted[0] << "\n";
+        portfolios << name << "\n";
+        for (int h = 0; h < LOADBENCH_HOLDINGS; h++) {
+            char line[64];
+            snprintf(line, sizeof(line), "T%03d 100 %.1f\n", (m * LOADBENCH_HOLDINGS + h) % LOADBENCH_STOCKS,
+                     100.0 + h);
+            portfolios << line;
+        }
+    }
+    for (int q = 0; q < LOADBENCH_STOCKS; q++) {
+        char line[32];
+        snprintf(line, sizeof(line), "T%03d", q);
+        quotes << line;
+        for (int p = 0; p < 10; p++) {
+            snprintf(line, sizeof(line), " %.1f", 50.0 + q % 100 + p);
+            quotes << line;
+        }
+        quotes << "\n";
+    }
+    // A run starts every price series at index 0
+    unlink((scratch_dir + "/quotes.state").c_str());
+    return members.good() && portfolios.good() && quotes.good();
+}
+
+bool stack_port_open() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_M_TCP_PORT);
+    addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    bool open = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return open;
+}
+
+// Start the four servers in the scratch directory, each logging to
+// <name>.log there, and wait until a member can log in and get a quote
+bool start_stack() {
+    if (!write_data_files()) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (i == 3) {
+            usleep(200 * 1000);     // Server M expects its backends to be up
+        }
+        std::string binary = binary_dir + "/" + server_names[i];
+        std::string log = scratch_dir + "/" + server_names[i] + ".log";
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return false;
+        }
+        if (pid == 0) {
+            int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (chdir(scratch_dir.c_str()) == -1 || fd == -1) {
+                _exit(127);
+            }
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+            execl(binary.c_str(), server_names[i], (char*)NULL);
+            _exit(127);
+        }
+        server_pids[i] = pid;
+    }
+    return probe_stack();
+}
+
+// SIGINT, Server M first, then whatever is left after LOADBENCH_STOP_TIMEOUT_MS is killed
+void stop_stack() {
+    for (int i = 3; i >= 0; i--) {
+        if (server_pids[i] > 0) {
+            kill(server_pids[i], SIGINT);
+        }
+    }
+    long long deadline = now_ns() + LOADBENCH_STOP_TIMEOUT_MS * 1000000LL;
+    for (int i = 3; i >= 0; i--) {
+        while (server_pids[i] > 0) {
+            pid_t done = waitpid(server_pids[i], NULL, WNOHANG);
+            if (done == server_pids[i] || (done == -1 && errno != EINTR)) {
+                server_pids[i] = -1;
+            } else if (now_ns() > deadline) {
+                kill(server_pids[i], SIGKILL);
+                waitpid(server_pids[i], NULL, 0);
+                server_pids[i] = -1;
+            } else {
+                usleep(10 * 1000);
+            }
+        }
+    }
+}
+
+bool probe_stack() {
+    long long deadline = now_ns() + LOADBENCH_START_TIMEOUT_MS * 1000000LL;
+    while (now_ns() < deadline) {
+        for (int i = 0; i < 4; i++) {
+            if (waitpid(server_pids[i], NULL, WNOHANG) == server_pids[i]) {
+                fprintf(stderr, "[Loadbench] %s exited on startup\n", server_names[i]);
+                server_pids[i] = -1;
+                return false;
+            }
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(SERVER_M_TCP_PORT);
+        addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            std::string auth, quote;
+            bool ready = exchange(fd, "AUTH " LOADBENCH_PROBE_USER " " LOADBENCH_PROBE_USER, &auth, 1000) &&
+                         auth == "AUTH_SUCCESS" && exchange(fd, "quote T000", &quote, 1000) &&
+                         quote.compare(0, 5, "T000 ") == 0;
+            close(fd);
+            if (ready) {
+                return true;
+            }
+        } else if (fd != -1) {
+            close(fd);
+        }
+        usleep(50 * 1000);
+    }
+    fprintf(stderr, "[Loadbench] The stack did not answer within %d ms\n", LOADBENCH_START_TIMEOUT_MS);
+    return false;
+}
+
+// Send one message and read its reply, up to the '\0'
+bool exchange(int fd, const std::string& message, std::string* reply, int timeout_ms) {
+    std::string data = message;
+    data += '\0';
+    if (send(fd, data.data(), data.size(), MSG_NOSIGNAL) != (ssize_t)data.size()) {
+        return false;
+    }
+    reply->clear();
+    long long deadline = now_ns() + timeout_ms * 1000000LL;
+    char buffer[BUFFER_SIZE];
+    while (1) {
+        int wait_ms = (int)((deadline - now_ns()) / 1000000LL);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) {
+            return false;
+        }
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return false;
+        }
+        reply->append(buffer, n);
+        size_t end = reply->find('\0');
+        if (end != std::string::npos) {
+            reply->resize(end);
+            return true;
+        }
+    }
+}
+
+// The messages of one session of workload `w` for `member`, AUTH first
+std::vector<LoadStep> session_steps(const Workload& w, int member) {
+    std::vector<LoadStep> steps;
+    LoadStep auth;
+    auth.message = "AUTH " + member_name(member) + " " + member_password(member);
+    auth.expect = "AUTH_SUCCESS";
+    steps.push_back(auth);
+
+    char stock[16];
+    snprintf(stock, sizeof(stock), "T%03d", (member * LOADBENCH_HOLDINGS) % LOADBENCH_STOCKS);
+    for (int i = 0; i < LOADBENCH_STEPS; i++) {
+        LoadStep step;
+        if (w.kind == WORKLOAD_LOGIN) {
+            break;
+        } else if (w.kind == WORKLOAD_QUOTE) {
+            char name[16];
+            snprintf(name, sizeof(name), "T%03d", (member * 7 + i) % LOADBENCH_STOCKS);
+            step.message = std::string("quote ") + name;
+            step.expect = std::string(name) + " ";
+        } else if (w.kind == WORKLOAD_QUOTE_ALL) {
+            char last[16];
+            snprintf(last, sizeof(last), "T%03d ", LOADBENCH_STOCKS - 1);
+            step.message = "quote";
+            step.expect = last;     // the listing got to its last page
+        } else if (w.kind == WORKLOAD_POSITION) {
+            step.message = "position";
+            step.expect = "Total unrealized gain/loss";
+        } else if (i % 4 == 0) {
+            step.message = std::string("buy ") + stock + " 1";
+            step.expect = "BUY CONFIRM";
+        } else if (i % 4 == 1) {
+            step.message = "Y";
+            step.expect = "BUY_SUCCESS";
+        } else if (i % 4 == 2) {
+            step.message = std::string("sell ") + stock + " 1";
+            step.expect = "SELL CONFIRM";
+        } else {
+            step.message = "Y";
+            step.expect = "SELL_CONFIRMED";
+        }
+        steps.push_back(step);
+    }
+    return steps;
+}
+
+// One run of `w` against a fresh stack. Returns false only if the stack did
+// not start; failed requests are counted in result->errors.
+bool run_workload(const Workload& w, LoadResult* result) {
+    reported_failures = 0;
+    bool started = start_stack();
+    if (!started) {
+        stop_stack();
+        return false;
+    }
+
+    // One poll() loop drives every session: each message is sent once the
+    // reply to the previous one is in, and a finished session makes room
+    // for the next member's
+    std::vector<LoadSession> sessions(LOADBENCH_CONNECTIONS);
+    std::vector<double> latencies_ms;
+    int next_member = 0;
+    int finished = 0;
+    int errors = 0;
+    long long start_ns = now_ns();
+    for (size_t i = 0; i < sessions.size(); i++) {
+        sessions[i].fd = -1;
+    }
+    while (finished < LOADBENCH_SESSIONS) {
+        long long now = now_ns();
+        std::vector<struct pollfd> fds;
+        std::vector<LoadSession*> fd_sessions;
+        for (size_t i = 0; i < sessions.size(); i++) {
+            LoadSession* s = &sessions[i];
+            if (s->fd == -1 && next_member < LOADBENCH_SESSIONS) {
+                if (!open_session(s, w, next_member++, now)) {
+                    errors += (int)s->steps.size();
+                    finished++;
+                    continue;
+                }
+            }
+            if (s->fd == -1) {
+                continue;
+            }
+            if (now - s->sent_ns > LOADBENCH_REPLY_TIMEOUT_MS * 1000000LL) {
+                session_failed(s, "no reply", &errors);
+                finished++;
+                continue;
+            }
+            struct pollfd pfd;
+            pfd.fd = s->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            fd_sessions.push_back(s);
+        }
+        if (fds.empty()) {
+            continue;
+        }
+        if (poll(&fds[0], fds.size(), 100) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        char buffer[BUFFER_SIZE];
+        for (size_t i = 0; i < fds.size(); i++) {
+            LoadSession* s = fd_sessions[i];
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+                continue;
+            }
+            ssize_t n = recv(s->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n <= 0) {
+                if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                session_failed(s, "connection closed", &errors);
+                finished++;
+                continue;
+            }
+            s->received.append(buffer, n);
+            size_t end = s->received.find('\0');
+            if (end == std::string::npos) {
+                continue;
+            }
+            long long replied_ns = now_ns();
+            std::string reply = s->received.substr(0, end);
+            s->received.erase(0, end + 1);
+            const LoadStep& step = s->steps[s->next_step - 1];
+            if (reply.find(step.expect) == std::string::npos || reply.compare(0, 4, "BUSY") == 0) {
+                session_failed(s, "reply \"" + reply.substr(0, 80) + "\" to \"" + step.message + "\"", &errors);
+                finished++;
+                continue;
+            }
+            // The AUTH is only measured in the login workload
+            if (w.kind == WORKLOAD_LOGIN || s->next_step > 1) {
+                latencies_ms.push_back((replied_ns - s->sent_ns) / 1e6);
+            }
+            if (s->next_step < s->steps.size()) {
+                send_step(s, replied_ns);
+            } else {
+                close(s->fd);
+                s->fd = -1;
+                finished++;
+            }
+        }
+    }
+    long long elapsed_ns = now_ns() - start_ns;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].fd != -1) {
+            close(sessions[i].fd);
+        }
+    }
+    stop_stack();
+
+    memset(result, 0, sizeof(*result));
+    result->errors = errors;
+    if (!latencies_ms.empty()) {
+        std::sort(latencies_ms.begin(), latencies_ms.end());
+        size_t n = latencies_ms.size();
+        result->ops_per_s = n / (elapsed_ns / 1e9);
+        result->p50_ms = latencies_ms[n / 2];
+        result->p90_ms = latencies_ms[n * 9 / 10];
+        result->p99_ms = latencies_ms[n * 99 / 100];
+    }
+    return true;
+}
+
+bool open_session(LoadSession* s, const Workload& w, int member, long long now) {
+    s->member = member;
+    s->steps = session_steps(w, member);
+    s->next_step = 0;
+    s->received.clear();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_M_TCP_PORT);
+    addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd == -1 || connect(s->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        if (s->fd != -1) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        return false;
+    }
+    send_step(s, now);
+    return true;
+}
+
+void send_step(LoadSession* s, long long now) {
+    std::string message = s->steps[s->next_step++].message;
+    message += '\0';
+    if (send(s->fd, message.data(), message.size(), MSG_NOSIGNAL) != (ssize_t)message.size()) {
+        perror("send");
+    }
+    s->sent_ns = now;
+}
+
+// Count the session's unanswered messages as errors and close it
+void session_failed(LoadSession* s, const std::string& reason, int* errors) {
+    if (reported_failures++ < LOADBENCH_MAX_REPORTED) {
+        fprintf(stderr, "[Loadbench] %s: %s\n", member_name(s->member).c_str(), reason.c_str());
+    }
+    *errors += (int)(s->steps.size() - s->next_step) + 1;
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Median of each figure on its own, like the microbenchmarks
+LoadResult median_result(std::vector<LoadResult> runs) {
+    LoadResult median;
+    memset(&median, 0, sizeof(median));
+    std::vector<double> values(runs.size());
+    double LoadResult::*fields[4] = { &LoadResult::ops_per_s, &LoadResult::p50_ms, &LoadResult::p90_ms,
+                                      &LoadResult::p99_ms };
+    for (int f = 0; f < 4; f++) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            values[i] = runs[i].*fields[f];
+        }
+        std::sort(values.begin(), values.end());
+        median.*fields[f] = values[values.size() / 2];
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        median.errors += runs[i].errors;
+    }
+    return median;
+}
+
+// "<CPU count> x <CPU model>", the first model name in /proc/cpuinfo
+std::string machine_name() {
+    std::string model = "unknown CPU";
+    std::ifstream cpuinfo(LOADBENCH_CPUINFO);
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        size_t colon = line.find(':');
+        if (line.compare(0, 10, "model name") == 0 && colon != std::string::npos) {
+            size_t start = line.find_first_not_of(" \t", colon + 1);
+            if (start != std::string::npos) {
+                model = line.substr(start);
+            }
+            break;
+        }
+    }
+    return std::to_string(sysconf(_SC_NPROCESSORS_ONLN)) + " x " + model;
+}
+
+// A "machine <name>" line, then "<workload> <ops/s> <p50 ms> <p90 ms> <p99 ms>"
+// lines; '#' starts a comment
+bool load_baseline(const std::string& path, std::map<std::string, LoadResult>* baseline, std::string* machine) {
+    std::ifstream file(path.c_str());
+    if (!file.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (line.compare(0, 8, "machine ") == 0) {
+            *machine = line.substr(8);
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string name;
+        LoadResult r;
+        memset(&r, 0, sizeof(r));
+        if (fields >> name >> r.ops_per_s >> r.p50_ms >> r.p90_ms >> r.p99_ms) {
+            (*baseline)[name] = r;
+        }
+    }
+    return !baseline->empty();
+}
+
+bool save_baseline(const std::string& path, const std::map<std::string, LoadResult>& baseline,
+                   const std::string& machine) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+        perror(path.c_str());
+        return false;
+    }
+    fprintf(file, "# ./loadbench baseline, rewritten by make perf-baseline. Figures depend on the machine,\n");
+    fprintf(file, "# so they are only compared on the one named here (CPU count x model).\n");
+    fprintf(file, "# %d sessions over %d connections per run.\n", LOADBENCH_SESSIONS, LOADBENCH_CONNECTIONS);
+    fprintf(file, "machine %s\n", machine.c_str());
+    fprintf(file, "# workload ops_per_s p50_ms p90_ms p99_ms\n");
+    std::map<std::string, LoadResult> rest = baseline;
+    for (int i = 0; i < workload_count; i++) {
+        std::map<std::string, LoadResult>::iterator it = rest.find(workloads[i].name);
+        if (it != rest.end()) {
+            fprintf(file, "%s %.1f %.3f %.3f %.3f\n", it->first.c_str(), it->second.ops_per_s,
+                    it->second.p50_ms, it->second.p90_ms, it->second.p99_ms);
+            rest.erase(it);
+        }
+    }
+    // Workloads this build no longer has are kept for an older one
+    for (std::map<std::string, LoadResult>::iterator it = rest.begin(); it != rest.end(); ++it) {
+        fprintf(file, "%s %.1f %.3f %.3f %.3f\n", it->first.c_str(), it->second.ops_per_s,
+                it->second.p50_ms, it->second.p90_ms, it->second.p99_ms);
+    }
+    return fclose(file) == 0;
+}
+
+// Whether `r` is slower than `base`; *verdict says how it compares either way
+bool compare_result(const LoadResult& r, const LoadResult& base, double threshold, std::string* verdict) {
+    double limit = threshold / 100.0;
+    bool regressed = false;
+    char note[256];
+    snprintf(note, sizeof(note), "ops/s %+.0f%%, p50 %+.0f%%, p99 %+.0f%%",
+             base.ops_per_s > 0 ? (r.ops_per_s / base.ops_per_s - 1) * 100 : 0.0,
+             base.p50_ms > 0 ? (r.p50_ms / base.p50_ms - 1) * 100 : 0.0,
+             base.p99_ms > 0 ? (r.p99_ms / base.p99_ms - 1) * 100 : 0.0);
+    if (r.ops_per_s < base.ops_per_s * (1 - limit)) {
+        regressed = true;
+    }
+    if (r.p50_ms > base.p50_ms * (1 + limit) && r.p50_ms - base.p50_ms > LOADBENCH_NOISE_MS) {
+        regressed = true;
+    }
+    if (r.p99_ms > base.p99_ms * (1 + limit * LOADBENCH_TAIL_FACTOR) && r.p99_ms - base.p99_ms > LOADBENCH_NOISE_MS) {
+        regressed = true;
+    }
+    *verdict = std::string(regressed ? "SLOWER  " : "ok      ") + note;
+    return regressed;
+}
+
+void remove_scratch_dir() {
+    DIR* dir = opendir(scratch_dir.c_str());
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlink((scratch_dir + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(scratch_dir.c_str());
+}
@@ -0,0 +1,152 @@
+// portfolio_snapshot.cpp – Converts Server P's portfolios between text and binary
+
+// Usage:
+//   ./portfolio_snapshot to-binary portfolios.txt portfolios.snap
+//   ./portfolio_snapshot to-text portfolios.snap portfolios.txt
+//
+// The text side follows the same rules as Server P's load_portfolios_file():
+// a line with one word starts a user, a line with three words is a holding of
+// the current user. See portfolio_snapshot.h for the binary layout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <fstream>
+#include "portfolio_snapshot.h"
+
+struct Holding {
+    int shares;
+    double avg_price;
+};
+
+typedef std::map<std::string, Holding> Portfolio;
+typedef std::map<std::string, Portfolio> PortfolioTable;
+
+std::vector<std::string> split_string(const std::string& str, char delimiter) {
+    std::vector<std::string> tokens;
+    std::string token;
+    std::istringstream tokenStream(str);
+    while (std::getline(tokenStream, token, delimiter)) {
+        if (!token.empty()) {
+            tokens.push_back(token);
+        }
+    }
+    return tokens;
+}
+
+bool read_text(const char* path, PortfolioTable& table) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    std::string line;
+    std::string current_user;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        std::vector<std::string> parts = split_string(line, ' ');
+        if (parts.size() == 1) {
+            current_user = parts[0];
+            table[current_user] = Portfolio();
+        } else if (parts.size() == 3 && !current_user.empty()) {
+            try {
+                Holding holding;
+                holding.shares = std::stoi(parts[1]);
+                holding.avg_price = std::stod(parts[2]);
+                table[current_user][parts[0]] = holding;
+            } catch (const std::exception&) {
+                fprintf(stderr, "%s:%d: bad holding line\n", path, line_number);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Shortest fixed-point form that reads back to the same double, which keeps
+// the "150.0" style of the shipped portfolios.txt
+std::string format_price(double price) {
+    char buf[400];
+    for (int decimals = 1; decimals <= 17; decimals++) {
+        snprintf(buf, sizeof(buf), "%.*f", decimals, price);
+        if (strtod(buf, NULL) == price) {
+            return buf;
+        }
+    }
+    snprintf(buf, sizeof(buf), "%.17g", price);
+    return buf;
+}
+
+int to_binary(const char* text_path, const char* snap_path) {
+    PortfolioTable table;
+    if (!read_text(text_path, table)) {
+        return 1;
+    }
+    SnapshotBuilder builder;
+    size_t holdings = 0;
+    for (PortfolioTable::const_iterator user = table.begin(); user != table.end(); ++user) {
+        snapshot_add_user(&builder, user->first);
+        for (Portfolio::const_iterator it = user->second.begin(); it != user->second.end(); ++it) {
+            snapshot_add_holding(&builder, it->first, it->second.shares, it->second.avg_price);
+            holdings++;
+        }
+    }
+    if (!snapshot_save(&builder, snap_path)) {
+        perror(snap_path);
+        return 1;
+    }
+    printf("Wrote %zu users and %zu holdings to %s\n", table.size(), holdings, snap_path);
+    return 0;
+}
+
+int to_text(const char* snap_path, const char* text_path) {
+    PortfolioSnapshot snap;
+    const char* error;
+    if (!snapshot_open(snap_path, &snap, &error)) {
+        fprintf(stderr, "Could not load %s: %s\n", snap_path, error != NULL ? error : strerror(errno));
+        return 1;
+    }
+    std::string tmp_path = std::string(text_path) + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (file == NULL) {
+        perror(tmp_path.c_str());
+        snapshot_close(&snap);
+        return 1;
+    }
+    for (uint64_t u = 0; u < snap.header->user_count; u++) {
+        const SnapshotUser& user = snap.users[u];
+        fprintf(file, "%s\n", snapshot_user_name(&snap, user).c_str());
+        for (uint32_t i = 0; i < user.holding_count; i++) {
+            const SnapshotHolding& holding = snap.holdings[user.first_holding + i];
+            fprintf(file, "%s %d %s\n", snapshot_stock_name(&snap, holding).c_str(),
+                    holding.shares, format_price(holding.avg_price).c_str());
+        }
+    }
+    printf("Wrote %llu users and %llu holdings to %s\n", (unsigned long long)snap.header->user_count,
+           (unsigned long long)snap.header->holding_count, text_path);
+    snapshot_close(&snap);
+    if (fclose(file) != 0 || rename(tmp_path.c_str(), text_path) == -1) {
+        perror(text_path);
+        unlink(tmp_path.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && strcmp(argv[1], "to-binary") == 0) {
+        return to_binary(argv[2], argv[3]);
+    }
+    if (argc == 4 && strcmp(argv[1], "to-text") == 0) {
+        return to_text(argv[2], argv[3]);
+    }
+    fprintf(stderr, "Usage: %s to-binary <portfolios.txt> <portfolios.snap>\n"
+                    "       %s to-text <portfolios.snap> <portfolios.txt>\n", argv[0], argv[0]);
+    return 1;
+}
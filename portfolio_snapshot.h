@@ -0,0 +1,223 @@
+// portfolio_snapshot.h - Binary snapshot format for Server P's portfolios
+
+// A snapshot holds the same data as portfolios.txt in a form that can be
+// mmap'ed and walked without any parsing:
+//
+//   SnapshotHeader
+//   SnapshotUser[user_count]         sorted by name, each owns a run of holdings
+//   SnapshotHolding[holding_count]   sorted by stock name within each user
+//   string pool                      user and stock names, not null-terminated
+//
+// Because both arrays are already in std::map order, a loader can append
+// with emplace_hint(end()) instead of searching for every insert. Numbers
+// are stored in host byte order; endian_check rejects a snapshot written on
+// a machine with the other one. Written by the portfolio_snapshot tool.
+
+#ifndef PORTFOLIO_SNAPSHOT_H
+#define PORTFOLIO_SNAPSHOT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define SNAPSHOT_MAGIC "EE450PS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENDIAN_CHECK 0x01020304u
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    uint64_t user_count;
+    uint64_t holding_count;
+    uint64_t strings_size;
+    uint64_t users_offset;          // byte offsets from the start of the file
+    uint64_t holdings_offset;
+    uint64_t strings_offset;
+};
+
+struct SnapshotUser {
+    uint64_t name_offset;           // into the string pool
+    uint32_t name_len;
+    uint32_t holding_count;
+    uint64_t first_holding;
+};
+
+struct SnapshotHolding {
+    uint64_t stock_offset;
+    uint32_t stock_len;
+    int32_t shares;
+    double avg_price;
+};
+
+// A mapped, validated snapshot
+struct PortfolioSnapshot {
+    const char* base;
+    size_t size;
+    const SnapshotHeader* header;
+    const SnapshotUser* users;
+    const SnapshotHolding* holdings;
+    const char* strings;
+};
+
+static inline std::string snapshot_user_name(const PortfolioSnapshot* snap, const SnapshotUser& user) {
+    return std::string(snap->strings + user.name_offset, user.name_len);
+}
+
+static inline std::string snapshot_stock_name(const PortfolioSnapshot* snap, const SnapshotHolding& holding) {
+    return std::string(snap->strings + holding.stock_offset, holding.stock_len);
+}
+
+static inline bool snapshot_range_ok(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t limit) {
+    return offset <= limit && (elem_size == 0 || count <= (limit - offset) / elem_size);
+}
+
+// Map `path` and check that every offset stays inside the file. Returns false
+// with a reason in *error; a missing file sets *error to NULL.
+static inline bool snapshot_open(const char* path, PortfolioSnapshot* snap, const char** error) {
+    *error = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        *error = "file too short";
+        return false;
+    }
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        *error = "mmap failed";
+        return false;
+    }
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+    snap->base = (const char*)mem;
+    snap->size = st.st_size;
+    snap->header = (const SnapshotHeader*)mem;
+    const SnapshotHeader* h = snap->header;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        *error = "not a portfolio snapshot";
+    } else if (h->endian_check != SNAPSHOT_ENDIAN_CHECK) {
+        *error = "written on a machine with a different byte order";
+    } else if (h->version != SNAPSHOT_VERSION) {
+        *error = "unsupported snapshot version";
+    } else if (!snapshot_range_ok(h->users_offset, h->user_count, sizeof(SnapshotUser), snap->size) ||
+               !snapshot_range_ok(h->holdings_offset, h->holding_count, sizeof(SnapshotHolding), snap->size) ||
+               !snapshot_range_ok(h->strings_offset, h->strings_size, 1, snap->size) ||
+               h->users_offset % alignof(SnapshotUser) != 0 ||
+               h->holdings_offset % alignof(SnapshotHolding) != 0) {
+        *error = "truncated or corrupt";
+    }
+    if (*error != NULL) {
+        munmap(mem, st.st_size);
+        return false;
+    }
+    snap->users = (const SnapshotUser*)(snap->base + h->users_offset);
+    snap->holdings = (const SnapshotHolding*)(snap->base + h->holdings_offset);
+    snap->strings = snap->base + h->strings_offset;
+
+    for (uint64_t u = 0; u < h->user_count && *error == NULL; u++) {
+        const SnapshotUser& user = snap->users[u];
+        if (!snapshot_range_ok(user.name_offset, user.name_len, 1, h->strings_size) ||
+            !snapshot_range_ok(user.first_holding, user.holding_count, 1, h->holding_count)) {
+            *error = "truncated or corrupt";
+        }
+    }
+    for (uint64_t i = 0; i < h->holding_count && *error == NULL; i++) {
+        const SnapshotHolding& holding = snap->holdings[i];
+        if (!snapshot_range_ok(holding.stock_offset, holding.stock_len, 1, h->strings_size)) {
+            *error = "truncated or corrupt";
+        }
+    }
+    if (*error != NULL) {
+        munmap(mem, st.st_size);
+        return false;
+    }
+    return true;
+}
+
+static inline void snapshot_close(PortfolioSnapshot* snap) {
+    munmap((void*)snap->base, snap->size);
+}
+
+// Collects users and holdings (in map order) and writes them out in one go
+struct SnapshotBuilder {
+    std::vector<SnapshotUser> users;
+    std::vector<SnapshotHolding> holdings;
+    std::string strings;
+};
+
+static inline void snapshot_add_user(SnapshotBuilder* builder, const std::string& name) {
+    SnapshotUser user;
+    user.name_offset = builder->strings.size();
+    user.name_len = (uint32_t)name.size();
+    user.holding_count = 0;
+    user.first_holding = builder->holdings.size();
+    builder->strings += name;
+    builder->users.push_back(user);
+}
+
+// Adds a holding to the most recently added user
+static inline void snapshot_add_holding(SnapshotBuilder* builder, const std::string& stock,
+                                        int shares, double avg_price) {
+    SnapshotHolding holding;
+    holding.stock_offset = builder->strings.size();
+    holding.stock_len = (uint32_t)stock.size();
+    holding.shares = shares;
+    holding.avg_price = avg_price;
+    builder->strings += stock;
+    builder->holdings.push_back(holding);
+    builder->users.back().holding_count++;
+}
+
+// Write to a temporary file and rename it over `path`, so a reader never
+// maps a half-written snapshot
+static inline bool snapshot_save(const SnapshotBuilder* builder, const char* path) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.endian_check = SNAPSHOT_ENDIAN_CHECK;
+    header.user_count = builder->users.size();
+    header.holding_count = builder->holdings.size();
+    header.strings_size = builder->strings.size();
+    header.users_offset = sizeof(SnapshotHeader);
+    header.holdings_offset = header.users_offset + header.user_count * sizeof(SnapshotUser);
+    header.strings_offset = header.holdings_offset + header.holding_count * sizeof(SnapshotHolding);
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && !builder->users.empty()) {
+        ok = fwrite(&builder->users[0], sizeof(SnapshotUser), builder->users.size(), file) == builder->users.size();
+    }
+    if (ok && !builder->holdings.empty()) {
+        ok = fwrite(&builder->holdings[0], sizeof(SnapshotHolding), builder->holdings.size(), file) ==
+             builder->holdings.size();
+    }
+    if (ok && !builder->strings.empty()) {
+        ok = fwrite(builder->strings.data(), 1, builder->strings.size(), file) == builder->strings.size();
+    }
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path) == -1) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,207 @@
+// priceengine.h - Stochastic price engine behind Server Q's --simulate mode
+
+// Instead of stepping through the ten prices of quotes.txt on ADVANCE, every
+// stock follows a random walk in log price that moves on a clock tick:
+//   gbm    geometric Brownian motion, log price += drift + vol * Z
+//   jump   the same plus jumps: with probability ENGINE_JUMP_RATE per tick
+//          the log price also moves by a jump with mean ENGINE_JUMP_MEAN and
+//          standard deviation ENGINE_JUMP_VOL
+// Stocks are correlated through one market factor M, drawn once per tick:
+// Z = sqrt(rho) * M + sqrt(1 - rho) * e, with e drawn per stock.
+//
+// The state is structure-of-arrays (log price, drift, vol), padded to a
+// multiple of ENGINE_LANES, so a tick is a few branch-free loops over
+// contiguous doubles that the compiler turns into SIMD code. The uniforms
+// come from ENGINE_LANES xorshift128+ generators stepped side by side, which
+// vectorizes the same way. Box-Muller's log/sqrt/cos/sin are plain libm
+// calls, so a seed gives the same path on any build and any CPU. The
+// Makefile builds the users of this file with -O2 -fno-trapping-math; without
+// the latter GCC does not turn the jump test into a vector select.
+//
+// Nothing here allocates after engine_ready(), and nothing reads a clock:
+// the path is a function of the seed and the starting prices, tick by tick.
+
+#ifndef PRICEENGINE_H
+#define PRICEENGINE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define ENGINE_LANES 8
+#define ENGINE_TICKS_PER_STEP 100  // ticks that add up to one step of the quotes.txt series
+#define ENGINE_MIN_VOL 1e-4        // per tick, for flat series
+#define ENGINE_MAX_VOL 0.01        // per tick, for series that jump around at random
+#define ENGINE_JUMP_RATE 0.001     // jump probability per stock per tick
+#define ENGINE_JUMP_MEAN -0.01
+#define ENGINE_JUMP_VOL 0.04
+
+enum EngineModel {
+    ENGINE_GBM,
+    ENGINE_JUMP
+};
+
+struct EngineRng {
+    uint64_t s0[ENGINE_LANES];
+    uint64_t s1[ENGINE_LANES];
+};
+
+struct PriceEngine {
+    EngineModel model;
+    double correlation;
+    size_t count;                   // stocks added
+    size_t padded;                  // count rounded up to ENGINE_LANES
+    long long tick;                 // ticks run so far
+    EngineRng rng;
+    std::vector<double> log_price;  // [padded]
+    std::vector<double> drift;
+    std::vector<double> vol;
+    std::vector<double> normal;     // scratch: [padded] shocks, then the market factor
+    std::vector<double> uniform;    // scratch: [padded + ENGINE_LANES]
+};
+
+// splitmix64, to spread one seed over the generators' state
+static inline uint64_t engine_mix(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline void engine_init(PriceEngine* engine, EngineModel model, double correlation, uint64_t seed) {
+    engine->model = model;
+    engine->correlation = correlation;
+    engine->count = 0;
+    engine->padded = 0;
+    engine->tick = 0;
+    for (int l = 0; l < ENGINE_LANES; l++) {
+        engine->rng.s0[l] = engine_mix(&seed);
+        engine->rng.s1[l] = engine_mix(&seed) | 1;  // never all zero
+    }
+    engine->log_price.clear();
+    engine->drift.clear();
+    engine->vol.clear();
+}
+
+// Per-tick volatility from a price series: the standard deviation of its log
+// returns, spread over ENGINE_TICKS_PER_STEP ticks and clamped to
+// [ENGINE_MIN_VOL, ENGINE_MAX_VOL]
+static inline double engine_series_vol(const double* prices, int n) {
+    double sum = 0.0, sum_sq = 0.0;
+    int returns = 0;
+    for (int i = 0; i + 1 < n; i++) {
+        if (prices[i] > 0.0 && prices[i + 1] > 0.0) {
+            double r = log(prices[i + 1] / prices[i]);
+            sum += r;
+            sum_sq += r * r;
+            returns++;
+        }
+    }
+    if (returns < 2) {
+        return ENGINE_MIN_VOL;
+    }
+    double variance = (sum_sq - sum * sum / returns) / (returns - 1);
+    double vol = sqrt((variance > 0.0 ? variance : 0.0) / ENGINE_TICKS_PER_STEP);
+    return vol < ENGINE_MIN_VOL ? ENGINE_MIN_VOL : vol > ENGINE_MAX_VOL ? ENGINE_MAX_VOL : vol;
+}
+
+// Add a stock starting at `price`, returns its slot. Drift is -vol^2 / 2, so
+// the expected price stays where it started.
+static inline int engine_add(PriceEngine* engine, double price, double vol) {
+    engine->log_price.push_back(log(price > 0.01 ? price : 0.01));
+    engine->drift.push_back(-0.5 * vol * vol);
+    engine->vol.push_back(vol);
+    return (int)engine->count++;
+}
+
+// Pad the arrays and size the scratch space, after the last engine_add().
+// Padding slots are stepped along with the rest but never read.
+static inline void engine_ready(PriceEngine* engine) {
+    engine->padded = (engine->count + ENGINE_LANES - 1) / ENGINE_LANES * ENGINE_LANES;
+    engine->log_price.resize(engine->padded, 0.0);
+    engine->drift.resize(engine->padded, 0.0);
+    engine->vol.resize(engine->padded, 0.0);
+    engine->normal.assign(engine->padded + ENGINE_LANES, 0.0);
+    engine->uniform.assign(engine->padded + ENGINE_LANES, 0.0);
+}
+
+// n uniforms in [0, 1), n a multiple of ENGINE_LANES. Lane l of every group
+// comes from generator l; the top 52 bits become the mantissa of a double in
+// [1, 2), so no integer-to-double conversion is needed.
+static inline void engine_fill_uniform(EngineRng* rng, double* out, size_t n) {
+    uint64_t s0[ENGINE_LANES], s1[ENGINE_LANES];
+    memcpy(s0, rng->s0, sizeof(s0));
+    memcpy(s1, rng->s1, sizeof(s1));
+    for (size_t i = 0; i < n; i += ENGINE_LANES) {
+        for (int l = 0; l < ENGINE_LANES; l++) {
+            uint64_t x = s0[l];
+            uint64_t y = s1[l];
+            s0[l] = y;
+            x ^= x << 23;
+            x ^= x >> 17;
+            x ^= y ^ (y >> 26);
+            s1[l] = x;
+            uint64_t bits = ((x + y) >> 12) | 0x3ff0000000000000ULL;
+            double one_to_two;
+            memcpy(&one_to_two, &bits, sizeof(one_to_two));
+            out[i + l] = one_to_two - 1.0;
+        }
+    }
+    memcpy(rng->s0, s0, sizeof(s0));
+    memcpy(rng->s1, s1, sizeof(s1));
+}
+
+// n standard normals (Box-Muller), n a multiple of ENGINE_LANES
+static inline void engine_fill_normal(EngineRng* rng, double* out, double* scratch, size_t n) {
+    engine_fill_uniform(rng, scratch, n);
+    for (size_t i = 0; i < n; i += 2) {
+        double radius = sqrt(-2.0 * log(1.0 - scratch[i]));
+        double angle = 2.0 * M_PI * scratch[i + 1];
+        out[i] = radius * cos(angle);
+        out[i + 1] = radius * sin(angle);
+    }
+}
+
+// log_price += drift + vol * (market + own * normal), the diffusion step
+static inline void engine_diffuse(double* __restrict__ log_price, const double* __restrict__ drift,
+                                  const double* __restrict__ vol, const double* __restrict__ normal,
+                                  double market, double own, size_t n) {
+    for (size_t i = 0; i < n; i += ENGINE_LANES) {
+        for (int l = 0; l < ENGINE_LANES; l++) {
+            log_price[i + l] += drift[i + l] + vol[i + l] * (market + own * normal[i + l]);
+        }
+    }
+}
+
+// Add a jump where uniform < ENGINE_JUMP_RATE. Given a jump, uniform / rate
+// is again uniform on [0, 1): it sets the jump size, uniformly distributed
+// with mean ENGINE_JUMP_MEAN and deviation ENGINE_JUMP_VOL.
+static inline void engine_jump(double* __restrict__ log_price, const double* __restrict__ uniform, size_t n) {
+    const double scale = ENGINE_JUMP_VOL * sqrt(3.0);
+    for (size_t i = 0; i < n; i += ENGINE_LANES) {
+        for (int l = 0; l < ENGINE_LANES; l++) {
+            double u = uniform[i + l];
+            double jump = ENGINE_JUMP_MEAN + scale * (2.0 * u / ENGINE_JUMP_RATE - 1.0);
+            log_price[i + l] += u < ENGINE_JUMP_RATE ? jump : 0.0;
+        }
+    }
+}
+
+// Move every stock by one tick
+static inline void engine_tick(PriceEngine* engine) {
+    size_t n = engine->padded;
+    double* normal = engine->normal.data();
+    double* uniform = engine->uniform.data();
+
+    engine_fill_normal(&engine->rng, normal, uniform, n + ENGINE_LANES);
+    engine_diffuse(engine->log_price.data(), engine->drift.data(), engine->vol.data(), normal,
+                   sqrt(engine->correlation) * normal[n], sqrt(1.0 - engine->correlation), n);
+    if (engine->model == ENGINE_JUMP) {
+        engine_fill_uniform(&engine->rng, uniform, n);
+        engine_jump(engine->log_price.data(), uniform, n);
+    }
+    engine->tick++;
+}
+
+#endif
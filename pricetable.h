@@ -0,0 +1,170 @@
+// pricetable.h - Shared-memory price table published by Server Q
+
+// Server Q is the only writer. It keeps one entry per symbol in a dense
+// array in POSIX shared memory and updates an entry whenever the price
+// moves. Every entry is guarded by its own sequence lock: the writer makes
+// the sequence odd, updates the fields and makes it even again, and a reader
+// retries until it saw the same even sequence before and after copying. A
+// reader never blocks the writer and never makes a syscall.
+//
+// Entries are only ever appended. A symbol keeps its slot for the life of
+// the table, so readers may cache the slot index.
+
+#ifndef PRICETABLE_H
+#define PRICETABLE_H
+
+#include <string>
+#include "shmring.h"
+
+#define PRICE_TABLE_NAME "/ee450_prices"
+#define PRICE_TABLE_MAGIC 0x45455054u     // "EEPT"
+#define PRICE_TABLE_SLOTS 256
+#define PRICE_SYMBOL_LEN 16
+#define PRICE_READ_MAX_RETRIES 1000000
+
+struct PriceEntry {
+    alignas(64) std::atomic<uint32_t> seq;      // odd while the writer is updating
+    char symbol[PRICE_SYMBOL_LEN];              // set once, before the entry is counted
+    std::atomic<double> price;
+    std::atomic<int32_t> current_idx;           // position in the symbol's price cycle, -1 under --simulate
+    std::atomic<int64_t> updated_ns;            // CLOCK_MONOTONIC time of the last update
+};
+
+struct PriceTable {
+    uint32_t magic;
+    std::atomic<uint32_t> count;                // entries [0, count) are valid
+    PriceEntry entries[PRICE_TABLE_SLOTS];
+};
+
+// A consistent copy of one entry
+struct PriceSnapshot {
+    double price;
+    int current_idx;
+    long long updated_ns;
+};
+
+// Writer side: (re)create the table, held with a shared flock like the shm
+// channels so readers can tell a live table from one left by a crash.
+// Returns NULL with errno set on failure.
+static inline PriceTable* price_table_create() {
+    shm_unlink(PRICE_TABLE_NAME);
+    int fd = shm_open(PRICE_TABLE_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (flock(fd, LOCK_SH) == -1 || ftruncate(fd, sizeof(PriceTable)) == -1) {
+        int err = errno;
+        close(fd);
+        shm_unlink(PRICE_TABLE_NAME);
+        errno = err;
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(PriceTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        shm_unlink(PRICE_TABLE_NAME);
+        errno = err;
+        return NULL;
+    }
+    PriceTable* table = new (mem) PriceTable();
+    table->magic = PRICE_TABLE_MAGIC;
+    table->count.store(0);
+    return table;
+}
+
+// Writer side: give a new symbol the next slot, -1 if the table is full
+static inline int price_table_add(PriceTable* table, const std::string& symbol) {
+    uint32_t slot = table->count.load(std::memory_order_relaxed);
+    if (slot >= PRICE_TABLE_SLOTS || symbol.size() >= PRICE_SYMBOL_LEN) {
+        return -1;
+    }
+    PriceEntry& entry = table->entries[slot];
+    memset(entry.symbol, 0, sizeof(entry.symbol));
+    memcpy(entry.symbol, symbol.c_str(), symbol.size());
+    entry.seq.store(0, std::memory_order_relaxed);
+    entry.price.store(0.0, std::memory_order_relaxed);
+    entry.current_idx.store(0, std::memory_order_relaxed);
+    entry.updated_ns.store(0, std::memory_order_relaxed);
+    table->count.store(slot + 1, std::memory_order_release);
+    return (int)slot;
+}
+
+// Writer side: publish a new price for the symbol in `slot`
+static inline void price_table_publish(PriceTable* table, int slot, double price, int current_idx) {
+    PriceEntry& entry = table->entries[slot];
+    uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+    entry.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.price.store(price, std::memory_order_relaxed);
+    entry.current_idx.store(current_idx, std::memory_order_relaxed);
+    entry.updated_ns.store(shm_now_ns(), std::memory_order_relaxed);
+    entry.seq.store(seq + 2, std::memory_order_release);
+}
+
+// Reader side: map the table read-only, NULL if Server Q is not publishing
+// one. The descriptor stays open in *fd_out for shm_owner_running().
+static inline const PriceTable* price_table_open(int* fd_out) {
+    int fd = shm_open(PRICE_TABLE_NAME, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(PriceTable) || !shm_owner_running(fd)) {
+        close(fd);
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(PriceTable), PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    const PriceTable* table = (const PriceTable*)mem;
+    if (table->magic != PRICE_TABLE_MAGIC) {
+        munmap(mem, sizeof(PriceTable));
+        close(fd);
+        return NULL;
+    }
+    *fd_out = fd;
+    return table;
+}
+
+static inline void price_table_close(const PriceTable* table, int fd) {
+    munmap((void*)table, sizeof(PriceTable));
+    close(fd);
+}
+
+// Reader side: slot of `symbol`, -1 if the table does not have it
+static inline int price_table_find(const PriceTable* table, const std::string& symbol) {
+    uint32_t count = table->count.load(std::memory_order_acquire);
+    for (uint32_t slot = 0; slot < count && slot < PRICE_TABLE_SLOTS; slot++) {
+        if (strncmp(table->entries[slot].symbol, symbol.c_str(), PRICE_SYMBOL_LEN) == 0) {
+            return (int)slot;
+        }
+    }
+    return -1;
+}
+
+// Reader side: consistent copy of the entry in `slot`. Returns false if the
+// symbol has not been priced yet, or if the entry stays mid-update (a writer
+// that died there) for PRICE_READ_MAX_RETRIES attempts.
+static inline bool price_table_read(const PriceTable* table, int slot, PriceSnapshot* out) {
+    const PriceEntry& entry = table->entries[slot];
+    for (int attempt = 0; attempt < PRICE_READ_MAX_RETRIES; attempt++) {
+        uint32_t before = entry.seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            shm_cpu_relax();
+            continue;
+        }
+        out->price = entry.price.load(std::memory_order_relaxed);
+        out->current_idx = entry.current_idx.load(std::memory_order_relaxed);
+        out->updated_ns = entry.updated_ns.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.seq.load(std::memory_order_relaxed) == before) {
+            return before != 0;
+        }
+    }
+    return false;
+}
+
+#endif
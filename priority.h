@@ -0,0 +1,133 @@
+// priority.h - Trades ahead of reads in a backend's receive queue
+
+// Server P and Server Q take up to PRIORITY_BATCH requests off their socket
+// (or shared-memory ring) at once, whatever is already waiting, and serve the
+// trades among them first: BUY, SELL, BASKET ... APPLY, ADVANCE, the release
+// of a sell hold ("N") and PING, which must not look like an outage. Reads
+// (PORTFOLIO, QUOTE, QUOTE_PAGE, HISTORY, TRADES, CHECK, ...) follow in the
+// order they arrived.
+//
+// A read waits behind at most PRIORITY_BATCH - 1 trades, the ones taken in
+// the same batch, so a stream of trades cannot starve it. When nothing else
+// is waiting the batch is one request and nothing changes.
+//
+// Server A's shared-memory ring is read through the same loop (see
+// backend.h); its requests are all reads, so their order does not change.
+
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "shmring.h"
+
+#define PRIORITY_BATCH 8            // requests taken off the queue at once
+#define PRIORITY_MSG_MAX 1024       // same as the UDP BUFFER_SIZE
+
+struct PriorityBatch {
+    int count;
+    int order[PRIORITY_BATCH];      // indexes into the arrays below, trades first
+    char data[PRIORITY_BATCH][PRIORITY_MSG_MAX];  // each NUL-terminated
+    int len[PRIORITY_BATCH];
+    struct sockaddr_storage addr[PRIORITY_BATCH];
+    socklen_t addr_len[PRIORITY_BATCH];
+    long long received_ns;          // when the batch was taken
+};
+
+static inline bool priority_word_is(const char* word, size_t len, const char* name) {
+    return len == strlen(name) && memcmp(word, name, len) == 0;
+}
+
+// Whether `message` (with or without its "#<id> " tag) is served ahead of reads
+static inline bool priority_is_trade(const char* message) {
+    if (message[0] == '#') {
+        const char* space = strchr(message, ' ');
+        if (space == NULL) {
+            return false;
+        }
+        message = space + 1;
+    }
+    size_t len = strcspn(message, " ");
+    if (priority_word_is(message, len, "BUY") || priority_word_is(message, len, "SELL") ||
+        priority_word_is(message, len, "ADVANCE") || priority_word_is(message, len, "N") ||
+        priority_word_is(message, len, "PING")) {
+        return true;
+    }
+    if (priority_word_is(message, len, "BASKET")) {
+        // BASKET <user> APPLY ...; BASKET <user> CHECK is a read
+        const char* user = message + len + strspn(message + len, " ");
+        const char* action = user + strcspn(user, " ");
+        action += strspn(action, " ");
+        return priority_word_is(action, strcspn(action, " "), "APPLY");
+    }
+    return false;
+}
+
+// Put the trades first, each class in arrival order
+static inline void priority_order(PriorityBatch* batch) {
+    bool trade[PRIORITY_BATCH];
+    int next = 0;
+    for (int i = 0; i < batch->count; i++) {
+        trade[i] = priority_is_trade(batch->data[i]);
+        if (trade[i]) {
+            batch->order[next++] = i;
+        }
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if (!trade[i]) {
+            batch->order[next++] = i;
+        }
+    }
+}
+
+// Block for one datagram, then take whatever else is already queued on the
+// socket. Returns the number of requests, -1 with errno set on error.
+static inline int priority_recv_udp(int sockfd, PriorityBatch* batch) {
+    struct mmsghdr msgs[PRIORITY_BATCH];
+    struct iovec parts[PRIORITY_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < PRIORITY_BATCH; i++) {
+        parts[i].iov_base = batch->data[i];
+        parts[i].iov_len = PRIORITY_MSG_MAX - 1;
+        msgs[i].msg_hdr.msg_iov = &parts[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &batch->addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(batch->addr[i]);
+    }
+    int count = recvmmsg(sockfd, msgs, PRIORITY_BATCH, MSG_WAITFORONE, NULL);
+    if (count <= 0) {
+        return -1;
+    }
+    batch->received_ns = shm_now_ns();
+    batch->count = count;
+    for (int i = 0; i < count; i++) {
+        batch->len[i] = (int)msgs[i].msg_len;
+        batch->data[i][batch->len[i]] = '\0';
+        batch->addr_len[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+    priority_order(batch);
+    return count;
+}
+
+// The same for a shared-memory request ring; addr is left zeroed
+static inline int priority_recv_shm(ShmRing* ring, PriorityBatch* batch, ShmSpin* spin) {
+    int len = shm_ring_wait_pop(ring, batch->data[0], PRIORITY_MSG_MAX - 1, spin);
+    int count = 0;
+    while (len >= 0) {
+        batch->len[count] = len;
+        batch->data[count][len] = '\0';
+        batch->addr_len[count] = sizeof(struct sockaddr_in);
+        memset(&batch->addr[count], 0, sizeof(batch->addr[count]));
+        if (++count == PRIORITY_BATCH) {
+            break;
+        }
+        len = shm_ring_pop(ring, batch->data[count], PRIORITY_MSG_MAX - 1);
+    }
+    batch->received_ns = shm_now_ns();
+    batch->count = count;
+    priority_order(batch);
+    return count;
+}
+
+#endif
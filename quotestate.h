@@ -0,0 +1,139 @@
+// quotestate.h - Server Q's mutable quote state, kept in a memory-mapped file
+
+// Server Q maps QUOTE_STATE_FILE with MAP_SHARED and keeps each stock's
+// cursor into its price series (and, under --simulate, its last simulated
+// log price) in an entry of the mapping. An ADVANCE is one store into the
+// page cache: no syscall and no fsync. The kernel writes the pages back on
+// its own, and a crash of Server Q loses nothing, because the pages belong
+// to the file, not to the process. Only a crash of the machine can lose the
+// last few seconds of moves.
+//
+// Entries are only ever appended, like the shared price table's. A symbol
+// keeps its entry across restarts and reloads, even after it leaves
+// quotes.txt, so a stock that comes back resumes where it was. A field is a
+// naturally aligned 4 or 8 byte store, so it is never seen half written.
+//
+// The file is held with an exclusive flock: two Server Qs never move the
+// same cursors. A file with the wrong size, magic, version or byte order is
+// started over from index 0.
+
+#ifndef QUOTESTATE_H
+#define QUOTESTATE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+#define QUOTE_STATE_FILE "quotes.state"
+#define QUOTE_STATE_MAGIC "EE450QS"
+#define QUOTE_STATE_VERSION 1
+#define QUOTE_STATE_ENDIAN_CHECK 0x01020304u
+#define QUOTE_STATE_SLOTS 1024
+#define QUOTE_STATE_SYMBOL_LEN 16
+
+struct QuoteStateEntry {
+    char symbol[QUOTE_STATE_SYMBOL_LEN];  // set once, before the entry is counted
+    int32_t current_idx;                  // position in the symbol's price series
+    int32_t has_sim_price;                // sim_log_price was set by the price engine
+    double sim_log_price;                 // last simulated log price
+};
+
+struct QuoteStateFile {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    uint32_t count;                       // entries [0, count) are valid
+    uint32_t reserved;
+    QuoteStateEntry entries[QUOTE_STATE_SLOTS];
+};
+
+static inline bool quote_state_valid(const QuoteStateFile* state) {
+    return memcmp(state->magic, QUOTE_STATE_MAGIC, sizeof(QUOTE_STATE_MAGIC)) == 0 &&
+           state->version == QUOTE_STATE_VERSION && state->endian_check == QUOTE_STATE_ENDIAN_CHECK &&
+           state->count <= QUOTE_STATE_SLOTS;
+}
+
+// Map `path`, creating it if needed. Returns NULL with errno set on failure
+// (EWOULDBLOCK when another process holds it). *reset is set when the file
+// was new or unusable and now starts empty.
+static inline QuoteStateFile* quote_state_open(const char* path, bool* reset) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    *reset = st.st_size != (off_t)sizeof(QuoteStateFile);
+    if (*reset && ftruncate(fd, 0) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(QuoteStateFile)) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(QuoteStateFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    // The descriptor stays open: it holds the flock for as long as Server Q runs
+    QuoteStateFile* state = (QuoteStateFile*)mem;
+    if (*reset || !quote_state_valid(state)) {
+        *reset = true;
+        memset(state, 0, sizeof(*state));
+        memcpy(state->magic, QUOTE_STATE_MAGIC, sizeof(QUOTE_STATE_MAGIC));
+        state->version = QUOTE_STATE_VERSION;
+        state->endian_check = QUOTE_STATE_ENDIAN_CHECK;
+    }
+    return state;
+}
+
+// Entry of `symbol`, -1 if there is none
+static inline int quote_state_find(const QuoteStateFile* state, const std::string& symbol) {
+    for (uint32_t slot = 0; slot < state->count; slot++) {
+        const QuoteStateEntry& entry = state->entries[slot];
+        if (strncmp(entry.symbol, symbol.c_str(), QUOTE_STATE_SYMBOL_LEN) == 0) {
+            return (int)slot;
+        }
+    }
+    return -1;
+}
+
+// Give a new symbol the next entry, starting at index 0. Returns -1 if the
+// file is full or the symbol too long to keep.
+static inline int quote_state_add(QuoteStateFile* state, const std::string& symbol) {
+    uint32_t slot = state->count;
+    if (slot >= QUOTE_STATE_SLOTS || symbol.size() >= QUOTE_STATE_SYMBOL_LEN) {
+        return -1;
+    }
+    QuoteStateEntry& entry = state->entries[slot];
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.symbol, symbol.c_str(), symbol.size());
+    __atomic_store_n(&state->count, slot + 1, __ATOMIC_RELEASE);
+    return (int)slot;
+}
+
+// Ask the kernel to write the pages back now, without waiting for it
+static inline void quote_state_flush(QuoteStateFile* state) {
+    msync(state, sizeof(QuoteStateFile), MS_ASYNC);
+}
+
+#endif
@@ -0,0 +1,511 @@
+// replay.cpp - Replays a Server M traffic capture against a test stack
+
+// Usage: ./replay [--fast] [--stub-backends] <capture file>
+//
+// Every client session in the capture (see capture.h) becomes a TCP
+// connection to Server M. Each message the member sent is sent again, at its
+// original offset from the start of the capture, or with --fast as soon as
+// the reply to the previous one is in. What Server M sends back is compared
+// with what it sent in the capture; the first mismatches are printed, and the
+// exit status is 1 if there was any.
+//
+// Replies only match when the stack starts from the same data files as the
+// captured one. With --stub-backends, replay also stands in for Server A, P
+// and Q (which must not be running): it answers each request with the reply
+// captured for the same request text, so only Server M is under test and the
+// replies do not depend on how the sessions interleave.
+//
+// Portions of this code are inspired on Beej's Guide to Network Programming
+// https://beej.us/guide/bgnet/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "capture.h"
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_M_TCP_PORT 45654
+#define SERVER_A_PORT 41654
+#define SERVER_P_PORT 42654
+#define SERVER_Q_PORT 43654
+#define BUFFER_SIZE 1024
+#define REPLAY_IDLE_MS 2000         // a reply that stops short is compared after this long without data
+#define REPLAY_POLL_MAX_MS 100
+#define REPLAY_MAX_REPORTED 10      // mismatches printed in full
+#define STUB_NOT_CAPTURED "ERROR: not in capture"
+
+// One message the member sent, and what Server M sent back before the next one
+struct ReplayStep {
+    long long at_ns;                // offset from the start of the capture
+    std::string message;
+    std::string expected;
+};
+
+struct ReplaySession {
+    unsigned id;                    // Server M's session id in the capture
+    long long open_ns;
+    long long close_ns;
+    std::vector<ReplayStep> steps;
+
+    int fd;                         // -1 until connected and after closing
+    size_t next_step;               // next step to send
+    bool waiting;                   // steps[next_step - 1] was sent, its reply is being collected
+    bool done;
+    std::string received;           // bytes from Server M not compared yet
+    long long sent_ns;
+    long long last_data_ns;
+
+    ReplaySession() : id(0), open_ns(0), close_ns(-1), fd(-1), next_step(0), waiting(false),
+                      done(false), sent_ns(0), last_data_ns(0) {}
+};
+
+// A backend stand-in for --stub-backends
+struct StubBackend {
+    char channel;
+    int port;
+    int fd;
+};
+
+std::vector<ReplaySession> replay_sessions;
+std::map<std::string, std::deque<std::string> > stub_replies;  // channel + request text -> replies, in order
+long long capture_span_ns = 0;
+unsigned long long capture_dropped = 0;
+
+std::vector<double> latencies_ms;
+int messages_sent = 0;
+int mismatches = 0;
+int stub_answered = 0;
+int stub_unmatched = 0;
+
+// Function prototypes
+bool load_capture(const char* path);
+const char* split_request_tag(const std::string& datagram, std::string* tag);
+bool open_stub_backends(StubBackend* stubs);
+void serve_stub(StubBackend* stub);
+bool connect_session(ReplaySession* r);
+void send_step(ReplaySession* r, long long now);
+void check_step(ReplaySession* r, long long now);
+void close_session(ReplaySession* r);
+std::string printable(const std::string& data);
+void print_report(long long elapsed_ns, bool stubs);
+
+int main(int argc, char* argv[]) {
+    bool fast = false;
+    bool stubs = false;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            fast = true;
+        } else if (strcmp(argv[i], "--stub-backends") == 0) {
+            stubs = true;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [--fast] [--stub-backends] <capture file>\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!load_capture(path)) {
+        return 2;
+    }
+    int step_count = 0;
+    for (size_t i = 0; i < replay_sessions.size(); i++) {
+        step_count += (int)replay_sessions[i].steps.size();
+    }
+    printf("[Replay] %s: %d sessions, %d messages over %.2f s%s.\n", path, (int)replay_sessions.size(),
+           step_count, capture_span_ns / 1e9, fast ? ", replaying as fast as possible" : "");
+    if (capture_dropped > 0) {
+        printf("[Replay] The capture dropped %llu records, some sessions may not match.\n", capture_dropped);
+    }
+
+    StubBackend stub_backends[3] = { { 'A', SERVER_A_PORT, -1 }, { 'P', SERVER_P_PORT, -1 },
+                                     { 'Q', SERVER_Q_PORT, -1 } };
+    if (stubs && !open_stub_backends(stub_backends)) {
+        return 2;
+    }
+
+    // One poll() loop drives every session: connect at the captured open
+    // time, send each message when it is due and its predecessor's reply is
+    // in, and compare the reply once it is complete
+    long long start_ns = shm_now_ns();
+    size_t remaining = replay_sessions.size();
+    std::vector<struct pollfd> fds;
+    std::vector<ReplaySession*> fd_sessions;
+    while (remaining > 0) {
+        long long now = shm_now_ns();
+        long long offset = now - start_ns;
+        long long next_due = now + REPLAY_POLL_MAX_MS * 1000000LL;
+        fds.clear();
+        fd_sessions.clear();
+
+        for (size_t i = 0; i < replay_sessions.size(); i++) {
+            ReplaySession* r = &replay_sessions[i];
+            if (r->done) {
+                continue;
+            }
+            if (r->fd == -1) {
+                if (!fast && offset < r->open_ns) {
+                    next_due = std::min(next_due, start_ns + r->open_ns);
+                    continue;
+                }
+                if (!connect_session(r)) {
+                    r->done = true;
+                    remaining--;
+                    continue;
+                }
+            }
+            if (r->waiting) {
+                check_step(r, now);
+            }
+            if (!r->waiting) {
+                long long due = r->next_step < r->steps.size() ? r->steps[r->next_step].at_ns : r->close_ns;
+                if (fast || offset >= due) {
+                    if (r->next_step < r->steps.size()) {
+                        send_step(r, now);
+                    } else {
+                        close_session(r);
+                        remaining--;
+                        continue;
+                    }
+                } else {
+                    next_due = std::min(next_due, start_ns + due);
+                }
+            }
+            if (r->waiting) {
+                next_due = std::min(next_due, r->last_data_ns + REPLAY_IDLE_MS * 1000000LL);
+            }
+            struct pollfd pfd;
+            pfd.fd = r->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            fd_sessions.push_back(r);
+        }
+        for (int b = 0; stubs && b < 3; b++) {
+            struct pollfd pfd;
+            pfd.fd = stub_backends[b].fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+        }
+        if (remaining == 0) {
+            break;
+        }
+
+        int timeout_ms = (int)((next_due - shm_now_ns() + 999999) / 1000000);
+        if (poll(fds.data(), fds.size(), timeout_ms < 0 ? 0 : timeout_ms) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 2;
+        }
+
+        now = shm_now_ns();
+        for (size_t i = 0; i < fds.size(); i++) {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+                continue;
+            }
+            if (i >= fd_sessions.size()) {
+                serve_stub(&stub_backends[i - fd_sessions.size()]);
+                continue;
+            }
+            ReplaySession* r = fd_sessions[i];
+            char buffer[BUFFER_SIZE];
+            ssize_t n = recv(r->fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                r->received.append(buffer, n);
+                r->last_data_ns = now;
+            } else if (n == 0 || errno != EINTR) {
+                // Server M hung up: whatever is still expected never comes
+                r->last_data_ns = 0;
+                if (r->waiting) {
+                    check_step(r, now);
+                }
+                close_session(r);
+                remaining--;
+            }
+        }
+    }
+
+    print_report(shm_now_ns() - start_ns, stubs);
+    return mismatches == 0 ? 0 : 1;
+}
+
+// Rebuild each session's messages and replies (and, for the stubs, every
+// backend request's reply) from the capture records
+bool load_capture(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        perror(path);
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string data = contents.str();
+
+    CaptureHeader header;
+    if (data.size() < sizeof(header)) {
+        fprintf(stderr, "[Replay] %s is not a capture file\n", path);
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+        header.endian_check != CAPTURE_ENDIAN_CHECK || header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "[Replay] %s is not a capture file this replay can read\n", path);
+        return false;
+    }
+
+    std::map<unsigned, size_t> session_index;           // capture session id -> replay_sessions
+    std::map<unsigned long, std::string> request_keys;  // capture request id -> stub key
+    long long at_ns = 0;
+    size_t pos = sizeof(header);
+    while (pos < data.size()) {
+        if (data.size() - pos < 2) {
+            break;
+        }
+        int kind = (unsigned char)data[pos];
+        char channel = data[pos + 1];
+        pos += 2;
+        uint64_t delta, session, len;
+        if (!capture_get_varint(data.data(), data.size(), &pos, &delta) ||
+            !capture_get_varint(data.data(), data.size(), &pos, &session) ||
+            !capture_get_varint(data.data(), data.size(), &pos, &len) || len > data.size() - pos) {
+            printf("[Replay] The capture ends in a partial record, ignoring it.\n");
+            break;
+        }
+        std::string payload = data.substr(pos, len);
+        pos += len;
+        at_ns += (long long)delta;
+
+        std::map<unsigned, size_t>::iterator it = session_index.find((unsigned)session);
+        ReplaySession* r = it == session_index.end() ? NULL : &replay_sessions[it->second];
+        std::string tag;
+        if (kind == CAPTURE_OPEN) {
+            session_index[(unsigned)session] = replay_sessions.size();
+            replay_sessions.push_back(ReplaySession());
+            replay_sessions.back().id = (unsigned)session;
+            replay_sessions.back().open_ns = at_ns;
+        } else if (kind == CAPTURE_CLOSE && r != NULL) {
+            r->close_ns = at_ns;
+        } else if (kind == CAPTURE_CLIENT_IN && r != NULL) {
+            ReplayStep step;
+            step.at_ns = at_ns;
+            step.message = payload;
+            r->steps.push_back(step);
+        } else if (kind == CAPTURE_CLIENT_OUT && r != NULL && !r->steps.empty()) {
+            r->steps.back().expected += payload;
+        } else if (kind == CAPTURE_BACKEND_OUT) {
+            const char* text = split_request_tag(payload, &tag);
+            if (!tag.empty()) {
+                request_keys[strtoul(tag.c_str() + 1, NULL, 10)] = std::string(1, channel) + text;
+            }
+        } else if (kind == CAPTURE_BACKEND_IN) {
+            const char* text = split_request_tag(payload, &tag);
+            std::map<unsigned long, std::string>::iterator req = tag.empty() ? request_keys.end()
+                : request_keys.find(strtoul(tag.c_str() + 1, NULL, 10));
+            if (req != request_keys.end()) {
+                stub_replies[req->second].push_back(text);
+                request_keys.erase(req);
+            }
+        } else if (kind == CAPTURE_DROPPED) {
+            capture_dropped += session;
+        }
+    }
+    capture_span_ns = at_ns;
+    for (size_t i = 0; i < replay_sessions.size(); i++) {
+        if (replay_sessions[i].close_ns < 0) {
+            replay_sessions[i].close_ns = at_ns;  // still open when the capture ended
+        }
+    }
+    return true;
+}
+
+// Split "#<id>[/<trace>] <text>" into the tag (with its space) and the text;
+// an untagged datagram has an empty tag
+const char* split_request_tag(const std::string& datagram, std::string* tag) {
+    tag->clear();
+    if (datagram.empty() || datagram[0] != '#') {
+        return datagram.c_str();
+    }
+    size_t space = datagram.find(' ');
+    if (space == std::string::npos) {
+        return datagram.c_str();
+    }
+    tag->assign(datagram, 0, space + 1);
+    return datagram.c_str() + space + 1;
+}
+
+// Bind the backends' UDP ports (beej guide 6.3)
+bool open_stub_backends(StubBackend* stubs) {
+    for (int b = 0; b < 3; b++) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(stubs[b].port);
+        addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+        stubs[b].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (stubs[b].fd == -1 || bind(stubs[b].fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("stub backend bind");
+            fprintf(stderr, "[Replay] Could not take Server %c's port %d, is it still running?\n",
+                    stubs[b].channel, stubs[b].port);
+            return false;
+        }
+    }
+    printf("[Replay] Standing in for Server A, P and Q, with replies to %d distinct requests.\n",
+           (int)stub_replies.size());
+    return true;
+}
+
+// Answer one request with the next reply captured for the same text
+void serve_stub(StubBackend* stub) {
+    char buffer[BUFFER_SIZE];
+    struct sockaddr_storage their_addr;
+    socklen_t addr_len = sizeof(their_addr);
+    ssize_t n = recvfrom(stub->fd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&their_addr, &addr_len);
+    if (n <= 0) {
+        return;
+    }
+    std::string tag;
+    std::string datagram(buffer, n);
+    const char* text = split_request_tag(datagram, &tag);
+    if (tag.empty()) {
+        return;  // one-way notification, nothing to answer
+    }
+    std::deque<std::string>& replies = stub_replies[std::string(1, stub->channel) + text];
+    std::string reply = tag;
+    if (replies.empty()) {
+        reply += STUB_NOT_CAPTURED;
+        stub_unmatched++;
+    } else {
+        reply += replies.front();
+        replies.pop_front();
+        stub_answered++;
+    }
+    if (sendto(stub->fd, reply.data(), reply.size(), 0, (struct sockaddr*)&their_addr, addr_len) == -1) {
+        perror("stub sendto");
+    }
+}
+
+// TCP connection to Server M (beej guide 6.2)
+bool connect_session(ReplaySession* r) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_M_TCP_PORT);
+    addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    r->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (r->fd == -1 || connect(r->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        if (r->fd != -1) {
+            close(r->fd);
+            r->fd = -1;
+        }
+        mismatches += (int)r->steps.size();
+        return false;
+    }
+    return true;
+}
+
+void send_step(ReplaySession* r, long long now) {
+    const ReplayStep& step = r->steps[r->next_step++];
+    std::string message = step.message;
+    message += '\0';
+    if (send(r->fd, message.data(), message.size(), MSG_NOSIGNAL) != (ssize_t)message.size()) {
+        perror("send");
+    }
+    messages_sent++;
+    r->waiting = true;
+    r->sent_ns = now;
+    r->last_data_ns = now;
+}
+
+// The reply to the last message is complete once it is as long as the
+// captured one, or when Server M has gone quiet for REPLAY_IDLE_MS. Extra
+// bytes stay for the next message.
+void check_step(ReplaySession* r, long long now) {
+    const ReplayStep& step = r->steps[r->next_step - 1];
+    bool complete = r->received.size() >= step.expected.size();
+    if (!complete && r->last_data_ns != 0 && now - r->last_data_ns < REPLAY_IDLE_MS * 1000000LL) {
+        return;
+    }
+    r->waiting = false;
+    std::string got = r->received.substr(0, step.expected.size());
+    r->received.erase(0, got.size());
+    if (got == step.expected) {
+        if (!step.expected.empty()) {
+            latencies_ms.push_back((r->last_data_ns - r->sent_ns) / 1e6);
+        }
+        return;
+    }
+    mismatches++;
+    if (mismatches <= REPLAY_MAX_REPORTED) {
+        printf("[Replay] Session %u, message %d \"%s\":\n  expected \"%s\"\n  got      \"%s\"\n", r->id,
+               (int)r->next_step, printable(step.message).c_str(), printable(step.expected).c_str(),
+               printable(got).c_str());
+    }
+}
+
+void close_session(ReplaySession* r) {
+    if (r->fd != -1) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    // Messages never sent because Server M hung up count as mismatches
+    mismatches += (int)(r->steps.size() - r->next_step);
+    r->next_step = r->steps.size();
+    r->done = true;
+}
+
+// Escape NULs and newlines so a reply fits on one line
+std::string printable(const std::string& data) {
+    std::string out;
+    for (size_t i = 0; i < data.size(); i++) {
+        if (data[i] == '\0') {
+            out += "\\0";
+        } else if (data[i] == '\n') {
+            out += "\\n";
+        } else {
+            out += data[i];
+        }
+    }
+    return out;
+}
+
+void print_report(long long elapsed_ns, bool stubs) {
+    double seconds = elapsed_ns / 1e9;
+    printf("[Replay] Sent %d messages in %.2f s (%.1f messages/s), %d mismatched.\n", messages_sent, seconds,
+           seconds > 0 ? messages_sent / seconds : 0.0, mismatches);
+    if (!latencies_ms.empty()) {
+        std::sort(latencies_ms.begin(), latencies_ms.end());
+        size_t n = latencies_ms.size();
+        printf("[Replay] Reply latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms.\n",
+               latencies_ms[n / 2], latencies_ms[n * 9 / 10], latencies_ms[n * 99 / 100], latencies_ms[n - 1]);
+    }
+    if (stubs) {
+        printf("[Replay] Stub backends answered %d requests, %d were not in the capture.\n",
+               stub_answered, stub_unmatched);
+    }
+}
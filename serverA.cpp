@@ -20,12 +20,19 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <memory>
 #include <fstream>
 #include <iostream>
+#include "shmring.h"
+#include "filewatch.h"
+#include "tradecore.h"
+#include "trace.h"
+#include "backend.h"
 
 // Default values - replace XXX with your USC ID last 3 digits
 #define SERVER_A_PORT 41654
@@ -34,14 +41,31 @@
 
 // Global socket file descriptor for cleanup
 int sockfd = -1;
-std::map<std::string, std::string> users; // Maps usernames to encrypted passwords
+
+// --transport=shm: Server M's requests also arrive over a shared-memory ring
+// (see backend.h). process_lock keeps the UDP loop and the ring's thread
+// from running process_message() at the same time.
+ShmChannel* shm_channel = NULL;
+pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tracing (see trace.h and backend.h)
+TraceLog trace_log = { -1, 0, "serverA" };
+
+// Maps usernames to encrypted passwords. A reload builds a new table on the
+// watcher thread and publishes it with one atomic pointer store (RCU style):
+// each request works on the snapshot it loaded, and the old table is freed
+// when the last request holding it is done.
+typedef std::map<std::string, std::string> MemberTable;
+std::shared_ptr<const MemberTable> users;
 
 // Function prototypes
 void sigint_handler(int sig);
 void load_members_file();
-void encrypt_password(char* password);
-std::vector<std::string> split_string(const std::string& str, char delimiter);
+bool parse_members_file(MemberTable& table);
+void reload_members_file();
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len);
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len);
+const char* strip_request_tag(char* message);
 
 // handle ctrl+c (beej guide man pages 9.4)
 void sigint_handler(int sig) {
@@ -52,10 +76,30 @@ void sigint_handler(int sig) {
         close(sockfd);
     }
     
+    if (shm_channel != NULL) {
+        shm_channel_retire(shm_channel, SHM_NAME_A);
+    }
+    
     exit(0);
 }
 
+// bench.cpp builds this file with NO_SERVER_MAIN to call its handlers directly
+#ifndef NO_SERVER_MAIN
 int main(int argc, char *argv[]) {
+    // --transport=udp (default) or --transport=shm, --port=N for a standby instance
+    bool use_shm = false;
+    int port = SERVER_A_PORT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--transport=shm") == 0) {
+            use_shm = true;
+        } else if (strncmp(argv[i], "--port=", 7) == 0) {
+            port = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--transport=udp") != 0) {
+            fprintf(stderr, "Usage: %s [--transport=udp|shm] [--port=N]\n", argv[0]);
+            exit(1);
+        }
+    }
+    
     // register sigint handler (beej guide)
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
@@ -78,7 +122,7 @@ int main(int argc, char *argv[]) {
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_flags = AI_PASSIVE; // Use my IP
 
-    if ((rv = getaddrinfo(NULL, std::to_string(SERVER_A_PORT).c_str(), &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &servinfo)) != 0) {
         fprintf(stderr, "[Server A] getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
     }
@@ -114,10 +158,37 @@ int main(int argc, char *argv[]) {
 
     freeaddrinfo(servinfo);
     
-    // load users
+    // load users, and again whenever members.txt changes
     load_members_file();
+    static const FileWatch members_watch = { MEMBERS_FILE, reload_members_file };
+    if (!file_watch_start(&members_watch)) {
+        fprintf(stderr, "[Server A] Failed to start the members file watcher\n");
+    }
     
-    printf("[Server A] Booting up using UDP on port %d\n", SERVER_A_PORT);
+    printf("[Server A] Booting up using UDP on port %d\n", port);
+    
+    // The rings are found by name, not port: they belong to the primary
+    if (use_shm && port != SERVER_A_PORT) {
+        printf("[Server A] Standby on port %d: serving UDP only, not shared memory.\n", port);
+        use_shm = false;
+    }
+    
+    // Same-host fast path, UDP keeps working alongside it
+    if (use_shm) {
+        pthread_t shm_thread;
+        static BackendShm shm = { NULL, &trace_log, process_message, &process_lock };
+        shm_channel = shm_channel_create(SHM_NAME_A);
+        shm.channel = shm_channel;
+        if (shm_channel == NULL) {
+            perror("shm_open");
+        } else if (pthread_create(&shm_thread, NULL, backend_shm_serve, &shm) != 0) {
+            fprintf(stderr, "[Server A] Failed to start the shared memory thread\n");
+            shm_channel_retire(shm_channel, SHM_NAME_A);
+            shm_channel = NULL;
+        } else {
+            printf("[Server A] Serving Server M over shared memory (%s).\n", SHM_NAME_A);
+        }
+    }
     
     // listen for msgs (beej guide, 6.3)
     struct sockaddr_storage their_addr;
@@ -134,11 +205,14 @@ int main(int argc, char *argv[]) {
         }
 
         buffer[numbytes] = '\0';
+        backend_received_ns = shm_now_ns();
         
         // print client addr, port (beej guide)
         struct sockaddr_in* client_addr = (struct sockaddr_in*)&their_addr;
         
-        process_message(buffer, client_addr, addr_len);
+        pthread_mutex_lock(&process_lock);
+        process_message(strip_request_tag(buffer), client_addr, addr_len);
+        pthread_mutex_unlock(&process_lock);
     }
     
     // cleanup socket (beej guide  9.4)
@@ -146,13 +220,34 @@ int main(int argc, char *argv[]) {
     close(sockfd);
     return 0;
 }
+#endif
 
 void load_members_file() {
+    std::shared_ptr<MemberTable> table = std::make_shared<MemberTable>();
+    if (!parse_members_file(*table)) {
+        printf("[Server A] Error: Could not open members file: %s\n", MEMBERS_FILE);
+        exit(1);
+    }
+    std::atomic_store(&users, std::shared_ptr<const MemberTable>(table));
+}
+
+// Swap in a freshly parsed members.txt. A file that cannot be read or holds
+// no members (say, caught just after truncation) is ignored.
+void reload_members_file() {
+    std::shared_ptr<MemberTable> table = std::make_shared<MemberTable>();
+    if (!parse_members_file(*table) || table->empty()) {
+        printf("[Server A] Ignoring unreadable or empty %s, keeping the current members.\n", MEMBERS_FILE);
+        return;
+    }
+    std::atomic_store(&users, std::shared_ptr<const MemberTable>(table));
+    printf("[Server A] Reloaded %s: %d members.\n", MEMBERS_FILE, (int)table->size());
+}
+
+bool parse_members_file(MemberTable& table) {
     std::ifstream file(MEMBERS_FILE);
     
     if (!file.is_open()) {
-        printf("[Server A] Error: Could not open members file: %s\n", MEMBERS_FILE);
-        exit(1);
+        return false;
     }
     
     std::string line;
@@ -167,12 +262,13 @@ void load_members_file() {
         
         if (parts.size() == 2) {
             // Store encrypted passwords directly from file
-            users[parts[0]] = parts[1];
+            table[parts[0]] = parts[1];
             count++;
         }
     }
     
     file.close();
+    return true;
 }
 
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len) {
@@ -183,6 +279,12 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
         return;
     }
     
+    // Server M's health check, answered without a log line
+    if (parts[0] == "PING") {
+        send_reply("PONG", sizeof("PONG"), client_addr, client_len);
+        return;
+    }
+    
     // Handle authentication request
     if (parts[0] == "AUTH" && parts.size() == 3) {
         std::string username = parts[1];
@@ -198,8 +300,9 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
         
         // Check if user exists and password matches
         bool authenticated = false;
+        std::shared_ptr<const MemberTable> members = std::atomic_load(&users);
         
-        for (const auto& user : users) {
+        for (const auto& user : *members) {
             std::string stored_username = user.first;
             
             // Convert stored username to lowercase for comparison
@@ -229,8 +332,7 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
         char* null_term_response = new char[response_len];
         strcpy(null_term_response, response);
         
-        int send_result = sendto(sockfd, null_term_response, response_len, 0,
-                             (struct sockaddr *)client_addr, client_len);
+        int send_result = send_reply(null_term_response, response_len, client_addr, client_len);
         if (send_result == -1) {
             perror("sendto");
         }
@@ -239,30 +341,11 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
     }
 }
 
-// Password encryption function (offset by +3)
-void encrypt_password(char* password) {
-    for (int i = 0; password[i] != '\0'; i++) {
-        if (isalpha(password[i])) {
-            char base = islower(password[i]) ? 'a' : 'A';
-            password[i] = ((password[i] - base + 3) % 26) + base;
-        } 
-        else if (isdigit(password[i])) {
-            password[i] = ((password[i] - '0' + 3) % 10) + '0';
-        }
-        // Special characters remain unchanged
-    }
+// See backend.h
+const char* strip_request_tag(char* message) {
+    return backend_strip_tag(&trace_log, message);
 }
 
-std::vector<std::string> split_string(const std::string& str, char delimiter) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(str);
-    std::string token;
-    
-    while (std::getline(ss, token, delimiter)) {
-        if (!token.empty()) {
-            tokens.push_back(token);
-        }
-    }
-    
-    return tokens;
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len) {
+    return backend_send_reply(sockfd, shm_channel, &trace_log, data, len, client_addr, client_len);
 }
@@ -5,6 +5,11 @@
 //  - Handles TCP connections from clients
 //  - Routes requests to appropriate backend servers via UDP
 //  - Manages authentication, trading, and portfolio operations
+//
+//  Every client session is a resumable state machine driven by one event
+//  loop (epoll, or io_uring with --io=uring). A session waiting for a
+//  member's confirmation or a backend reply holds no thread or process,
+//  only its Session record.
  
 // Portions of this code are inspired on Beej's Guide to Network Programming 
 // https://beej.us/guide/bgnet/
@@ -14,19 +19,37 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include "uring.h"
+#include "tradecore.h"
+#include "shmring.h"
+#include "pricetable.h"
+#include "trace.h"
+#include "capture.h"
+#include "upgrade.h"
 
 // Default values - last 3 digits of my USC ID is 654
 #define SERVER_A_PORT 41654
@@ -36,23 +59,505 @@
 #define SERVER_M_TCP_PORT 45654
 #define SERVER_IP "127.0.0.1" 
 #define BUFFER_SIZE 1024
-#define BACKLOG 10
+#define BACKLOG 128
+
+// I/O backend, chosen at startup with --io=epoll|uring
+#define IO_MAX_EVENTS 64
+#define IO_RING_ENTRIES 256
+#define IO_RECV_BUFFERS 64         // provided buffers per group (client TCP, backend UDP)
+#define IO_CLIENT_GROUP 0
+#define IO_BACKEND_GROUP 1
+#define IO_SEND_SLOTS 64           // backend datagrams queued for the next submission
+
+// Event loop threads sharing the TCP port with SO_REUSEPORT, chosen with --reactors=N
+#define MAX_REACTORS 64
+
+// Graceful upgrade (--upgrade), see upgrade.h
+#define UPGRADE_REQUEST_ID_GAP 1000000u  // the new Server M's request ids start this far past ours
+#define UPGRADE_DRAIN_SECONDS 60         // sessions still busy after this are closed
+
+// Backend deadlines, health checks and failover to --standby instances
+#define BACKEND_TIMEOUT_MS 200         // first send's deadline, doubled on every retry
+#define BACKEND_MAX_ATTEMPTS 3         // sends of an idempotent request before giving up
+#define BACKEND_TRADE_TIMEOUT_MS 1400  // trades are sent once, with the same total budget
+#define HEALTH_INTERVAL_MS 500         // every instance gets a PING this often
+#define HEALTH_MAX_MISSES 2            // unanswered PINGs or timed-out requests before an instance is down
+
+// Shared-memory transport to co-located backends, chosen with --transport=udp|shm
+#define SHM_ATTACH_RETRY_MS 1000   // how often to look for a backend's channel
+
+// Admission control limits
+#define MAX_SESSIONS 4096          // concurrent client sessions
+#define MAX_PENDING_SESSIONS 256   // accepted connections waiting for a session slot
+#define PENDING_TIMEOUT_MS 5000    // a queued connection is rejected after waiting this long
+#define MAX_INFLIGHT_BACKEND 32    // sessions with an outstanding backend exchange
+#define BACKEND_SLOT_WAIT_MS 2000  // how long a confirmed trade waits for a backend slot
+#define READ_SLOT_PERCENT 75       // share of MAX_INFLIGHT_BACKEND that reads may hold, the rest is kept for trades
+#define READ_SLOT_WAIT_MS 500      // how long a read waits for a backend slot
+#define TRADE_GRANT_STREAK 4       // freed slots that go to trades in a row while a read waits
+#define RATE_LIMIT_PER_SEC 5       // token refill rate per member
+#define RATE_LIMIT_BURST 10        // token bucket capacity per member
+#define RATE_LIMIT_SLOTS 1024      // members tracked by the token bucket table
+#define BUSY_MSG "BUSY"
+#define BASKET_MAX_LEGS 50         // legs in one basket command
+#define ORPHAN_HOLD_MS 30000       // SELL_HOLD_MS in serverP.cpp: a late hold is released until it expires anyway
+
+// Paged backend replies (all-stock quote, portfolio), streamed to the client
+#define PAGE_MAX_BYTES 960         // same as the backends' page size
+#define QUOTE_LINE_EXTRA 32        // " <price>\n" after each stock in a batched QUOTE reply
+
+// GCRA form of a token bucket: one time stamp instead of a count and a
+// refill time, so a reactor updates it with a single compare-and-swap
+struct TokenBucket {
+    std::atomic<unsigned long long> user_hash;  // 0 marks an empty slot
+    std::atomic<long long> allowed_at_ns;       // when the bucket would be full again
+};
+
+// Admission counters and per-member token buckets
+struct AdmissionState {
+    std::atomic<int> active_sessions;
+    std::atomic<int> pending_sessions;
+    std::atomic<int> inflight_backend;
+    std::atomic<int> inflight_reads;    // the part of inflight_backend held by reads
+    std::atomic<long> accepted_total;
+    std::atomic<long> rejected_queue_full;
+    std::atomic<long> rejected_queue_timeout;
+    std::atomic<long> rejected_backend_busy;
+    std::atomic<long> rejected_rate_limited;
+    TokenBucket buckets[RATE_LIMIT_SLOTS];  // shared by all reactors, lock-free
+};
+
+// Connection accepted while every session slot was taken
+struct PendingSession {
+    int client_sockfd;
+    long long accepted_ns;
+};
+
+// A CHECK ... HOLD whose sell ended before Server P answered. If the answer
+// still comes and holds shares, they are released at once.
+struct OrphanHold {
+    std::string username;
+    long long expires_ns;
+};
+
+// What reactor_main() needs to start reactors 1..N-1
+struct ReactorArgs {
+    int index;
+    const char* io_requested;
+    std::vector<std::string> standbys;
+};
+
+// What a session is waiting for. IDLE sessions wait for the next command.
+enum SessionState {
+    SESSION_IDLE,
+    SESSION_AUTH_WAIT,              // Server A's verdict
+    SESSION_QUOTE_WAIT,             // Server Q's quote(s)
+    SESSION_QUOTE_PAGE_WAIT,        // next page of the all-stock quote
+    SESSION_HISTORY_WAIT,           // Server Q's OHLC/VWAP bars
+    SESSION_TRADES_WAIT,            // next page of the member's trades from Server P
+    SESSION_BUY_QUOTE_WAIT,         // current price before asking the member
+    SESSION_BUY_CONFIRM_WAIT,       // member's Y/N
+    SESSION_BUY_RESULT_WAIT,        // Server P applying the buy
+    SESSION_BUY_ADVANCE_WAIT,       // Server Q moving the price forward
+    SESSION_SELL_PREPARE_WAIT,      // Server Q's quote and Server P's share hold, asked for together
+    SESSION_SELL_CONFIRM_WAIT,
+    SESSION_SELL_RESULT_WAIT,       // Server P's SELL and Server Q's ADVANCE, sent together
+    SESSION_POSITION_PORTFOLIO_WAIT,  // next page of the member's holdings
+    SESSION_POSITION_QUOTE_WAIT,    // batched QUOTE for holdings of the current page
+    SESSION_BASKET_QUOTE_WAIT,      // one batched QUOTE for every leg
+    SESSION_BASKET_CHECK_WAIT,      // Server P checking all sell legs at once
+    SESSION_BASKET_CONFIRM_WAIT,
+    SESSION_BASKET_RESULT_WAIT,     // Server P applying every leg in one message
+    SESSION_BASKET_ADVANCE_WAIT,    // one batched ADVANCE for every leg
+    SESSION_BACKEND_SLOT_WAIT,      // confirmed trade parked until a backend slot frees up
+    SESSION_READ_SLOT_WAIT          // read command parked until a read slot frees up
+};
+
+enum TradeSide { TRADE_NONE, TRADE_BUY, TRADE_SELL, TRADE_BASKET };
+
+struct BasketLeg {
+    TradeSide side;                 // TRADE_BUY or TRADE_SELL
+    std::string stock_name;
+    int num_shares;
+    double price;                   // quoted before the confirmation
+};
+
+struct PositionHolding {
+    std::string stock_name;
+    int shares;
+    double avg_price;
+};
+
+struct Session {
+    unsigned id;                    // never reused, tags this session's I/O
+    int fd;
+    SessionState state;
+    std::string username;           // set once authenticated
+    std::string inbuf;              // client bytes not yet split into messages
+    std::deque<std::string> queued_messages;  // commands that arrived while busy
+    std::string outbuf;             // client bytes not yet handed to the kernel
+    bool send_in_flight;            // a send (io_uring) or an EPOLLOUT wait (epoll) is outstanding
+    bool migrating;                 // io_uring: receive cancelled, to hand the session over
+    bool holds_backend_slot;
+    bool slot_is_read;              // the slot counts against the reads' share
+    unsigned awaiting_request;      // backend request id being waited on, 0 if none
+    unsigned awaiting_parallel;     // a second one sent at the same time, 0 if none
+    int reply_backend;              // backends[] index of the reply being handled
+    long long slot_deadline_ns;     // SESSION_BACKEND_SLOT_WAIT or SESSION_READ_SLOT_WAIT gives up after this
+    std::string command;            // the command being run, dispatched again after a read slot wait
+
+    // Command in progress
+    std::string auth_username;
+    std::string stock_name;
+    int num_shares;
+    double current_price;
+    TradeSide trade_side;
+    std::string backend_result;     // Server P's answer, forwarded after the ADVANCE
+    std::string sell_hold;          // Server P's hold on the shares being sold, empty if none
+    std::vector<std::string> portfolio_lines;  // current PORTFOLIO page
+    size_t position_next;           // next portfolio line to price
+    std::vector<PositionHolding> position_batch;  // holdings in the outstanding QUOTE
+    double total_gain;
+    bool position_priced;           // Server P sent total_gain with the first page
+    unsigned page_seq;              // page of a paged reply being waited on
+    std::string page_after;         // its cursor, the last stock (or trade) of the page before
+    bool page_more;                 // the backend has pages after the current one
+    unsigned trades_listed;         // trades streamed so far
+    std::vector<BasketLeg> basket;
+
+    // Tracing (--trace), trace_id is 0 unless the command in progress was sampled
+    unsigned long long trace_id;
+    long long trace_command_ns;     // when the command was dispatched
+    std::string trace_command;      // its first word only, AUTH arguments stay out of the file
+    long long trace_request_ns;     // when the awaited backend request went out
+    std::string trace_request;      // e.g. "Server Q QUOTE"
+    long long trace_confirm_ns;     // when the member was asked to confirm
+
+    Session() : id(0), fd(-1), state(SESSION_IDLE), send_in_flight(false), migrating(false),
+                holds_backend_slot(false), slot_is_read(false), awaiting_request(0), awaiting_parallel(0),
+                reply_backend(0), slot_deadline_ns(0),
+                num_shares(0), current_price(0.0), trade_side(TRADE_NONE), position_next(0),
+                total_gain(0.0), position_priced(false), page_seq(0), page_more(false), trades_listed(0), trace_id(0),
+                trace_command_ns(0), trace_request_ns(0), trace_confirm_ns(0) {}
+};
+
+enum IoBackend { IO_EPOLL, IO_URING };
+
+// epoll data and io_uring user_data carry the kind of event in the high bits
+// and a session id or slot index in the low bits
+enum IoTag {
+    IO_TAG_ACCEPT = 1,
+    IO_TAG_CLIENT_RECV,
+    IO_TAG_CLIENT_SEND,
+    IO_TAG_BACKEND_RECV,
+    IO_TAG_BACKEND_SEND,
+    IO_TAG_PROVIDE,
+    IO_TAG_SHM_DOORBELL,
+    IO_TAG_UPGRADE_LISTEN,
+    IO_TAG_UPGRADE_PEER,
+    IO_TAG_CANCEL
+};
+#define IO_TAG_SHIFT 32
+#define IO_TAG(kind, index) (((unsigned long long)(kind) << IO_TAG_SHIFT) | (unsigned)(index))
+
+// A backend datagram waiting to be submitted with the next io_uring_enter()
+struct IoSendSlot {
+    bool busy;
+    char data[BUFFER_SIZE];
+    struct sockaddr_in addr;
+    struct iovec iov;
+    struct msghdr msg;
+};
+
+// Client bytes owned by an in-flight io_uring send. Slots are reused, and
+// their buffer trades places with the session's outbuf on every send, so
+// once both have grown to the size of a reply neither is reallocated.
+struct IoClientSend {
+    unsigned session_id;            // 0 while the slot is free
+    std::string data;
+    size_t offset;
+};
+
+// A backend reachable over shared memory once it publishes its channel
+struct ShmPeer {
+    const char* name;
+    const char* label;
+    const struct sockaddr_in* addr;
+    ShmChannel* channel;            // NULL while the backend only speaks UDP
+    int inflight;                   // tagged requests sent over the ring, reply not seen yet
+    long long next_attach_ns;
+};
+
+// What a waker thread watches; it owns the lock descriptor
+struct ShmWaker {
+    ShmChannel* channel;
+    int fd;
+    int wake_fd;                    // the reactor's shm_eventfd
+};
+
+// One process serving a backend: the primary on the usual port, or a standby
+struct BackendInstance {
+    struct sockaddr_in addr;
+    bool healthy;
+    int missed;                     // PINGs and requests in a row that went unanswered
+    unsigned ping_request;          // outstanding PING, 0 if none
+};
+
+// Server A, P or Q. Requests go to the first healthy instance, so once the
+// primary answers PINGs again traffic moves back to it.
+struct Backend {
+    const char* name;
+    const struct sockaddr_in* primary;  // server_a_addr etc., what callers pass around
+    std::vector<BackendInstance> instances;  // [0] is the primary
+    size_t active;
+};
+
+// A backend request waiting for its reply
+struct PendingRequest {
+    unsigned session_id;            // 0 for a PING
+    int backend;                    // index into backends
+    size_t instance;                // where the last send went
+    std::string datagram;           // tagged, sent again as is on a retry
+    bool idempotent;                // safe to send again: reads, not trades or ADVANCE
+    int attempts;
+    long long deadline_ns;
+};
+
+// --reactors=N: N event loop threads, each with the state from here down to
+// trace_next_id (thread_local) and its own sockets. See "Multiple reactors".
+int reactor_count = 1;
+std::vector<int> reactor_cpus;                   // --pin=cpu,...: reactor i runs on reactor_cpus[i % size]
+thread_local int reactor_index = 0;
 
 // Global socket file descriptors for cleanup
-int tcp_sockfd = -1;
-int udp_sockfd = -1;
-std::map<int, std::string> client_usernames;
+thread_local int tcp_sockfd = -1;
+thread_local int udp_sockfd = -1;
+struct sockaddr_in server_a_addr, server_p_addr, server_q_addr;
+
+thread_local std::map<unsigned, Session*> sessions;
+thread_local unsigned next_session_id = 1;       // steps by reactor_count, so ids are unique across reactors
+thread_local std::map<unsigned, PendingRequest> pending_requests;  // by backend request id
+thread_local std::map<unsigned, OrphanHold> orphan_holds;          // by backend request id
+thread_local unsigned next_request_id = 1;
+thread_local Backend backends[3];                // A, P, Q
+thread_local long long next_health_check_ns = 0;
+thread_local std::deque<unsigned> slot_waiters;  // confirmed trades parked for a backend slot
+thread_local std::deque<unsigned> read_waiters;  // reads parked for a read slot
+thread_local int reactor_inflight = 0;           // this reactor's share of MAX_INFLIGHT_BACKEND in use
+thread_local int reactor_read_inflight = 0;      // the part of it held by reads
+thread_local int trade_grant_streak = 0;         // slots granted to trades in a row while a read waited
+
+AdmissionState* admission = NULL;
+thread_local std::deque<PendingSession> pending_sessions;
+volatile sig_atomic_t stats_requested = 0;
+
+thread_local IoBackend io_backend = IO_EPOLL;
+thread_local int io_epoll_fd = -1;
+thread_local Uring io_ring;
+thread_local bool io_multishot_accept = true;
+thread_local bool io_multishot_recv = true;
+thread_local char* io_buffer_pools[2] = { NULL, NULL };  // provided buffers, by group
+thread_local IoSendSlot io_send_slots[IO_SEND_SLOTS];
+thread_local std::deque<IoClientSend> io_client_sends;   // a deque, so a slot's buffer never moves while in flight
+thread_local std::vector<unsigned> io_free_client_sends; // indexes of free slots
+
+thread_local bool shm_enabled = false;           // reactor 0 only: the rings have one reader
+thread_local ShmPeer shm_peers[3];
+thread_local ShmSpin shm_spin;
+thread_local int shm_eventfd = -1;               // written by waker threads while the loop sleeps
+thread_local uint64_t shm_eventfd_value;         // io_uring read target
+
+// --prices=shm: position reads current prices from Server Q's shared price table
+bool prices_from_shm = false;
+thread_local const PriceTable* price_table = NULL;
+thread_local int price_table_fd = -1;
+thread_local long long price_table_next_check_ns = 0;
+
+// --trace=N: one client command in every N is traced to TRACE_FILE, 0 disables
+unsigned trace_sample_every = 0;
+thread_local unsigned trace_sample_count = 0;
+thread_local unsigned trace_next_id = 1;         // steps by reactor_count like next_session_id
+TraceLog trace_log = { -1, 0, "serverM" };
+
+// --capture=<file>: client and backend traffic is recorded for ./replay, see capture.h
+CaptureWriter* capture = NULL;
+
+// Graceful upgrade: the old Server M is `draining` once it handed its sockets over
+int upgrade_listen_fd = -1;                      // where a new Server M asks for them
+int upgrade_peer_fd = -1;                        // connection to the Server M replacing us, or being replaced
+bool draining = false;
+unsigned upgrade_split_id = 0;                   // the new Server M's request ids start here
+long long drain_deadline_ns = 0;
 
 // Function prototypes
 void sigint_handler(int sig);
-void encrypt_password(char* password);
-std::vector<std::string> split_string(const std::string& str, char delimiter);
-bool handle_authentication(int client_sockfd, const std::string& username, const std::string& password);
-void handle_quote(int client_sockfd, const std::string& stock_name);
-void handle_buy(int client_sockfd, const std::string& stock_name, int num_shares);
-void handle_sell(int client_sockfd, const std::string& stock_name, int num_shares);
-void handle_position(int client_sockfd);
-void handle_client(int client_sockfd);
+void sigusr1_handler(int sig);
+long long monotonic_ns();
+void open_server_sockets();
+void open_tcp_listener();
+void open_udp_socket(int port);
+void* reactor_main(void* arg);
+void run_reactor(const char* io_requested, bool use_shm, const std::vector<std::string>& standbys);
+void pin_reactor();
+int reactor_share(int limit);
+void init_admission_state();
+void print_admission_stats();
+bool consume_rate_token(const std::string& username);
+bool acquire_backend_slot(bool read);
+void release_backend_slot(bool read);
+
+// Event handlers, called by the I/O backend
+void on_accept(int client_sockfd);
+void on_client_data(Session* s, const char* data, size_t len);
+void on_client_closed(Session* s, int err);
+void on_backend_datagram(char* data, size_t len);
+
+// Session executor
+Session* start_session(int client_sockfd);
+void reject_busy(int client_sockfd);
+void dispatch_pending_sessions();
+Session* find_session(unsigned id);
+void session_close(Session* s);
+void session_send(Session* s, const char* data, size_t len);
+void session_send_reply(Session* s, const char* text, size_t len);
+void session_sendv(Session* s, const struct iovec* parts, int count);
+void session_pump(Session* s);
+void session_on_client_message(Session* s, const std::string& message);
+void session_on_backend_reply(Session* s, const char* reply);
+void finish_command(Session* s);
+void run_command(Session* s, const std::string& message);
+bool session_claim_reply(Session* s, unsigned request_id);
+bool session_waiting(const Session* s);
+void session_forget_requests(Session* s);
+void forget_hold_request(Session* s, unsigned request_id);
+void release_orphan_hold(unsigned request_id, const char* reply);
+void release_sell_hold(Session* s);
+bool session_acquire_slot(Session* s);
+bool session_acquire_read_slot(Session* s);
+void session_release_slot(Session* s);
+void park_for_backend_slot(Session* s);
+void park_for_read_slot(Session* s);
+Session* first_waiter(std::deque<unsigned>& waiters, SessionState state);
+void grant_backend_slots();
+void expire_slot_waiters();
+unsigned backend_request(Session* s, const struct sockaddr_in* addr, const std::string& message);
+int backend_notify(const struct sockaddr_in* addr, const char* message, size_t len);
+const char* backend_name(const struct sockaddr_in* addr);
+char backend_channel(const struct sockaddr_in* addr);
+
+// Backend health and failover
+void init_backends(const std::vector<std::string>& standbys);
+int backend_index(const struct sockaddr_in* addr);
+unsigned take_request_id();
+bool backend_idempotent(const std::string& message);
+void send_health_checks();
+void on_health_reply(const PendingRequest& request);
+void backend_missed(int backend, size_t instance);
+void backend_select(Backend* b);
+void expire_backend_requests();
+void on_backend_timeout(Session* s, const Backend* b);
+int backend_timer_ms(int timeout_ms);
+
+// Request tracing
+void trace_begin_command(Session* s, const std::string& command);
+void trace_end_command(Session* s);
+bool awaiting_confirmation(const Session* s);
+void trace_confirmation(Session* s);
+
+// Session logic, one step per event
+void dispatch_command(Session* s, const std::string& message);
+void handle_authentication(Session* s, const std::string& username, const std::string& password);
+void on_auth_reply(Session* s, const char* reply);
+void handle_quote(Session* s, const std::string& stock_name);
+void on_quote_reply(Session* s, const char* reply);
+bool request_quote_page(Session* s);
+void on_quote_page(Session* s, const char* reply);
+const char* parse_page_header(const char* reply, const char* kind, unsigned seq, bool* more, std::string* extra);
+std::string last_page_key(const char* lines);
+void handle_history(Session* s, const std::vector<std::string>& parts);
+void on_history_reply(Session* s, const char* reply);
+void handle_trades(Session* s, const std::string& stock_name, const std::string& since);
+bool request_trades_page(Session* s);
+void on_trades_page(Session* s, const char* reply);
+void handle_buy(Session* s, const std::string& stock_name, int num_shares);
+void on_buy_quote(Session* s, const char* reply);
+void on_buy_confirmation(Session* s, const std::string& confirmation);
+void submit_buy(Session* s);
+void on_buy_result(Session* s, const char* reply);
+void handle_sell(Session* s, const std::string& stock_name, int num_shares);
+void on_sell_prepared(Session* s, const char* reply);
+void on_sell_confirmation(Session* s, const std::string& confirmation);
+void submit_sell(Session* s);
+void on_sell_result(Session* s, const char* reply);
+void advance_after_trade(Session* s, const char* result, SessionState advance_state);
+void forward_trade_result(Session* s);
+int format_confirmation(char* out, const char* side, const Session* s, double total);
+void handle_position(Session* s);
+bool request_portfolio_page(Session* s);
+void on_position_portfolio(Session* s, const char* reply);
+void request_next_position_quote(Session* s);
+bool send_position_batch(Session* s);
+void on_position_quote(Session* s, const char* reply);
+void add_position_gain(Session* s, const PositionHolding& holding, double current_price);
+void send_position_line(Session* s, const PositionHolding& holding);
+bool parse_position_line(const std::string& line, PositionHolding* holding);
+void finish_position(Session* s);
+void handle_basket(Session* s, const std::vector<std::string>& parts);
+void on_basket_quotes(Session* s, const char* reply);
+void on_basket_check(Session* s, const char* reply);
+void confirm_basket(Session* s);
+void on_basket_confirmation(Session* s, const std::string& confirmation);
+void submit_basket(Session* s);
+void on_basket_result(Session* s, const char* reply);
+std::string basket_portfolio_message(Session* s, const char* mode);
+std::string compact_number(double value);
+
+// I/O backends
+void io_init(const char* requested);
+void io_run(int timeout_ms);
+void io_run_epoll(int timeout_ms);
+void io_run_uring(int timeout_ms);
+struct io_uring_sqe* io_get_sqe();
+void io_provide_buffer(int group, int bid);
+void io_arm_client_recv(Session* s);
+void io_arm_backend_recv();
+void io_arm_accept();
+void io_watch_client(Session* s);
+void io_forget_client(Session* s);
+void io_flush_client(Session* s);
+void io_client_writable(Session* s);
+int io_send_datagram(const struct sockaddr_in* addr, const char* data, size_t len);
+void io_arm_shm_doorbell();
+void io_watch_listening();
+void io_stop_listening();
+void io_watch_upgrade(int fd, IoTag tag);
+void io_adopt_socket(int fd);
+
+// Shared-memory transport
+void shm_init();
+bool shm_attach(ShmPeer* peer);
+void shm_detach(ShmPeer* peer);
+bool shm_send(const struct sockaddr_in* addr, const char* data, size_t len);
+int shm_poll();
+bool shm_spin_for_replies();
+bool shm_park();
+void shm_unpark();
+void* shm_waker(void* arg);
+bool lookup_shared_price(const std::string& stock_name, double* price);
+
+// Graceful upgrade
+void upgrade_take_over();
+void upgrade_init();
+void upgrade_on_listener_ready();
+void upgrade_on_peer_ready();
+void upgrade_start_drain(int peer_fd);
+void upgrade_abort();
+void upgrade_hand_over_sessions();
+bool upgrade_session_idle(const Session* s);
+void upgrade_hand_over(Session* s);
+void upgrade_recv_cancelled(Session* s);
+void upgrade_receive_session(int client_sockfd, const char* payload, size_t len);
+bool upgrade_forward_datagram(unsigned request_id, const char* data, size_t len);
 
 void sigint_handler(int sig) {
     (void)sig;  // Explicitly cast to void to prevent unused parameter warning
@@ -70,24 +575,75 @@ void sigint_handler(int sig) {
         close(udp_sockfd);
     }
     
+    if (upgrade_listen_fd != -1) {
+        unlink(UPGRADE_SOCKET_PATH);
+    }
+    
+    if (capture != NULL) {
+        capture_close(capture);
+    }
+    
     printf("[Server M] Cleanup complete, exiting.\n");
     exit(0);
 }
 
-// Password encryption (offset by +3)
-void encrypt_password(char* password) {
-    for (int i = 0; password[i] != '\0'; i++) {
-        if (isalpha(password[i])) {
-            char base = islower(password[i]) ? 'a' : 'A';
-            password[i] = ((password[i] - base + 3) % 26) + base;
-        } 
-        else if (isdigit(password[i])) {
-            password[i] = ((password[i] - '0' + 3) % 10) + '0';
-        }
-    }
+void sigusr1_handler(int sig) {
+    (void)sig;
+    stats_requested = 1;
 }
 
+// Password encryption (offset by +3)
+
 int main(int argc, char *argv[]) {
+    // --io=epoll (default) or --io=uring, --transport=udp (default) or --transport=shm,
+    // --prices=udp (default) or --prices=shm, --trace=N (default 0, off), --capture=<file>,
+    // --upgrade (take over from the running Server M), --standby=<A|P|Q>:<port>[,...] (repeatable),
+    // --reactors=N (default 1), --pin=<cpu>[,...]
+    const char* io_requested = "epoll";
+    const char* capture_path = NULL;
+    bool use_shm = false;
+    bool upgrade = false;
+    std::vector<std::string> standbys;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--io=", 5) == 0) {
+            io_requested = argv[i] + 5;
+        } else if (strcmp(argv[i], "--transport=shm") == 0) {
+            use_shm = true;
+        } else if (strcmp(argv[i], "--prices=shm") == 0) {
+            prices_from_shm = true;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_sample_every = (unsigned)strtoul(argv[i] + 8, NULL, 10);
+        } else if (strncmp(argv[i], "--capture=", 10) == 0 && argv[i][10] != '\0') {
+            capture_path = argv[i] + 10;
+        } else if (strcmp(argv[i], "--upgrade") == 0) {
+            upgrade = true;
+        } else if (strncmp(argv[i], "--standby=", 10) == 0) {
+            std::vector<std::string> specs = split_string(argv[i] + 10, ',');
+            standbys.insert(standbys.end(), specs.begin(), specs.end());
+        } else if (strncmp(argv[i], "--reactors=", 11) == 0) {
+            reactor_count = atoi(argv[i] + 11);
+        } else if (strncmp(argv[i], "--pin=", 6) == 0) {
+            std::vector<std::string> cpus = split_string(argv[i] + 6, ',');
+            for (size_t c = 0; c < cpus.size(); c++) {
+                reactor_cpus.push_back(atoi(cpus[c].c_str()));
+            }
+        } else if (strcmp(argv[i], "--transport=udp") != 0 && strcmp(argv[i], "--prices=udp") != 0) {
+            fprintf(stderr, "Usage: %s [--io=epoll|uring] [--transport=udp|shm] [--prices=udp|shm] [--trace=N] "
+                            "[--capture=<file>] [--upgrade] [--standby=<A|P|Q>:<port>[,...]] "
+                            "[--reactors=N] [--pin=<cpu>[,...]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+        fprintf(stderr, "[Server M] --reactors must be between 1 and %d\n", MAX_REACTORS);
+        exit(1);
+    }
+    // The handover protocol moves one listener and one UDP socket
+    if (upgrade && reactor_count > 1) {
+        fprintf(stderr, "[Server M] --upgrade needs --reactors=1\n");
+        exit(1);
+    }
+    
     // sigaction() -  Beej's Guide Section 9.4 (Signal Handling)
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
@@ -102,11 +658,180 @@ int main(int argc, char *argv[]) {
     
     printf("[Server M] Registered signal handler for SIGINT\n");
     
+    // A new Server M takes the sockets over from the running one instead of
+    // binding its own, so no connection is refused during a deploy
+    if (upgrade) {
+        upgrade_take_over();
+    } else {
+        open_server_sockets();
+    }
+    
+    // Print bootup message after UDP bind succeeds (spec-compliant)
+    printf("[Server M] Booting up using UDP on port %d.\n", SERVER_M_UDP_PORT);
+    
+    // SIGUSR1 asks for an admission stats dump; a vanished client must not kill the server
+    struct sigaction usr1_sa;
+    usr1_sa.sa_handler = sigusr1_handler;
+    sigemptyset(&usr1_sa.sa_mask);
+    usr1_sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &usr1_sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Thousands of idle sessions need thousands of descriptors
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    
+    // Backend addresses never change, set them up once
+    memset(&server_a_addr, 0, sizeof(server_a_addr));
+    server_a_addr.sin_family = AF_INET;
+    server_a_addr.sin_port = htons(SERVER_A_PORT);
+    server_a_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    server_p_addr = server_a_addr;
+    server_p_addr.sin_port = htons(SERVER_P_PORT);
+    server_q_addr = server_a_addr;
+    server_q_addr.sin_port = htons(SERVER_Q_PORT);
+    
+    init_admission_state();
+    if (trace_sample_every > 0) {
+        // After an upgrade, keep appending to the old Server M's file
+        if (!(upgrade && trace_log_open(&trace_log, false)) && !trace_log_open(&trace_log, true)) {
+            perror(TRACE_FILE);
+            exit(1);
+        }
+        printf("[Server M] Tracing one command in every %u to %s.\n", trace_sample_every, TRACE_FILE);
+    }
+    if (capture_path != NULL) {
+        capture = new CaptureWriter();
+        if (!capture_open(capture, capture_path)) {
+            perror(capture_path);
+            exit(1);
+        }
+        printf("[Server M] Capturing client and backend traffic to %s.\n", capture_path);
+    }
+    
+    // Reactors 1..N-1 open their own sockets; signals stay with this thread,
+    // which goes on as reactor 0
+    for (int i = 1; i < reactor_count; i++) {
+        ReactorArgs* args = new ReactorArgs();
+        args->index = i;
+        args->io_requested = io_requested;
+        args->standbys = standbys;
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, reactor_main, args);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0) {
+            fprintf(stderr, "[Server M] Failed to start reactor %d: %s\n", i, strerror(err));
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    run_reactor(io_requested, use_shm, standbys);
+    
+    return 0;
+}
+
+void* reactor_main(void* arg) {
+    ReactorArgs* args = (ReactorArgs*)arg;
+    reactor_index = args->index;
+    open_tcp_listener();
+    open_udp_socket(0);
+    run_reactor(args->io_requested, false, args->standbys);
+    return NULL;
+}
+
+// One reactor: its sockets are open, set up the rest of its state and serve
+// its share of the clients. Only reactor 0 reads the shared memory rings and
+// takes part in upgrades.
+void run_reactor(const char* io_requested, bool use_shm, const std::vector<std::string>& standbys) {
+    pin_reactor();
+    next_session_id = reactor_index + 1;
+    trace_next_id = reactor_index + 1;
+    init_backends(standbys);
+    io_init(io_requested);
+    if (use_shm) {
+        shm_init();
+    }
+    if (reactor_count > 1) {
+        struct sockaddr_in udp_addr;
+        socklen_t udp_len = sizeof(udp_addr);
+        getsockname(udp_sockfd, (struct sockaddr*)&udp_addr, &udp_len);
+        printf("[Server M] Reactor %d listening on TCP port %d, backend replies on UDP port %d.\n",
+               reactor_index, SERVER_M_TCP_PORT, ntohs(udp_addr.sin_port));
+        fflush(stdout);
+    } else {
+        upgrade_init();
+    }
+    
+    // Main server loop: wait for I/O, run whatever session steps it unblocks.
+    // Admission control: at most MAX_SESSIONS sessions, then a bounded queue
+    // of MAX_PENDING_SESSIONS, then an immediate BUSY rejection (each divided
+    // among the reactors).
+    while (1) {
+        dispatch_pending_sessions();
+        expire_slot_waiters();
+        expire_backend_requests();
+        send_health_checks();
+        if (draining) {
+            upgrade_hand_over_sessions();
+        }
+        if (stats_requested && reactor_index == 0) {
+            stats_requested = 0;
+            print_admission_stats();
+        }
+        
+        // Wake up periodically while anything is waiting with a deadline,
+        // and in time for the next backend deadline or health check
+        int timeout_ms = (pending_sessions.empty() && slot_waiters.empty() && read_waiters.empty() &&
+                          !draining) ? -1 : 100;
+        io_run(backend_timer_ms(timeout_ms));
+    }
+}
+
+// --pin: reactor i runs on reactor_cpus[i % size], wherever the scheduler likes without it
+void pin_reactor() {
+    if (reactor_cpus.empty()) {
+        return;
+    }
+    int cpu = reactor_cpus[reactor_index % reactor_cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "[Server M] Could not pin reactor %d to CPU %d: %s\n", reactor_index, cpu, strerror(err));
+        return;
+    }
+    printf("[Server M] Reactor %d pinned to CPU %d.\n", reactor_index, cpu);
+}
+
+// A reactor's part of a process-wide limit
+int reactor_share(int limit) {
+    return limit / reactor_count > 0 ? limit / reactor_count : 1;
+}
+
+// Bind the TCP listener and the UDP socket, or exit
+void open_server_sockets() {
+    open_tcp_listener();
+    open_udp_socket(SERVER_M_UDP_PORT);
+}
+
+// This reactor's listener on SERVER_M_TCP_PORT. With several reactors each
+// has its own, bound with SO_REUSEPORT, and the kernel spreads new
+// connections over them.
+void open_tcp_listener() {
     // Setting up TCP socket
     // Beej's Guide Sections 5.1 and 5.2
     struct addrinfo tcp_hints, *tcp_servinfo, *p;
     int rv;
-    char s[INET6_ADDRSTRLEN];
 
     memset(&tcp_hints, 0, sizeof tcp_hints);
     tcp_hints.ai_family = AF_INET; 
@@ -132,6 +857,11 @@ int main(int argc, char *argv[]) {
             close(tcp_sockfd);
             continue;
         }
+        if (reactor_count > 1 && setsockopt(tcp_sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt SO_REUSEPORT");
+            close(tcp_sockfd);
+            continue;
+        }
 
         if (bind(tcp_sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(tcp_sockfd);
@@ -156,6 +886,13 @@ int main(int argc, char *argv[]) {
     }
     
     // [Removed TCP socket setup print]
+}
+
+// The socket backend requests go out on and replies come back to: port
+// SERVER_M_UDP_PORT for reactor 0, any free port (0) for the others
+void open_udp_socket(int port) {
+    int rv;
+    struct addrinfo *p;
 
     // Setting up UDP socket using getaddrinfo and bind
     // Based on Beej's Guide Section 5.3 (Datagram Sockets)
@@ -166,7 +903,7 @@ int main(int argc, char *argv[]) {
     udp_hints.ai_socktype = SOCK_DGRAM;
     udp_hints.ai_flags = AI_PASSIVE; 
 
-    if ((rv = getaddrinfo(NULL, std::to_string(SERVER_M_UDP_PORT).c_str(), &udp_hints, &udp_servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, std::to_string(port).c_str(), &udp_hints, &udp_servinfo)) != 0) {
         fprintf(stderr, "[Server M] getaddrinfo: %s\n", gai_strerror(rv));
         close(tcp_sockfd);
         exit(1);
@@ -203,814 +940,3134 @@ int main(int argc, char *argv[]) {
     freeaddrinfo(udp_servinfo);
     
     // [Removed UDP socket setup print]
+}
+
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void init_admission_state() {
+    admission = new AdmissionState();
+    admission->active_sessions = 0;
+    admission->pending_sessions = 0;
+    admission->inflight_backend = 0;
+    admission->inflight_reads = 0;
+    admission->accepted_total = 0;
+    admission->rejected_queue_full = 0;
+    admission->rejected_queue_timeout = 0;
+    admission->rejected_backend_busy = 0;
+    admission->rejected_rate_limited = 0;
+    for (int i = 0; i < RATE_LIMIT_SLOTS; i++) {
+        admission->buckets[i].user_hash = 0;
+        admission->buckets[i].allowed_at_ns = 0;
+    }
+}
+
+void print_admission_stats() {
+    printf("[Server M] Admission stats: active sessions %d/%d, queue depth %d/%d, "
+           "in-flight backend requests %d/%d (reads %d), accepted %ld, rejected (queue full %ld, "
+           "queue timeout %ld, backend busy %ld, rate limited %ld)\n",
+           admission->active_sessions.load(), MAX_SESSIONS,
+           admission->pending_sessions.load(), MAX_PENDING_SESSIONS,
+           admission->inflight_backend.load(), MAX_INFLIGHT_BACKEND, admission->inflight_reads.load(),
+           admission->accepted_total.load(),
+           admission->rejected_queue_full.load(),
+           admission->rejected_queue_timeout.load(),
+           admission->rejected_backend_busy.load(),
+           admission->rejected_rate_limited.load());
+    fflush(stdout);
+}
+
+// Per-member token bucket shared by all of the member's sessions, on every reactor
+bool consume_rate_token(const std::string& username) {
+    // FNV-1a, never 0 so 0 can mark an empty slot
+    unsigned long long hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < username.size(); i++) {
+        hash ^= (unsigned char)tolower(username[i]);
+        hash *= 1099511628211ULL;
+    }
+    if (hash == 0) {
+        hash = 1;
+    }
     
-    // Print bootup message after UDP bind succeeds (spec-compliant)
-    printf("[Server M] Booting up using UDP on port %d.\n", SERVER_M_UDP_PORT);
-    
-    // Main server loop , Following Beej's Guide Section 5.2 (A Simple Stream Server)
-    struct sockaddr_storage their_addr;
-    socklen_t sin_size = sizeof their_addr;
-    char client_ip[INET_ADDRSTRLEN];
-    
-    while (1) {
-        // Accepting new TCP connection , Based on Beej's Guide Section 5.2
-        int client_sockfd = accept(tcp_sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (client_sockfd == -1) {
-            perror("accept");
-            continue;
+    // Each command pushes allowed_at_ns one interval further; a member is
+    // over the limit once it runs more than RATE_LIMIT_BURST intervals ahead
+    const long long interval_ns = 1000000000LL / RATE_LIMIT_PER_SEC;
+    long long now = monotonic_ns();
+    bool allowed = true;
+    for (int probe = 0; probe < RATE_LIMIT_SLOTS; probe++) {
+        TokenBucket& bucket = admission->buckets[(hash + probe) % RATE_LIMIT_SLOTS];
+        unsigned long long owner = bucket.user_hash.load();
+        if (owner == 0 && bucket.user_hash.compare_exchange_strong(owner, hash)) {
+            owner = hash;
         }
-        // Convert client IP to string for logging
-        inet_ntop(AF_INET, &(((struct sockaddr_in*)&their_addr)->sin_addr),
-                  client_ip, INET_ADDRSTRLEN);
-        // [Spec: Remove connection notice print]
-        // Forking a child process to handle client, Beej's Guide Section 5.2
-        pid_t child_pid = fork();
-        if (child_pid == -1) {
-            perror("fork");
-            close(client_sockfd);
+        if (owner != hash) {
             continue;
         }
-        if (child_pid == 0) {  // Child process
-            close(tcp_sockfd);  // Child don't need the listener
-            handle_client(client_sockfd);
-            close(client_sockfd);
-            exit(0);
-        }
-        // Parent process
-        close(client_sockfd);
-        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        
+        long long allowed_at = bucket.allowed_at_ns.load();
+        while (1) {
+            long long next = (allowed_at > now ? allowed_at : now) + interval_ns;
+            if (next - now > RATE_LIMIT_BURST * interval_ns) {
+                allowed = false;
+                break;
+            }
+            if (bucket.allowed_at_ns.compare_exchange_weak(allowed_at, next)) {
+                break;
+            }
         }
+        break;
     }
+    // A full table fails open rather than locking members out
     
-    return 0;
+    if (!allowed) {
+        admission->rejected_rate_limited++;
+    }
+    return allowed;
 }
 
-// Process client commands
-void handle_client(int client_sockfd) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-    
-    while ((bytes_received = recv(client_sockfd, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        std::string message(buffer);
-        std::vector<std::string> parts = split_string(message, ' ');
-        
-        if (parts[0] == "AUTH" && parts.size() == 3) {
-            if (handle_authentication(client_sockfd, parts[1], parts[2])) {
-                client_usernames[client_sockfd] = parts[1];
-            }
-        } 
-        else if (parts[0] == "quote") {
-            std::string stock_name = (parts.size() > 1) ? parts[1] : "";
-            handle_quote(client_sockfd, stock_name);
-        } 
-        else if (parts[0] == "buy" && parts.size() == 3) {
-            try {
-                int shares = std::stoi(parts[2]);
-                handle_buy(client_sockfd, parts[1], shares);
-            } catch (const std::invalid_argument&) {
-                const char* error_msg = "ERROR: Invalid number of shares";
-                send(client_sockfd, error_msg, strlen(error_msg), 0);
-            }
-        } 
-        else if (parts[0] == "sell" && parts.size() == 3) {
-            try {
-                int shares = std::stoi(parts[2]);
-                handle_sell(client_sockfd, parts[1], shares);
-            } catch (const std::invalid_argument&) {
-                const char* error_msg = "ERROR: Invalid number of shares";
-                send(client_sockfd, error_msg, strlen(error_msg), 0);
-            }
-        } 
-        else if (parts[0] == "position") {
-            handle_position(client_sockfd);
-        } 
-        else {
-            const char* error_msg = "ERROR: Unknown command or incorrect format";
-            send(client_sockfd, error_msg, strlen(error_msg), 0);
+// Each reactor has its own share of MAX_INFLIGHT_BACKEND: a slot it frees
+// goes to its own waiters, which no other reactor could wake. Reads may only
+// hold READ_SLOT_PERCENT of it, so a storm of quotes and positions always
+// leaves slots for trades.
+bool acquire_backend_slot(bool read) {
+    int share = reactor_share(MAX_INFLIGHT_BACKEND);
+    if (reactor_inflight >= share) {
+        return false;
+    }
+    if (read) {
+        int read_share = share * READ_SLOT_PERCENT / 100;
+        if (reactor_read_inflight >= (read_share > 0 ? read_share : 1)) {
+            return false;
         }
+        reactor_read_inflight++;
+        admission->inflight_reads++;
     }
-    
-    // Client disconnected or error
-    if (bytes_received == 0) {
-        printf("[Server M] Client disconnected\n");
-    } else if (bytes_received == -1) {
-        perror("recv");
+    reactor_inflight++;
+    admission->inflight_backend++;
+    return true;
+}
+
+void release_backend_slot(bool read) {
+    if (read) {
+        reactor_read_inflight--;
+        admission->inflight_reads--;
     }
-    
-    // Remove from client map
-    client_usernames.erase(client_sockfd);
+    reactor_inflight--;
+    admission->inflight_backend--;
 }
 
-bool handle_authentication(int client_sockfd, const std::string& username, const std::string& password) {
-    struct sockaddr_in server_a_addr;
-    char buffer[BUFFER_SIZE];
-    
-    printf("[Server M] Received username %s and password ****.\n", username.c_str());
-    
-    // Encrypt password
-    char enc_pass[BUFFER_SIZE];
-    strncpy(enc_pass, password.c_str(), BUFFER_SIZE - 1);
-    enc_pass[BUFFER_SIZE - 1] = '\0';
-    encrypt_password(enc_pass);
-    
-    // Prepare message for Server A
-    std::string auth_message = "AUTH " + username + " " + enc_pass;
-    // Set up address for Server A
-    memset(&server_a_addr, 0, sizeof(server_a_addr));
-    server_a_addr.sin_family = AF_INET;
-    server_a_addr.sin_port = htons(SERVER_A_PORT);
-    server_a_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Sending AUTH request to Server A using UDP
-    if (sendto(udp_sockfd, auth_message.c_str(), auth_message.length(), 0,
-               (struct sockaddr *)&server_a_addr, sizeof(server_a_addr)) == -1) {
-        perror("sendto");
-        return false;
+void on_accept(int client_sockfd) {
+    admission->accepted_total++;
+    
+    if ((int)sessions.size() < reactor_share(MAX_SESSIONS) && pending_sessions.empty()) {
+        start_session(client_sockfd);
+    } else if ((int)pending_sessions.size() < reactor_share(MAX_PENDING_SESSIONS)) {
+        PendingSession pending;
+        pending.client_sockfd = client_sockfd;
+        pending.accepted_ns = monotonic_ns();
+        pending_sessions.push_back(pending);
+        admission->pending_sessions++;
+    } else {
+        admission->rejected_queue_full++;
+        reject_busy(client_sockfd);
+        printf("[Server M] Overloaded: rejected a connection (queue depth %d, rejected %ld).\n",
+               (int)pending_sessions.size(), admission->rejected_queue_full.load());
     }
-    printf("[Server M] Sent the authentication request to Server A\n");
-    
-    // Receiving AUTH response from Server A using UDP
-    //  Beej's Guide Section  5.8
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int bytes_received;
-    
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom");
-        return false;
+}
+
+Session* start_session(int client_sockfd) {
+    Session* s = new Session();
+    s->id = next_session_id;
+    next_session_id += reactor_count;
+    s->fd = client_sockfd;
+    sessions[s->id] = s;
+    admission->active_sessions++;
+    
+    // Each reply goes out in one sendmsg(), so there is nothing for Nagle's
+    // algorithm to coalesce; it would only hold a streamed reply's last part
+    // back until the client's delayed ACK
+    int yes = 1;
+    if (setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+        perror("setsockopt TCP_NODELAY");
     }
-    buffer[bytes_received] = '\0';
-    printf("[Server M] Received the response from server A using UDP over %d\n", SERVER_M_UDP_PORT);
-    
-    // Process Server A response
-    if (strcmp(buffer, "AUTH_SUCCESS") == 0) {
-        const char* success_msg = "AUTH_SUCCESS";
-        size_t msg_len = strlen(success_msg) + 1;
-        char* null_term_response = new char[msg_len];
-        strcpy(null_term_response, success_msg);
-        int send_res = send(client_sockfd, null_term_response, msg_len, 0);
-        printf("[Server M] Sent the response from server A to the client using TCP over port %d.\n", SERVER_M_TCP_PORT);
-        delete[] null_term_response;
-        return true;
-    } else {
-        const char* error_msg = "AUTH_FAILED";
-        size_t msg_len = strlen(error_msg) + 1;
-        char* null_term_response = new char[msg_len];
-        strcpy(null_term_response, error_msg);
-        int send_res = send(client_sockfd, null_term_response, msg_len, 0);
-        printf("[Server M] Sent the response from server A to the client using TCP over port %d.\n", SERVER_M_TCP_PORT);
-        delete[] null_term_response;
-        return false;
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_OPEN, 0, s->id, NULL, 0);
     }
+    io_watch_client(s);
+    return s;
 }
 
-void handle_quote(int client_sockfd, const std::string& stock_name) {
-    if (client_usernames.find(client_sockfd) == client_usernames.end()) {
-        const char* error_msg = "ERROR: Not authenticated";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+void reject_busy(int client_sockfd) {
+    send(client_sockfd, BUSY_MSG, strlen(BUSY_MSG) + 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_sockfd);
+}
+
+// Hand queued connections to free session slots, oldest first, and shed the
+// ones that waited longer than PENDING_TIMEOUT_MS
+void dispatch_pending_sessions() {
+    long long now = monotonic_ns();
+    while (!pending_sessions.empty()) {
+        PendingSession pending = pending_sessions.front();
+        if (now - pending.accepted_ns > (long long)PENDING_TIMEOUT_MS * 1000000LL) {
+            pending_sessions.pop_front();
+            admission->pending_sessions--;
+            admission->rejected_queue_timeout++;
+            reject_busy(pending.client_sockfd);
+            continue;
+        }
+        if ((int)sessions.size() >= reactor_share(MAX_SESSIONS)) {
+            break;
+        }
+        pending_sessions.pop_front();
+        admission->pending_sessions--;
+        start_session(pending.client_sockfd);
     }
-    struct sockaddr_in server_q_addr;
-    char buffer[BUFFER_SIZE];
-    
-    printf("[Server M] Received a quote request from %s%s%s, using TCP over port %d.\n",
-           client_usernames[client_sockfd].c_str(),
-           stock_name.empty() ? "" : " for stock ",
-           stock_name.empty() ? "" : stock_name.c_str(),
-           SERVER_M_TCP_PORT);
-    
-    // Prepare message for Server Q
-    std::string quote_message = "QUOTE " + stock_name;
-    
-    // Set up address , for Server Q
-    memset(&server_q_addr, 0, sizeof(server_q_addr));
-    server_q_addr.sin_family = AF_INET;
-    server_q_addr.sin_port = htons(SERVER_Q_PORT);
-    server_q_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Send - to Server Q
-    if (sendto(udp_sockfd, quote_message.c_str(), quote_message.length(), 0,
-              (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
-        perror("sendto Server Q");
-        const char* error_msg = "ERROR: Failed to get quote";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+}
+
+Session* find_session(unsigned id) {
+    std::map<unsigned, Session*>::iterator it = sessions.find(id);
+    return it == sessions.end() ? NULL : it->second;
+}
+
+void session_close(Session* s) {
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_CLOSE, 0, s->id, NULL, 0);
     }
-    printf("[Server M] Sent quote request to server Q.\n");
-    printf("[Server M] Forwarded the quote request to server Q.\n");
-    
-    // Receive response from Server Q
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int bytes_received;
-    
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server Q");
-        const char* error_msg = "ERROR: Failed to get quote";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+    sessions.erase(s->id);
+    admission->active_sessions--;
+    session_forget_requests(s);
+    release_sell_hold(s);
+    io_forget_client(s);
+    close(s->fd);
+    bool freed_slot = s->holds_backend_slot;
+    if (freed_slot) {
+        release_backend_slot(s->slot_is_read);
     }
-    printf("[Server M] Received quote response from server Q.\n");
-    printf("[Server M] Received the quote response from server Q using UDP over %d\n", SERVER_M_UDP_PORT);
-    
-    buffer[bytes_received] = '\0';
-    
-    size_t resp_len = strlen(buffer) + 1; 
-    char* null_term_resp = new char[resp_len];
-    strcpy(null_term_resp, buffer);
-    
-    int send_res = send(client_sockfd, null_term_resp, resp_len, 0);
-    if (send_res == -1) {
-        perror("send quote result to client");
+    delete s;
+    if (freed_slot) {
+        grant_backend_slots();
+    }
+}
+
+void on_client_closed(Session* s, int err) {
+    // Client disconnected or error
+    if (err == 0) {
+        printf("[Server M] Client disconnected\n");
     } else {
-        printf("[Server M] Forwarded the quote response to the client.\n");
+        errno = err;
+        perror("recv");
     }
-    delete[] null_term_resp;
+    session_close(s);
 }
 
-void handle_buy(int client_sockfd, const std::string& stock_name, int num_shares) {
-    if (client_usernames.find(client_sockfd) == client_usernames.end()) {
-        const char* error_msg = "ERROR: Not authenticated";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0);
-        return;
+// Split the client byte stream into messages. The client null-terminates
+// every message; newline-terminated input (e.g. from nc) works too.
+void on_client_data(Session* s, const char* data, size_t len) {
+    s->inbuf.append(data, len);
+    size_t start = 0;
+    for (size_t i = 0; i < s->inbuf.size(); i++) {
+        if (s->inbuf[i] != '\0' && s->inbuf[i] != '\n') {
+            continue;
+        }
+        std::string message = s->inbuf.substr(start, i - start);
+        start = i + 1;
+        if (!message.empty() && message[message.size() - 1] == '\r') {
+            message.erase(message.size() - 1);
+        }
+        if (!message.empty()) {
+            session_on_client_message(s, message);
+        }
+    }
+    s->inbuf.erase(0, start);
+    session_pump(s);
+}
+
+void session_on_client_message(Session* s, const std::string& message) {
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_CLIENT_IN, 0, s->id, message.data(), message.size());
+    }
+    switch (s->state) {
+    case SESSION_IDLE:
+        if (s->queued_messages.empty()) {
+            run_command(s, message);
+        } else {
+            s->queued_messages.push_back(message);
+        }
+        break;
+    case SESSION_BUY_CONFIRM_WAIT:
+        trace_confirmation(s);
+        on_buy_confirmation(s, message);
+        break;
+    case SESSION_SELL_CONFIRM_WAIT:
+        trace_confirmation(s);
+        on_sell_confirmation(s, message);
+        break;
+    case SESSION_BASKET_CONFIRM_WAIT:
+        trace_confirmation(s);
+        on_basket_confirmation(s, message);
+        break;
+    default:
+        // The session is busy with a backend, run this once it is idle again
+        s->queued_messages.push_back(message);
+        break;
+    }
+}
+
+// Run commands that arrived while the session was busy
+void session_pump(Session* s) {
+    while (s->state == SESSION_IDLE && !s->queued_messages.empty()) {
+        std::string message = s->queued_messages.front();
+        s->queued_messages.pop_front();
+        run_command(s, message);
+    }
+}
+
+// Dispatch one client command; a command answered without waiting on
+// anything ends its trace here
+void run_command(Session* s, const std::string& message) {
+    trace_begin_command(s, message.substr(0, message.find(' ')));
+    s->command = message;
+    dispatch_command(s, message);
+    if (s->state == SESSION_IDLE) {
+        trace_end_command(s);
+    } else if (awaiting_confirmation(s)) {
+        s->trace_confirm_ns = monotonic_ns();
+    }
+}
+
+void session_send(Session* s, const char* data, size_t len) {
+    struct iovec part;
+    part.iov_base = (void*)data;
+    part.iov_len = len;
+    session_sendv(s, &part, 1);
+}
+
+// `text` and then the '\0' that ends a reply, without copying `text` to
+// append the terminator
+void session_send_reply(Session* s, const char* text, size_t len) {
+    struct iovec parts[2];
+    parts[0].iov_base = (void*)text;
+    parts[0].iov_len = len;
+    parts[1].iov_base = (void*)"";
+    parts[1].iov_len = 1;
+    session_sendv(s, parts, 2);
+}
+
+// Send the parts in order. With epoll and nothing already queued they go
+// straight to the socket in one sendmsg(); only what the socket does not
+// take is copied into the session's outbuf.
+void session_sendv(Session* s, const struct iovec* parts, int count) {
+    if (capture != NULL) {
+        capture_recordv(capture, CAPTURE_CLIENT_OUT, 0, s->id, parts, count);
+    }
+    int first = 0;
+    size_t offset = 0;
+    if (io_backend == IO_EPOLL && s->outbuf.empty() && !s->send_in_flight) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)parts;
+        msg.msg_iovlen = count;
+        ssize_t sent;
+        do {
+            sent = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        } while (sent == -1 && errno == EINTR);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // The client is gone; the read side notices and closes the session
+            perror("send");
+            shutdown(s->fd, SHUT_RDWR);
+            return;
+        }
+        // Skip what was sent, the rest is queued below
+        size_t left = sent > 0 ? (size_t)sent : 0;
+        while (first < count && left >= parts[first].iov_len) {
+            left -= parts[first].iov_len;
+            first++;
+        }
+        offset = left;
+    }
+    for (int i = first; i < count; i++) {
+        s->outbuf.append((const char*)parts[i].iov_base + offset, parts[i].iov_len - offset);
+        offset = 0;
+    }
+    io_flush_client(s);
+}
+
+// The current command is done: back to IDLE and give up the backend slot
+void finish_command(Session* s) {
+    session_forget_requests(s);
+    release_sell_hold(s);
+    s->state = SESSION_IDLE;
+    session_release_slot(s);
+    trace_end_command(s);
+}
+
+// Whether the session waits for this backend reply; it stops waiting for it
+bool session_claim_reply(Session* s, unsigned request_id) {
+    if (s->awaiting_request == request_id) {
+        s->awaiting_request = 0;
+        return true;
+    }
+    if (s->awaiting_parallel == request_id) {
+        s->awaiting_parallel = 0;
+        return true;
+    }
+    return false;
+}
+
+// A step that sent two requests at once goes on once both replies are in
+bool session_waiting(const Session* s) {
+    return s->awaiting_request != 0 || s->awaiting_parallel != 0;
+}
+
+// Drop what the session still waits for, e.g. the second reply of a pair
+// after the first one ended the command; a late reply is then ignored
+void session_forget_requests(Session* s) {
+    if (s->awaiting_request != 0) {
+        forget_hold_request(s, s->awaiting_request);
+        pending_requests.erase(s->awaiting_request);
+        s->awaiting_request = 0;
+    }
+    if (s->awaiting_parallel != 0) {
+        forget_hold_request(s, s->awaiting_parallel);
+        pending_requests.erase(s->awaiting_parallel);
+        s->awaiting_parallel = 0;
+    }
+}
+
+// A sell that ends while its CHECK ... HOLD is out (the quote failed, a
+// backend timed out, the member left) keeps the request id, so a hold that
+// comes back later is released instead of locking the shares for
+// ORPHAN_HOLD_MS
+void forget_hold_request(Session* s, unsigned request_id) {
+    std::map<unsigned, PendingRequest>::const_iterator it = pending_requests.find(request_id);
+    if (s->state != SESSION_SELL_PREPARE_WAIT || it == pending_requests.end() ||
+        it->second.backend != backend_index(&server_p_addr)) {
+        return;
+    }
+    long long now = monotonic_ns();
+    for (std::map<unsigned, OrphanHold>::iterator old = orphan_holds.begin(); old != orphan_holds.end();) {
+        if (old->second.expires_ns <= now) {
+            orphan_holds.erase(old++);
+        } else {
+            ++old;
+        }
+    }
+    OrphanHold& orphan = orphan_holds[request_id];
+    orphan.username = s->username;
+    orphan.expires_ns = now + ORPHAN_HOLD_MS * 1000000LL;
+}
+
+// Late answer to a forgotten CHECK ... HOLD: "SUFFICIENT_SHARES <hold id>"
+void release_orphan_hold(unsigned request_id, const char* reply) {
+    std::map<unsigned, OrphanHold>::iterator it = orphan_holds.find(request_id);
+    if (it == orphan_holds.end()) {
+        return;
+    }
+    const char* hold = strncmp(reply, "SUFFICIENT_SHARES ", 18) == 0 ? reply + 18 : NULL;
+    if (hold != NULL && it->second.expires_ns > monotonic_ns()) {
+        std::string release = "N " + it->second.username + " " + hold;
+        backend_notify(&server_p_addr, release.c_str(), release.length());
+        printf("[Server M] Released the shares held for an ended sell of member %s.\n",
+               it->second.username.c_str());
+    }
+    orphan_holds.erase(it);
+}
+
+// Let go of the shares Server P holds for a sell that will not be sent
+void release_sell_hold(Session* s) {
+    if (s->sell_hold.empty()) {
+        return;
+    }
+    std::string release = "N " + s->username + " " + s->sell_hold;
+    backend_notify(&server_p_addr, release.c_str(), release.length());
+    s->sell_hold.clear();
+}
+
+// Slot for a trade (buy, sell, basket), which may use every slot
+bool session_acquire_slot(Session* s) {
+    if (!s->holds_backend_slot) {
+        s->holds_backend_slot = acquire_backend_slot(false);
+        s->slot_is_read = false;
+    }
+    return s->holds_backend_slot;
+}
+
+// Slot for a read (login, quote, history, trades, position), within the
+// reads' share. A parked read is dispatched again holding its slot, so this
+// then returns true at once.
+bool session_acquire_read_slot(Session* s) {
+    if (!s->holds_backend_slot) {
+        s->holds_backend_slot = acquire_backend_slot(true);
+        s->slot_is_read = s->holds_backend_slot;
+    }
+    return s->holds_backend_slot;
+}
+
+void session_release_slot(Session* s) {
+    if (s->holds_backend_slot) {
+        s->holds_backend_slot = false;
+        release_backend_slot(s->slot_is_read);
+        grant_backend_slots();
+    }
+}
+
+// A confirmed trade waits (without blocking anyone) for a backend slot
+void park_for_backend_slot(Session* s) {
+    s->state = SESSION_BACKEND_SLOT_WAIT;
+    s->slot_deadline_ns = monotonic_ns() + (long long)BACKEND_SLOT_WAIT_MS * 1000000LL;
+    slot_waiters.push_back(s->id);
+}
+
+// A read waits for a slot instead of being refused outright, so that a
+// short burst of reads is served late rather than not at all
+void park_for_read_slot(Session* s) {
+    s->state = SESSION_READ_SLOT_WAIT;
+    s->slot_deadline_ns = monotonic_ns() + (long long)READ_SLOT_WAIT_MS * 1000000LL;
+    read_waiters.push_back(s->id);
+}
+
+// The oldest session still parked in `waiters`, dropping closed ones
+Session* first_waiter(std::deque<unsigned>& waiters, SessionState state) {
+    while (!waiters.empty()) {
+        Session* s = find_session(waiters.front());
+        if (s != NULL && s->state == state) {
+            return s;
+        }
+        waiters.pop_front();
+    }
+    return NULL;
+}
+
+// Freed slots go to parked trades first. After TRADE_GRANT_STREAK trades in
+// a row while a read waits, the next slot goes to the read, so reads keep
+// moving however many trades there are.
+void grant_backend_slots() {
+    while (1) {
+        Session* trade = first_waiter(slot_waiters, SESSION_BACKEND_SLOT_WAIT);
+        Session* read = first_waiter(read_waiters, SESSION_READ_SLOT_WAIT);
+        if (read != NULL && (trade == NULL || trade_grant_streak >= TRADE_GRANT_STREAK) &&
+            session_acquire_read_slot(read)) {
+            trade_grant_streak = 0;
+            read_waiters.pop_front();
+            read->state = SESSION_IDLE;
+            dispatch_command(read, read->command);
+            if (read->state == SESSION_IDLE) {
+                trace_end_command(read);
+            }
+            session_pump(read);
+            continue;
+        }
+        if (trade == NULL || !session_acquire_slot(trade)) {
+            return;
+        }
+        trade_grant_streak = read != NULL ? trade_grant_streak + 1 : 0;
+        Session* s = trade;
+        slot_waiters.pop_front();
+        if (s->trade_side == TRADE_BUY) {
+            submit_buy(s);
+        } else if (s->trade_side == TRADE_SELL) {
+            submit_sell(s);
+        } else {
+            submit_basket(s);
+        }
+        session_pump(s);
+    }
+}
+
+void expire_slot_waiters() {
+    long long now = monotonic_ns();
+    while (!slot_waiters.empty()) {
+        Session* s = find_session(slot_waiters.front());
+        if (s != NULL && s->state == SESSION_BACKEND_SLOT_WAIT) {
+            if (s->slot_deadline_ns > now) {
+                break;
+            }
+            admission->rejected_backend_busy++;
+            const char* busy_msg = s->trade_side == TRADE_BUY ? BUSY_MSG ": buy not processed"
+                                 : s->trade_side == TRADE_SELL ? BUSY_MSG ": sell not processed"
+                                                               : BUSY_MSG ": basket not processed";
+            session_send(s, busy_msg, strlen(busy_msg) + 1);
+            finish_command(s);
+        }
+        slot_waiters.pop_front();
+        if (s != NULL) {
+            session_pump(s);
+        }
+    }
+    while (!read_waiters.empty()) {
+        Session* s = find_session(read_waiters.front());
+        if (s != NULL && s->state == SESSION_READ_SLOT_WAIT) {
+            if (s->slot_deadline_ns > now) {
+                return;
+            }
+            admission->rejected_backend_busy++;
+            session_send(s, BUSY_MSG, strlen(BUSY_MSG) + 1);
+            finish_command(s);
+        }
+        read_waiters.pop_front();
+        if (s != NULL) {
+            session_pump(s);
+        }
+    }
+}
+
+// Send a tagged request to a backend; the reply comes back to this session
+// through on_backend_datagram(). Returns the request id, 0 if the send failed.
+unsigned backend_request(Session* s, const struct sockaddr_in* addr, const std::string& message) {
+    unsigned request_id = take_request_id();
+    std::string tagged = "#" + std::to_string(request_id);
+    if (s->trace_id != 0) {
+        char trace_tag[24];
+        snprintf(trace_tag, sizeof(trace_tag), "/%llx", s->trace_id);
+        tagged += trace_tag;
+        s->trace_request_ns = monotonic_ns();
+        s->trace_request = std::string(backend_name(addr)) + " " + message.substr(0, message.find(' '));
+    }
+    tagged += " " + message;
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_BACKEND_OUT, backend_channel(addr), s->id, tagged.data(), tagged.size());
+    }
+    // Whichever instance is active gets it; shm_send() only knows the primaries
+    int backend = backend_index(addr);
+    Backend* b = &backends[backend];
+    if (io_send_datagram(&b->instances[b->active].addr, tagged.c_str(), tagged.length()) == -1) {
+        return 0;
+    }
+    PendingRequest& request = pending_requests[request_id];
+    request.session_id = s->id;
+    request.backend = backend;
+    request.instance = b->active;
+    request.datagram = tagged;
+    request.idempotent = backend_idempotent(message);
+    request.attempts = 1;
+    request.deadline_ns = monotonic_ns() +
+        (long long)(request.idempotent ? BACKEND_TIMEOUT_MS : BACKEND_TRADE_TIMEOUT_MS) * 1000000LL;
+    s->awaiting_request = request_id;
+    return request_id;
+}
+
+// Untagged one-way message, no reply expected
+int backend_notify(const struct sockaddr_in* addr, const char* message, size_t len) {
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_BACKEND_OUT, backend_channel(addr), 0, message, len);
+    }
+    Backend* b = &backends[backend_index(addr)];
+    return io_send_datagram(&b->instances[b->active].addr, message, len);
+}
+
+const char* backend_name(const struct sockaddr_in* addr) {
+    if (addr->sin_port == server_a_addr.sin_port) {
+        return "Server A";
+    }
+    return addr->sin_port == server_p_addr.sin_port ? "Server P" : "Server Q";
+}
+
+// Backend letter in a capture record
+char backend_channel(const struct sockaddr_in* addr) {
+    return backend_name(addr)[strlen("Server ")];
+}
+
+// Server A, P and Q, each with the standbys named by --standby=<letter>:<port>
+void init_backends(const std::vector<std::string>& standbys) {
+    const char* names[3] = { "Server A", "Server P", "Server Q" };
+    const struct sockaddr_in* primaries[3] = { &server_a_addr, &server_p_addr, &server_q_addr };
+    for (int i = 0; i < 3; i++) {
+        Backend* b = &backends[i];
+        b->name = names[i];
+        b->primary = primaries[i];
+        BackendInstance primary;
+        primary.addr = *primaries[i];
+        primary.healthy = true;        // until it misses its PINGs
+        primary.missed = 0;
+        primary.ping_request = 0;
+        b->instances.push_back(primary);
+        b->active = 0;
+    }
+    
+    const char* letters = "APQ";
+    for (size_t i = 0; i < standbys.size(); i++) {
+        const std::string& spec = standbys[i];
+        const char* letter = (spec.size() > 2 && spec[1] == ':' && spec[0] != '\0') ?
+                             strchr(letters, toupper(spec[0])) : NULL;
+        int port = letter != NULL ? atoi(spec.c_str() + 2) : 0;
+        if (letter == NULL || port <= 0 || port > 65535) {
+            fprintf(stderr, "[Server M] Bad --standby entry \"%s\", expected e.g. Q:%d\n",
+                    spec.c_str(), SERVER_Q_PORT + 1);
+            exit(1);
+        }
+        Backend* b = &backends[letter - letters];
+        BackendInstance standby = b->instances[0];
+        standby.addr.sin_port = htons(port);
+        standby.healthy = false;       // until its first PONG
+        b->instances.push_back(standby);
+        if (reactor_index == 0) {
+            printf("[Server M] %s has a standby on port %d.\n", b->name, port);
+        }
+    }
+}
+
+// Which of backends[] a primary address (server_a_addr etc.) stands for
+int backend_index(const struct sockaddr_in* addr) {
+    for (int i = 0; i < 3; i++) {
+        if (backends[i].primary->sin_port == addr->sin_port) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+unsigned take_request_id() {
+    unsigned request_id = next_request_id++;
+    if (next_request_id == 0) {
+        next_request_id = 1;
+    }
+    return request_id;
+}
+
+// Reads may be sent again. A trade or an ADVANCE that reached the backend
+// the first time would be applied twice.
+bool backend_idempotent(const std::string& message) {
+    std::string command = message.substr(0, message.find(' '));
+    if (command == "BUY" || command == "SELL" || command == "ADVANCE") {
+        return false;
+    }
+    // "CHECK <username> <stock> <shares> HOLD": a second one would hold the shares twice
+    if (command == "CHECK" && message.size() > 5 && message.compare(message.size() - 5, 5, " HOLD") == 0) {
+        return false;
+    }
+    // "BASKET <username> CHECK|APPLY ..."
+    size_t mode = message.find(' ', strlen("BASKET "));
+    return command != "BASKET" || mode == std::string::npos || message.compare(mode + 1, 5, "APPLY") != 0;
+}
+
+// Every HEALTH_INTERVAL_MS: an instance that has not answered its last PING
+// missed it, and every instance gets a new one. PINGs go to each instance
+// directly and stay out of the capture.
+void send_health_checks() {
+    long long now = monotonic_ns();
+    if (now < next_health_check_ns) {
+        return;
+    }
+    next_health_check_ns = now + (long long)HEALTH_INTERVAL_MS * 1000000LL;
+    
+    for (int i = 0; i < 3; i++) {
+        Backend* b = &backends[i];
+        for (size_t k = 0; k < b->instances.size(); k++) {
+            BackendInstance& instance = b->instances[k];
+            if (instance.ping_request != 0) {
+                pending_requests.erase(instance.ping_request);
+                instance.ping_request = 0;
+                backend_missed(i, k);
+            }
+            unsigned request_id = take_request_id();
+            std::string ping = "#" + std::to_string(request_id) + " PING";
+            if (io_send_datagram(&instance.addr, ping.c_str(), ping.length()) == -1) {
+                backend_missed(i, k);
+                continue;
+            }
+            PendingRequest& request = pending_requests[request_id];
+            request.session_id = 0;
+            request.backend = i;
+            request.instance = k;
+            request.idempotent = false;
+            request.attempts = 1;
+            request.deadline_ns = next_health_check_ns;
+            instance.ping_request = request_id;
+        }
+    }
+}
+
+void on_health_reply(const PendingRequest& request) {
+    Backend* b = &backends[request.backend];
+    BackendInstance& instance = b->instances[request.instance];
+    instance.ping_request = 0;
+    instance.missed = 0;
+    if (!instance.healthy) {
+        instance.healthy = true;
+        printf("[Server M] %s on port %d is answering.\n", b->name, ntohs(instance.addr.sin_port));
+        backend_select(b);
+    }
+}
+
+// An unanswered PING or a request past its deadline
+void backend_missed(int backend, size_t index) {
+    Backend* b = &backends[backend];
+    BackendInstance& instance = b->instances[index];
+    if (++instance.missed < HEALTH_MAX_MISSES || !instance.healthy) {
+        return;
+    }
+    instance.healthy = false;
+    printf("[Server M] %s on port %d stopped answering.\n", b->name, ntohs(instance.addr.sin_port));
+    backend_select(b);
+}
+
+// New requests go to the first healthy instance, or to the primary when
+// none is
+void backend_select(Backend* b) {
+    size_t active = 0;
+    while (active < b->instances.size() && !b->instances[active].healthy) {
+        active++;
+    }
+    if (active == b->instances.size()) {
+        active = 0;
+    }
+    if (active == b->active) {
+        return;
+    }
+    b->active = active;
+    printf("[Server M] Sending %s requests to the %s on port %d.\n", b->name,
+           active == 0 ? "primary" : "standby", ntohs(b->instances[active].addr.sin_port));
+}
+
+// Requests past their deadline. An idempotent one is sent again, to whichever
+// instance is active by now, with twice the deadline; anything else, or a
+// request out of attempts, ends its command. The map holds one request per
+// session waiting on a backend plus the PINGs, so a scan is cheap.
+void expire_backend_requests() {
+    long long now = monotonic_ns();
+    std::vector<unsigned> expired;
+    for (std::map<unsigned, PendingRequest>::iterator it = pending_requests.begin();
+         it != pending_requests.end(); ++it) {
+        if (it->second.session_id != 0 && it->second.deadline_ns <= now) {
+            expired.push_back(it->first);
+        }
+    }
+    
+    for (size_t i = 0; i < expired.size(); i++) {
+        unsigned request_id = expired[i];
+        std::map<unsigned, PendingRequest>::iterator it = pending_requests.find(request_id);
+        if (it == pending_requests.end()) {
+            continue;
+        }
+        PendingRequest& request = it->second;
+        Backend* b = &backends[request.backend];
+        backend_missed(request.backend, request.instance);
+        
+        if (request.idempotent && request.attempts < BACKEND_MAX_ATTEMPTS) {
+            request.attempts++;
+            request.instance = b->active;
+            request.deadline_ns = now + ((long long)BACKEND_TIMEOUT_MS << (request.attempts - 1)) * 1000000LL;
+            printf("[Server M] No reply from %s to request %u, sending it again (attempt %d of %d).\n",
+                   b->name, request_id, request.attempts, BACKEND_MAX_ATTEMPTS);
+            if (io_send_datagram(&b->instances[b->active].addr, request.datagram.c_str(),
+                                 request.datagram.length()) == -1) {
+                perror("sendto");
+            }
+            continue;
+        }
+        
+        Session* s = find_session(request.session_id);
+        if (s != NULL) {
+            forget_hold_request(s, request_id);
+        }
+        pending_requests.erase(it);
+        printf("[Server M] %s did not answer request %u, giving up.\n", b->name, request_id);
+        if (s == NULL || !session_claim_reply(s, request_id)) {
+            continue;
+        }
+        on_backend_timeout(s, b);
+        session_pump(s);
+    }
+}
+
+// The backend never answered: end the command instead of leaving the member waiting
+void on_backend_timeout(Session* s, const Backend* b) {
+    char message[BUFFER_SIZE];
+    int len;
+    switch (s->state) {
+    case SESSION_BUY_ADVANCE_WAIT:
+    case SESSION_BASKET_ADVANCE_WAIT:
+        // The trade is done, only the price did not move
+        forward_trade_result(s);
+        return;
+    case SESSION_SELL_RESULT_WAIT:
+        // The ADVANCE sent along with the SELL: the trade result still counts
+        if (b->primary == &server_q_addr) {
+            if (!session_waiting(s)) {
+                forward_trade_result(s);
+            }
+            return;
+        }
+        // fall through
+    case SESSION_BUY_RESULT_WAIT:
+    case SESSION_BASKET_RESULT_WAIT:
+        // Server P may or may not have applied it, and a trade is never sent twice
+        len = snprintf(message, sizeof(message),
+                       "ERROR: %s did not respond, check your position before trading again", b->name);
+        break;
+    default:
+        len = snprintf(message, sizeof(message), BUSY_MSG ": %s did not respond", b->name);
+        break;
+    }
+    session_send_reply(s, message, len);
+    finish_command(s);
+}
+
+// `timeout_ms` (-1 for none), cut short to wake up for the next request
+// deadline or health check
+int backend_timer_ms(int timeout_ms) {
+    long long next_ns = next_health_check_ns;
+    for (std::map<unsigned, PendingRequest>::iterator it = pending_requests.begin();
+         it != pending_requests.end(); ++it) {
+        if (it->second.session_id != 0 && it->second.deadline_ns < next_ns) {
+            next_ns = it->second.deadline_ns;
+        }
+    }
+    long long wait_ms = (next_ns - monotonic_ns() + 999999LL) / 1000000LL;
+    if (wait_ms < 0) {
+        wait_ms = 0;
+    }
+    return (timeout_ms == -1 || wait_ms < timeout_ms) ? (int)wait_ms : timeout_ms;
+}
+
+// `data` has room for one more byte: the datagram is ended with a '\0' in
+// place, so the reply is parsed and forwarded straight from the receive buffer
+void on_backend_datagram(char* data, size_t len) {
+    if (len == 0 || data[0] != '#') {
+        return;
+    }
+    data[len] = '\0';
+    const char* space = (const char*)memchr(data, ' ', len);
+    const char* reply = space == NULL ? "" : space + 1;
+    unsigned request_id = (unsigned)strtoul(data + 1, NULL, 10);
+    std::map<unsigned, PendingRequest>::iterator it = pending_requests.find(request_id);
+    if (it == pending_requests.end() && upgrade_forward_datagram(request_id, data, len)) {
+        return;
+    }
+    if (it != pending_requests.end() && it->second.session_id == 0) {
+        on_health_reply(it->second);
+        pending_requests.erase(it);
+        return;
+    }
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_BACKEND_IN, 0, it == pending_requests.end() ? 0 : it->second.session_id,
+                       data, len);
+    }
+    if (it == pending_requests.end()) {
+        // The session went away (or its command ended) while the backend was
+        // working, or a retry was answered twice
+        release_orphan_hold(request_id, reply);
+        return;
+    }
+    Session* s = find_session(it->second.session_id);
+    int backend = it->second.backend;
+    pending_requests.erase(it);
+    if (s == NULL || !session_claim_reply(s, request_id)) {
+        return;
+    }
+    s->reply_backend = backend;
+    
+    unsigned long long trace_id = s->trace_id;  // the handler may finish the command
+    if (trace_id == 0) {
+        session_on_backend_reply(s, reply);
+    } else {
+        long long received_ns = monotonic_ns();
+        trace_span(&trace_log, trace_id, s->trace_request.c_str(), s->trace_request_ns, received_ns,
+                   "\"request\":" + std::to_string(request_id));
+        session_on_backend_reply(s, reply);
+        trace_span(&trace_log, trace_id, "handle reply", received_ns, monotonic_ns(), "");
+        if (awaiting_confirmation(s)) {
+            s->trace_confirm_ns = monotonic_ns();
+        }
+    }
+    session_pump(s);
+}
+
+void session_on_backend_reply(Session* s, const char* reply) {
+    switch (s->state) {
+    case SESSION_AUTH_WAIT:               on_auth_reply(s, reply); break;
+    case SESSION_QUOTE_WAIT:              on_quote_reply(s, reply); break;
+    case SESSION_QUOTE_PAGE_WAIT:         on_quote_page(s, reply); break;
+    case SESSION_HISTORY_WAIT:            on_history_reply(s, reply); break;
+    case SESSION_TRADES_WAIT:             on_trades_page(s, reply); break;
+    case SESSION_BUY_QUOTE_WAIT:          on_buy_quote(s, reply); break;
+    case SESSION_BUY_RESULT_WAIT:         on_buy_result(s, reply); break;
+    case SESSION_BUY_ADVANCE_WAIT:        forward_trade_result(s); break;
+    case SESSION_SELL_PREPARE_WAIT:       on_sell_prepared(s, reply); break;
+    case SESSION_SELL_RESULT_WAIT:        on_sell_result(s, reply); break;
+    case SESSION_POSITION_PORTFOLIO_WAIT: on_position_portfolio(s, reply); break;
+    case SESSION_POSITION_QUOTE_WAIT:     on_position_quote(s, reply); break;
+    case SESSION_BASKET_QUOTE_WAIT:       on_basket_quotes(s, reply); break;
+    case SESSION_BASKET_CHECK_WAIT:       on_basket_check(s, reply); break;
+    case SESSION_BASKET_RESULT_WAIT:      on_basket_result(s, reply); break;
+    case SESSION_BASKET_ADVANCE_WAIT:     forward_trade_result(s); break;
+    default: break;
+    }
+}
+
+// Sample this command for tracing, see trace.h
+void trace_begin_command(Session* s, const std::string& command) {
+    s->trace_id = 0;
+    if (trace_sample_every == 0 || ++trace_sample_count % trace_sample_every != 0) {
+        return;
+    }
+    // The pid keeps ids from two Server M runs apart in an appended-to file
+    s->trace_id = ((unsigned long long)getpid() << 32) | trace_next_id;
+    trace_next_id += reactor_count;
+    if (trace_next_id <= (unsigned)reactor_count) {
+        trace_next_id = reactor_index + 1;
+    }
+    s->trace_command_ns = monotonic_ns();
+    s->trace_command = command;
+}
+
+// The whole command, from dispatch to its last reply to the client
+void trace_end_command(Session* s) {
+    if (s->trace_id == 0) {
+        return;
+    }
+    trace_span(&trace_log, s->trace_id, s->trace_command.c_str(), s->trace_command_ns, monotonic_ns(),
+               "\"session\":" + std::to_string(s->id));
+    s->trace_id = 0;
+}
+
+bool awaiting_confirmation(const Session* s) {
+    return s->state == SESSION_BUY_CONFIRM_WAIT || s->state == SESSION_SELL_CONFIRM_WAIT ||
+           s->state == SESSION_BASKET_CONFIRM_WAIT;
+}
+
+// Time the member took to answer the confirmation prompt
+void trace_confirmation(Session* s) {
+    trace_span(&trace_log, s->trace_id, "member confirmation", s->trace_confirm_ns, monotonic_ns(), "");
+}
+
+// Process client commands
+void dispatch_command(Session* s, const std::string& message) {
+    std::vector<std::string> parts = split_string(message, ' ');
+    if (parts.empty()) {
+        return;
+    }
+    
+    // Per-member rate limit, applied once the session is authenticated. A
+    // read dispatched again after waiting for its slot was counted already.
+    if (parts[0] != "AUTH" && !s->username.empty() && !s->holds_backend_slot &&
+        !consume_rate_token(s->username)) {
+        const char* busy_msg = BUSY_MSG ": rate limit exceeded";
+        session_send(s, busy_msg, strlen(busy_msg) + 1);
+        printf("[Server M] Rate limited a %s request from %s.\n",
+               parts[0].c_str(), s->username.c_str());
+        return;
+    }
+    
+    if (parts[0] == "AUTH" && parts.size() == 3) {
+        handle_authentication(s, parts[1], parts[2]);
+    } 
+    else if (parts[0] == "quote") {
+        std::string stock_name = (parts.size() > 1) ? parts[1] : "";
+        handle_quote(s, stock_name);
+    } 
+    else if ((parts[0] == "buy" || parts[0] == "sell") && parts.size() == 3) {
+        int shares = 0;
+        if (!parse_int(parts[2], &shares) || shares <= 0) {
+            const char* error_msg = "ERROR: Invalid number of shares";
+            session_send(s, error_msg, strlen(error_msg) + 1);
+        } else if (parts[0] == "buy") {
+            handle_buy(s, parts[1], shares);
+        } else {
+            handle_sell(s, parts[1], shares);
+        }
+    } 
+    else if (parts[0] == "position") {
+        handle_position(s);
+    } 
+    else if (parts[0] == "history" && (parts.size() == 4 || parts.size() == 5)) {
+        handle_history(s, parts);
+    }
+    else if (parts[0] == "history" && parts.size() == 2) {
+        handle_trades(s, parts[1], "0");
+    }
+    else if (parts[0] == "trades" && (parts.size() == 1 || (parts.size() == 3 && parts[1] == "since"))) {
+        handle_trades(s, "", parts.size() == 3 ? parts[2] : "0");
+    }
+    else if (parts[0] == "basket") {
+        handle_basket(s, parts);
+    }
+    else {
+        const char* error_msg = "ERROR: Unknown command or incorrect format";
+        session_send(s, error_msg, strlen(error_msg));
+    }
+}
+
+void handle_authentication(Session* s, const std::string& username, const std::string& password) {
+    printf("[Server M] Received username %s and password ****.\n", username.c_str());
+    
+    if (!session_acquire_read_slot(s)) {
+        park_for_read_slot(s);
+        return;
+    }
+    
+    // Encrypt password
+    char enc_pass[BUFFER_SIZE];
+    strncpy(enc_pass, password.c_str(), BUFFER_SIZE - 1);
+    enc_pass[BUFFER_SIZE - 1] = '\0';
+    encrypt_password(enc_pass);
+    
+    // Prepare message for Server A
+    std::string auth_message = "AUTH " + username + " " + enc_pass;
+    
+    // Sending AUTH request to Server A using UDP
+    if (!backend_request(s, &server_a_addr, auth_message)) {
+        perror("sendto");
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Sent the authentication request to Server A\n");
+    s->auth_username = username;
+    s->state = SESSION_AUTH_WAIT;
+}
+
+void on_auth_reply(Session* s, const char* reply) {
+    printf("[Server M] Received the response from server A using UDP over %d\n", SERVER_M_UDP_PORT);
+    
+    // Process Server A response
+    if (strcmp(reply, "AUTH_SUCCESS") == 0) {
+        const char* success_msg = "AUTH_SUCCESS";
+        session_send(s, success_msg, strlen(success_msg) + 1);
+        printf("[Server M] Sent the response from server A to the client using TCP over port %d.\n", SERVER_M_TCP_PORT);
+        s->username = s->auth_username;
+    } else {
+        const char* error_msg = "AUTH_FAILED";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        printf("[Server M] Sent the response from server A to the client using TCP over port %d.\n", SERVER_M_TCP_PORT);
+    }
+    finish_command(s);
+}
+
+void handle_quote(Session* s, const std::string& stock_name) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg));
+        return;
+    }
+    if (!session_acquire_read_slot(s)) {
+        park_for_read_slot(s);
+        return;
     }
     
-    struct sockaddr_in server_q_addr;
-    char buffer[BUFFER_SIZE];
-    
-    printf("[Server M] Received a buy request from member %s using TCP over port %d.\n",
-           client_usernames[client_sockfd].c_str(), SERVER_M_TCP_PORT);
-    
-    // getting current price from Server Q
-    std::string quote_message = "QUOTE " + stock_name;
-    
-    // Set address for Server Q
-    memset(&server_q_addr, 0, sizeof(server_q_addr));
-    server_q_addr.sin_family = AF_INET;
-    server_q_addr.sin_port = htons(SERVER_Q_PORT);
-    server_q_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Send to Server Q 
-    size_t quote_len = quote_message.length() + 1;
-    char* null_term_quote = new char[quote_len];
-    strcpy(null_term_quote, quote_message.c_str());
+    printf("[Server M] Received a quote request from %s%s%s, using TCP over port %d.\n",
+           s->username.c_str(),
+           stock_name.empty() ? "" : " for stock ",
+           stock_name.empty() ? "" : stock_name.c_str(),
+           SERVER_M_TCP_PORT);
     
-    if (sendto(udp_sockfd, null_term_quote, quote_len, 0,
-              (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
+    // Every stock: too many for one datagram, Server Q pages them
+    if (stock_name.empty()) {
+        s->page_seq = 1;
+        s->page_after.clear();
+        if (!request_quote_page(s)) {
+            perror("sendto Server Q");
+            const char* error_msg = "ERROR: Failed to get quote";
+            session_send(s, error_msg, strlen(error_msg) + 1);
+            finish_command(s);
+            return;
+        }
+        printf("[Server M] Forwarded the quote request to server Q.\n");
+        return;
+    }
+    
+    // Prepare message for Server Q
+    std::string quote_message = "QUOTE " + stock_name;
+    
+    // Send - to Server Q
+    if (!backend_request(s, &server_q_addr, quote_message)) {
+        perror("sendto Server Q");
+        const char* error_msg = "ERROR: Failed to get quote";
+        session_send(s, error_msg, strlen(error_msg));
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Sent quote request to server Q.\n");
+    printf("[Server M] Forwarded the quote request to server Q.\n");
+    s->state = SESSION_QUOTE_WAIT;
+}
+
+void on_quote_reply(Session* s, const char* reply) {
+    printf("[Server M] Received quote response from server Q.\n");
+    printf("[Server M] Received the quote response from server Q using UDP over %d\n", SERVER_M_UDP_PORT);
+    
+    session_send(s, reply, strlen(reply) + 1);
+    printf("[Server M] Forwarded the quote response to the client.\n");
+    finish_command(s);
+}
+
+bool request_quote_page(Session* s) {
+    std::string quote_message = "QUOTE_PAGE " + std::to_string(s->page_seq);
+    if (!s->page_after.empty()) {
+        quote_message += " " + s->page_after;
+    }
+    if (!backend_request(s, &server_q_addr, quote_message)) {
+        return false;
+    }
+    s->state = SESSION_QUOTE_PAGE_WAIT;
+    return true;
+}
+
+// Each page goes to the client as soon as it arrives, and the '\0' after the
+// last one ends the response. Only one page is in flight at a time, so a
+// large listing never floods the UDP socket or the shared-memory ring.
+void on_quote_page(Session* s, const char* reply) {
+    bool more;
+    const char* lines = parse_page_header(reply, "PAGE", s->page_seq, &more, NULL);
+    if (lines == NULL) {
+        // Nothing streamed yet: an error; otherwise end with what was sent
+        const char* error_msg = s->page_seq == 1 ? "ERROR: Failed to get quote" : "";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    if (s->page_seq == 1) {
+        printf("[Server M] Received quote response from server Q.\n");
+        printf("[Server M] Received the quote response from server Q using UDP over %d\n", SERVER_M_UDP_PORT);
+    }
+    session_send(s, lines, strlen(lines));
+    
+    if (more) {
+        s->page_after = last_page_key(lines);
+        s->page_seq++;
+        if (!s->page_after.empty() && request_quote_page(s)) {
+            return;
+        }
+        perror("sendto Server Q");
+    }
+    session_send(s, "", 1);
+    printf("[Server M] Forwarded the quote response to the client.\n");
+    finish_command(s);
+}
+
+// A paged reply starts with "<kind> <seq> MORE|END[ <extra>]\n". Returns the
+// lines after that header, or NULL if the reply is not page `seq` of `kind`.
+// `extra` (when not NULL) gets the word after MORE|END, empty if there is none.
+const char* parse_page_header(const char* reply, const char* kind, unsigned seq, bool* more, std::string* extra) {
+    size_t kind_len = strlen(kind);
+    if (strncmp(reply, kind, kind_len) != 0 || reply[kind_len] != ' ') {
+        return NULL;
+    }
+    char* end;
+    unsigned long reply_seq = strtoul(reply + kind_len + 1, &end, 10);
+    if (reply_seq != seq || *end != ' ') {
+        return NULL;
+    }
+    const char* word = end + 1;
+    if (strncmp(word, "MORE", 4) == 0) {
+        *more = true;
+        word += 4;
+    } else if (strncmp(word, "END", 3) == 0) {
+        *more = false;
+        word += 3;
+    } else {
+        return NULL;
+    }
+    const char* newline = strchr(word, '\n');
+    if (newline == NULL || (newline != word && *word != ' ')) {
+        return NULL;
+    }
+    if (extra != NULL) {
+        extra->assign(newline == word ? newline : word + 1, newline);
+    }
+    return newline + 1;
+}
+
+// Cursor for the next page: the first word (stock or trade number) of its last line
+std::string last_page_key(const char* lines) {
+    size_t end = strlen(lines);
+    if (end > 0 && lines[end - 1] == '\n') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && lines[start - 1] != '\n') {
+        start--;
+    }
+    return std::string(lines + start, strcspn(lines + start, " \n"));
+}
+
+// history <stock> <from> <to> [bar_size]: Server Q aggregates the bars from
+// its range indexes, only the bars travel back
+void handle_history(Session* s, const std::vector<std::string>& parts) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    if (!session_acquire_read_slot(s)) {
+        park_for_read_slot(s);
+        return;
+    }
+    
+    printf("[Server M] Received a history request from %s for stock %s, using TCP over port %d.\n",
+           s->username.c_str(), parts[1].c_str(), SERVER_M_TCP_PORT);
+    
+    std::string history_message = "HISTORY";
+    for (size_t i = 1; i < parts.size(); i++) {
+        history_message += " " + parts[i];
+    }
+    if (!backend_request(s, &server_q_addr, history_message)) {
+        perror("sendto Server Q");
+        const char* error_msg = "ERROR: Failed to get history";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the history request to server Q.\n");
+    s->state = SESSION_HISTORY_WAIT;
+}
+
+void on_history_reply(Session* s, const char* reply) {
+    printf("[Server M] Received the history response from server Q using UDP over %d\n", SERVER_M_UDP_PORT);
+    session_send(s, reply, strlen(reply) + 1);
+    printf("[Server M] Forwarded the history response to the client.\n");
+    finish_command(s);
+}
+
+// history <stock> and trades [since <n>]: the member's own trades from
+// Server P's ledger, streamed a page at a time like the all-stock quote and
+// ended by a "Trades: <count>" line
+void handle_trades(Session* s, const std::string& stock_name, const std::string& since) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    char* end;
+    strtoull(since.c_str(), &end, 10);
+    if (since.empty() || *end != '\0' || since[0] == '-') {
+        const char* error_msg = "ERROR: Invalid trade number";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    if (!session_acquire_read_slot(s)) {
+        park_for_read_slot(s);
+        return;
+    }
+    
+    printf("[Server M] Received a trades request from %s using TCP over port %d.\n",
+           s->username.c_str(), SERVER_M_TCP_PORT);
+    
+    s->stock_name = stock_name;
+    s->page_seq = 1;
+    s->page_after = since;
+    s->trades_listed = 0;
+    if (!request_trades_page(s)) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to get trades";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the trades request to server P.\n");
+}
+
+bool request_trades_page(Session* s) {
+    std::string trades_message = "TRADES " + s->username + " " + std::to_string(s->page_seq) + " " + s->page_after;
+    if (!s->stock_name.empty()) {
+        trades_message += " " + s->stock_name;
+    }
+    if (!backend_request(s, &server_p_addr, trades_message)) {
+        return false;
+    }
+    s->state = SESSION_TRADES_WAIT;
+    return true;
+}
+
+void on_trades_page(Session* s, const char* reply) {
+    bool more;
+    const char* lines = parse_page_header(reply, "TRADES", s->page_seq, &more, NULL);
+    if (lines == NULL) {
+        // Nothing streamed yet: an error; otherwise end with what was sent
+        const char* error_msg = s->page_seq == 1 ? "ERROR: Failed to get trades" : "";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    if (s->page_seq == 1) {
+        printf("[Server M] Received the trades response from server P using UDP over %d\n", SERVER_M_UDP_PORT);
+    }
+    session_send(s, lines, strlen(lines));
+    for (const char* c = lines; *c != '\0'; c++) {
+        s->trades_listed += *c == '\n';
+    }
+    
+    if (more) {
+        s->page_after = last_page_key(lines);
+        s->page_seq++;
+        if (!s->page_after.empty() && request_trades_page(s)) {
+            return;
+        }
+        perror("sendto Server P");
+    }
+    char count_line[64];
+    snprintf(count_line, sizeof(count_line), "Trades: %u", s->trades_listed);
+    session_send(s, count_line, strlen(count_line) + 1);
+    printf("[Server M] Forwarded the trades response to the client.\n");
+    finish_command(s);
+}
+
+void handle_buy(Session* s, const std::string& stock_name, int num_shares) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    if (!session_acquire_slot(s)) {
+        admission->rejected_backend_busy++;
+        session_send(s, BUSY_MSG, strlen(BUSY_MSG) + 1);
+        return;
+    }
+    
+    printf("[Server M] Received a buy request from member %s using TCP over port %d.\n",
+           s->username.c_str(), SERVER_M_TCP_PORT);
+    
+    // getting current price from Server Q
+    std::string quote_message = "QUOTE " + stock_name;
+    
+    if (!backend_request(s, &server_q_addr, quote_message)) {
         perror("sendto Server Q");
         const char* error_msg = "ERROR: Failed to get quote for buy";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0);
-        delete[] null_term_quote;
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Sent quote request to server Q.\n");
+    s->stock_name = stock_name;
+    s->num_shares = num_shares;
+    s->trade_side = TRADE_BUY;
+    s->state = SESSION_BUY_QUOTE_WAIT;
+}
+
+void on_buy_quote(Session* s, const char* reply) {
+    printf("[Server M] Received quote response from server Q.\n");
+    
+    // stock doesn't exist or Error
+    if (strncmp(reply, "ERROR", 5) == 0) {
+        session_send(s, reply, strlen(reply) + 1);
+        finish_command(s);
+        return;
+    }
+    
+    // Parse price from Server Q response
+    std::string response(reply);
+    std::vector<std::string> parts = split_string(response, ' ');
+    
+    if (parts.size() < 2 || !parse_double(parts[1], &s->current_price)) {
+        const char* error_msg = "ERROR: Invalid quote response";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    
+    double total_cost = s->current_price * s->num_shares;
+    
+    // ask client for confirmation
+    char confirm_msg[BUFFER_SIZE];
+    int msg_len = format_confirmation(confirm_msg, "BUY", s, total_cost);
+    session_send_reply(s, confirm_msg, msg_len);
+    printf("[Server M] Sent the buy confirmation to the client.\n");
+    
+    // Don't hold a backend slot while the member decides
+    session_release_slot(s);
+    s->state = SESSION_BUY_CONFIRM_WAIT;
+}
+
+void on_buy_confirmation(Session* s, const std::string& confirmation) {
+    if (confirmation != "yes" && confirmation != "YES" && confirmation != "y" && confirmation != "Y") {
+        const char* cancel_msg = "Buy transaction cancelled";
+        session_send(s, cancel_msg, strlen(cancel_msg) + 1); 
+        printf("[Server M] Buy denied.\n");
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Buy approved.\n");
+    
+    if (!session_acquire_slot(s)) {
+        park_for_backend_slot(s);
+        return;
+    }
+    submit_buy(s);
+}
+
+// Process the buy with Server P
+void submit_buy(Session* s) {
+    std::string buy_message = "BUY " + s->username + " " + s->stock_name + " " + 
+                             std::to_string(s->num_shares) + " " + std::to_string(s->current_price);
+    
+    if (!backend_request(s, &server_p_addr, buy_message)) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to process buy";
+        session_send(s, error_msg, strlen(error_msg) + 1); 
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the buy confirmation response to Server P.\n");
+    s->state = SESSION_BUY_RESULT_WAIT;
+}
+
+void on_buy_result(Session* s, const char* reply) {
+    advance_after_trade(s, reply, SESSION_BUY_ADVANCE_WAIT);
+}
+
+// Advance stock price in Server Q, then hand Server P's result to the client
+void advance_after_trade(Session* s, const char* result, SessionState advance_state) {
+    s->backend_result = result;
+    std::string advance_message = "ADVANCE " + s->stock_name;
+    
+    if (!backend_request(s, &server_q_addr, advance_message)) {
+        perror("sendto Server Q (advance)");
+        forward_trade_result(s);
+        return;
+    }
+    printf("[Server M] Sent a time forward request for %s.\n", s->stock_name.c_str());
+    s->state = advance_state;
+}
+
+// "<side> CONFIRM: <stock> <shares> shares at $<price> = $<total>" into a
+// BUFFER_SIZE buffer, returns its length
+int format_confirmation(char* out, const char* side, const Session* s, double total) {
+    int len = snprintf(out, BUFFER_SIZE, "%s CONFIRM: %s %d shares at $%f = $%f",
+                       side, s->stock_name.c_str(), s->num_shares, s->current_price, total);
+    return len < BUFFER_SIZE ? len : BUFFER_SIZE - 1;
+}
+
+// Forward Server P's response to client with null terminator
+void forward_trade_result(Session* s) {
+    session_send_reply(s, s->backend_result.data(), s->backend_result.length());
+    if (s->trade_side == TRADE_BUY) {
+        printf("[Server M] Forwarded the buy result to the client.\n");
+    } else if (s->trade_side == TRADE_BASKET) {
+        printf("[Server M] Forwarded the basket result to the client.\n");
+    } else {
+        printf("[Server M] Forwarded the sell result to the client.\n");
+    }
+    finish_command(s);
+}
+
+// The quote and the share check do not depend on each other, so they go out
+// together. Server P holds the shares until the SELL (or until SELL_HOLD_MS
+// in serverP.cpp passes), so the SELL cannot be beaten to them by another
+// sell and is not checked again. A sell costs two backend round trips in a
+// row: quote and hold, then SELL and ADVANCE.
+void handle_sell(Session* s, const std::string& stock_name, int num_shares) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    if (!session_acquire_slot(s)) {
+        admission->rejected_backend_busy++;
+        session_send(s, BUSY_MSG, strlen(BUSY_MSG) + 1);
+        return;
+    }
+    
+    printf("[Server M] Received a sell request from member %s using TCP over port %d.\n",
+           s->username.c_str(), SERVER_M_TCP_PORT);
+    
+    std::string quote_message = "QUOTE " + stock_name;
+    
+    // Send to Server Q
+    unsigned quote_request = backend_request(s, &server_q_addr, quote_message);
+    if (quote_request == 0) {
+        perror("sendto Server Q");
+        const char* error_msg = "ERROR: Failed to get quote for sell";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Sent the quote request to server Q.\n");
+    
+    // check if user has enough shares with Server P, and hold them
+    std::string check_message = "CHECK " + s->username + " " + stock_name + " " + std::to_string(num_shares) + " HOLD";
+    
+    // Send to Server P
+    if (!backend_request(s, &server_p_addr, check_message)) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to check shares";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the sell request to server P.\n");
+    s->awaiting_parallel = quote_request;
+    s->stock_name = stock_name;
+    s->num_shares = num_shares;
+    s->sell_hold.clear();
+    s->trade_side = TRADE_SELL;
+    s->state = SESSION_SELL_PREPARE_WAIT;
+}
+
+// Server Q's quote or Server P's hold, whichever came first
+void on_sell_prepared(Session* s, const char* reply) {
+    if (s->reply_backend == backend_index(&server_q_addr)) {
+        printf("[Server M] Received quote response from server Q.\n");
+        
+        // stock doesn't exist or Error
+        if (strncmp(reply, "ERROR", 5) == 0) {
+            session_send(s, reply, strlen(reply) + 1);
+            finish_command(s);
+            return;
+        }
+        
+        // Parse the price from Server Q's response
+        std::string response(reply);
+        std::vector<std::string> parts = split_string(response, ' ');
+        
+        if (parts.size() < 2 || !parse_double(parts[1], &s->current_price)) {
+            const char* error_msg = "ERROR: Invalid quote response";
+            session_send(s, error_msg, strlen(error_msg) + 1);
+            finish_command(s);
+            return;
+        }
+    } else {
+        // If not enough shares
+        if (strcmp(reply, "INSUFFICIENT_SHARES") == 0) {
+            const char* error_msg = "ERROR: You do not have enough shares to sell";
+            session_send(s, error_msg, strlen(error_msg) + 1);
+            finish_command(s);
+            return;
+        }
+        // "SUFFICIENT_SHARES <hold id>"
+        const char* hold = strchr(reply, ' ');
+        s->sell_hold = hold != NULL ? hold + 1 : "";
+    }
+    if (session_waiting(s)) {
         return;
     }
-    printf("[Server M] Sent quote request to server Q.\n");
-    delete[] null_term_quote;
     
-    // Receive quote -from Server Q
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int bytes_received;
+    // Ask client for confirmation
+    double total_value = s->current_price * s->num_shares;
+    char confirm_msg[BUFFER_SIZE];
+    int msg_len = format_confirmation(confirm_msg, "SELL", s, total_value);
+    session_send_reply(s, confirm_msg, msg_len);
+    printf("[Server M] Forwarded the sell confirmation to the client.\n");
+    
+    // Don't hold a backend slot while the member decides
+    session_release_slot(s);
+    s->state = SESSION_SELL_CONFIRM_WAIT;
+}
+
+void on_sell_confirmation(Session* s, const std::string& confirmation) {
+    if (confirmation != "yes" && confirmation != "YES" && confirmation != "y" && confirmation != "Y") {
+        const char* cancel_msg = "Sell transaction cancelled";
+        // Forward denial to Server P so it can log “Sell denied.” and let go of the shares
+        std::string denial = s->sell_hold.empty() ? "N" : "N " + s->username + " " + s->sell_hold;
+        backend_notify(&server_p_addr, denial.c_str(), denial.length());
+        s->sell_hold.clear();
+        session_send(s, cancel_msg, strlen(cancel_msg) + 1);
+        printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
+        finish_command(s);
+        return;
+    }
     
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server Q");
-        const char* error_msg = "ERROR: Failed to get quote for buy";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0); 
+    if (!session_acquire_slot(s)) {
+        park_for_backend_slot(s);
         return;
     }
-    printf("[Server M] Received quote response from server Q.\n");
+    submit_sell(s);
+}
+
+// Process the sell with Server P against its hold, and advance the price
+// at the same time: the ADVANCE follows every SELL whatever its result
+void submit_sell(Session* s) {
+    std::string sell_message = "SELL " + s->username + " " + s->stock_name + " " + 
+                              std::to_string(s->num_shares) + " " + std::to_string(s->current_price);
+    if (!s->sell_hold.empty()) {
+        sell_message += " " + s->sell_hold;
+    }
     
-    buffer[bytes_received] = '\0';
+    unsigned sell_request = backend_request(s, &server_p_addr, sell_message);
+    if (sell_request == 0) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to process sell";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
+    s->sell_hold.clear();
+    s->backend_result.clear();
+    s->state = SESSION_SELL_RESULT_WAIT;
     
-    // stock doesn't exist or Error
-    if (strncmp(buffer, "ERROR", 5) == 0) {
-        send(client_sockfd, buffer, strlen(buffer) + 1, 0);
+    std::string advance_message = "ADVANCE " + s->stock_name;
+    if (!backend_request(s, &server_q_addr, advance_message)) {
+        perror("sendto Server Q (advance)");
+        return;
+    }
+    printf("[Server M] Sent a time forward request for %s.\n", s->stock_name.c_str());
+    s->awaiting_parallel = sell_request;
+}
+
+// Server P's result or Server Q's ADVANCE reply; the result goes to the
+// client once both are in
+void on_sell_result(Session* s, const char* reply) {
+    if (s->reply_backend == backend_index(&server_p_addr)) {
+        s->backend_result = reply;
+    }
+    if (!session_waiting(s)) {
+        forward_trade_result(s);
+    }
+}
+
+// basket <buy|sell> <stock> <shares> [<buy|sell> <stock> <shares> ...]
+//
+// All legs go through as one transaction: one batched QUOTE, one CHECK of
+// every sell leg, one confirmation, one BASKET message that Server P applies
+// all-or-nothing, and one batched ADVANCE. A basket costs the same number of
+// round trips as a single sell, however many legs it has.
+void handle_basket(Session* s, const std::vector<std::string>& parts) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
         return;
     }
     
-    // Parse price from Server Q response
-    std::string response(buffer);
-    std::vector<std::string> parts = split_string(response, ' ');
+    size_t leg_count = (parts.size() - 1) / 3;
+    if (parts.size() < 4 || (parts.size() - 1) % 3 != 0 || leg_count > BASKET_MAX_LEGS) {
+        const char* error_msg = "ERROR: Invalid basket format";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    std::vector<BasketLeg> basket;
+    for (size_t i = 1; i + 2 < parts.size(); i += 3) {
+        BasketLeg leg;
+        leg.side = parts[i] == "buy" ? TRADE_BUY : parts[i] == "sell" ? TRADE_SELL : TRADE_NONE;
+        leg.stock_name = parts[i + 1];
+        leg.price = 0.0;
+        if (!parse_int(parts[i + 2], &leg.num_shares)) {
+            leg.num_shares = 0;
+        }
+        if (leg.side == TRADE_NONE || leg.num_shares <= 0) {
+            std::string error_msg = "ERROR: Invalid basket leg: " + parts[i] + " " + parts[i + 1] + " " + parts[i + 2];
+            session_send(s, error_msg.c_str(), error_msg.length() + 1);
+            return;
+        }
+        basket.push_back(leg);
+    }
     
-    if (parts.size() < 2) {
-        const char* error_msg = "ERROR: Invalid quote response";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0);
+    if (!session_acquire_slot(s)) {
+        admission->rejected_backend_busy++;
+        session_send(s, BUSY_MSG, strlen(BUSY_MSG) + 1);
         return;
     }
     
-    double current_price = std::stod(parts[1]);
-    double total_cost = current_price * num_shares;
+    printf("[Server M] Received a basket request with %d legs from member %s using TCP over port %d.\n",
+           (int)basket.size(), s->username.c_str(), SERVER_M_TCP_PORT);
     
-    // ask client for confirmation
-    std::string confirm_msg = "BUY CONFIRM: " + stock_name + " " + 
-                             std::to_string(num_shares) + " shares at $" + 
-                             std::to_string(current_price) + " = $" + 
-                             std::to_string(total_cost);
+    std::string quote_message = "QUOTE";
+    for (size_t i = 0; i < basket.size(); i++) {
+        quote_message += " " + basket[i].stock_name;
+    }
+    if (!backend_request(s, &server_q_addr, quote_message)) {
+        perror("sendto Server Q");
+        const char* error_msg = "ERROR: Failed to get quotes for basket";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Sent a batched quote request for %d stocks to server Q.\n", (int)basket.size());
+    s->basket.swap(basket);
+    s->trade_side = TRADE_BASKET;
+    s->state = SESSION_BASKET_QUOTE_WAIT;
+}
+
+// Server Q answers a batched QUOTE with one "<stock> <price>" line per stock,
+// in request order
+void on_basket_quotes(Session* s, const char* reply) {
+    printf("[Server M] Received the batched quote response from server Q.\n");
+    
+    if (strncmp(reply, "ERROR", 5) == 0) {
+        session_send(s, reply, strlen(reply) + 1);
+        finish_command(s);
+        return;
+    }
     
-    // making sure to include the null terminator
-    size_t msg_len = confirm_msg.length() + 1; 
-    char* null_term_msg = new char[msg_len];
-    strcpy(null_term_msg, confirm_msg.c_str());
+    std::vector<std::string> lines = split_string(reply, '\n');
+    if (lines.size() != s->basket.size()) {
+        const char* error_msg = "ERROR: Invalid quote response";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    bool has_sells = false;
+    for (size_t i = 0; i < lines.size(); i++) {
+        std::vector<std::string> quote = split_string(lines[i], ' ');
+        if (quote.size() < 2 || quote[0] != s->basket[i].stock_name ||
+            !parse_double(quote[1], &s->basket[i].price)) {
+            const char* error_msg = "ERROR: Invalid quote response";
+            session_send(s, error_msg, strlen(error_msg) + 1);
+            finish_command(s);
+            return;
+        }
+        has_sells = has_sells || s->basket[i].side == TRADE_SELL;
+    }
     
-    int send_res = send(client_sockfd, null_term_msg, msg_len, 0);
-    if (send_res == -1) {
-        perror("send buy confirmation to client");
-        delete[] null_term_msg;
+    // The apply message is the largest one this basket sends
+    if (basket_portfolio_message(s, "APPLY").length() >= BUFFER_SIZE) {
+        const char* error_msg = "ERROR: Basket too large";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
         return;
-    } else {
-        printf("[Server M] Sent the buy confirmation to the client.\n");
     }
-    delete[] null_term_msg;
     
-    // getting client confirmation
-    if ((bytes_received = recv(client_sockfd, buffer, BUFFER_SIZE - 1, 0)) <= 0) {
-        if (bytes_received == 0) {
-            printf("[Server M] Client disconnected during buy confirmation\n");
-        } else {
-            perror("recv confirmation");
+    if (!has_sells) {
+        confirm_basket(s);
+        return;
+    }
+    if (!backend_request(s, &server_p_addr, basket_portfolio_message(s, "CHECK"))) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to check shares";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the basket's sell legs to server P for checking.\n");
+    s->state = SESSION_BASKET_CHECK_WAIT;
+}
+
+void on_basket_check(Session* s, const char* reply) {
+    if (strncmp(reply, "INSUFFICIENT_SHARES", 19) == 0) {
+        std::string error_msg = "ERROR: You do not have enough shares";
+        if (reply[19] == ' ') {
+            error_msg += std::string(" of") + (reply + 19);
         }
+        error_msg += " to sell";
+        session_send(s, error_msg.c_str(), error_msg.length() + 1);
+        finish_command(s);
         return;
     }
+    confirm_basket(s);
+}
+
+// One confirmation for the whole basket. Each leg is listed when that fits in
+// the client's buffer, otherwise only the totals are.
+void confirm_basket(Session* s) {
+    double buys = 0.0, sells = 0.0;
+    std::string legs;
+    for (size_t i = 0; i < s->basket.size(); i++) {
+        const BasketLeg& leg = s->basket[i];
+        double value = leg.price * leg.num_shares;
+        if (leg.side == TRADE_BUY) {
+            buys += value;
+        } else {
+            sells += value;
+        }
+        legs += std::string(leg.side == TRADE_BUY ? "buy " : "sell ") + leg.stock_name + " " +
+                std::to_string(leg.num_shares) + " at $" + compact_number(leg.price) + "\n";
+    }
+    std::string confirm_msg = "BASKET CONFIRM: " + std::to_string(s->basket.size()) + " legs, buy $" +
+                              std::to_string(buys) + ", sell $" + std::to_string(sells) +
+                              ", net $" + std::to_string(buys - sells) + "\n";
+    if (confirm_msg.length() + legs.length() < BUFFER_SIZE) {
+        confirm_msg += legs;
+    }
     
-    buffer[bytes_received] = '\0';
-    std::string confirmation(buffer);
-    // [Removed debug print of client confirmation]
+    session_send(s, confirm_msg.c_str(), confirm_msg.length() + 1);
+    printf("[Server M] Sent the basket confirmation to the client.\n");
     
+    // Don't hold a backend slot while the member decides
+    session_release_slot(s);
+    s->state = SESSION_BASKET_CONFIRM_WAIT;
+}
+
+void on_basket_confirmation(Session* s, const std::string& confirmation) {
     if (confirmation != "yes" && confirmation != "YES" && confirmation != "y" && confirmation != "Y") {
-        const char* cancel_msg = "Buy transaction cancelled";
-        send(client_sockfd, cancel_msg, strlen(cancel_msg) + 1, 0); 
-        printf("[Server M] Buy denied.\n");
+        const char* cancel_msg = "Basket transaction cancelled";
+        session_send(s, cancel_msg, strlen(cancel_msg) + 1);
+        printf("[Server M] Basket denied.\n");
+        finish_command(s);
         return;
     }
-    printf("[Server M] Buy approved.\n");
+    printf("[Server M] Basket approved.\n");
     
-    // Process the buy with Server P
-    std::string username = client_usernames[client_sockfd];
-    std::string buy_message = "BUY " + username + " " + stock_name + " " + 
-                             std::to_string(num_shares) + " " + std::to_string(current_price);
+    if (!session_acquire_slot(s)) {
+        park_for_backend_slot(s);
+        return;
+    }
+    submit_basket(s);
+}
+
+void submit_basket(Session* s) {
+    if (!backend_request(s, &server_p_addr, basket_portfolio_message(s, "APPLY"))) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to process basket";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the basket to Server P.\n");
+    s->state = SESSION_BASKET_RESULT_WAIT;
+}
+
+// Server P applied every leg or none; only advance prices for a basket that
+// went through, once per leg as a single trade would
+void on_basket_result(Session* s, const char* reply) {
+    s->backend_result = reply;
+    if (strncmp(reply, "BASKET_SUCCESS", 14) != 0) {
+        forward_trade_result(s);
+        return;
+    }
+    std::string advance_message = "ADVANCE";
+    for (size_t i = 0; i < s->basket.size(); i++) {
+        advance_message += " " + s->basket[i].stock_name;
+    }
+    if (!backend_request(s, &server_q_addr, advance_message)) {
+        perror("sendto Server Q (advance)");
+        forward_trade_result(s);
+        return;
+    }
+    printf("[Server M] Sent a batched time forward request for %d stocks.\n", (int)s->basket.size());
+    s->state = SESSION_BASKET_ADVANCE_WAIT;
+}
+
+// BASKET <user> <CHECK|APPLY> <B|S> <stock> <shares> <price> ...
+std::string basket_portfolio_message(Session* s, const char* mode) {
+    std::string message = "BASKET " + s->username + " " + mode;
+    for (size_t i = 0; i < s->basket.size(); i++) {
+        const BasketLeg& leg = s->basket[i];
+        message += std::string(leg.side == TRADE_BUY ? " B " : " S ") + leg.stock_name + " " +
+                   std::to_string(leg.num_shares) + " " + compact_number(leg.price);
+    }
+    return message;
+}
+
+// std::to_string without the trailing zeros, so long batched messages stay
+// within one datagram
+std::string compact_number(double value) {
+    std::string text = std::to_string(value);
+    size_t end = text.find_last_not_of('0');
+    if (end != std::string::npos && text[end] == '.') {
+        end--;
+    }
+    return text.substr(0, end + 1);
+}
+
+void handle_position(Session* s) {
+    if (s->username.empty()) {
+        const char* error_msg = "ERROR: Not authenticated";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        return;
+    }
+    if (!session_acquire_read_slot(s)) {
+        park_for_read_slot(s);
+        return;
+    }
     
-    struct sockaddr_in server_p_addr;
+    printf("[Server M] Received a position request from Member to check %s’s gain using TCP over port %d.\n",
+           s->username.c_str(), SERVER_M_TCP_PORT);
+    
+    // First, get portfolio from Server P, one page at a time
+    s->page_seq = 1;
+    s->page_after.clear();
+    s->total_gain = 0.0;
+    s->position_priced = false;
+    if (!request_portfolio_page(s)) {
+        perror("sendto Server P");
+        const char* error_msg = "ERROR: Failed to get portfolio";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    printf("[Server M] Forwarded the position request to server P.\n");
+}
+
+bool request_portfolio_page(Session* s) {
+    std::string portfolio_message = "PORTFOLIO " + s->username + " " + std::to_string(s->page_seq);
+    if (!s->page_after.empty()) {
+        portfolio_message += " " + s->page_after;
+    }
+    if (!backend_request(s, &server_p_addr, portfolio_message)) {
+        return false;
+    }
+    s->state = SESSION_POSITION_PORTFOLIO_WAIT;
+    return true;
+}
+
+void on_position_portfolio(Session* s, const char* reply) {
+    bool more;
+    std::string gain;
+    const char* lines = parse_page_header(reply, "PORTFOLIO", s->page_seq, &more, &gain);
+    if (lines == NULL) {
+        if (s->page_seq > 1) {
+            finish_position(s);  // end with the holdings already streamed
+            return;
+        }
+        const char* error_msg = "ERROR: Invalid portfolio response";
+        session_send(s, error_msg, strlen(error_msg) + 1);
+        finish_command(s);
+        return;
+    }
+    if (s->page_seq == 1) {
+        printf("[Server M] Received user’s portfolio from server P using UDP over %d\n", SERVER_M_UDP_PORT);
+        
+        // Server P keeps the gain up to date with Server Q's prices; without
+        // it (a holding Server Q never priced), price every holding here
+        if (!gain.empty()) {
+            s->position_priced = true;
+            s->total_gain = strtod(gain.c_str(), NULL);
+        }
+    }
     
-    // Set up address for Server P
-    memset(&server_p_addr, 0, sizeof(server_p_addr));
-    server_p_addr.sin_family = AF_INET;
-    server_p_addr.sin_port = htons(SERVER_P_PORT);
-    server_p_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    // Now for each stock on this page, get current price from Server Q
+    s->portfolio_lines = split_string(lines, '\n');
+    s->position_next = 0;
+    s->page_more = false;
+    if (more) {
+        s->page_after = last_page_key(lines);
+        s->page_seq++;
+        s->page_more = !s->page_after.empty();
+    }
+    if (s->position_priced) {
+        PositionHolding holding;
+        for (size_t i = 0; i < s->portfolio_lines.size(); i++) {
+            if (parse_position_line(s->portfolio_lines[i], &holding)) {
+                send_position_line(s, holding);
+            }
+        }
+        s->position_next = s->portfolio_lines.size();
+    }
+    request_next_position_quote(s);
+}
+
+// "<stock> <shares> <avg_price>", false for a malformed line or no shares
+bool parse_position_line(const std::string& line, PositionHolding* holding) {
+    std::vector<std::string> stock_info = split_string(line, ' ');
+    if (stock_info.size() != 3) {
+        return false;
+    }
+    holding->stock_name = stock_info[0];
+    if (!parse_int(stock_info[1], &holding->shares) || !parse_double(stock_info[2], &holding->avg_price)) {
+        return false;
+    }
+    return holding->shares != 0;
+}
+
+// Price the rest of the current page: from Server Q's shared table when it
+// has the stock, otherwise in one batched QUOTE for as many holdings as the
+// reply has room for. Then ask for the next page, or send the total.
+void request_next_position_quote(Session* s) {
+    while (true) {
+        s->position_batch.clear();
+        size_t reply_bytes = 0;
+        while (s->position_next < s->portfolio_lines.size()) {
+            // Skip malformed lines and holdings with no shares
+            PositionHolding holding;
+            if (!parse_position_line(s->portfolio_lines[s->position_next], &holding)) {
+                s->position_next++;
+                continue;
+            }
+            
+            // Read the price straight from Server Q's table when it publishes one
+            double current_price;
+            if (prices_from_shm && lookup_shared_price(holding.stock_name, &current_price)) {
+                add_position_gain(s, holding, current_price);
+                s->position_next++;
+                continue;
+            }
+            
+            size_t line_bytes = holding.stock_name.length() + QUOTE_LINE_EXTRA;
+            if (!s->position_batch.empty() && reply_bytes + line_bytes > PAGE_MAX_BYTES) {
+                break;
+            }
+            reply_bytes += line_bytes;
+            s->position_batch.push_back(holding);
+            s->position_next++;
+        }
+        
+        if (s->position_batch.empty()) {
+            break;
+        }
+        if (send_position_batch(s)) {
+            return;
+        }
+        perror("sendto Server Q");  // these holdings go unpriced, try the next batch
+    }
     
-    // Send to Server P
-    size_t buy_len = buy_message.length() + 1;
-    char* null_term_buy = new char[buy_len];
-    strcpy(null_term_buy, buy_message.c_str());
-    if (sendto(udp_sockfd, null_term_buy, buy_len, 0,
-              (struct sockaddr *)&server_p_addr, sizeof(server_p_addr)) == -1) {
+    if (s->page_more) {
+        if (request_portfolio_page(s)) {
+            return;
+        }
         perror("sendto Server P");
-        const char* error_msg = "ERROR: Failed to process buy";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0); 
-        delete[] null_term_buy;
+    }
+    finish_position(s);
+}
+
+// Get current prices for the batch from Server Q
+bool send_position_batch(Session* s) {
+    std::string quote_message = "QUOTE";
+    for (size_t i = 0; i < s->position_batch.size(); i++) {
+        quote_message += " " + s->position_batch[i].stock_name;
+    }
+    if (!backend_request(s, &server_q_addr, quote_message)) {
+        return false;
+    }
+    s->state = SESSION_POSITION_QUOTE_WAIT;
+    return true;
+}
+
+void on_position_quote(Session* s, const char* reply) {
+    // One unknown stock fails the whole batch and Server Q names it: price
+    // the others again without it
+    if (strncmp(reply, "ERROR", 5) == 0) {
+        const char* not_found = "ERROR: Stock not found: ";
+        std::string missing = strncmp(reply, not_found, strlen(not_found)) == 0 ? reply + strlen(not_found) : "";
+        std::vector<PositionHolding> rest;
+        for (size_t i = 0; i < s->position_batch.size(); i++) {
+            if (!missing.empty() && s->position_batch[i].stock_name != missing) {
+                rest.push_back(s->position_batch[i]);
+            }
+        }
+        if (rest.size() == s->position_batch.size()) {
+            rest.clear();  // not a stock of this batch, give up on it
+        }
+        s->position_batch.swap(rest);
+        if (s->position_batch.empty() || !send_position_batch(s)) {
+            request_next_position_quote(s);
+        }
         return;
     }
-    printf("[Server M] Forwarded the buy confirmation response to Server P.\n");
-    delete[] null_term_buy;
     
-    // Receive confirmation from Server P
-    from_len = sizeof(from_addr);
+    // One "<stock> <price>" line per holding, in request order
+    std::vector<std::string> quote_lines = split_string(reply, '\n');
+    for (size_t i = 0; i < quote_lines.size() && i < s->position_batch.size(); i++) {
+        std::vector<std::string> quote_parts = split_string(quote_lines[i], ' ');
+        double price = 0.0;
+        if (quote_parts.size() >= 2 && quote_parts[0] == s->position_batch[i].stock_name &&
+            parse_double(quote_parts[1], &price)) {
+            add_position_gain(s, s->position_batch[i], price);
+        }
+    }
+    request_next_position_quote(s);
+}
+
+// Holdings are streamed to the client as they are priced
+void add_position_gain(Session* s, const PositionHolding& holding, double current_price) {
+    double stock_gain = holding.shares * (current_price - holding.avg_price);
+    s->total_gain += stock_gain;
+    send_position_line(s, holding);
+}
+
+void send_position_line(Session* s, const PositionHolding& holding) {
+    // Add to result in required format
+    char line[BUFFER_SIZE];
+    int len = snprintf(line, sizeof(line), "%s %d %.6f\n",
+                       holding.stock_name.c_str(), holding.shares, holding.avg_price);
+    session_send(s, line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+}
+
+// The total line and its '\0' end the streamed response
+void finish_position(Session* s) {
+    char profit_line[100];
+    snprintf(profit_line, sizeof(profit_line), "Total unrealized gain/loss: $%.6f", s->total_gain);
+    session_send(s, profit_line, strlen(profit_line) + 1);
+    printf("[Server M] Forwarded the gain to the client.\n");
+    s->portfolio_lines.clear();
+    s->position_batch.clear();
+    finish_command(s);
+}
+
+// Pick the I/O backend. io_uring falls back to epoll when the kernel (or a
+// seccomp policy) refuses io_uring_setup.
+void io_init(const char* requested) {
+    bool want_uring = strcmp(requested, "uring") == 0;
+    if (!want_uring && strcmp(requested, "epoll") != 0 && strcmp(requested, "classic") != 0) {
+        printf("[Server M] Unknown I/O backend '%s', using epoll.\n", requested);
+    }
+    
+    if (want_uring) {
+        int ret = uring_init(&io_ring, IO_RING_ENTRIES);
+        if (ret == 0) {
+            io_backend = IO_URING;
+            for (int group = IO_CLIENT_GROUP; group <= IO_BACKEND_GROUP; group++) {
+                io_buffer_pools[group] = new char[IO_RECV_BUFFERS * BUFFER_SIZE];
+                for (int bid = 0; bid < IO_RECV_BUFFERS; bid++) {
+                    io_provide_buffer(group, bid);
+                }
+            }
+            for (int i = 0; i < IO_SEND_SLOTS; i++) {
+                io_send_slots[i].busy = false;
+            }
+            io_adopt_socket(tcp_sockfd);
+            io_adopt_socket(udp_sockfd);
+            io_watch_listening();
+            uring_enter(&io_ring, 0, -1);
+            printf("[Server M] Using io_uring I/O backend.\n");
+            return;
+        }
+        printf("[Server M] io_uring unavailable (%s), falling back to epoll.\n", strerror(-ret));
+    }
+    
+    // epoll: everything non-blocking, the loop only touches ready sockets
+    io_backend = IO_EPOLL;
+    io_adopt_socket(tcp_sockfd);
+    io_adopt_socket(udp_sockfd);
+    io_epoll_fd = epoll_create1(0);
+    if (io_epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    io_watch_listening();
+}
+
+// Start accepting clients and reading backend replies
+void io_watch_listening() {
+    if (io_backend == IO_URING) {
+        io_arm_accept();
+        io_arm_backend_recv();
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = IO_TAG(IO_TAG_ACCEPT, 0);
+    if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, tcp_sockfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.u64 = IO_TAG(IO_TAG_BACKEND_RECV, 0);
+    if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, udp_sockfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+// Stop both, once the sockets belong to a new Server M. The io_uring
+// requests end with -ECANCELED and are not re-armed while draining.
+void io_stop_listening() {
+    if (io_backend == IO_URING) {
+        uring_prep_cancel(io_get_sqe(), IO_TAG(IO_TAG_ACCEPT, 0), IO_TAG(IO_TAG_CANCEL, 0));
+        uring_prep_cancel(io_get_sqe(), IO_TAG(IO_TAG_BACKEND_RECV, 0), IO_TAG(IO_TAG_CANCEL, 0));
+        return;
+    }
+    epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, tcp_sockfd, NULL);
+    epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, udp_sockfd, NULL);
+}
+
+// Readiness of an upgrade socket. io_uring polls are one-shot, the handler
+// re-arms them.
+void io_watch_upgrade(int fd, IoTag tag) {
+    if (io_backend == IO_URING) {
+        uring_prep_poll_add(io_get_sqe(), fd, POLLIN, IO_TAG(tag, 0));
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = IO_TAG(tag, 0);
+    if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+}
+
+// epoll needs non-blocking sockets; io_uring waits for blocking ones
+// itself. A socket handed over by a Server M with the other backend
+// arrives with the other mode.
+void io_adopt_socket(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, io_backend == IO_EPOLL ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+// Wait up to timeout_ms (< 0 waits forever) and handle whatever is ready
+void io_run(int timeout_ms) {
+    // Replies due over shared memory: busy-poll for them first, and only
+    // sleep once the rings are parked so a backend reply wakes the loop
+    if (shm_enabled && (shm_poll() > 0 || shm_spin_for_replies() || !shm_park())) {
+        timeout_ms = 0;
+    }
+    
+    if (io_backend == IO_URING) {
+        io_run_uring(timeout_ms);
+    } else {
+        io_run_epoll(timeout_ms);
+    }
+    
+    if (shm_enabled) {
+        shm_unpark();
+        shm_poll();
+    }
+}
+
+void io_run_epoll(int timeout_ms) {
+    struct epoll_event events[IO_MAX_EVENTS];
+    int ready = epoll_wait(io_epoll_fd, events, IO_MAX_EVENTS, timeout_ms);
+    if (ready == -1) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+        }
+        return;
+    }
     
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server P");
-        const char* error_msg = "ERROR: Failed to confirm buy";
-        send(client_sockfd, error_msg, strlen(error_msg) + 1, 0); 
+    char buffer[BUFFER_SIZE];
+    for (int i = 0; i < ready; i++) {
+        unsigned kind = (unsigned)(events[i].data.u64 >> IO_TAG_SHIFT);
+        unsigned index = (unsigned)(events[i].data.u64 & 0xffffffffu);
+        
+        if (kind == IO_TAG_ACCEPT) {
+            // Accepting new TCP connections, Based on Beej's Guide Section 5.2
+            while (1) {
+                struct sockaddr_storage their_addr;
+                socklen_t sin_size = sizeof their_addr;
+                int client_sockfd = accept4(tcp_sockfd, (struct sockaddr *)&their_addr, &sin_size,
+                                            SOCK_NONBLOCK);
+                if (client_sockfd == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("accept");
+                    }
+                    break;
+                }
+                on_accept(client_sockfd);
+            }
+        } else if (kind == IO_TAG_BACKEND_RECV) {
+            while (1) {
+                struct sockaddr_in from_addr;
+                socklen_t from_len = sizeof(from_addr);
+                int bytes = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
+                                     (struct sockaddr *)&from_addr, &from_len);
+                if (bytes == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        perror("recvfrom");
+                    }
+                    break;
+                }
+                on_backend_datagram(buffer, bytes);
+            }
+        } else if (kind == IO_TAG_UPGRADE_LISTEN) {
+            upgrade_on_listener_ready();
+        } else if (kind == IO_TAG_UPGRADE_PEER) {
+            upgrade_on_peer_ready();
+        } else if (kind == IO_TAG_SHM_DOORBELL) {
+            // The replies themselves are picked up by shm_poll()
+            uint64_t count;
+            if (read(shm_eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("read eventfd");
+            }
+        } else if (kind == IO_TAG_CLIENT_RECV) {
+            Session* s = find_session(index);
+            if (s == NULL) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                io_client_writable(s);
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP))) {
+                continue;
+            }
+            while (1) {
+                int bytes = recv(s->fd, buffer, BUFFER_SIZE, 0);
+                if (bytes > 0) {
+                    on_client_data(s, buffer, bytes);
+                    continue;
+                }
+                if (bytes == 0) {
+                    on_client_closed(s, 0);
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    on_client_closed(s, errno);
+                }
+                break;
+            }
+        }
+    }
+}
+
+void io_run_uring(int timeout_ms) {
+    int ret = uring_enter(&io_ring, 1, timeout_ms);
+    if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+        errno = -ret;
+        perror("io_uring_enter");
         return;
     }
-    
-    buffer[bytes_received] = '\0';
-    // [Removed debug print of buy confirmation from Server P]
-    
-    // Advance stock price in Server Q
-    std::string advance_message = "ADVANCE " + stock_name;
-    
-    size_t adv_len = advance_message.length() + 1;
-    char* null_term_adv = new char[adv_len];
-    strcpy(null_term_adv, advance_message.c_str());
-    
-    if (sendto(udp_sockfd, null_term_adv, adv_len, 0,
-              (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
-        perror("sendto Server Q (advance)");
+    
+    struct io_uring_cqe cqe;
+    while (uring_pop_cqe(&io_ring, &cqe)) {
+        unsigned kind = (unsigned)(cqe.user_data >> IO_TAG_SHIFT);
+        unsigned index = (unsigned)(cqe.user_data & 0xffffffffu);
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        int bid = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+        
+        if (kind == IO_TAG_ACCEPT) {
+            if (cqe.res >= 0) {
+                on_accept(cqe.res);
+            } else if (cqe.res == -EINVAL && io_multishot_accept) {
+                // Kernel predates multishot accept, re-arm one accept at a time
+                io_multishot_accept = false;
+            } else if (cqe.res != -ECANCELED) {
+                errno = -cqe.res;
+                perror("accept");
+            }
+            if (!more && !draining) {
+                io_arm_accept();
+            }
+        } else if (kind == IO_TAG_BACKEND_RECV) {
+            if (cqe.res > 0 && bid >= 0) {
+                on_backend_datagram(io_buffer_pools[IO_BACKEND_GROUP] + bid * BUFFER_SIZE, cqe.res);
+            } else if (cqe.res == -EINVAL && io_multishot_recv) {
+                io_multishot_recv = false;
+            } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+                errno = -cqe.res;
+                perror("recvfrom");
+            }
+            if (bid >= 0) {
+                io_provide_buffer(IO_BACKEND_GROUP, bid);
+            }
+            if (!more && !draining) {
+                io_arm_backend_recv();
+            }
+        } else if (kind == IO_TAG_CLIENT_RECV) {
+            // The session may be gone already, the buffer still goes back
+            Session* s = find_session(index);
+            if (s != NULL) {
+                if (cqe.res > 0 && bid >= 0) {
+                    on_client_data(s, io_buffer_pools[IO_CLIENT_GROUP] + bid * BUFFER_SIZE, cqe.res);
+                    if (!more && s->migrating) {
+                        upgrade_recv_cancelled(s);
+                    } else if (!more) {
+                        io_arm_client_recv(s);
+                    }
+                } else if (s->migrating && (cqe.res == -ECANCELED || cqe.res == -ENOBUFS)) {
+                    upgrade_recv_cancelled(s);
+                } else if (cqe.res == -ENOBUFS || (cqe.res == -EINVAL && io_multishot_recv)) {
+                    // Out of provided buffers (they come back with this submission),
+                    // or a kernel without multishot recv
+                    if (cqe.res == -EINVAL) {
+                        io_multishot_recv = false;
+                    }
+                    io_arm_client_recv(s);
+                } else if (cqe.res <= 0) {
+                    on_client_closed(s, -cqe.res);
+                }
+            }
+            if (bid >= 0) {
+                io_provide_buffer(IO_CLIENT_GROUP, bid);
+            }
+        } else if (kind == IO_TAG_CLIENT_SEND) {
+            if (index >= io_client_sends.size() || io_client_sends[index].session_id == 0) {
+                continue;
+            }
+            IoClientSend& pending = io_client_sends[index];
+            Session* s = find_session(pending.session_id);
+            if (cqe.res < 0) {
+                if (s != NULL) {
+                    errno = -cqe.res;
+                    perror("send");
+                    s->outbuf.clear();
+                    shutdown(s->fd, SHUT_RDWR);
+                }
+            } else {
+                pending.offset += cqe.res;
+                if (s != NULL && pending.offset < pending.data.size()) {
+                    // Short send, push the rest ahead of anything queued since
+                    s->outbuf.insert(0, pending.data, pending.offset, std::string::npos);
+                }
+            }
+            pending.session_id = 0;
+            pending.data.clear();
+            io_free_client_sends.push_back(index);
+            if (s != NULL) {
+                s->send_in_flight = false;
+                io_flush_client(s);
+            }
+        } else if (kind == IO_TAG_BACKEND_SEND) {
+            if (index < IO_SEND_SLOTS) {
+                io_send_slots[index].busy = false;
+            }
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                perror("sendto");
+            }
+        } else if (kind == IO_TAG_SHM_DOORBELL) {
+            io_arm_shm_doorbell();
+        } else if (kind == IO_TAG_UPGRADE_LISTEN) {
+            int fd = upgrade_listen_fd;
+            upgrade_on_listener_ready();
+            if (fd != -1 && upgrade_listen_fd == fd) {
+                io_watch_upgrade(fd, IO_TAG_UPGRADE_LISTEN);
+            }
+        } else if (kind == IO_TAG_UPGRADE_PEER) {
+            int fd = upgrade_peer_fd;
+            upgrade_on_peer_ready();
+            if (fd != -1 && upgrade_peer_fd == fd) {
+                io_watch_upgrade(fd, IO_TAG_UPGRADE_PEER);
+            }
+        } else if (kind == IO_TAG_PROVIDE && cqe.res < 0) {
+            fprintf(stderr, "provide buffers: %s\n", strerror(-cqe.res));
+        }
+    }
+}
+
+// Next free SQE, flushing the submission queue first if it is full
+struct io_uring_sqe* io_get_sqe() {
+    struct io_uring_sqe* sqe = uring_get_sqe(&io_ring);
+    if (sqe == NULL) {
+        uring_enter(&io_ring, 0, -1);
+        sqe = uring_get_sqe(&io_ring);
+    }
+    return sqe;
+}
+
+// The kernel gets one byte less than the buffer, the room on_backend_datagram()
+// needs to end the datagram
+void io_provide_buffer(int group, int bid) {
+    struct io_uring_sqe* sqe = io_get_sqe();
+    uring_prep_provide_buffers(sqe, io_buffer_pools[group] + bid * BUFFER_SIZE, BUFFER_SIZE - 1, 1,
+                               group, bid, IO_TAG(IO_TAG_PROVIDE, group));
+}
+
+void io_arm_accept() {
+    struct io_uring_sqe* sqe = io_get_sqe();
+    if (io_multishot_accept) {
+        uring_prep_multishot_accept(sqe, tcp_sockfd, IO_TAG(IO_TAG_ACCEPT, 0));
+    } else {
+        uring_prep_accept(sqe, tcp_sockfd, IO_TAG(IO_TAG_ACCEPT, 0));
+    }
+}
+
+void io_arm_client_recv(Session* s) {
+    struct io_uring_sqe* sqe = io_get_sqe();
+    if (io_multishot_recv) {
+        uring_prep_recv_multishot(sqe, s->fd, IO_CLIENT_GROUP, IO_TAG(IO_TAG_CLIENT_RECV, s->id));
     } else {
-        printf("[Server M] Sent a time forward request for %s.\n", stock_name.c_str());
-        // Clear any incoming response
-        from_len = sizeof(from_addr);
-        recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&from_addr, &from_len);
+        uring_prep_recv_select(sqe, s->fd, BUFFER_SIZE, IO_CLIENT_GROUP, IO_TAG(IO_TAG_CLIENT_RECV, s->id));
     }
-    delete[] null_term_adv;
-    
-    // Forward Server P's response to client with null terminator
-    size_t resp_len = strlen(buffer) + 1; 
-    char* null_term_resp = new char[resp_len];
-    strcpy(null_term_resp, buffer);
-    
-    int send_res_final = send(client_sockfd, null_term_resp, resp_len, 0);
-    if (send_res_final == -1) {
-        perror("send buy result to client");
+}
+
+void io_arm_backend_recv() {
+    struct io_uring_sqe* sqe = io_get_sqe();
+    if (io_multishot_recv) {
+        uring_prep_recv_multishot(sqe, udp_sockfd, IO_BACKEND_GROUP, IO_TAG(IO_TAG_BACKEND_RECV, 0));
     } else {
-        printf("[Server M] Forwarded the buy result to the client.\n");
+        uring_prep_recv_select(sqe, udp_sockfd, BUFFER_SIZE, IO_BACKEND_GROUP,
+                               IO_TAG(IO_TAG_BACKEND_RECV, 0));
     }
-    delete[] null_term_resp;
 }
 
-void handle_sell(int client_sockfd, const std::string& stock_name, int num_shares) {
-    if (client_usernames.find(client_sockfd) == client_usernames.end()) {
-        const char* error_msg = "ERROR: Not authenticated";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+// io_uring: read the doorbell eventfd, completing whenever a waker thread writes it
+void io_arm_shm_doorbell() {
+    uring_prep_rw(io_get_sqe(), IORING_OP_READ, shm_eventfd, &shm_eventfd_value,
+                  sizeof(shm_eventfd_value), 0, IO_TAG(IO_TAG_SHM_DOORBELL, 0));
+}
+
+void io_watch_client(Session* s) {
+    if (io_backend == IO_URING) {
+        io_arm_client_recv(s);
         return;
     }
-    
-    struct sockaddr_in server_q_addr, server_p_addr;
-    char buffer[BUFFER_SIZE];
-    
-    printf("[Server M] Received a sell request from member %s using TCP over port %d.\n",
-           client_usernames[client_sockfd].c_str(), SERVER_M_TCP_PORT);
-    
-    std::string quote_message = "QUOTE " + stock_name;
-    
-    // Set up address for Server Q
-    memset(&server_q_addr, 0, sizeof(server_q_addr));
-    server_q_addr.sin_family = AF_INET;
-    server_q_addr.sin_port = htons(SERVER_Q_PORT);
-    server_q_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Send to Server Q
-    if (sendto(udp_sockfd, quote_message.c_str(), quote_message.length(), 0,
-              (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
-        perror("sendto Server Q");
-        const char* error_msg = "ERROR: Failed to get quote for sell";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = IO_TAG(IO_TAG_CLIENT_RECV, s->id);
+    if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+        perror("epoll_ctl");
     }
-    printf("[Server M] Sent the quote request to server Q.\n");
-    
-    // Receive quote from Server Q
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int bytes_received;
-    
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server Q");
-        const char* error_msg = "ERROR: Failed to get quote for sell";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+}
+
+void io_forget_client(Session* s) {
+    if (io_backend == IO_URING) {
+        // In-flight operations keep the socket open past close(), shut it down
+        // so they complete and the client sees the connection end
+        shutdown(s->fd, SHUT_RDWR);
         return;
     }
-    printf("[Server M] Received quote response from server Q.\n");
-    
-    // buffer[bytes_received] = '\0';
-    // printf("[Server M] Received quote response from Server Q: %s\n", buffer);
-    
-    // // If stock doesn't exist or error
-    // if (strncmp(buffer, "ERROR", 5) == 0) {
-    //     send(client_sockfd, buffer, bytes_received, 0);
-    //     return;
-    // }
+    epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+}
 
-    buffer[bytes_received] = '\0';
-    
-    // stock doesn't exist or Error
-    if (strncmp(buffer, "ERROR", 5) == 0) {
-        send(client_sockfd, buffer, strlen(buffer) + 1, 0);
+// Hand the session's pending output to the kernel. epoll writes what the
+// socket takes and waits for EPOLLOUT for the rest; io_uring keeps one send
+// per session in flight.
+void io_flush_client(Session* s) {
+    if (s->outbuf.empty() || s->send_in_flight) {
         return;
     }
     
-    // Parse the price from Server Q's response
-    std::string response(buffer);
-    std::vector<std::string> parts = split_string(response, ' ');
-    
-    if (parts.size() < 2) {
-        const char* error_msg = "ERROR: Invalid quote response";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+    if (io_backend == IO_URING) {
+        if (io_free_client_sends.empty()) {
+            io_free_client_sends.push_back(io_client_sends.size());
+            io_client_sends.push_back(IoClientSend());
+        }
+        unsigned send_id = io_free_client_sends.back();
+        io_free_client_sends.pop_back();
+        IoClientSend& pending = io_client_sends[send_id];
+        pending.session_id = s->id;
+        pending.data.swap(s->outbuf);   // s->outbuf gets the slot's empty buffer
+        pending.offset = 0;
+        struct io_uring_sqe* sqe = io_get_sqe();
+        uring_prep_send(sqe, s->fd, pending.data.data(), pending.data.size(), MSG_NOSIGNAL,
+                        IO_TAG(IO_TAG_CLIENT_SEND, send_id));
+        s->send_in_flight = true;
         return;
     }
     
-    double current_price = std::stod(parts[1]);
-    
-    // check if user has enough shares with Server P
-    std::string username = client_usernames[client_sockfd];
-    std::string check_message = "CHECK " + username + " " + stock_name + " " + std::to_string(num_shares);
-    
-    // Set up address for Server P
-    memset(&server_p_addr, 0, sizeof(server_p_addr));
-    server_p_addr.sin_family = AF_INET;
-    server_p_addr.sin_port = htons(SERVER_P_PORT);
-    server_p_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Send to Server P
-    if (sendto(udp_sockfd, check_message.c_str(), check_message.length(), 0,
-              (struct sockaddr *)&server_p_addr, sizeof(server_p_addr)) == -1) {
-        perror("sendto Server P");
-        const char* error_msg = "ERROR: Failed to check shares";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+    while (!s->outbuf.empty()) {
+        int sent = send(s->fd, s->outbuf.data(), s->outbuf.size(), MSG_NOSIGNAL);
+        if (sent > 0) {
+            s->outbuf.erase(0, sent);
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+            ev.data.u64 = IO_TAG(IO_TAG_CLIENT_RECV, s->id);
+            epoll_ctl(io_epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+            s->send_in_flight = true;
+            return;
+        }
+        // The client is gone; the read side notices and closes the session
+        perror("send");
+        s->outbuf.clear();
+        shutdown(s->fd, SHUT_RDWR);
+        break;
     }
-    printf("[Server M] Forwarded the sell request to server P.\n");
-    
-    // Receive response from Server P
-    from_len = sizeof(from_addr);
-    
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server P");
-        const char* error_msg = "ERROR: Failed to check shares";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+}
+
+// Called from the EPOLLOUT path once the socket drained
+void io_client_writable(Session* s) {
+    s->send_in_flight = false;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = IO_TAG(IO_TAG_CLIENT_RECV, s->id);
+    epoll_ctl(io_epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+    io_flush_client(s);
+}
+
+// Backend datagram. It goes over a backend's shared-memory ring when there is
+// one. With io_uring it is copied into a send slot and goes out with the next
+// io_uring_enter(); when every slot is taken it is sent directly.
+int io_send_datagram(const struct sockaddr_in* addr, const char* data, size_t len) {
+    if (shm_enabled && shm_send(addr, data, len)) {
+        return (int)len;
+    }
+    if (io_backend == IO_URING && len <= BUFFER_SIZE) {
+        for (int i = 0; i < IO_SEND_SLOTS; i++) {
+            IoSendSlot& slot = io_send_slots[i];
+            if (slot.busy) {
+                continue;
+            }
+            slot.busy = true;
+            memcpy(slot.data, data, len);
+            slot.addr = *addr;
+            slot.iov.iov_base = slot.data;
+            slot.iov.iov_len = len;
+            memset(&slot.msg, 0, sizeof(slot.msg));
+            slot.msg.msg_name = &slot.addr;
+            slot.msg.msg_namelen = sizeof(slot.addr);
+            slot.msg.msg_iov = &slot.iov;
+            slot.msg.msg_iovlen = 1;
+            uring_prep_sendmsg(io_get_sqe(), udp_sockfd, &slot.msg, IO_TAG(IO_TAG_BACKEND_SEND, i));
+            return (int)len;
+        }
+    }
+    return sendto(udp_sockfd, data, len, 0, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+// Shared memory only helps when the backends are on this host; elsewhere UDP
+// stays the only path
+void shm_init() {
+    if (strncmp(SERVER_IP, "127.", 4) != 0) {
+        printf("[Server M] Backends are not local, using UDP only.\n");
         return;
     }
     
-    buffer[bytes_received] = '\0';
-    
-    // If not enough shares
-    if (strcmp(buffer, "INSUFFICIENT_SHARES") == 0) {
-        const char* error_msg = "ERROR: You do not have enough shares to sell";
-        size_t error_len = strlen(error_msg) + 1;
-        char* null_term_error = new char[error_len];
-        strcpy(null_term_error, error_msg);
-        int send_res = send(client_sockfd, null_term_error, error_len, 0);
-        delete[] null_term_error;
+    shm_eventfd = eventfd(0, EFD_CLOEXEC | (io_backend == IO_EPOLL ? EFD_NONBLOCK : 0));
+    if (shm_eventfd == -1) {
+        perror("eventfd");
         return;
     }
-    
-    // Ask client for confirmation
-    double total_value = current_price * num_shares;
-    std::string confirm_msg = "SELL CONFIRM: " + stock_name + " " + 
-                             std::to_string(num_shares) + " shares at $" + 
-                             std::to_string(current_price) + " = $" + 
-                             std::to_string(total_value);
-    
-    size_t msg_len = confirm_msg.length() + 1;
-    char* null_term_msg = new char[msg_len];
-    strcpy(null_term_msg, confirm_msg.c_str());
-    
-    int send_res = send(client_sockfd, null_term_msg, msg_len, 0);
-    if (send_res == -1) {
-        perror("send sell confirmation to client");
+    if (io_backend == IO_URING) {
+        io_arm_shm_doorbell();
     } else {
-        printf("[Server M] Forwarded the sell confirmation to the client.\n");
-    }
-    delete[] null_term_msg;
-    
-    // Get client confirmation
-    if ((bytes_received = recv(client_sockfd, buffer, BUFFER_SIZE - 1, 0)) <= 0) {
-        if (bytes_received == 0) {
-            printf("[Server M] Client disconnected during sell confirmation\n");
-        } else {
-            perror("recv confirmation");
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = IO_TAG(IO_TAG_SHM_DOORBELL, 0);
+        if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, shm_eventfd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(shm_eventfd);
+            return;
         }
-        return;
     }
     
-    buffer[bytes_received] = '\0';
-    std::string confirmation(buffer);
-    // [Removed debug print of client confirmation]
-    
-    if (confirmation != "yes" && confirmation != "YES" && confirmation != "y" && confirmation != "Y") {
-        const char* cancel_msg = "Sell transaction cancelled";
-        size_t msg_len = strlen(cancel_msg) + 1; 
-        char* null_term_msg = new char[msg_len];
-        strcpy(null_term_msg, cancel_msg);
-        // Forward denial to Server P so it can log “Sell denied.”
-        sendto(udp_sockfd, "N", 1, 0,
-               (struct sockaddr *)&server_p_addr, sizeof(server_p_addr));
-        int send_res = send(client_sockfd, null_term_msg, msg_len, 0);
-        printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
-        delete[] null_term_msg;
-        return;
+    const char* names[3] = { SHM_NAME_A, SHM_NAME_P, SHM_NAME_Q };
+    const char* labels[3] = { "A", "P", "Q" };
+    const struct sockaddr_in* addrs[3] = { &server_a_addr, &server_p_addr, &server_q_addr };
+    for (int i = 0; i < 3; i++) {
+        shm_peers[i].name = names[i];
+        shm_peers[i].label = labels[i];
+        shm_peers[i].addr = addrs[i];
+        shm_peers[i].channel = NULL;
+        shm_peers[i].inflight = 0;
+        shm_peers[i].next_attach_ns = 0;
     }
-    
-    // Process the sell with Server P
-    std::string sell_message = "SELL " + username + " " + stock_name + " " + 
-                              std::to_string(num_shares) + " " + std::to_string(current_price);
-    
-    // Send to Server P 
-    size_t sell_len = sell_message.length() + 1;
-    char* null_term_sell = new char[sell_len];
-    strcpy(null_term_sell, sell_message.c_str());
-    if (sendto(udp_sockfd, null_term_sell, sell_len, 0,
-              (struct sockaddr *)&server_p_addr, sizeof(server_p_addr)) == -1) {
-        perror("sendto Server P");
-        const char* error_msg = "ERROR: Failed to process sell";
-        size_t error_len = strlen(error_msg) + 1;
-        char* null_term_error = new char[error_len];
-        strcpy(null_term_error, error_msg);
-        send(client_sockfd, null_term_error, error_len, 0);
-        delete[] null_term_error;
-        delete[] null_term_sell;
-        return;
+    shm_spin_init(&shm_spin);
+    shm_enabled = true;
+    printf("[Server M] Shared memory transport enabled for co-located backends.\n");
+}
+
+// Map the backend's channel if it publishes one. Failed attempts are retried
+// at most every SHM_ATTACH_RETRY_MS, so a UDP-only backend costs one
+// shm_open() per interval.
+bool shm_attach(ShmPeer* peer) {
+    long long now = monotonic_ns();
+    if (now < peer->next_attach_ns) {
+        return false;
     }
-    printf("[Server M] Forwarded the sell confirmation response to Server P.\n");
-    delete[] null_term_sell;
-    
-    // Receive confirmation from Server P
-    from_len = sizeof(from_addr);
-    
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server P");
-        const char* error_msg = "ERROR: Failed to confirm sell";
-        
-        size_t error_len = strlen(error_msg) + 1;
-        char* null_term_error = new char[error_len];
-        strcpy(null_term_error, error_msg);
-        
-        send(client_sockfd, null_term_error, error_len, 0);
-        delete[] null_term_error;
-        return;
+    // The ring has one reader: leave it to a Server M we are replacing
+    if (upgrade_peer_fd != -1 && !draining) {
+        return false;
     }
+    peer->next_attach_ns = now + (long long)SHM_ATTACH_RETRY_MS * 1000000LL;
     
-    buffer[bytes_received] = '\0';
-    
-    // Advance stock price in Server Q
-    std::string advance_message = "ADVANCE " + stock_name;
-    
-    size_t advance_len = advance_message.length() + 1;
-    char* null_term_advance = new char[advance_len];
-    strcpy(null_term_advance, advance_message.c_str());
-    
-    if (sendto(udp_sockfd, null_term_advance, advance_len, 0,
-              (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
-        perror("sendto Server Q (advance)");
-    } else {
-        printf("[Server M] Sent a time forward request for %s.\n", stock_name.c_str());
-        // Clear any incoming response
-        from_len = sizeof(from_addr);
-        recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&from_addr, &from_len);
+    int fd;
+    ShmChannel* channel = shm_channel_open(peer->name, &fd);
+    if (channel == NULL) {
+        return false;
     }
-    delete[] null_term_advance;
-    
-    // Forward Server P's response to client
-    size_t resp_len = strlen(buffer) + 1; 
-    char* null_term_resp = new char[resp_len];
-    strcpy(null_term_resp, buffer);
-    
-    int send_res_final = send(client_sockfd, null_term_resp, resp_len, 0);
-    if (send_res_final == -1) {
-        perror("send sell result to client");
-    } else {
-        printf("[Server M] Forwarded the sell result to the client.\n");
+    // Replies left over from an earlier Server M are of no use to us
+    channel->replies.head.store(channel->replies.tail.load());
+    
+    ShmWaker* waker_state = new ShmWaker();
+    waker_state->channel = channel;
+    waker_state->fd = fd;
+    waker_state->wake_fd = shm_eventfd;
+    pthread_t waker;
+    if (pthread_create(&waker, NULL, shm_waker, waker_state) != 0) {
+        fprintf(stderr, "[Server M] Failed to start the shared memory waker for Server %s\n", peer->label);
+        delete waker_state;
+        munmap(channel, sizeof(ShmChannel));
+        close(fd);
+        return false;
     }
-    delete[] null_term_resp;
+    pthread_detach(waker);
+    
+    peer->channel = channel;
+    peer->inflight = 0;
+    printf("[Server M] Using shared memory to reach Server %s.\n", peer->label);
+    return true;
 }
 
+// The backend went away. Its mapping stays, the waker thread still reads it.
+void shm_detach(ShmPeer* peer) {
+    printf("[Server M] Server %s left shared memory, using UDP.\n", peer->label);
+    peer->channel = NULL;
+    peer->inflight = 0;
+    peer->next_attach_ns = monotonic_ns() + (long long)SHM_ATTACH_RETRY_MS * 1000000LL;
+}
 
-void handle_position(int client_sockfd) {
-    if (client_usernames.find(client_sockfd) == client_usernames.end()) {
-        const char* error_msg = "ERROR: Not authenticated";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+// Put a backend message on the backend's request ring. false means use UDP.
+bool shm_send(const struct sockaddr_in* addr, const char* data, size_t len) {
+    for (int i = 0; i < 3; i++) {
+        ShmPeer* peer = &shm_peers[i];
+        if (peer->addr->sin_port != addr->sin_port) {
+            continue;
+        }
+        if (peer->channel != NULL && !peer->channel->alive.load()) {
+            shm_detach(peer);
+        }
+        if (peer->channel == NULL && !shm_attach(peer)) {
+            return false;
+        }
+        if (!shm_ring_push(&peer->channel->requests, data, len)) {
+            return false;
+        }
+        if (len > 0 && data[0] == '#') {
+            peer->inflight++;
+        }
+        return true;
     }
-    
-    struct sockaddr_in server_p_addr, server_q_addr;
+    return false;
+}
+
+// Deliver every reply waiting in the rings, returns how many there were
+int shm_poll() {
     char buffer[BUFFER_SIZE];
-    
-    std::string username = client_usernames[client_sockfd];
-    printf("[Server M] Received a position request from Member to check %s’s gain using TCP over port %d.\n",
-           username.c_str(), SERVER_M_TCP_PORT);
-    
-    // First, get portfolio from Server P
-    std::string portfolio_message = "PORTFOLIO " + username;
-    
-    // Set up address for Server P
-    memset(&server_p_addr, 0, sizeof(server_p_addr));
-    server_p_addr.sin_family = AF_INET;
-    server_p_addr.sin_port = htons(SERVER_P_PORT);
-    server_p_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    // Send to Server P
-    if (sendto(udp_sockfd, portfolio_message.c_str(), portfolio_message.length(), 0,
-              (struct sockaddr *)&server_p_addr, sizeof(server_p_addr)) == -1) {
-        perror("sendto Server P");
-        const char* error_msg = "ERROR: Failed to get portfolio";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
-        return;
+    int delivered = 0;
+    for (int i = 0; i < 3; i++) {
+        ShmPeer* peer = &shm_peers[i];
+        if (peer->channel == NULL) {
+            continue;
+        }
+        int len;
+        while (peer->channel != NULL &&
+               (len = shm_ring_pop(&peer->channel->replies, buffer, BUFFER_SIZE - 1)) >= 0) {
+            if (peer->inflight > 0) {
+                peer->inflight--;
+            }
+            on_backend_datagram(buffer, len);
+            delivered++;
+        }
+        if (peer->channel != NULL && !peer->channel->alive.load()) {
+            shm_detach(peer);
+        }
+    }
+    return delivered;
+}
+
+// Adaptive busy-poll, only while some backend owes us a reply over shm
+bool shm_spin_for_replies() {
+    ShmRing* rings[3];
+    int count = 0;
+    bool waiting = false;
+    for (int i = 0; i < 3; i++) {
+        if (shm_peers[i].channel != NULL) {
+            rings[count++] = &shm_peers[i].channel->replies;
+            waiting = waiting || shm_peers[i].inflight > 0;
+        }
+    }
+    return waiting && shm_spin_until_any(rings, count, &shm_spin);
+}
+
+// Mark the reply rings parked before the loop sleeps. Returns false (and
+// unparks) if a reply slipped in meanwhile.
+bool shm_park() {
+    bool empty = true;
+    for (int i = 0; i < 3; i++) {
+        if (shm_peers[i].channel != NULL) {
+            shm_ring_park(&shm_peers[i].channel->replies);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (shm_peers[i].channel != NULL && !shm_ring_empty(&shm_peers[i].channel->replies)) {
+            empty = false;
+        }
+    }
+    if (!empty) {
+        shm_unpark();
+    }
+    return empty;
+}
+
+void shm_unpark() {
+    for (int i = 0; i < 3; i++) {
+        if (shm_peers[i].channel != NULL) {
+            shm_ring_unpark(&shm_peers[i].channel->replies);
+        }
+    }
+}
+
+// One per attached backend: turns the futex doorbell of its reply ring into
+// an eventfd write, which epoll/io_uring can wait on. It also checks once a
+// second that the backend is still running.
+void* shm_waker(void* arg) {
+    ShmWaker* waker_state = (ShmWaker*)arg;
+    ShmChannel* channel = waker_state->channel;
+    uint32_t seen = channel->replies.doorbell.load();
+    while (channel->alive.load()) {
+        shm_futex_wait(&channel->replies.doorbell, seen, 1000);
+        uint32_t now = channel->replies.doorbell.load();
+        if (!shm_owner_running(waker_state->fd)) {
+            // Let the loop notice and fall back to UDP
+            channel->alive.store(0);
+            now = seen + 1;
+        }
+        if (now != seen) {
+            seen = now;
+            uint64_t one = 1;
+            if (write(waker_state->wake_fd, &one, sizeof(one)) == -1) {
+                perror("write eventfd");
+            }
+        }
+    }
+    close(waker_state->fd);
+    delete waker_state;
+    return NULL;
+}
+
+// Current price from Server Q's shared price table, no syscall and no message
+// to Server Q. Whether the table (still) has a live writer is checked at most
+// every SHM_ATTACH_RETRY_MS; false means ask Server Q instead.
+bool lookup_shared_price(const std::string& stock_name, double* price) {
+    long long now = monotonic_ns();
+    if (now >= price_table_next_check_ns) {
+        price_table_next_check_ns = now + (long long)SHM_ATTACH_RETRY_MS * 1000000LL;
+        if (price_table != NULL && !shm_owner_running(price_table_fd)) {
+            price_table_close(price_table, price_table_fd);
+            price_table = NULL;
+            printf("[Server M] Server Q stopped publishing prices, asking it directly.\n");
+        }
+        if (price_table == NULL) {
+            price_table = price_table_open(&price_table_fd);
+            if (price_table != NULL) {
+                printf("[Server M] Reading prices from Server Q's shared price table.\n");
+            }
+        }
+    }
+    if (price_table == NULL) {
+        return false;
     }
-    printf("[Server M] Forwarded the position request to server P.\n");
-    
-    // Receive portfolio from Server P
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int bytes_received;
     
-    if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                  (struct sockaddr *)&from_addr, &from_len)) == -1) {
-        perror("recvfrom Server P");
-        const char* error_msg = "ERROR: Failed to get portfolio";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+    int slot = price_table_find(price_table, stock_name);
+    PriceSnapshot snapshot;
+    if (slot == -1 || !price_table_read(price_table, slot, &snapshot)) {
+        return false;
+    }
+    *price = snapshot.price;
+    return true;
+}
+
+// --upgrade: get the TCP listener and UDP socket from the running Server M.
+// It keeps the connection open while it drains and sends its sessions over it.
+void upgrade_take_over() {
+    int fd = upgrade_connect(UPGRADE_SOCKET_PATH);
+    if (fd == -1) {
+        perror(UPGRADE_SOCKET_PATH);
+        fprintf(stderr, "[Server M] No running Server M to take over from\n");
+        exit(1);
+    }
+    UpgradeRecord* record = new UpgradeRecord();
+    if (upgrade_recv(fd, record, 0) != 1 || record->kind != UPGRADE_LISTENERS || record->fd_count != 2) {
+        fprintf(stderr, "[Server M] The running Server M did not hand over its sockets "
+                        "(is it still finishing an earlier upgrade?)\n");
+        exit(1);
+    }
+    record->payload[record->len < sizeof(record->payload) ? record->len : sizeof(record->payload) - 1] = '\0';
+    tcp_sockfd = record->fds[0];
+    udp_sockfd = record->fds[1];
+    upgrade_split_id = (unsigned)strtoul(record->payload, NULL, 10);
+    next_request_id = upgrade_split_id;
+    upgrade_peer_fd = fd;
+    delete record;
+    printf("[Server M] Took over the listening sockets from the running Server M.\n");
+}
+
+// Listen for the next upgrade, and for the sessions of the Server M we replaced
+void upgrade_init() {
+    upgrade_listen_fd = upgrade_listen(UPGRADE_SOCKET_PATH);
+    if (upgrade_listen_fd == -1) {
+        perror(UPGRADE_SOCKET_PATH);
+        printf("[Server M] Graceful upgrades are unavailable.\n");
+    } else {
+        io_watch_upgrade(upgrade_listen_fd, IO_TAG_UPGRADE_LISTEN);
+    }
+    if (upgrade_peer_fd != -1) {
+        io_watch_upgrade(upgrade_peer_fd, IO_TAG_UPGRADE_PEER);
+    }
+}
+
+// A new Server M connected. One upgrade at a time: a process that is still
+// taking sessions from its predecessor, or handing them on, refuses.
+void upgrade_on_listener_ready() {
+    int fd = accept4(upgrade_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept upgrade");
+        }
         return;
     }
-    printf("[Server M] Received user’s portfolio from server P using UDP over %d\n", SERVER_M_UDP_PORT);
-    buffer[bytes_received] = '\0';
-    std::string portfolio(buffer);
-    // Now for each stock in portfolio, get current price from Server Q
-    std::vector<std::string> portfolio_lines = split_string(portfolio, '\n');
-    if (portfolio_lines.empty()) {
-        const char* error_msg = "ERROR: Empty portfolio response";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+    if (draining || upgrade_peer_fd != -1) {
+        printf("[Server M] Refused an upgrade, the previous one is still in progress.\n");
+        close(fd);
         return;
     }
-    if (portfolio_lines[0] != "PORTFOLIO") {
-        const char* error_msg = "ERROR: Invalid portfolio response";
-        send(client_sockfd, error_msg, strlen(error_msg), 0);
+    upgrade_start_drain(fd);
+}
+
+// Hand the sockets over and stop using them for anything but sends
+void upgrade_start_drain(int peer_fd) {
+    unsigned split_id = next_request_id + UPGRADE_REQUEST_ID_GAP;
+    char payload[16];
+    int len = snprintf(payload, sizeof(payload), "%u", split_id);
+    int fds[2] = { tcp_sockfd, udp_sockfd };
+    if (!upgrade_send(peer_fd, UPGRADE_LISTENERS, payload, len, fds, 2)) {
+        perror("sendmsg upgrade");
+        close(peer_fd);
         return;
     }
-    
-    // Set up address for Server Q
-    memset(&server_q_addr, 0, sizeof(server_q_addr));
-    server_q_addr.sin_family = AF_INET;
-    server_q_addr.sin_port = htons(SERVER_Q_PORT);
-    server_q_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    
-    std::string result;
-    double total_gain = 0.0;
-    
-    for (size_t i = 1; i < portfolio_lines.size(); i++) {
-        std::vector<std::string> stock_info = split_string(portfolio_lines[i], ' ');
-        
-        if (stock_info.size() != 3) {
-            continue;
+    draining = true;
+    drain_deadline_ns = monotonic_ns() + UPGRADE_DRAIN_SECONDS * 1000000000LL;
+    upgrade_split_id = split_id;
+    upgrade_peer_fd = peer_fd;
+    io_stop_listening();
+    close(upgrade_listen_fd);
+    upgrade_listen_fd = -1;
+    io_watch_upgrade(upgrade_peer_fd, IO_TAG_UPGRADE_PEER);
+    printf("[Server M] Handed the listening sockets to a new Server M, draining %d sessions.\n",
+           (int)sessions.size());
+    upgrade_hand_over_sessions();
+}
+
+// The new Server M went away before we finished: take the sockets back
+void upgrade_abort() {
+    printf("[Server M] The new Server M went away, listening again.\n");
+    close(upgrade_peer_fd);
+    upgrade_peer_fd = -1;
+    draining = false;
+    io_watch_listening();
+    upgrade_init();
+}
+
+// Records from the other Server M
+void upgrade_on_peer_ready() {
+    UpgradeRecord* record = new UpgradeRecord();
+    while (upgrade_peer_fd != -1) {
+        int ret = upgrade_recv(upgrade_peer_fd, record, MSG_DONTWAIT);
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
         }
-        
-        std::string stock_name = stock_info[0];
-        int shares = std::stoi(stock_info[1]);
-        double avg_price = std::stod(stock_info[2]);
-        
-        // Skip if no shares
-        if (shares == 0) {
+        if (ret == -1 && errno == EMSGSIZE) {
+            perror("recvmsg upgrade");
             continue;
         }
-        
-        // Get current price from Server Q
-        std::string quote_message = "QUOTE " + stock_name;
-        
-        if (sendto(udp_sockfd, quote_message.c_str(), quote_message.length(), 0,
-                  (struct sockaddr *)&server_q_addr, sizeof(server_q_addr)) == -1) {
-            perror("sendto Server Q");
-            continue;
+        if (ret != 1) {
+            if (ret == -1) {
+                perror("recvmsg upgrade");
+            }
+            if (draining) {
+                upgrade_abort();
+            } else {
+                printf("[Server M] The previous Server M has handed over every session.\n");
+                close(upgrade_peer_fd);
+                upgrade_peer_fd = -1;
+            }
+            break;
         }
         
-        from_len = sizeof(from_addr);
-        
-        if ((bytes_received = recvfrom(udp_sockfd, buffer, BUFFER_SIZE - 1, 0,
-                                      (struct sockaddr *)&from_addr, &from_len)) == -1) {
-            perror("recvfrom Server Q");
-            continue;
+        if (record->kind == UPGRADE_DATAGRAM && record->len < sizeof(record->payload)) {
+            on_backend_datagram(record->payload, record->len);
+        } else if (record->kind == UPGRADE_CONNECTION && record->fd_count == 1 && !draining) {
+            io_adopt_socket(record->fds[0]);
+            on_accept(record->fds[0]);
+        } else if (record->kind == UPGRADE_SESSION && record->fd_count == 1 && !draining) {
+            upgrade_receive_session(record->fds[0], record->payload, record->len);
+        } else {
+            for (int i = 0; i < record->fd_count; i++) {
+                close(record->fds[i]);
+            }
         }
-        
-        buffer[bytes_received] = '\0';
-        std::string quote_response(buffer);
-        
-        std::vector<std::string> quote_parts = split_string(quote_response, ' ');
-        
-        if (quote_parts.size() < 2 || quote_parts[0] != stock_name) {
-            continue;
+    }
+    delete record;
+}
+
+// Called while draining: pass on queued connections and every idle session,
+// close what is still busy at the deadline, and exit once nothing is left
+void upgrade_hand_over_sessions() {
+    while (!pending_sessions.empty()) {
+        int client_sockfd = pending_sessions.front().client_sockfd;
+        if (!upgrade_send(upgrade_peer_fd, UPGRADE_CONNECTION, NULL, 0, &client_sockfd, 1)) {
+            perror("sendmsg upgrade");
+            return;
         }
-        
-        double current_price = std::stod(quote_parts[1]);
-        double stock_gain = shares * (current_price - avg_price);
-        total_gain += stock_gain;
-        
-        // Add to result in required format
-        char formatted_line[100];
-        snprintf(formatted_line, sizeof(formatted_line), "%s %d %.6f", stock_name.c_str(), shares, avg_price);
-        result += std::string(formatted_line) + "\n";
+        close(client_sockfd);
+        pending_sessions.pop_front();
+        admission->pending_sessions--;
     }
     
-    char profit_line[100];
-    snprintf(profit_line, sizeof(profit_line), "Total unrealized gain/loss: $%.6f", total_gain);
-    result += std::string(profit_line);
-    
-    // Send result to client
-    size_t result_len = result.length() + 1;
-    char* null_term_result = new char[result_len];
-    strcpy(null_term_result, result.c_str());
+    bool expired = monotonic_ns() > drain_deadline_ns;
+    std::vector<Session*> ready, busy;
+    for (std::map<unsigned, Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        if (upgrade_session_idle(it->second)) {
+            ready.push_back(it->second);
+        } else if (expired) {
+            busy.push_back(it->second);
+        }
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+        if (io_backend == IO_URING) {
+            // The session moves once its receive has ended, see upgrade_recv_cancelled()
+            uring_prep_cancel(io_get_sqe(), IO_TAG(IO_TAG_CLIENT_RECV, ready[i]->id), IO_TAG(IO_TAG_CANCEL, 0));
+            ready[i]->migrating = true;
+        } else {
+            upgrade_hand_over(ready[i]);
+        }
+    }
+    for (size_t i = 0; i < busy.size(); i++) {
+        printf("[Server M] Closed a session still busy after %d seconds of draining.\n", UPGRADE_DRAIN_SECONDS);
+        session_close(busy[i]);
+    }
     
-    int send_res = send(client_sockfd, null_term_result, result_len, 0);
-    if (send_res == -1) {
-        perror("send portfolio result to client");
-    } else {
-        printf("[Server M] Forwarded the gain to the client.\n");
+    if (sessions.empty() && pending_sessions.empty()) {
+        printf("[Server M] Handed over every session, exiting.\n");
+        close(upgrade_peer_fd);
+        if (capture != NULL) {
+            capture_close(capture);
+        }
+        exit(0);
     }
-    delete[] null_term_result;
 }
 
-std::vector<std::string> split_string(const std::string& str, char delimiter) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(str);
-    std::string token;
+// Between commands, with nothing left to send, and not already moving
+bool upgrade_session_idle(const Session* s) {
+    return s->state == SESSION_IDLE && s->queued_messages.empty() && s->outbuf.empty() &&
+           !s->send_in_flight && !s->migrating;
+}
+
+// Send the client socket, the username and any bytes read but not yet
+// handled to the new Server M, then forget the session
+void upgrade_hand_over(Session* s) {
+    if (io_backend == IO_EPOLL) {
+        epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    }
     
-    while (std::getline(ss, token, delimiter)) {
-        if (!token.empty()) {
-            tokens.push_back(token);
+    // Whatever the client sent meanwhile either comes along or stays in the
+    // socket for the new Server M to read
+    std::string payload = s->username + "\n" + s->inbuf;
+    char buffer[BUFFER_SIZE];
+    while (payload.size() + BUFFER_SIZE <= UPGRADE_MAX_PAYLOAD) {
+        int bytes = recv(s->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (bytes > 0) {
+            payload.append(buffer, bytes);
+            continue;
+        }
+        if (bytes == 0) {
+            on_client_closed(s, 0);
+            return;
+        }
+        if (errno != EINTR) {
+            break;
         }
     }
     
-    return tokens;
+    if (!upgrade_send(upgrade_peer_fd, UPGRADE_SESSION, payload.data(), payload.size(), &s->fd, 1)) {
+        // Keep serving it here; losing the new Server M aborts the upgrade
+        perror("sendmsg upgrade");
+        s->inbuf = payload.substr(s->username.size() + 1);
+        io_watch_client(s);
+        on_client_data(s, "", 0);
+        return;
+    }
+    if (capture != NULL) {
+        capture_record(capture, CAPTURE_CLOSE, 0, s->id, NULL, 0);
+    }
+    sessions.erase(s->id);
+    admission->active_sessions--;
+    close(s->fd);
+    delete s;
+}
+
+// io_uring: the session's receive ended after upgrade_hand_over_sessions()
+// cancelled it. Data that came first may have started a command, which has
+// to finish here.
+void upgrade_recv_cancelled(Session* s) {
+    s->migrating = false;
+    if (draining && upgrade_session_idle(s)) {
+        upgrade_hand_over(s);
+    } else {
+        io_arm_client_recv(s);
+    }
+}
+
+// A session from the Server M we replaced: authenticated as before, and
+// its unread input is handled as if it had just arrived
+void upgrade_receive_session(int client_sockfd, const char* payload, size_t len) {
+    const char* newline = (const char*)memchr(payload, '\n', len);
+    if (newline == NULL || (int)sessions.size() >= reactor_share(MAX_SESSIONS)) {
+        reject_busy(client_sockfd);
+        return;
+    }
+    io_adopt_socket(client_sockfd);
+    Session* s = start_session(client_sockfd);
+    s->username.assign(payload, newline - payload);
+    on_client_data(s, newline + 1, len - (newline + 1 - payload));
+}
+
+// A reply read from the shared UDP socket that answers the other Server M.
+// Request ids below upgrade_split_id are the old process's.
+bool upgrade_forward_datagram(unsigned request_id, const char* data, size_t len) {
+    if (upgrade_peer_fd == -1 || (draining ? request_id < upgrade_split_id : request_id >= upgrade_split_id)) {
+        return false;
+    }
+    if (!upgrade_send(upgrade_peer_fd, UPGRADE_DATAGRAM, data, len, NULL, 0)) {
+        perror("sendmsg upgrade");
+    }
+    return true;
 }
@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -22,50 +23,184 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
+#include <functional>
 #include <fstream>
 #include <iostream>
+#include "shmring.h"
+#include "portfolio_snapshot.h"
+#include "tradecore.h"
+#include "trace.h"
+#include "backend.h"
+#include "ledger.h"
+#include "priority.h"
 #include <fstream>  // Added include
 
 
 // Default values - replace XXX with your USC ID last 3 digits
 #define SERVER_P_PORT 42654
 #define BUFFER_SIZE 1024
+#define PAGE_MAX_BYTES 960   // lines per PORTFOLIO or TRADES reply; the request tag and header fit in the rest
 #define PORTFOLIOS_FILE "portfolios.txt"
+#define PORTFOLIOS_SNAPSHOT "portfolios.snap"   // written by ./portfolio_snapshot
+#define PORTFOLIO_STRIPES 64        // independent write locks over the members
+#define MAX_WORKERS 64              // --workers limit
+#define SERVER_Q_PORT 43654         // price changes come from Server Q
+#define SERVER_Q_IP "127.0.0.1"
+#define PRICE_SUBSCRIBE_MS 2000     // how often the subscription with Server Q is renewed
+#define SELL_HOLD_MS 30000          // how long a CHECK ... HOLD keeps the shares for the SELL
 
 // Global socket file descriptor for cleanup
 int sockfd = -1;
 
-// Data structure for a single stock holding
-struct StockHolding {
+// --transport=shm: Server M's requests also arrive over a shared-memory ring
+// (see backend.h). Requests are served by several threads at once
+// (--workers and the ring's thread); process_message() is thread-safe.
+ShmChannel* shm_channel = NULL;
+
+// Tracing (see trace.h and backend.h)
+TraceLog trace_log = { -1, 0, "serverP" };
+
+// Portfolio store. Members are spread over PORTFOLIO_STRIPES stripes by a
+// hash of their name, and a trade (BUY, SELL, BASKET APPLY) locks only its
+// member's stripe, so trades of members in different stripes never contend.
+// Reads (PORTFOLIO, CHECK, BASKET CHECK) take no write lock: a member's
+// portfolio is an immutable copy that a trade replaces with one atomic
+// store, like the reloaded tables of Server A and Q. A stripe's member index
+// is a map under a reader-writer lock that readers hold only to find the
+// member; a new member's first buy inserts in place, without copying it.
+typedef std::shared_ptr<const Portfolio> PortfolioRef;
+
+// Shares a sell has reserved between its CHECK and its SELL
+struct ShareHold {
+    unsigned long long id;
     std::string stock_name;
     int shares;
-    double avg_price;
-    
-    // Default constructor needed for std::map
-    StockHolding() : stock_name(""), shares(0), avg_price(0.0) {}
-    
-    StockHolding(std::string name, int qty, double price) 
-        : stock_name(name), shares(qty), avg_price(price) {}
+    long long expires_ns;           // shm_now_ns() time
+};
+
+// Unrealized gain is kept per member rather than priced on every position
+// request: Server Q pushes price changes (PRICES, after a SUBSCRIBE), and a
+// change reaches only the members holding that stock, through each stripe's
+// holders index. The market value is in millionths of a dollar, the
+// precision of Server Q's prices, so no number of price changes adds
+// rounding error. A member's own trade sums their gain again from scratch,
+// O(holdings) like the portfolio copy the trade makes anyway.
+// The gain and the portfolio it was summed over are one immutable view.
+// A trade or a price change builds a new view under the stripe's
+// write_lock and stores it whole, so a position read takes no lock and
+// never pairs a gain with another portfolio's holdings.
+struct MemberView {
+    PortfolioRef portfolio;
+    // Over the holdings that have a price
+    long long market_micros;        // shares x price
+    double cost;                    // shares x average buy price
+    int unpriced;                   // holdings Server Q has not priced yet
+
+    MemberView() : market_micros(0), cost(0.0), unpriced(0) {}
 };
 
-// Portfolio is a map of stock symbols to holdings
-typedef std::map<std::string, StockHolding> Portfolio;
+typedef std::shared_ptr<const MemberView> MemberViewRef;
+
+struct MemberSlot {
+    MemberViewRef view;             // std::atomic_load/atomic_store only
+    std::vector<ShareHold> holds;   // under the stripe's write_lock
+};
 
-// User database maps usernames to portfolios
-std::map<std::string, Portfolio> user_portfolios;
+typedef std::map<std::string, std::shared_ptr<MemberSlot> > MemberIndex;
+
+// The stripe's members holding one stock, and the price their market values include
+struct StockHolders {
+    long long price_micros;         // -1 until Server Q sent one
+    std::set<MemberSlot*> members;
+};
+
+struct PortfolioStripe {
+    pthread_mutex_t write_lock;     // held for a whole read-modify-publish
+    MemberIndex members;            // changed under write_lock and index_lock (write)
+    pthread_rwlock_t index_lock;    // read-held by readers that do not hold write_lock
+    std::map<std::string, StockHolders> holders;  // by stock, under write_lock
+    TradeLedger ledger;             // the stripe's members' trades, under ledger_lock
+    pthread_mutex_t ledger_lock;    // taken inside write_lock by trades, alone by TRADES queries
+
+    PortfolioStripe() {
+        pthread_mutex_init(&write_lock, NULL);
+        pthread_rwlock_init(&index_lock, NULL);
+        pthread_mutex_init(&ledger_lock, NULL);
+    }
+};
+
+PortfolioStripe portfolio_stripes[PORTFOLIO_STRIPES];
+
+// Latest price of every stock, with the PRICES sequence number it came in.
+// Workers may take two PRICES messages out of order; the older one loses.
+struct LastPrice {
+    long long micros;
+    unsigned long long seq;
+};
+std::map<std::string, LastPrice> last_prices;   // under price_lock
+pthread_mutex_t price_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t price_update_lock = PTHREAD_MUTEX_INITIALIZER;  // one PRICES message at a time
+
+// Every applied trade, for TRADES queries (see ledger.h), is in its member's
+// stripe's ledger, so trades in different stripes never share a lock. The
+// trade takes its number from next_trade_seq and appends while holding its
+// stripe's write_lock, so a ledger's numbers ascend in the order its trades
+// were applied. Like hold ids, trade numbers start from the wall clock in
+// microseconds: a number from before a restart or a failover is below every
+// new one, so "trades since <n>" never matches the wrong trade. The ledger
+// itself is memory only: TRADES lists this process's trades, see ledger.h.
+std::atomic<unsigned long long> next_trade_seq(1);
+
+// Sell reservations: CHECK <user> <stock> <shares> HOLD reserves the shares
+// under the stripe lock and answers "SUFFICIENT_SHARES <hold id>". The SELL
+// that names the hold commits without checking again, and N <user> <hold id>
+// gives the shares back. Every other trade may only spend shares nobody
+// holds, so a live hold's shares are always there. Ids start from the wall
+// clock, so a hold id from before a restart does not match a new one.
+std::atomic<unsigned long long> next_hold_id(1);
+
+// Loaders build every stripe's index off to the side, then publish them
+typedef std::vector<std::shared_ptr<MemberIndex> > LoadedIndexes;
 
 void sigint_handler(int sig);
+void load_portfolios();
 void load_portfolios_file();
-std::vector<std::string> split_string(const std::string& str, char delimiter);
+bool load_portfolios_snapshot();
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len);
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len);
+const char* strip_request_tag(char* message);
 void handle_buy(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
 void handle_sell(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
 void handle_check_shares(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
 void handle_portfolio(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void handle_basket(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void handle_trades(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void* udp_serve(void* arg);
+size_t stripe_index(const std::string& username);
+PortfolioStripe& stripe_for(const std::string& username);
+std::shared_ptr<MemberSlot> read_member_slot(const std::string& username);
+PortfolioRef read_portfolio(const std::string& username);
+void write_portfolio(PortfolioStripe& stripe, const std::string& username, const Portfolio& portfolio);
+void add_loaded_member(LoadedIndexes& indexes, const std::string& username, const Portfolio& portfolio);
+void publish_loaded(LoadedIndexes& indexes);
+long long price_to_micros(double price);
+long long known_price(const std::string& stock_name);
+void index_holdings(PortfolioStripe& stripe, MemberSlot* slot, const Portfolio* before, const PortfolioRef& after);
+void reprice_holders(StockHolders& holders, const std::string& stock_name, long long micros);
+void handle_prices(const std::vector<std::string>& parts);
+PortfolioRef read_position(const std::string& username, double* gain, bool* priced);
+MemberSlot* find_member_slot(PortfolioStripe& stripe, const std::string& username);
+int held_shares(MemberSlot* slot, const std::string& stock_name);
+bool take_hold(MemberSlot* slot, unsigned long long hold_id, const std::string& stock_name, int num_shares);
+void handle_sell_denied(const std::vector<std::string>& parts);
+void* subscribe_prices(void* arg);
 
 // catch ctrl+c , cleanup (beej guide man pages 9.4)
 void sigint_handler(int sig) {
@@ -75,10 +210,42 @@ void sigint_handler(int sig) {
         close(sockfd);
     }
     
+    if (shm_channel != NULL) {
+        shm_channel_retire(shm_channel, SHM_NAME_P);
+    }
+    
     exit(0);
 }
 
+// bench.cpp builds this file with NO_SERVER_MAIN to call its handlers directly
+#ifndef NO_SERVER_MAIN
 int main(int argc, char *argv[]) {
+    // --transport=udp (default) or --transport=shm, --workers=N (default 1),
+    // --port=N for a standby instance
+    bool use_shm = false;
+    int port = SERVER_P_PORT;
+    int workers = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--transport=shm") == 0) {
+            use_shm = true;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--port=", 7) == 0) {
+            port = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--transport=udp") != 0) {
+            fprintf(stderr, "Usage: %s [--transport=udp|shm] [--workers=N] [--port=N]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (workers < 1 || workers > MAX_WORKERS) {
+        fprintf(stderr, "[Server P] --workers must be between 1 and %d\n", MAX_WORKERS);
+        exit(1);
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+    next_hold_id = (unsigned long long)started.tv_sec * 1000000ULL + started.tv_nsec / 1000;
+    next_trade_seq = next_hold_id.load();
+    
     // shutdown on sigint , be graceful (beej guide man pages 9.4)
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
@@ -102,7 +269,7 @@ int main(int argc, char *argv[]) {
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_flags = AI_PASSIVE; // Use my IP
 
-    if ((rv = getaddrinfo(NULL, std::to_string(SERVER_P_PORT).c_str(), &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &servinfo)) != 0) {
         fprintf(stderr, "[Server P] getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
     }
@@ -140,31 +307,122 @@ int main(int argc, char *argv[]) {
     
     
     // Load portfolios
-    load_portfolios_file();
+    load_portfolios();
+    
+    printf("[Server P] Booting up using UDP on port %d\n", port);
     
-    printf("[Server P] Booting up using UDP on port %d\n", SERVER_P_PORT);
-    // main loop recv/process , beej guide 6.3
-    struct sockaddr_storage their_addr;
-    socklen_t addr_len;
-    char buffer[BUFFER_SIZE];
-    int numbytes;
+    // The rings are found by name, not port: they belong to the primary
+    if (use_shm && port != SERVER_P_PORT) {
+        printf("[Server P] Standby on port %d: serving UDP only, not shared memory.\n", port);
+        use_shm = false;
+    }
+    
+    // Same-host fast path, UDP keeps working alongside it
+    if (use_shm) {
+        pthread_t shm_thread;
+        static BackendShm shm = { NULL, &trace_log, process_message, NULL };
+        shm_channel = shm_channel_create(SHM_NAME_P);
+        shm.channel = shm_channel;
+        if (shm_channel == NULL) {
+            perror("shm_open");
+        } else if (pthread_create(&shm_thread, NULL, backend_shm_serve, &shm) != 0) {
+            fprintf(stderr, "[Server P] Failed to start the shared memory thread\n");
+            shm_channel_retire(shm_channel, SHM_NAME_P);
+            shm_channel = NULL;
+        } else {
+            printf("[Server P] Serving Server M over shared memory (%s).\n", SHM_NAME_P);
+        }
+    }
+    // Every worker blocks in recvfrom() on the one socket, and the kernel
+    // hands each datagram to one of them; the main thread is worker 1
+    for (int i = 1; i < workers; i++) {
+        pthread_t worker_thread;
+        if (pthread_create(&worker_thread, NULL, udp_serve, NULL) != 0) {
+            fprintf(stderr, "[Server P] Failed to start worker thread %d\n", i + 1);
+            exit(1);
+        }
+    }
+    if (workers > 1) {
+        printf("[Server P] Serving UDP requests on %d worker threads.\n", workers);
+    }
+    
+    // Price changes arrive on the request socket, see handle_prices()
+    pthread_t subscribe_thread;
+    if (pthread_create(&subscribe_thread, NULL, subscribe_prices, NULL) != 0) {
+        fprintf(stderr, "[Server P] Failed to start the price subscription, gains are priced by Server M\n");
+    }
+    udp_serve(NULL);
+    return 0;
+}
+#endif
+
+// main loop recv/process , beej guide 6.3. Each worker takes what is
+// waiting on the socket, up to PRIORITY_BATCH requests, and serves the
+// trades among them first (see priority.h).
+void* udp_serve(void* arg) {
+    (void)arg;
+    PriorityBatch batch;
 
     while (1) {
-        addr_len = sizeof their_addr;
-        // recvfrom loop , beej guide 6.3
-        if ((numbytes = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0,
-            (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-            perror("recvfrom");
+        if (priority_recv_udp(sockfd, &batch) == -1) {
+            perror("recvmmsg");
             continue;
         }
-
-        buffer[numbytes] = '\0';
         
-        
-        process_message(buffer, (struct sockaddr_in*)&their_addr, addr_len);
+        for (int i = 0; i < batch.count; i++) {
+            int m = batch.order[i];
+            backend_received_ns = batch.received_ns;
+            process_message(strip_request_tag(batch.data[m]), (struct sockaddr_in*)&batch.addr[m],
+                            batch.addr_len[m]);
+        }
     }
-    
-    return 0;
+    return NULL;
+}
+
+// Prefer the binary snapshot when it is at least as new as the text file;
+// an older one would silently drop edits made to portfolios.txt since
+void load_portfolios() {
+    struct stat text_st, snap_st;
+    bool have_text = stat(PORTFOLIOS_FILE, &text_st) == 0;
+    if (stat(PORTFOLIOS_SNAPSHOT, &snap_st) == 0) {
+        if (have_text && snap_st.st_mtime < text_st.st_mtime) {
+            printf("[Server P] %s is older than %s, ignoring it.\n", PORTFOLIOS_SNAPSHOT, PORTFOLIOS_FILE);
+        } else if (load_portfolios_snapshot()) {
+            return;
+        }
+    }
+    load_portfolios_file();
+}
+
+// Both arrays in the snapshot are in map order, so every insert is an
+// append at end() and no string is parsed
+bool load_portfolios_snapshot() {
+    PortfolioSnapshot snap;
+    const char* error;
+    if (!snapshot_open(PORTFOLIOS_SNAPSHOT, &snap, &error)) {
+        if (error != NULL) {
+            printf("[Server P] Ignoring %s: %s.\n", PORTFOLIOS_SNAPSHOT, error);
+        }
+        return false;
+    }
+
+    LoadedIndexes indexes;
+    for (uint64_t u = 0; u < snap.header->user_count; u++) {
+        const SnapshotUser& user = snap.users[u];
+        Portfolio portfolio;
+        const SnapshotHolding* holding = snap.holdings + user.first_holding;
+        for (uint32_t i = 0; i < user.holding_count; i++, holding++) {
+            std::string stock_name = snapshot_stock_name(&snap, *holding);
+            portfolio.emplace_hint(portfolio.end(), stock_name,
+                StockHolding(stock_name, holding->shares, holding->avg_price));
+        }
+        add_loaded_member(indexes, snapshot_user_name(&snap, user), portfolio);
+    }
+    publish_loaded(indexes);
+    printf("[Server P] Loaded %llu portfolios from %s.\n",
+           (unsigned long long)snap.header->user_count, PORTFOLIOS_SNAPSHOT);
+    snapshot_close(&snap);
+    return true;
 }
 
 void load_portfolios_file() {
@@ -177,7 +435,9 @@ void load_portfolios_file() {
     
     std::string line;
     std::string current_user;
+    Portfolio current_portfolio;
     int user_count = 0;
+    LoadedIndexes indexes;
     
     while (std::getline(file, line)) {
         if (line.empty()) {
@@ -188,8 +448,11 @@ void load_portfolios_file() {
         
         if (parts.size() == 1) {
             // This is a username line
+            if (!current_user.empty()) {
+                add_loaded_member(indexes, current_user, current_portfolio);
+            }
             current_user = parts[0];
-            user_portfolios[current_user] = Portfolio();
+            current_portfolio.clear();
             user_count++;
         } 
         else if (parts.size() == 3 && !current_user.empty()) {
@@ -198,14 +461,263 @@ void load_portfolios_file() {
             int shares = std::stoi(parts[1]);
             double avg_price = std::stod(parts[2]);
             
-            user_portfolios[current_user][stock_name] = StockHolding(stock_name, shares, avg_price);
+            current_portfolio[stock_name] = StockHolding(stock_name, shares, avg_price);
         }
     }
+    if (!current_user.empty()) {
+        add_loaded_member(indexes, current_user, current_portfolio);
+    }
+    publish_loaded(indexes);
     
     file.close();
     
 }
 
+size_t stripe_index(const std::string& username) {
+    return std::hash<std::string>()(username) % PORTFOLIO_STRIPES;
+}
+
+PortfolioStripe& stripe_for(const std::string& username) {
+    return portfolio_stripes[stripe_index(username)];
+}
+
+// The member's slot, empty for a member without a portfolio, for callers
+// that do not hold the stripe's write_lock
+std::shared_ptr<MemberSlot> read_member_slot(const std::string& username) {
+    PortfolioStripe& stripe = stripe_for(username);
+    std::shared_ptr<MemberSlot> slot;
+    pthread_rwlock_rdlock(&stripe.index_lock);
+    MemberIndex::const_iterator it = stripe.members.find(username);
+    if (it != stripe.members.end()) {
+        slot = it->second;
+    }
+    pthread_rwlock_unlock(&stripe.index_lock);
+    return slot;
+}
+
+// Snapshot of a member's portfolio, empty if the member has none. It stays
+// valid (and unchanged) for as long as the caller holds it.
+PortfolioRef read_portfolio(const std::string& username) {
+    std::shared_ptr<MemberSlot> slot = read_member_slot(username);
+    if (!slot) {
+        return PortfolioRef();
+    }
+    return std::atomic_load(&slot->view)->portfolio;
+}
+
+// Publish a member's new portfolio. The caller holds the stripe's write_lock,
+// so read_portfolio() then change then write_portfolio() is atomic per member.
+void write_portfolio(PortfolioStripe& stripe, const std::string& username, const Portfolio& portfolio) {
+    PortfolioRef updated = std::make_shared<const Portfolio>(portfolio);
+    MemberIndex::const_iterator it = stripe.members.find(username);
+    if (it != stripe.members.end()) {
+        MemberViewRef before = std::atomic_load(&it->second->view);
+        index_holdings(stripe, it->second.get(), before->portfolio.get(), updated);
+        return;
+    }
+    
+    // New member: the slot is complete before readers can find it
+    std::shared_ptr<MemberSlot> slot = std::make_shared<MemberSlot>();
+    index_holdings(stripe, slot.get(), NULL, updated);
+    pthread_rwlock_wrlock(&stripe.index_lock);
+    stripe.members[username] = slot;
+    pthread_rwlock_unlock(&stripe.index_lock);
+}
+
+// Members arrive in name order from a snapshot, so each insert is an append
+void add_loaded_member(LoadedIndexes& indexes, const std::string& username, const Portfolio& portfolio) {
+    if (indexes.empty()) {
+        for (int i = 0; i < PORTFOLIO_STRIPES; i++) {
+            indexes.push_back(std::make_shared<MemberIndex>());
+        }
+    }
+    MemberIndex& index = *indexes[stripe_index(username)];
+    std::shared_ptr<MemberView> view = std::make_shared<MemberView>();
+    view->portfolio = std::make_shared<const Portfolio>(portfolio);
+    std::shared_ptr<MemberSlot> slot = std::make_shared<MemberSlot>();
+    slot->view = view;
+    index.emplace_hint(index.end(), username, slot)->second = slot;
+}
+
+// Replace every stripe's members with the loaded ones, and index their holdings
+void publish_loaded(LoadedIndexes& indexes) {
+    for (int i = 0; i < PORTFOLIO_STRIPES; i++) {
+        PortfolioStripe& stripe = portfolio_stripes[i];
+        MemberIndex members;
+        if (!indexes.empty()) {
+            members.swap(*indexes[i]);
+        }
+        pthread_mutex_lock(&stripe.write_lock);
+        stripe.holders.clear();
+        for (MemberIndex::const_iterator it = members.begin(); it != members.end(); ++it) {
+            index_holdings(stripe, it->second.get(), NULL, it->second->view->portfolio);
+        }
+        pthread_rwlock_wrlock(&stripe.index_lock);
+        stripe.members.swap(members);
+        pthread_rwlock_unlock(&stripe.index_lock);
+        pthread_mutex_unlock(&stripe.write_lock);
+    }
+}
+
+// Server Q's prices have six decimals
+long long price_to_micros(double price) {
+    return llround(price * 1000000.0);
+}
+
+// Latest price of the stock in micros, -1 if Server Q never sent one
+long long known_price(const std::string& stock_name) {
+    pthread_mutex_lock(&price_lock);
+    std::map<std::string, LastPrice>::const_iterator it = last_prices.find(stock_name);
+    long long micros = it == last_prices.end() ? -1 : it->second.micros;
+    pthread_mutex_unlock(&price_lock);
+    return micros;
+}
+
+// Bring the stripe's holders index up to date with a portfolio change (from
+// `before`, NULL for none, to `after`), and publish `after` with its gain as
+// the member's view. The caller holds the stripe's write_lock.
+void index_holdings(PortfolioStripe& stripe, MemberSlot* slot, const Portfolio* before, const PortfolioRef& after) {
+    if (before != NULL) {
+        for (Portfolio::const_iterator it = before->begin(); it != before->end(); ++it) {
+            Portfolio::const_iterator now = after->find(it->first);
+            if (it->second.shares <= 0 || (now != after->end() && now->second.shares > 0)) {
+                continue;
+            }
+            std::map<std::string, StockHolders>::iterator holders = stripe.holders.find(it->first);
+            if (holders != stripe.holders.end()) {
+                holders->second.members.erase(slot);
+                if (holders->second.members.empty()) {
+                    stripe.holders.erase(holders);
+                }
+            }
+        }
+    }
+    
+    std::shared_ptr<MemberView> view = std::make_shared<MemberView>();
+    view->portfolio = after;
+    for (Portfolio::const_iterator it = after->begin(); it != after->end(); ++it) {
+        const StockHolding& holding = it->second;
+        if (holding.shares <= 0) {
+            continue;
+        }
+        std::map<std::string, StockHolders>::iterator holders = stripe.holders.find(it->first);
+        if (holders == stripe.holders.end()) {
+            holders = stripe.holders.insert(std::make_pair(it->first, StockHolders())).first;
+            holders->second.price_micros = known_price(it->first);
+        }
+        holders->second.members.insert(slot);
+        if (holders->second.price_micros < 0) {
+            view->unpriced++;
+            continue;
+        }
+        view->market_micros += holding.shares * holders->second.price_micros;
+        view->cost += holding.shares * holding.avg_price;
+    }
+    std::atomic_store(&slot->view, MemberViewRef(view));
+}
+
+// Move every holder of the stock to its new price. The caller holds the
+// stripe's write_lock, so no trade replaces a holder's portfolio meanwhile.
+void reprice_holders(StockHolders& holders, const std::string& stock_name, long long micros) {
+    for (std::set<MemberSlot*>::iterator it = holders.members.begin(); it != holders.members.end(); ++it) {
+        MemberSlot* slot = *it;
+        std::shared_ptr<MemberView> view = std::make_shared<MemberView>(*std::atomic_load(&slot->view));
+        const StockHolding& holding = view->portfolio->find(stock_name)->second;
+        if (holders.price_micros < 0) {
+            view->market_micros += holding.shares * micros;
+            view->cost += holding.shares * holding.avg_price;
+            view->unpriced--;
+        } else {
+            view->market_micros += holding.shares * (micros - holders.price_micros);
+        }
+        std::atomic_store(&slot->view, MemberViewRef(view));
+    }
+    holders.price_micros = micros;
+}
+
+// PRICES <seq> <stock> <price> ...: price changes pushed by Server Q. Each
+// stripe is locked once per message, and only the holders of a stock whose
+// price moved are touched. No reply.
+void handle_prices(const std::vector<std::string>& parts) {
+    unsigned long long seq = strtoull(parts[1].c_str(), NULL, 10);
+    std::vector<std::pair<std::string, long long> > changed;
+    
+    pthread_mutex_lock(&price_update_lock);
+    pthread_mutex_lock(&price_lock);
+    for (size_t i = 2; i + 1 < parts.size(); i += 2) {
+        long long micros = price_to_micros(strtod(parts[i + 1].c_str(), NULL));
+        std::map<std::string, LastPrice>::iterator it = last_prices.find(parts[i]);
+        if (it == last_prices.end()) {
+            LastPrice unknown = { -1, 0 };
+            it = last_prices.insert(std::make_pair(parts[i], unknown)).first;
+        }
+        if (seq <= it->second.seq) {
+            continue;
+        }
+        it->second.seq = seq;
+        if (it->second.micros != micros) {
+            it->second.micros = micros;
+            changed.push_back(std::make_pair(parts[i], micros));
+        }
+    }
+    pthread_mutex_unlock(&price_lock);
+    
+    // A trade that indexes a stock from here on already sees the new price,
+    // and reprice_holders() then moves it by nothing
+    for (int i = 0; i < PORTFOLIO_STRIPES && !changed.empty(); i++) {
+        PortfolioStripe& stripe = portfolio_stripes[i];
+        pthread_mutex_lock(&stripe.write_lock);
+        for (size_t k = 0; k < changed.size(); k++) {
+            std::map<std::string, StockHolders>::iterator holders = stripe.holders.find(changed[k].first);
+            if (holders != stripe.holders.end()) {
+                reprice_holders(holders->second, changed[k].first, changed[k].second);
+            }
+        }
+        pthread_mutex_unlock(&stripe.write_lock);
+    }
+    pthread_mutex_unlock(&price_update_lock);
+}
+
+// The member's portfolio and unrealized gain, taken together from one view
+// without a lock. `priced` is false while some holding has no price from
+// Server Q.
+PortfolioRef read_position(const std::string& username, double* gain, bool* priced) {
+    std::shared_ptr<MemberSlot> slot = read_member_slot(username);
+    *gain = 0.0;
+    *priced = true;
+    if (!slot) {
+        return PortfolioRef();
+    }
+    MemberViewRef view = std::atomic_load(&slot->view);
+    *gain = view->market_micros / 1000000.0 - view->cost;
+    *priced = view->unpriced == 0;
+    return view->portfolio;
+}
+
+// Ask Server Q for price changes every PRICE_SUBSCRIBE_MS. Server Q answers
+// a new subscriber with every price and forgets one that stops renewing, so
+// either server can restart. Until the first prices arrive the request asks
+// for all of them: after a quick restart Server Q still knows this port.
+void* subscribe_prices(void* arg) {
+    (void)arg;
+    struct sockaddr_in q_addr;
+    memset(&q_addr, 0, sizeof(q_addr));
+    q_addr.sin_family = AF_INET;
+    q_addr.sin_port = htons(SERVER_Q_PORT);
+    q_addr.sin_addr.s_addr = inet_addr(SERVER_Q_IP);
+    printf("[Server P] Subscribing to price changes from Server Q.\n");
+    while (1) {
+        pthread_mutex_lock(&price_lock);
+        const char* request = last_prices.empty() ? "SUBSCRIBE ALL" : "SUBSCRIBE";
+        pthread_mutex_unlock(&price_lock);
+        if (sendto(sockfd, request, strlen(request), 0, (struct sockaddr*)&q_addr, sizeof(q_addr)) == -1) {
+            perror("sendto Server Q");
+        }
+        usleep(PRICE_SUBSCRIBE_MS * 1000);
+    }
+    return NULL;
+}
+
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len) {
     std::string msg(message);
     std::vector<std::string> parts = split_string(msg, ' ');
@@ -214,23 +726,36 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
         return;
     }
     
+    // Server M's health check, answered without a log line
+    if (parts[0] == "PING") {
+        send_reply("PONG", sizeof("PONG"), client_addr, client_len);
+        return;
+    }
     
     if (parts[0] == "BUY" && parts.size() == 5) {
         handle_buy(parts, client_addr, client_len);
     } 
-    else if (parts[0] == "SELL" && parts.size() == 5) {
+    else if (parts[0] == "SELL" && (parts.size() == 5 || parts.size() == 6)) {
         handle_sell(parts, client_addr, client_len);
     } 
-    else if (parts[0] == "CHECK" && parts.size() == 4) {
+    else if (parts[0] == "CHECK" && (parts.size() == 4 || (parts.size() == 5 && parts[4] == "HOLD"))) {
         handle_check_shares(parts, client_addr, client_len);
     } 
-    else if (parts[0] == "PORTFOLIO" && parts.size() == 2) {
+    else if (parts[0] == "PORTFOLIO" && parts.size() >= 2 && parts.size() <= 4) {
         
         handle_portfolio(parts, client_addr, client_len);
     }
+    else if (parts[0] == "BASKET" && parts.size() >= 7 && (parts.size() - 3) % 4 == 0) {
+        handle_basket(parts, client_addr, client_len);
+    }
+    else if (parts[0] == "TRADES" && (parts.size() == 4 || parts.size() == 5)) {
+        handle_trades(parts, client_addr, client_len);
+    }
+    else if (parts[0] == "PRICES" && parts.size() >= 2) {
+        handle_prices(parts);
+    }
     else if (parts[0] == "N") {
-        printf("[Server P] Sale Denied \n");
-        fflush(stdout);            
+        handle_sell_denied(parts);
     }
     else {
         
@@ -240,36 +765,32 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
 void handle_buy(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
     if (parts.size() != 5) {
         const char* error = "ERROR: Invalid BUY format";
-        sendto(sockfd, error, strlen(error), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(error, strlen(error), client_addr, client_len);
         return;
     }
     
     std::string username = parts[1];
     std::string stock_name = parts[2];
-    int num_shares = std::stoi(parts[3]);
-    double price = std::stod(parts[4]);
-    
-    printf("[Server P] Received a buy request from the client.\n");
-    
-    if (user_portfolios.find(username) == user_portfolios.end()) {
-        user_portfolios[username] = Portfolio();
+    int num_shares = 0;
+    double price = 0;
+    if (!parse_int(parts[3], &num_shares) || !parse_double(parts[4], &price) || num_shares <= 0) {
+        const char* error = "ERROR: Invalid BUY format";
+        send_reply(error, strlen(error), client_addr, client_len);
+        return;
     }
     
-    Portfolio& portfolio = user_portfolios[username];
+    printf("[Server P] Received a buy request from the client.\n");
     
-    if (portfolio.find(stock_name) == portfolio.end()) {
-        portfolio[stock_name] = StockHolding(stock_name, num_shares, price);
-    } else {
-        StockHolding& holding = portfolio[stock_name];
-        
-        double old_value = holding.shares * holding.avg_price;
-        double new_value = num_shares * price;
-        int total_shares = holding.shares + num_shares;
-        
-        holding.avg_price = (old_value + new_value) / total_shares;
-        holding.shares = total_shares;
-    }
+    PortfolioStripe& stripe = stripe_for(username);
+    pthread_mutex_lock(&stripe.write_lock);
+    PortfolioRef current = read_portfolio(username);
+    Portfolio portfolio = current ? *current : Portfolio();
+    apply_buy(portfolio, stock_name, num_shares, price);
+    write_portfolio(stripe, username, portfolio);
+    pthread_mutex_lock(&stripe.ledger_lock);
+    ledger_append(&stripe.ledger, next_trade_seq++, username, stock_name, 'B', num_shares, price, time(NULL));
+    pthread_mutex_unlock(&stripe.ledger_lock);
+    pthread_mutex_unlock(&stripe.write_lock);
     
     printf("[Server P] Successfully bought %d shares of %s and updated %s's portfolio.\n", num_shares, stock_name.c_str(), username.c_str());
     
@@ -277,8 +798,7 @@ void handle_buy(const std::vector<std::string>& parts, struct sockaddr_in* clien
                           std::to_string(num_shares) + " " + std::to_string(price);
     
     // sendto response , beej guide 6.3
-    if (sendto(sockfd, response.c_str(), response.length(), 0,
-             (struct sockaddr *)client_addr, client_len) == -1) {
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
         perror("sendto");
     }
 }
@@ -286,25 +806,39 @@ void handle_buy(const std::vector<std::string>& parts, struct sockaddr_in* clien
 void handle_sell(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
     std::string username = parts[1];
     std::string stock_name = parts[2];
-    int num_shares = std::stoi(parts[3]);
-    double price = std::stod(parts[4]);
-    
+    int num_shares = 0;
+    double price = 0;
+    if (!parse_int(parts[3], &num_shares) || !parse_double(parts[4], &price) || num_shares <= 0) {
+        const char* error = "ERROR: Invalid SELL format";
+        send_reply(error, strlen(error), client_addr, client_len);
+        return;
+    }
+    unsigned long long hold_id = parts.size() == 6 ? strtoull(parts[5].c_str(), NULL, 10) : 0;
     
-    if (user_portfolios.find(username) == user_portfolios.end()) {
+    // The check and the update happen under the stripe lock, so two sells
+    // racing for the same shares cannot both pass
+    PortfolioStripe& stripe = stripe_for(username);
+    pthread_mutex_lock(&stripe.write_lock);
+    PortfolioRef current = read_portfolio(username);
+    MemberSlot* slot = find_member_slot(stripe, username);
+    if (!current || slot == NULL) {
+        pthread_mutex_unlock(&stripe.write_lock);
         const char* response = "ERROR: User portfolio not found";
-        sendto(sockfd, response, strlen(response), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(response, strlen(response), client_addr, client_len);
         return;
     }
     
-    Portfolio& portfolio = user_portfolios[username];
+    Portfolio portfolio = *current;
     
-    if (portfolio.find(stock_name) == portfolio.end() || 
-        portfolio[stock_name].shares < num_shares) {
+    // A live hold from the CHECK already set the shares aside. Without one
+    // (it expired, or the SELL names none) only unheld shares can be sold.
+    bool reserved = hold_id != 0 && take_hold(slot, hold_id, stock_name, num_shares);
+    if (!reserved && (portfolio.find(stock_name) == portfolio.end() ||
+        portfolio[stock_name].shares - held_shares(slot, stock_name) < num_shares)) {
+        pthread_mutex_unlock(&stripe.write_lock);
         printf("[Server P] Stock %s does not have enough shares in %s's portfolio. Unable to sell %d shares of %s.\n", stock_name.c_str(), username.c_str(), num_shares, stock_name.c_str());
         const char* response = "ERROR: Insufficient shares";
-        sendto(sockfd, response, strlen(response), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(response, strlen(response), client_addr, client_len);
         return;
     }
     
@@ -320,10 +854,12 @@ void handle_sell(const std::vector<std::string>& parts, struct sockaddr_in* clie
     
     if (user_confirmation == 'Y' || user_confirmation == 'y') {
         printf("[Server P] User approves selling the stock.\n");
-        StockHolding& holding = portfolio[stock_name];
-        holding.shares -= num_shares;
-        
-        double profit = num_shares * (price - holding.avg_price);
+        double profit = apply_sell(portfolio, stock_name, num_shares, price);
+        write_portfolio(stripe, username, portfolio);
+        pthread_mutex_lock(&stripe.ledger_lock);
+        ledger_append(&stripe.ledger, next_trade_seq++, username, stock_name, 'S', num_shares, price, time(NULL));
+        pthread_mutex_unlock(&stripe.ledger_lock);
+        pthread_mutex_unlock(&stripe.write_lock);
         
         std::string response = "SELL_CONFIRMED: " + std::to_string(num_shares) + 
                               " shares of " + stock_name + " at $" + std::to_string(price) + 
@@ -332,19 +868,18 @@ void handle_sell(const std::vector<std::string>& parts, struct sockaddr_in* clie
         printf("[Server P] Successfully sold %d shares of %s and updated %s's portfolio.\n", num_shares, stock_name.c_str(), username.c_str());
         
         // sendto response , beej guide 6.3
-        if (sendto(sockfd, response.c_str(), response.length(), 0,
-                 (struct sockaddr *)client_addr, client_len) == -1) {
+        if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
             perror("sendto");
         }
     } else {
+        pthread_mutex_unlock(&stripe.write_lock);
         printf("[Server P] Sell denied.\n");
         {
           std::ofstream log("server.logs", std::ios::app);
           log << "[Server P] Sell denied.\n";
         }
         const char* response = "SELL_DENIED";
-        sendto(sockfd, response, strlen(response), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(response, strlen(response), client_addr, client_len);
     }
 }
 
@@ -397,90 +932,334 @@ void handle_sell(const std::vector<std::string>& parts, struct sockaddr_in* clie
 // }
 // }
 
+// BASKET <user> <CHECK|APPLY> <B|S> <stock> <shares> <price> ...
+//
+// Legs are checked in order against a running share count, so a basket may
+// sell shares an earlier leg bought. CHECK only answers SUFFICIENT_SHARES or
+// "INSUFFICIENT_SHARES <stock>"; APPLY updates the portfolio only when every
+// leg passes, so a basket is never half applied.
+void handle_basket(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::string username = parts[1];
+    bool apply = parts[2] == "APPLY";
+    size_t leg_count = (parts.size() - 3) / 4;
+    
+    printf("[Server P] Received a basket %s request with %d legs for %s.\n",
+           apply ? "apply" : "check", (int)leg_count, username.c_str());
+    
+    // APPLY checks and updates under the stripe lock, and leaves shares held
+    // for a pending sell alone; CHECK reads a snapshot
+    PortfolioStripe& stripe = stripe_for(username);
+    MemberSlot* slot = NULL;
+    if (apply) {
+        pthread_mutex_lock(&stripe.write_lock);
+        slot = find_member_slot(stripe, username);
+    }
+    PortfolioRef user = read_portfolio(username);
+    
+    std::map<std::string, int> running_shares;
+    std::vector<int> leg_shares(leg_count);
+    std::vector<double> leg_prices(leg_count);
+    for (size_t i = 0; i < leg_count; i++) {
+        const std::string& side = parts[3 + 4 * i];
+        const std::string& stock_name = parts[4 + 4 * i];
+        try {
+            leg_shares[i] = std::stoi(parts[5 + 4 * i]);
+            leg_prices[i] = std::stod(parts[6 + 4 * i]);
+        } catch (const std::exception&) {
+            leg_shares[i] = 0;
+        }
+        if ((side != "B" && side != "S") || leg_shares[i] <= 0) {
+            if (apply) {
+                pthread_mutex_unlock(&stripe.write_lock);
+            }
+            const char* error = "ERROR: Invalid BASKET format";
+            send_reply(error, strlen(error), client_addr, client_len);
+            return;
+        }
+        
+        if (running_shares.find(stock_name) == running_shares.end()) {
+            int held = 0;
+            if (user) {
+                Portfolio::const_iterator holding = user->find(stock_name);
+                held = holding != user->end() ? holding->second.shares : 0;
+            }
+            if (slot != NULL) {
+                held -= held_shares(slot, stock_name);
+            }
+            running_shares[stock_name] = held;
+        }
+        int& shares = running_shares[stock_name];
+        if (side == "B") {
+            shares += leg_shares[i];
+        } else if (shares < leg_shares[i]) {
+            if (apply) {
+                pthread_mutex_unlock(&stripe.write_lock);
+            }
+            printf("[Server P] Stock %s does not have enough shares in %s's portfolio. Unable to sell %d shares of %s.\n",
+                   stock_name.c_str(), username.c_str(), leg_shares[i], stock_name.c_str());
+            std::string response = (apply ? "ERROR: Insufficient shares of " : "INSUFFICIENT_SHARES ") + stock_name;
+            send_reply(response.c_str(), response.length(), client_addr, client_len);
+            return;
+        } else {
+            shares -= leg_shares[i];
+        }
+    }
+    
+    if (!apply) {
+        printf("[Server P] %s has sufficient shares for every sell leg. Requesting users’ confirmation for the basket.\n",
+               username.c_str());
+        const char* response = "SUFFICIENT_SHARES";
+        send_reply(response, strlen(response), client_addr, client_len);
+        return;
+    }
+    
+    Portfolio portfolio = user ? *user : Portfolio();
+    double profit = 0.0;
+    for (size_t i = 0; i < leg_count; i++) {
+        const std::string& stock_name = parts[4 + 4 * i];
+        if (parts[3 + 4 * i] == "B") {
+            apply_buy(portfolio, stock_name, leg_shares[i], leg_prices[i]);
+        } else {
+            profit += apply_sell(portfolio, stock_name, leg_shares[i], leg_prices[i]);
+        }
+    }
+    write_portfolio(stripe, username, portfolio);
+    
+    // The legs get consecutive sequence numbers
+    long long now = time(NULL);
+    unsigned long long first_seq = next_trade_seq.fetch_add(leg_count);
+    pthread_mutex_lock(&stripe.ledger_lock);
+    for (size_t i = 0; i < leg_count; i++) {
+        ledger_append(&stripe.ledger, first_seq + i, username, parts[4 + 4 * i], parts[3 + 4 * i][0], leg_shares[i],
+                      leg_prices[i], now);
+    }
+    pthread_mutex_unlock(&stripe.ledger_lock);
+    pthread_mutex_unlock(&stripe.write_lock);
+    printf("[Server P] Successfully applied a basket of %d legs and updated %s's portfolio.\n",
+           (int)leg_count, username.c_str());
+    
+    std::string response = "BASKET_SUCCESS " + username + " " + std::to_string(leg_count) +
+                           " legs, profit/loss: $" + std::to_string(profit);
+    
+    // sendto response , beej guide 6.3
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+        perror("sendto");
+    }
+}
+
+// CHECK <user> <stock> <shares> [HOLD]. With HOLD the shares are reserved
+// for the SELL to come (see next_hold_id); without, it is a lock-free look at
+// a snapshot and the SELL checks again.
 void handle_check_shares(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
     std::string username = parts[1];
     std::string stock_name = parts[2];
-    int num_shares = std::stoi(parts[3]);
+    // A hold of no or negative shares would let other sells take more than
+    // the member owns
+    int num_shares = 0;
+    if (!parse_int(parts[3], &num_shares) || num_shares <= 0) {
+        const char* error = "ERROR: Invalid CHECK format";
+        send_reply(error, strlen(error), client_addr, client_len);
+        return;
+    }
+    bool hold = parts.size() == 5;
     
+    PortfolioStripe& stripe = stripe_for(username);
+    MemberSlot* slot = NULL;
+    if (hold) {
+        pthread_mutex_lock(&stripe.write_lock);
+        slot = find_member_slot(stripe, username);
+    }
     
     // Check if user exists
-    if (user_portfolios.find(username) == user_portfolios.end()) {
+    PortfolioRef user = read_portfolio(username);
+    if (!user) {
+        if (hold) {
+            pthread_mutex_unlock(&stripe.write_lock);
+        }
         printf("[Server P] Stock %s does not have enough sharess in %s's portfolio. Unable to sell %d shares of %s.\n", stock_name.c_str(), username.c_str(), num_shares, stock_name.c_str());
         const char* response = "INSUFFICIENT_SHARES";
-        sendto(sockfd, response, strlen(response), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(response, strlen(response), client_addr, client_len);
         return;
     }
     
-    Portfolio& portfolio = user_portfolios[username];
+    const Portfolio& portfolio = *user;
 
     
     printf("[Server P] Received a sell request from the main server.\n");
     
-    // Check if user has enough shares
-    if (portfolio.find(stock_name) == portfolio.end() || 
-        portfolio[stock_name].shares < num_shares) {
+    // Check if user has enough shares, less what other sells hold
+    Portfolio::const_iterator holding = portfolio.find(stock_name);
+    if (holding == portfolio.end() || 
+        holding->second.shares - (slot != NULL ? held_shares(slot, stock_name) : 0) < num_shares) {
+        if (hold) {
+            pthread_mutex_unlock(&stripe.write_lock);
+        }
             printf("[Server P] Stock %s does not have enough sharessss in %s's portfolio. Unable to sell %d shares of %s.\n", stock_name.c_str(), username.c_str(), num_shares, stock_name.c_str());
         const char* response = "INSUFFICIENT_SHARES";
-        sendto(sockfd, response, strlen(response), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(response, strlen(response), client_addr, client_len);
         return;
     }
     
     // User has enough shares
     printf("[Server P] Stock %s has sufficient shares in %s's portfolio. Requesting users’ confirmation for selling stock.\n", stock_name.c_str(), username.c_str());
 
-    const char* response = "SUFFICIENT_SHARES";
-    sendto(sockfd, response, strlen(response), 0,
-         (struct sockaddr *)client_addr, client_len);
+    if (!hold) {
+        const char* response = "SUFFICIENT_SHARES";
+        send_reply(response, strlen(response), client_addr, client_len);
+        return;
+    }
+    ShareHold reservation;
+    reservation.id = next_hold_id++;
+    reservation.stock_name = stock_name;
+    reservation.shares = num_shares;
+    reservation.expires_ns = shm_now_ns() + (long long)SELL_HOLD_MS * 1000000LL;
+    slot->holds.push_back(reservation);
+    pthread_mutex_unlock(&stripe.write_lock);
+    
+    char response[64];
+    int len = snprintf(response, sizeof(response), "SUFFICIENT_SHARES %llu", reservation.id);
+    send_reply(response, len, client_addr, client_len);
+}
+
+// The member's slot, NULL for a member without a portfolio. The caller holds
+// the stripe's write_lock.
+MemberSlot* find_member_slot(PortfolioStripe& stripe, const std::string& username) {
+    MemberIndex::const_iterator it = stripe.members.find(username);
+    return it == stripe.members.end() ? NULL : it->second.get();
+}
+
+// Shares of `stock_name` held for pending sells. Expired holds are dropped
+// on the way.
+int held_shares(MemberSlot* slot, const std::string& stock_name) {
+    long long now = shm_now_ns();
+    int held = 0;
+    for (size_t i = 0; i < slot->holds.size(); ) {
+        if (slot->holds[i].expires_ns <= now) {
+            slot->holds[i] = slot->holds.back();
+            slot->holds.pop_back();
+            continue;
+        }
+        if (slot->holds[i].stock_name == stock_name) {
+            held += slot->holds[i].shares;
+        }
+        i++;
+    }
+    return held;
+}
+
+// Remove a live hold, true if it was there and covers this sell
+bool take_hold(MemberSlot* slot, unsigned long long hold_id, const std::string& stock_name, int num_shares) {
+    held_shares(slot, stock_name);
+    for (size_t i = 0; i < slot->holds.size(); i++) {
+        if (slot->holds[i].id != hold_id) {
+            continue;
+        }
+        bool covers = slot->holds[i].stock_name == stock_name && slot->holds[i].shares >= num_shares;
+        slot->holds[i] = slot->holds.back();
+        slot->holds.pop_back();
+        return covers;
+    }
+    return false;
 }
 
+// N [<user> <hold id>]: the member said no, give the held shares back
+void handle_sell_denied(const std::vector<std::string>& parts) {
+    if (parts.size() == 3) {
+        PortfolioStripe& stripe = stripe_for(parts[1]);
+        pthread_mutex_lock(&stripe.write_lock);
+        MemberSlot* slot = find_member_slot(stripe, parts[1]);
+        if (slot != NULL) {
+            take_hold(slot, strtoull(parts[2].c_str(), NULL, 10), "", 0);
+        }
+        pthread_mutex_unlock(&stripe.write_lock);
+    }
+    printf("[Server P] Sale Denied \n");
+    fflush(stdout);
+}
+
+// PORTFOLIO <user> [<seq> [<after>]]: the holdings that sort after `after`
+// (from the first one if it is missing), as many as fit in PAGE_MAX_BYTES,
+// under a "PORTFOLIO <seq> MORE|END" header line. Server M asks for the next
+// page with the last stock it got as the cursor. The first page's header
+// ends with the member's unrealized gain when every holding has a price.
 void handle_portfolio(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
     std::string username = parts[1];
+    unsigned seq = parts.size() >= 3 ? (unsigned)strtoul(parts[2].c_str(), NULL, 10) : 1;
+    std::string after = parts.size() == 4 ? parts[3] : "";
     
-    printf("[Server P] Received a position request from the main server for Member: %s\n", username.c_str());
-    
-    if (user_portfolios.find(username) == user_portfolios.end()) {
-        std::string response = "PORTFOLIO\n";
-        sendto(sockfd, response.c_str(), response.length(), 0,
-             (struct sockaddr *)client_addr, client_len);
-        printf("[Server P] Finished sending the gain and portfolio of %s to the main server.\n", username.c_str());
-        return;
+    if (after.empty()) {
+        printf("[Server P] Received a position request from the main server for Member: %s\n", username.c_str());
     }
     
-    Portfolio& portfolio = user_portfolios[username];
-    
-    std::string response = "PORTFOLIO\n";
-    
-    for (const auto& holding : portfolio) {
-        const StockHolding& stock = holding.second;
-        
-        if (stock.shares > 0) {
-            response += stock.stock_name + " " + 
-                      std::to_string(stock.shares) + " " + 
-                      std::to_string(stock.avg_price) + "\n";
+    std::string lines;
+    bool last = true;
+    double gain = 0.0;
+    bool priced = false;
+    PortfolioRef user = after.empty() ? read_position(username, &gain, &priced) : read_portfolio(username);
+    if (user) {
+        const Portfolio& portfolio = *user;
+        Portfolio::const_iterator it = after.empty() ? portfolio.begin() : portfolio.upper_bound(after);
+        for (; it != portfolio.end(); ++it) {
+            const StockHolding& stock = it->second;
+            if (stock.shares <= 0) {
+                continue;
+            }
+            std::string line = stock.stock_name + " " + 
+                               std::to_string(stock.shares) + " " + 
+                               std::to_string(stock.avg_price) + "\n";
+            if (!lines.empty() && lines.length() + line.length() > PAGE_MAX_BYTES) {
+                last = false;
+                break;
+            }
+            lines += line;
         }
     }
     
+    std::string response = "PORTFOLIO " + std::to_string(seq) + (last ? " END" : " MORE") +
+                           (priced ? " " + std::to_string(gain) : "") + "\n" + lines;
     
     // sendto response , beej guide 6.3
-    if (sendto(sockfd, response.c_str(), response.length(), 0,
-             (struct sockaddr *)client_addr, client_len) == -1) {
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
         perror("sendto");
     }
-    printf("[Server P] Finished sending the gain and portfolio of %s to the main server.\n", username.c_str());
+    if (last) {
+        printf("[Server P] Finished sending the gain and portfolio of %s to the main server.\n", username.c_str());
+    }
 }
 
-std::vector<std::string> split_string(const std::string& str, char delimiter) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(str);
-    std::string token;
+// TRADES <user> <seq> <since> [<stock>]: the member's trades after trade
+// number `since` (of that stock only, if given), as many as fit in
+// PAGE_MAX_BYTES, under a "TRADES <seq> MORE|END" header line. Server M asks
+// for the next page with the last trade number it got as `since`.
+void handle_trades(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    const std::string& username = parts[1];
+    unsigned seq = (unsigned)strtoul(parts[2].c_str(), NULL, 10);
+    unsigned long long since = strtoull(parts[3].c_str(), NULL, 10);
+    std::string stock_name = parts.size() == 5 ? parts[4] : "";
     
-    while (std::getline(ss, token, delimiter)) {
-        if (!token.empty()) {
-            tokens.push_back(token);
-        }
+    if (seq == 1) {
+        printf("[Server P] Received a trades request from the main server for Member: %s\n", username.c_str());
     }
     
-    return tokens;
+    bool more;
+    PortfolioStripe& stripe = stripe_for(username);
+    pthread_mutex_lock(&stripe.ledger_lock);
+    std::string lines = ledger_page(&stripe.ledger, username, stock_name, since, PAGE_MAX_BYTES, &more);
+    pthread_mutex_unlock(&stripe.ledger_lock);
+    
+    std::string response = "TRADES " + std::to_string(seq) + (more ? " MORE\n" : " END\n") + lines;
+    
+    // sendto response , beej guide 6.3
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+        perror("sendto");
+    }
+}
+
+// See backend.h
+const char* strip_request_tag(char* message) {
+    return backend_strip_tag(&trace_log, message);
+}
+
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len) {
+    return backend_send_reply(sockfd, shm_channel, &trace_log, data, len, client_addr, client_len);
 }
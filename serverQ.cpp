@@ -3,6 +3,7 @@
 // - Loads stock quotes from quotes.txt
 // - Provides current stock prices in response to quote requests
 // - Advances stock price index after buy/sell transactions
+// - Optionally moves every price on a clock tick (--simulate, see priceengine.h)
 // - Communicates with Server M via UDP
  
 // Portions of this code are inspired on Beej's Guide to Network Programming 
@@ -20,44 +21,162 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 #include <string>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <memory>
+#include <math.h>
+#include <time.h>
 #include <fstream>
 #include <iostream>
+#include "shmring.h"
+#include "filewatch.h"
+#include "pricetable.h"
+#include "priceengine.h"
+#include "tradecore.h"
+#include "trace.h"
+#include "backend.h"
+#include "priority.h"
+#include "quotestate.h"
 
 // Default values - replace XXX with your USC ID last 3 digits
 #define SERVER_Q_PORT 43654
 #define BUFFER_SIZE 1024
+#define PAGE_MAX_BYTES 960 // lines per paged reply; the request tag and "PAGE" header fit in the rest
 #define QUOTES_FILE "quotes.txt"
 #define MAX_PRICES 10 // Each stock has 10 prices that cycle
+#define HISTORY_LEVELS 4 // sparse table levels, floor(log2(MAX_PRICES)) + 1
+#define SIM_DEFAULT_TICK_MS 100
+#define SIM_DEFAULT_CORRELATION 0.3
+#define SIM_REPORT_SECONDS 10 // how often the price engine logs its update rate
+#define PRICE_SUBSCRIBE_MS 2000 // subscribers renew this often, and are dropped after three misses
+#define PRICE_PUSH_MS 100 // how often simulated prices are pushed to subscribers
 
 // Global socket file descriptor for cleanup
 int sockfd = -1;
 
+// --transport=shm: Server M's requests also arrive over a shared-memory ring
+// (see backend.h). process_lock keeps the UDP loop and the ring's thread
+// from running process_message() at the same time.
+ShmChannel* shm_channel = NULL;
+pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tracing (see trace.h and backend.h)
+TraceLog trace_log = { -1, 0, "serverQ" };
+
+// Range indexes over a stock's price series, built once at load time so a
+// HISTORY query never walks the series:
+//   pv_prefix/volume_prefix  sums over [0, i), VWAP of [from, to] in O(1)
+//   range_high/range_low     sparse tables, level k covers [i, i + 2^k),
+//                            high/low of any range from two overlapping blocks
+struct HistoryIndex {
+    double pv_prefix[MAX_PRICES + 1];
+    double volume_prefix[MAX_PRICES + 1];
+    double range_high[HISTORY_LEVELS][MAX_PRICES];
+    double range_low[HISTORY_LEVELS][MAX_PRICES];
+};
+static_assert((1 << (HISTORY_LEVELS - 1)) <= MAX_PRICES && MAX_PRICES < (1 << HISTORY_LEVELS),
+              "HISTORY_LEVELS must be floor(log2(MAX_PRICES)) + 1");
+
 // Stock data structures
 struct StockQuote {
     std::string name;
     double prices[MAX_PRICES];
+    double volumes[MAX_PRICES];  // optional in quotes.txt, 1 each when absent
     int current_idx;
+    int table_slot;  // entry in the shared price table, -1 until published
+    int sim_slot;    // stock in the price engine, -1 when it follows prices[]
+    int state_slot;  // entry in the state file, -1 when current_idx is not kept
+    HistoryIndex history;
     
-    StockQuote() : current_idx(0) {
+    StockQuote() : current_idx(0), table_slot(-1), sim_slot(-1), state_slot(-1) {
         for (int i = 0; i < MAX_PRICES; i++) {
             prices[i] = 0.0;
+            volumes[i] = 1.0;
         }
     }
 };
 
-std::map<std::string, StockQuote> stock_quotes;
+// One aggregated bar over series indexes [from, to]
+struct PriceBar {
+    double open, high, low, close, vwap, volume;
+};
+
+// Current quotes. A reload builds a new table on the watcher thread and
+// publishes it with one atomic pointer store (RCU style): each request works
+// on the snapshot it loaded, and the old table is freed when the last
+// request holding it is done.
+typedef std::map<std::string, StockQuote> QuoteTable;
+std::shared_ptr<QuoteTable> stock_quotes;
+
+// Current prices for same-host readers, Server Q is the only writer
+PriceTable* price_table = NULL;
+
+// Cursors (and simulated prices) that survive a restart, see quotestate.h.
+// Cursors are written under process_lock, simulated prices by the engine
+// thread alone. NULL for a standby.
+QuoteStateFile* quote_state = NULL;
+
+// --simulate=gbm|jump: the price engine (see priceengine.h) moves every stock
+// once per tick on its own thread, and the quoted price comes from it instead
+// of prices[current_idx]. Only the engine thread touches price_engine. After
+// each tick it publishes a copy of the log prices with one atomic pointer
+// store, the same way a reload publishes the quote table.
+struct SimFrame {
+    long long tick;
+    std::vector<double> log_prices;  // by StockQuote::sim_slot
+};
+bool simulating = false;             // set before any other thread starts
+PriceEngine price_engine;
+long long sim_tick_ns = SIM_DEFAULT_TICK_MS * 1000000LL;
+std::vector<int> sim_table_slots;    // price table slot by engine slot, -1 for none
+std::vector<int> sim_state_slots;    // state file entry by engine slot, -1 for none
+std::shared_ptr<const SimFrame> sim_frame;
+
+// Price pushes: a subscriber (Server P, see its handle_prices()) sends
+// SUBSCRIBE every PRICE_SUBSCRIBE_MS and gets "PRICES <seq> <stock> <price>
+// ..." datagrams whenever prices move: after an ADVANCE or a reload, and
+// every PRICE_PUSH_MS while simulating. A new subscriber first gets every
+// price. The sequence number starts from the wall clock, so it keeps growing
+// across restarts. All of this is guarded by process_lock.
+struct PriceSubscriber {
+    struct sockaddr_in addr;
+    long long expires_ns;
+};
+std::vector<PriceSubscriber> price_subscribers;
+std::vector<std::string> price_push;  // " <stock> <price>" pairs not sent yet
+unsigned long long price_push_seq = 0;
+long long next_sim_push_ns = 0;
 
 // Function prototypes
 void sigint_handler(int sig);
 void load_quotes_file();
-std::vector<std::string> split_string(const std::string& str, char delimiter);
+bool parse_quotes_file(QuoteTable& table);
+void reload_quotes_file();
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len);
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len);
+const char* strip_request_tag(char* message);
 void handle_quote(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void send_quote_page(unsigned seq, const std::string& after, struct sockaddr_in* client_addr, socklen_t client_len);
 void handle_advance(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void handle_batch_advance(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void handle_history(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len);
+void build_history_index(StockQuote& quote);
+PriceBar query_bar(const StockQuote& quote, int from, int to);
+void publish_price(StockQuote& quote);
+bool attach_quote_state(StockQuote& quote);
+void save_cursor(const StockQuote& quote);
+void start_price_engine(EngineModel model, double correlation, unsigned long long seed);
+void* run_price_engine(void* arg);
+void publish_sim_frame();
+std::shared_ptr<const SimFrame> load_sim_frame();
+double current_price(const StockQuote& quote, const SimFrame* frame);
+void handle_subscribe(struct sockaddr_in* client_addr, bool snapshot);
+void queue_price_push(const StockQuote& quote, const SimFrame* frame);
+void flush_price_push(const struct sockaddr_in* only);
 
 // catch ctrl+c, cleanup 
 void sigint_handler(int sig) {
@@ -65,10 +184,55 @@ void sigint_handler(int sig) {
     if (sockfd != -1) {
         close(sockfd);
     }
+    if (shm_channel != NULL) {
+        shm_channel_retire(shm_channel, SHM_NAME_Q);
+    }
+    if (price_table != NULL) {
+        shm_unlink(PRICE_TABLE_NAME);
+    }
+    if (quote_state != NULL) {
+        quote_state_flush(quote_state);
+    }
+    
     exit(0);
 }
 
+// bench.cpp builds this file with NO_SERVER_MAIN to call its handlers directly
+#ifndef NO_SERVER_MAIN
 int main(int argc, char *argv[]) {
+    // --transport=udp (default) or --transport=shm, and the price engine:
+    // --simulate=gbm|jump [--tick-ms=N] [--seed=N] [--correlation=R], --port=N for a standby instance
+    bool use_shm = false;
+    int port = SERVER_Q_PORT;
+    const char* simulate = NULL;
+    int tick_ms = SIM_DEFAULT_TICK_MS;
+    unsigned long long seed = 1;
+    double correlation = SIM_DEFAULT_CORRELATION;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--transport=shm") == 0) {
+            use_shm = true;
+        } else if (strcmp(argv[i], "--simulate=gbm") == 0 || strcmp(argv[i], "--simulate=jump") == 0) {
+            simulate = argv[i] + 11;
+        } else if (strncmp(argv[i], "--tick-ms=", 10) == 0) {
+            tick_ms = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            seed = strtoull(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--correlation=", 14) == 0) {
+            correlation = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--port=", 7) == 0) {
+            port = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--transport=udp") != 0) {
+            fprintf(stderr, "Usage: %s [--transport=udp|shm] [--simulate=gbm|jump] [--tick-ms=N] [--seed=N] "
+                            "[--correlation=R] [--port=N]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (tick_ms < 0 || correlation < 0.0 || correlation > 1.0) {
+        fprintf(stderr, "[Server Q] --tick-ms must be 0 or more and --correlation between 0 and 1\n");
+        exit(1);
+    }
+    sim_tick_ns = tick_ms * 1000000LL;
+    
     // shutdown on sigint, exit
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
@@ -91,7 +255,7 @@ int main(int argc, char *argv[]) {
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_flags = AI_PASSIVE; // Use my IP
 
-    if ((rv = getaddrinfo(NULL, std::to_string(SERVER_Q_PORT).c_str(), &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(NULL, std::to_string(port).c_str(), &hints, &servinfo)) != 0) {
         fprintf(stderr, "[Server Q] getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
     }
@@ -127,40 +291,156 @@ int main(int argc, char *argv[]) {
 
     freeaddrinfo(servinfo);
     
-    // Load quotes
+    // Load quotes, then put every cursor back where the last run left it.
+    // A standby keeps its cursors in memory: the file belongs to the primary.
     load_quotes_file();
+    if (port == SERVER_Q_PORT) {
+        bool reset = false;
+        quote_state = quote_state_open(QUOTE_STATE_FILE, &reset);
+        if (quote_state == NULL) {
+            perror("[Server Q] " QUOTE_STATE_FILE);
+            printf("[Server Q] Price cursors will not survive a restart.\n");
+        } else {
+            int resumed = 0;
+            for (auto& stock_pair : *stock_quotes) {
+                resumed += attach_quote_state(stock_pair.second) ? 1 : 0;
+            }
+            if (reset) {
+                printf("[Server Q] Started a new %s.\n", QUOTE_STATE_FILE);
+            } else {
+                printf("[Server Q] Resumed %d price cursors from %s.\n", resumed, QUOTE_STATE_FILE);
+            }
+        }
+    }
+    struct timespec boot;
+    clock_gettime(CLOCK_REALTIME, &boot);
+    price_push_seq = (unsigned long long)boot.tv_sec * 1000000ULL + boot.tv_nsec / 1000;
+    
+    // Publish them for readers on this host (see pricetable.h). A standby
+    // leaves the table to the primary.
+    if (port == SERVER_Q_PORT) {
+        price_table = price_table_create();
+        if (price_table == NULL) {
+            perror("price table");
+        }
+    }
+    if (price_table != NULL) {
+        for (auto& stock_pair : *stock_quotes) {
+            publish_price(stock_pair.second);
+        }
+    }
+    
+    // Before the watcher starts: the engine takes its stocks from the table
+    if (simulate != NULL) {
+        start_price_engine(strcmp(simulate, "jump") == 0 ? ENGINE_JUMP : ENGINE_GBM, correlation, seed);
+    }
+    
+    // Pick up edits to quotes.txt without a restart
+    static const FileWatch quotes_watch = { QUOTES_FILE, reload_quotes_file };
+    if (!file_watch_start(&quotes_watch)) {
+        fprintf(stderr, "[Server Q] Failed to start the quotes file watcher\n");
+    }
+    
+    printf("[Server Q] Booting up using UDP on port %d\n", port);
     
-    printf("[Server Q] Booting up using UDP on port %d\n", SERVER_Q_PORT);
+    // The rings are found by name, not port: they belong to the primary
+    if (use_shm && port != SERVER_Q_PORT) {
+        printf("[Server Q] Standby on port %d: serving UDP only, not shared memory.\n", port);
+        use_shm = false;
+    }
+    
+    // Same-host fast path, UDP keeps working alongside it
+    if (use_shm) {
+        pthread_t shm_thread;
+        static BackendShm shm = { NULL, &trace_log, process_message, &process_lock };
+        shm_channel = shm_channel_create(SHM_NAME_Q);
+        shm.channel = shm_channel;
+        if (shm_channel == NULL) {
+            perror("shm_open");
+        } else if (pthread_create(&shm_thread, NULL, backend_shm_serve, &shm) != 0) {
+            fprintf(stderr, "[Server Q] Failed to start the shared memory thread\n");
+            shm_channel_retire(shm_channel, SHM_NAME_Q);
+            shm_channel = NULL;
+        } else {
+            printf("[Server Q] Serving Server M over shared memory (%s).\n", SHM_NAME_Q);
+        }
+    }
     
-    // main loop recv/process (beej guide 6.3)
-    struct sockaddr_storage their_addr;
-    socklen_t addr_len;
-    char buffer[BUFFER_SIZE];
-    int numbytes;
+    // main loop recv/process (beej guide 6.3), up to PRIORITY_BATCH waiting
+    // requests at a time with ADVANCE ahead of the reads (see priority.h)
+    PriorityBatch batch;
 
     while (1) {
-        addr_len = sizeof their_addr;
-        // recvfrom loop (beej guide 5.8)
-        if ((numbytes = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0,
-            (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-            perror("recvfrom");
+        if (priority_recv_udp(sockfd, &batch) == -1) {
+            perror("recvmmsg");
             continue;
         }
-
-        buffer[numbytes] = '\0';
         
-        process_message(buffer, (struct sockaddr_in*)&their_addr, addr_len);
+        for (int i = 0; i < batch.count; i++) {
+            int m = batch.order[i];
+            backend_received_ns = batch.received_ns;
+            pthread_mutex_lock(&process_lock);
+            process_message(strip_request_tag(batch.data[m]), (struct sockaddr_in*)&batch.addr[m],
+                            batch.addr_len[m]);
+            pthread_mutex_unlock(&process_lock);
+        }
     }
     
     return 0;
 }
+#endif
 
 void load_quotes_file() {
+    std::shared_ptr<QuoteTable> table = std::make_shared<QuoteTable>();
+    if (!parse_quotes_file(*table)) {
+        printf("[Server Q] Error: Could not open quotes file: %s\n", QUOTES_FILE);
+        exit(1);
+    }
+    std::atomic_store(&stock_quotes, table);
+}
+
+// Swap in a freshly parsed quotes.txt. Parsing happens here on the watcher
+// thread; only carrying each stock's current_idx (and price table slot) over
+// and the pointer swap run under process_lock, so no ADVANCE can land in the
+// old table after its cursor was copied.
+void reload_quotes_file() {
+    std::shared_ptr<QuoteTable> table = std::make_shared<QuoteTable>();
+    if (!parse_quotes_file(*table) || table->empty()) {
+        printf("[Server Q] Ignoring unreadable or empty %s, keeping the current quotes.\n", QUOTES_FILE);
+        return;
+    }
+    
+    int added = 0;
+    pthread_mutex_lock(&process_lock);
+    std::shared_ptr<QuoteTable> old_table = std::atomic_load(&stock_quotes);
+    for (auto& stock_pair : *table) {
+        StockQuote& quote = stock_pair.second;
+        QuoteTable::const_iterator old = old_table->find(stock_pair.first);
+        if (old != old_table->end()) {
+            quote.current_idx = old->second.current_idx;
+            quote.table_slot = old->second.table_slot;
+            quote.sim_slot = old->second.sim_slot;
+            quote.state_slot = old->second.state_slot;
+        } else {
+            if (quote_state != NULL) {
+                attach_quote_state(quote);
+            }
+            added++;
+        }
+        publish_price(quote);
+    }
+    std::atomic_store(&stock_quotes, table);
+    flush_price_push(NULL);
+    pthread_mutex_unlock(&process_lock);
+    
+    printf("[Server Q] Reloaded %s: %d stocks (%d new).\n", QUOTES_FILE, (int)table->size(), added);
+}
+
+bool parse_quotes_file(QuoteTable& table) {
     std::ifstream file(QUOTES_FILE);
     
     if (!file.is_open()) {
-        printf("[Server Q] Error: Could not open quotes file: %s\n", QUOTES_FILE);
-        exit(1);
+        return false;
     }
     
     std::string line;
@@ -178,16 +458,31 @@ void load_quotes_file() {
             StockQuote quote;
             quote.name = stock_name;
             
+            // Optional second block of MAX_PRICES numbers: volume at each index.
+            // A bad number rejects the whole file, so a half-edited quotes.txt
+            // never replaces a good table.
+            bool valid = true;
             for (int i = 0; i < MAX_PRICES; i++) {
-                quote.prices[i] = std::stod(parts[i + 1]);
+                valid = valid && parse_double(parts[i + 1], &quote.prices[i]);
+            }
+            if (parts.size() >= 2 * MAX_PRICES + 1) {
+                for (int i = 0; i < MAX_PRICES; i++) {
+                    valid = valid && parse_double(parts[MAX_PRICES + i + 1], &quote.volumes[i]);
+                }
             }
+            if (!valid) {
+                printf("[Server Q] Invalid number in %s: %s\n", QUOTES_FILE, line.c_str());
+                return false;
+            }
+            build_history_index(quote);
             
-            stock_quotes[stock_name] = quote;
+            table[stock_name] = quote;
             stock_count++;
         }
     }
     
     file.close();
+    return true;
 }
 
 void process_message(const char* message, struct sockaddr_in* client_addr, socklen_t client_len) {
@@ -198,35 +493,40 @@ void process_message(const char* message, struct sockaddr_in* client_addr, sockl
         return;
     }
     
+    // Server M's health check, answered without a log line
+    if (parts[0] == "PING") {
+        send_reply("PONG", sizeof("PONG"), client_addr, client_len);
+        return;
+    }
+    
+    if (parts[0] == "SUBSCRIBE") {
+        handle_subscribe(client_addr, parts.size() == 2 && parts[1] == "ALL");
+        return;
+    }
+    
     if (parts[0] == "QUOTE") {
         handle_quote(parts, client_addr, client_len);
     } 
-    else if (parts[0] == "ADVANCE" && parts.size() == 2) {
+    else if (parts[0] == "QUOTE_PAGE" && (parts.size() == 2 || parts.size() == 3)) {
+        send_quote_page((unsigned)strtoul(parts[1].c_str(), NULL, 10), parts.size() == 3 ? parts[2] : "",
+                        client_addr, client_len);
+    }
+    else if (parts[0] == "ADVANCE" && parts.size() >= 2) {
         handle_advance(parts, client_addr, client_len);
     }
+    else if (parts[0] == "HISTORY" && (parts.size() == 4 || parts.size() == 5)) {
+        handle_history(parts, client_addr, client_len);
+    }
 }
 
 void handle_quote(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+    std::shared_ptr<const SimFrame> frame = load_sim_frame();
+    
     if (parts.size() == 1) {
-        // request all stock quotes
-        printf("[Server Q] Received a quote request from the main server.\n");
-        
-        std::string response;
-        
-        for (const auto& stock_pair : stock_quotes) {
-            const StockQuote& quote = stock_pair.second;
-            double current_price = quote.prices[quote.current_idx];
-            
-            response += quote.name + " " + std::to_string(current_price) + "\n";
-        }
-        
-        // sendto response (beej guide 5.8)
-        if (sendto(sockfd, response.c_str(), response.length(), 0,
-                 (struct sockaddr *)client_addr, client_len) == -1) {
-            perror("sendto");
-        }
-        
-        printf("[Server Q] Returned all stock quotes.\n");
+        // request all stock quotes: too many for one datagram, so this is
+        // the first page and Server M asks for the rest with QUOTE_PAGE
+        send_quote_page(1, "", client_addr, client_len);
     } 
     else if (parts.size() == 2) {
         // request specific stock quote
@@ -235,47 +535,110 @@ void handle_quote(const std::vector<std::string>& parts, struct sockaddr_in* cli
         printf("[Server Q] Received a quote request from the main server for stock %s.\n", stock_name.c_str());
         
         // Check if stock exists
-        if (stock_quotes.find(stock_name) == stock_quotes.end()) {
+        if (quotes->find(stock_name) == quotes->end()) {
             const char* error = "ERROR: Stock not found";
-            sendto(sockfd, error, strlen(error), 0,
-                 (struct sockaddr *)client_addr, client_len);
+            send_reply(error, strlen(error), client_addr, client_len);
             return;
         }
         
         // Get current price
-        const StockQuote& quote = stock_quotes[stock_name];
-        double current_price = quote.prices[quote.current_idx];
+        const StockQuote& quote = (*quotes)[stock_name];
+        double price = current_price(quote, frame.get());
         
         // Prepare response
-        std::string response = stock_name + " " + std::to_string(current_price);
+        std::string response = stock_name + " " + std::to_string(price);
         
         // sendto response (beej guide 5.8)
-        if (sendto(sockfd, response.c_str(), response.length(), 0,
-                 (struct sockaddr *)client_addr, client_len) == -1) {
+        if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
             perror("sendto");
         }
         
         printf("[Server Q] Returned the stock quote of %s.\n", stock_name.c_str());
     }
+    else {
+        // Batched quote for a basket: one "<stock> <price>" line per stock, in
+        // request order, or an error naming the first unknown stock
+        printf("[Server Q] Received a quote request from the main server for %d stocks.\n", (int)parts.size() - 1);
+        
+        std::string response;
+        for (size_t i = 1; i < parts.size(); i++) {
+            QuoteTable::const_iterator it = quotes->find(parts[i]);
+            if (it == quotes->end()) {
+                std::string error = "ERROR: Stock not found: " + parts[i];
+                send_reply(error.c_str(), error.length(), client_addr, client_len);
+                return;
+            }
+            response += parts[i] + " " + std::to_string(current_price(it->second, frame.get())) + "\n";
+        }
+        
+        // sendto response (beej guide 5.8)
+        if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+            perror("sendto");
+        }
+        
+        printf("[Server Q] Returned %d stock quotes.\n", (int)parts.size() - 1);
+    }
+}
+
+// QUOTE_PAGE <seq> [<after>]: the stocks that sort after `after` (from the
+// first one if it is missing), as many as fit in PAGE_MAX_BYTES, under a
+// "PAGE <seq> MORE|END" header line. The cursor is a stock name rather than
+// an offset, so a reload between two pages never skips or repeats a stock.
+void send_quote_page(unsigned seq, const std::string& after, struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+    std::shared_ptr<const SimFrame> frame = load_sim_frame();
+    
+    if (after.empty()) {
+        printf("[Server Q] Received a quote request from the main server.\n");
+    }
+    
+    QuoteTable::const_iterator it = after.empty() ? quotes->begin() : quotes->upper_bound(after);
+    std::string lines;
+    for (; it != quotes->end(); ++it) {
+        const StockQuote& quote = it->second;
+        std::string line = quote.name + " " + std::to_string(current_price(quote, frame.get())) + "\n";
+        if (!lines.empty() && lines.length() + line.length() > PAGE_MAX_BYTES) {
+            break;
+        }
+        lines += line;
+    }
+    bool last = it == quotes->end();
+    std::string response = "PAGE " + std::to_string(seq) + (last ? " END\n" : " MORE\n") + lines;
+    
+    // sendto response (beej guide 5.8)
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+        perror("sendto");
+    }
+    
+    if (last) {
+        printf("[Server Q] Returned all stock quotes.\n");
+    }
 }
 
 void handle_advance(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    if (parts.size() > 2) {
+        handle_batch_advance(parts, client_addr, client_len);
+        return;
+    }
     std::string stock_name = parts[1];
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
     
     // Check if stock exists
-    if (stock_quotes.find(stock_name) == stock_quotes.end()) {
+    if (quotes->find(stock_name) == quotes->end()) {
         const char* error = "ERROR: Stock not found";
-        sendto(sockfd, error, strlen(error), 0,
-             (struct sockaddr *)client_addr, client_len);
+        send_reply(error, strlen(error), client_addr, client_len);
         return;
     }
     
-    // Advance stock price index
-    StockQuote& quote = stock_quotes[stock_name];
+    // Advance stock price index. A simulated stock's price moves with the
+    // clock instead, only its index into the history series moves here.
+    StockQuote& quote = (*quotes)[stock_name];
+    std::shared_ptr<const SimFrame> frame = load_sim_frame();
     int old_idx = quote.current_idx;
+    double price = current_price(quote, frame.get()); // Price before advancing
     quote.current_idx = (quote.current_idx + 1) % MAX_PRICES;
-    
-    double price = quote.prices[old_idx]; // Price before advancing
+    save_cursor(quote);
+    publish_price(quote);
     
     printf("[Server Q] Received a time forward request for %s, the current price of that stock is %.2f at time %d.\n",
            stock_name.c_str(), price, old_idx);
@@ -283,25 +646,389 @@ void handle_advance(const std::vector<std::string>& parts, struct sockaddr_in* c
     // Prepare response
     std::string response = "ADVANCED " + stock_name + " to index " + 
                           std::to_string(quote.current_idx) + 
-                          ", new price: " + std::to_string(quote.prices[quote.current_idx]);
+                          ", new price: " + std::to_string(current_price(quote, frame.get()));
+    
+    // Subscribers hear of the new price before Server M does
+    flush_price_push(NULL);
+    
+    // sendto response (beej guide 5.8)
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+        perror("sendto");
+    }
+}
+
+// ADVANCE <stock> <stock> ...: one step per listed stock (a stock listed twice
+// moves twice), after a basket. Nothing moves unless every stock exists.
+void handle_batch_advance(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+    
+    for (size_t i = 1; i < parts.size(); i++) {
+        if (quotes->find(parts[i]) == quotes->end()) {
+            std::string error = "ERROR: Stock not found: " + parts[i];
+            send_reply(error.c_str(), error.length(), client_addr, client_len);
+            return;
+        }
+    }
+    for (size_t i = 1; i < parts.size(); i++) {
+        StockQuote& quote = (*quotes)[parts[i]];
+        quote.current_idx = (quote.current_idx + 1) % MAX_PRICES;
+        save_cursor(quote);
+        publish_price(quote);
+    }
+    
+    printf("[Server Q] Received a time forward request for %d stocks.\n", (int)parts.size() - 1);
+    
+    std::string response = "ADVANCED " + std::to_string(parts.size() - 1) + " stocks";
+    flush_price_push(NULL);
+    
+    // sendto response (beej guide 5.8)
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
+        perror("sendto");
+    }
+}
+
+// HISTORY <stock> <from> <to> [bar_size]: OHLC, VWAP and volume over series
+// indexes [from, to], as one bar or as consecutive bars of bar_size indexes.
+// One line per bar: "<from> <to> <open> <high> <low> <close> <vwap> <volume>".
+void handle_history(const std::vector<std::string>& parts, struct sockaddr_in* client_addr, socklen_t client_len) {
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+    std::string stock_name = parts[1];
+    
+    printf("[Server Q] Received a history request from the main server for stock %s.\n", stock_name.c_str());
+    
+    QuoteTable::const_iterator it = quotes->find(stock_name);
+    if (it == quotes->end()) {
+        const char* error = "ERROR: Stock not found";
+        send_reply(error, strlen(error), client_addr, client_len);
+        return;
+    }
+    
+    int from = 0, to = 0, bar_size = 1;
+    bool parsed = parse_int(parts[2], &from) && parse_int(parts[3], &to) &&
+                  (parts.size() < 5 || parse_int(parts[4], &bar_size));
+    if (!parsed || from < 0 || to >= MAX_PRICES || from > to || bar_size <= 0) {
+        const char* error = "ERROR: Invalid range";
+        send_reply(error, strlen(error), client_addr, client_len);
+        return;
+    }
+    if (parts.size() < 5) {
+        bar_size = to - from + 1;
+    }
+    
+    std::string response;
+    char line[256];
+    for (int start = from; start <= to; start += bar_size) {
+        int end = start + bar_size - 1 < to ? start + bar_size - 1 : to;
+        PriceBar bar = query_bar(it->second, start, end);
+        snprintf(line, sizeof(line), "%d %d %.6f %.6f %.6f %.6f %.6f %.6f\n", start, end,
+                 bar.open, bar.high, bar.low, bar.close, bar.vwap, bar.volume);
+        response += line;
+    }
     
     // sendto response (beej guide 5.8)
-    if (sendto(sockfd, response.c_str(), response.length(), 0,
-             (struct sockaddr *)client_addr, client_len) == -1) {
+    if (send_reply(response.c_str(), response.length(), client_addr, client_len) == -1) {
         perror("sendto");
     }
+    
+    printf("[Server Q] Returned the history of %s for indexes %d to %d.\n", stock_name.c_str(), from, to);
+}
+
+void build_history_index(StockQuote& quote) {
+    HistoryIndex& index = quote.history;
+    index.pv_prefix[0] = 0.0;
+    index.volume_prefix[0] = 0.0;
+    for (int i = 0; i < MAX_PRICES; i++) {
+        index.pv_prefix[i + 1] = index.pv_prefix[i] + quote.prices[i] * quote.volumes[i];
+        index.volume_prefix[i + 1] = index.volume_prefix[i] + quote.volumes[i];
+        index.range_high[0][i] = quote.prices[i];
+        index.range_low[0][i] = quote.prices[i];
+    }
+    for (int k = 1; k < HISTORY_LEVELS; k++) {
+        int half = 1 << (k - 1);
+        for (int i = 0; i + (1 << k) <= MAX_PRICES; i++) {
+            index.range_high[k][i] = std::max(index.range_high[k - 1][i], index.range_high[k - 1][i + half]);
+            index.range_low[k][i] = std::min(index.range_low[k - 1][i], index.range_low[k - 1][i + half]);
+        }
+    }
 }
 
-std::vector<std::string> split_string(const std::string& str, char delimiter) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(str);
-    std::string token;
+// O(1) for any 0 <= from <= to < MAX_PRICES
+PriceBar query_bar(const StockQuote& quote, int from, int to) {
+    const HistoryIndex& index = quote.history;
+    int k = 31 - __builtin_clz((unsigned)(to - from + 1));
+    int second = to - (1 << k) + 1;
     
-    while (std::getline(ss, token, delimiter)) {
-        if (!token.empty()) {
-            tokens.push_back(token);
+    PriceBar bar;
+    bar.open = quote.prices[from];
+    bar.close = quote.prices[to];
+    bar.high = std::max(index.range_high[k][from], index.range_high[k][second]);
+    bar.low = std::min(index.range_low[k][from], index.range_low[k][second]);
+    bar.volume = index.volume_prefix[to + 1] - index.volume_prefix[from];
+    bar.vwap = bar.volume > 0 ? (index.pv_prefix[to + 1] - index.pv_prefix[from]) / bar.volume : 0.0;
+    return bar;
+}
+
+// Write the stock's current price to the shared price table, and queue it
+// for the subscribers
+void publish_price(StockQuote& quote) {
+    queue_price_push(quote, load_sim_frame().get());
+    // A simulated stock's entry is the engine thread's, see publish_sim_frame()
+    if (price_table == NULL || quote.sim_slot != -1) {
+        return;
+    }
+    if (quote.table_slot == -1) {
+        quote.table_slot = price_table_add(price_table, quote.name);
+        if (quote.table_slot == -1) {
+            fprintf(stderr, "[Server Q] No room in the price table for %s\n", quote.name.c_str());
+            return;
+        }
+    }
+    price_table_publish(price_table, quote.table_slot, quote.prices[quote.current_idx], quote.current_idx);
+}
+
+// Give the stock its entry in the state file, taking the cursor from it
+// when the entry was there already. Returns whether it was.
+bool attach_quote_state(StockQuote& quote) {
+    quote.state_slot = quote_state_find(quote_state, quote.name);
+    if (quote.state_slot != -1) {
+        int idx = quote_state->entries[quote.state_slot].current_idx;
+        if (idx >= 0 && idx < MAX_PRICES) {
+            quote.current_idx = idx;
+            return true;
+        }
+        save_cursor(quote);
+        return false;
+    }
+    quote.state_slot = quote_state_add(quote_state, quote.name);
+    if (quote.state_slot == -1) {
+        printf("[Server Q] No room in %s for %s, its cursor starts at 0 after a restart.\n",
+               QUOTE_STATE_FILE, quote.name.c_str());
+    }
+    return false;
+}
+
+// One store into the mapped file, nothing else
+void save_cursor(const StockQuote& quote) {
+    if (quote.state_slot != -1) {
+        quote_state->entries[quote.state_slot].current_idx = quote.current_idx;
+    }
+}
+
+// Hand every stock in the table to the price engine, starting from its
+// current price with the volatility of its series, and start the clock.
+// A stock with a simulated price in the state file starts from that price
+// instead. Stocks a reload adds later keep following their series.
+void start_price_engine(EngineModel model, double correlation, unsigned long long seed) {
+    engine_init(&price_engine, model, correlation, seed);
+    for (auto& stock_pair : *stock_quotes) {
+        StockQuote& quote = stock_pair.second;
+        double start_price = quote.prices[quote.current_idx];
+        if (quote.state_slot != -1 && quote_state->entries[quote.state_slot].has_sim_price) {
+            start_price = exp(quote_state->entries[quote.state_slot].sim_log_price);
         }
+        quote.sim_slot = engine_add(&price_engine, start_price, engine_series_vol(quote.prices, MAX_PRICES));
+        sim_table_slots.push_back(quote.table_slot);
+        sim_state_slots.push_back(quote.state_slot);
     }
+    engine_ready(&price_engine);
+    simulating = true;
+    publish_sim_frame();
     
-    return tokens;
+    pthread_t engine_thread;
+    if (pthread_create(&engine_thread, NULL, run_price_engine, NULL) != 0) {
+        fprintf(stderr, "[Server Q] Failed to start the price engine, prices stay where they are\n");
+        return;
+    }
+    printf("[Server Q] Simulating %d stocks (%s, correlation %.2f, seed %llu), ", (int)price_engine.count,
+           model == ENGINE_JUMP ? "jump" : "gbm", correlation, seed);
+    if (sim_tick_ns == 0) {
+        printf("ticking back to back.\n");
+    } else {
+        printf("one tick every %lld ms.\n", sim_tick_ns / 1000000LL);
+    }
+}
+
+// Tick on an absolute CLOCK_MONOTONIC schedule, or back to back with
+// --tick-ms=0. The path depends only on the tick count, so a tick that runs
+// late does not change prices, only when they are seen. If the engine falls
+// more than a second behind, the schedule restarts from now.
+void* run_price_engine(void* arg) {
+    (void)arg;
+    long long next_ns = shm_now_ns();
+    long long report_ns = next_ns + SIM_REPORT_SECONDS * 1000000000LL;
+    long long report_tick = price_engine.tick;
+    
+    while (1) {
+        engine_tick(&price_engine);
+        publish_sim_frame();
+        
+        long long now = shm_now_ns();
+        if (now >= report_ns) {
+            double updates = (double)(price_engine.tick - report_tick) * price_engine.count;
+            printf("[Server Q] Price engine at tick %lld, %.2f million updates/s.\n", price_engine.tick,
+                   updates / (now - report_ns + SIM_REPORT_SECONDS * 1000000000LL) * 1000.0);
+            fflush(stdout);
+            report_ns = now + SIM_REPORT_SECONDS * 1000000000LL;
+            report_tick = price_engine.tick;
+        }
+        if (sim_tick_ns == 0) {
+            continue;
+        }
+        next_ns += sim_tick_ns;
+        if (now - next_ns > 1000000000LL) {
+            next_ns = now;
+        }
+        struct timespec wake;
+        wake.tv_sec = next_ns / 1000000000LL;
+        wake.tv_nsec = next_ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+// Copy the engine's log prices out for the request threads, and refresh the
+// shared price table and the state file. The engine thread is the only
+// writer of a simulated stock's entries in both (publish_price() leaves
+// them alone, and each table entry has its own sequence lock), so it writes
+// them without process_lock and never holds up QUOTE or ADVANCE, even at
+// --tick-ms=0. It takes the lock only to push, at most every PRICE_PUSH_MS.
+void publish_sim_frame() {
+    std::shared_ptr<SimFrame> frame = std::make_shared<SimFrame>();
+    frame->tick = price_engine.tick;
+    frame->log_prices.assign(price_engine.log_price.begin(), price_engine.log_price.begin() + price_engine.count);
+    std::atomic_store(&sim_frame, std::shared_ptr<const SimFrame>(frame));
+    
+    if (price_table != NULL) {
+        for (size_t slot = 0; slot < sim_table_slots.size(); slot++) {
+            if (sim_table_slots[slot] != -1) {
+                price_table_publish(price_table, sim_table_slots[slot], exp(frame->log_prices[slot]), -1);
+            }
+        }
+    }
+    if (quote_state != NULL) {
+        for (size_t slot = 0; slot < sim_state_slots.size(); slot++) {
+            if (sim_state_slots[slot] != -1) {
+                QuoteStateEntry& entry = quote_state->entries[sim_state_slots[slot]];
+                entry.sim_log_price = frame->log_prices[slot];
+                entry.has_sim_price = 1;
+            }
+        }
+    }
+    // Pushing every tick would flood the subscribers at --tick-ms=0
+    long long now = shm_now_ns();
+    if (now < next_sim_push_ns) {
+        return;
+    }
+    next_sim_push_ns = now + PRICE_PUSH_MS * 1000000LL;
+    pthread_mutex_lock(&process_lock);
+    if (!price_subscribers.empty()) {
+        std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+        for (auto& stock_pair : *quotes) {
+            if (stock_pair.second.sim_slot != -1) {
+                queue_price_push(stock_pair.second, frame.get());
+            }
+        }
+        flush_price_push(NULL);
+    }
+    pthread_mutex_unlock(&process_lock);
+}
+
+// SUBSCRIBE [ALL]: add or renew a price subscriber. A new one, or one that
+// asks with ALL, gets every price. No reply otherwise.
+void handle_subscribe(struct sockaddr_in* client_addr, bool snapshot) {
+    long long expires_ns = shm_now_ns() + 3 * PRICE_SUBSCRIBE_MS * 1000000LL;
+    size_t i;
+    for (i = 0; i < price_subscribers.size(); i++) {
+        const struct sockaddr_in& addr = price_subscribers[i].addr;
+        if (addr.sin_addr.s_addr == client_addr->sin_addr.s_addr && addr.sin_port == client_addr->sin_port) {
+            price_subscribers[i].expires_ns = expires_ns;
+            break;
+        }
+    }
+    if (i == price_subscribers.size()) {
+        PriceSubscriber subscriber;
+        subscriber.addr = *client_addr;
+        subscriber.expires_ns = expires_ns;
+        price_subscribers.push_back(subscriber);
+        printf("[Server Q] Port %d subscribed to price changes.\n", ntohs(client_addr->sin_port));
+    } else if (!snapshot) {
+        return;
+    }
+    
+    // Whatever is queued goes to everyone first, the snapshot to this subscriber only
+    flush_price_push(NULL);
+    std::shared_ptr<QuoteTable> quotes = std::atomic_load(&stock_quotes);
+    std::shared_ptr<const SimFrame> frame = load_sim_frame();
+    for (auto& stock_pair : *quotes) {
+        queue_price_push(stock_pair.second, frame.get());
+    }
+    flush_price_push(client_addr);
+}
+
+void queue_price_push(const StockQuote& quote, const SimFrame* frame) {
+    if (price_subscribers.empty()) {
+        return;
+    }
+    price_push.push_back(" " + quote.name + " " + std::to_string(current_price(quote, frame)));
+}
+
+// Send the queued prices, PAGE_MAX_BYTES of pairs per datagram, to `only` or
+// (when it is NULL) to every subscriber that renewed in time
+void flush_price_push(const struct sockaddr_in* only) {
+    long long now = shm_now_ns();
+    for (size_t i = 0; i < price_subscribers.size(); ) {
+        if (price_subscribers[i].expires_ns < now) {
+            printf("[Server Q] Port %d stopped renewing its price subscription.\n",
+                   ntohs(price_subscribers[i].addr.sin_port));
+            price_subscribers.erase(price_subscribers.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    
+    size_t next = 0;
+    while (next < price_push.size()) {
+        std::string pairs;
+        do {
+            pairs += price_push[next++];
+        } while (next < price_push.size() && pairs.size() + price_push[next].size() <= PAGE_MAX_BYTES);
+        std::string datagram = "PRICES " + std::to_string(price_push_seq++) + pairs;
+        for (size_t i = 0; i < price_subscribers.size(); i++) {
+            const struct sockaddr_in* addr = &price_subscribers[i].addr;
+            if (only != NULL && (addr->sin_addr.s_addr != only->sin_addr.s_addr || addr->sin_port != only->sin_port)) {
+                continue;
+            }
+            if (sendto(sockfd, datagram.data(), datagram.size(), 0, (const struct sockaddr*)addr, sizeof(*addr)) == -1) {
+                perror("sendto subscriber");
+            }
+        }
+    }
+    price_push.clear();
+}
+
+// The latest engine frame, empty when not simulating
+std::shared_ptr<const SimFrame> load_sim_frame() {
+    if (!simulating) {
+        return std::shared_ptr<const SimFrame>();
+    }
+    return std::atomic_load(&sim_frame);
+}
+
+// The stock's price now: from the engine frame for a simulated stock,
+// otherwise the series price at current_idx
+double current_price(const StockQuote& quote, const SimFrame* frame) {
+    if (quote.sim_slot != -1 && frame != NULL) {
+        return exp(frame->log_prices[quote.sim_slot]);
+    }
+    return quote.prices[quote.current_idx];
+}
+
+// See backend.h
+const char* strip_request_tag(char* message) {
+    return backend_strip_tag(&trace_log, message);
+}
+
+int send_reply(const char* data, size_t len, struct sockaddr_in* client_addr, socklen_t client_len) {
+    return backend_send_reply(sockfd, shm_channel, &trace_log, data, len, client_addr, client_len);
 }
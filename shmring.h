@@ -0,0 +1,295 @@
+// shmring.h - Shared-memory transport between Server M and co-located backends
+
+// Each backend started with --transport=shm publishes a channel in POSIX
+// shared memory: one single-producer/single-consumer ring for Server M's
+// requests and one for the backend's replies. Messages are the same bytes
+// that would travel in a UDP datagram (including the "#<id> " request tag).
+//
+// A consumer first busy-polls its ring for an adaptive window, then parks:
+// it raises `parked` and sleeps on the `doorbell` futex. Producers only make
+// the futex_wake syscall when they see the consumer parked, so a busy pair
+// exchanges messages without entering the kernel at all.
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sched.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+
+#define SHM_NAME_A "/ee450_serverA"
+#define SHM_NAME_P "/ee450_serverP"
+#define SHM_NAME_Q "/ee450_serverQ"
+#define SHM_MAGIC 0x45453530u      // "EE50"
+#define SHM_RING_SLOTS 256         // power of two
+#define SHM_MSG_MAX 1024           // same as the UDP BUFFER_SIZE
+#define SHM_SPIN_START_NS 20000    // initial busy-poll window
+#define SHM_SPIN_MAX_NS 200000
+#define SHM_SPIN_MIN_NS 1000
+
+struct ShmSlot {
+    uint32_t len;
+    char data[SHM_MSG_MAX];
+};
+
+struct ShmRing {
+    alignas(64) std::atomic<uint32_t> head;     // next slot to read, advanced by the consumer
+    alignas(64) std::atomic<uint32_t> tail;     // next slot to write, advanced by the producer
+    alignas(64) std::atomic<uint32_t> parked;   // consumer is asleep (or about to be)
+    std::atomic<uint32_t> doorbell;             // futex word, bumped to wake the consumer
+    ShmSlot slots[SHM_RING_SLOTS];
+};
+
+struct ShmChannel {
+    uint32_t magic;
+    std::atomic<uint32_t> alive;                // cleared when the backend shuts down
+    ShmRing requests;                           // Server M -> backend
+    ShmRing replies;                            // backend -> Server M
+};
+
+// Consumer-side busy-poll window. It doubles when spinning caught a message
+// and halves when it did not; on a single CPU spinning only delays the
+// producer, so it stays off.
+struct ShmSpin {
+    long long window_ns;
+};
+
+static inline void shm_spin_init(ShmSpin* spin) {
+    spin->window_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_START_NS : 0;
+}
+
+static inline long long shm_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void shm_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// timeout_ms < 0 waits forever. The word lives in a MAP_SHARED mapping, so
+// this is a process-shared (not FUTEX_PRIVATE) wait.
+static inline int shm_futex_wait(std::atomic<uint32_t>* word, uint32_t expected, int timeout_ms) {
+    struct timespec ts;
+    struct timespec* tsp = NULL;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    return (int)syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, tsp, NULL, 0);
+}
+
+static inline void shm_futex_wake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void shm_ring_wake(ShmRing* ring) {
+    ring->doorbell.fetch_add(1);
+    shm_futex_wake(&ring->doorbell);
+}
+
+// Producer side. Returns false if the message is too big or the ring is full.
+static inline bool shm_ring_push(ShmRing* ring, const char* data, size_t len) {
+    if (len > SHM_MSG_MAX) {
+        return false;
+    }
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= SHM_RING_SLOTS) {
+        return false;
+    }
+    ShmSlot& slot = ring->slots[tail & (SHM_RING_SLOTS - 1)];
+    memcpy(slot.data, data, len);
+    slot.len = (uint32_t)len;
+    ring->tail.store(tail + 1, std::memory_order_release);
+
+    // Pairs with the fence in shm_ring_park(): either the consumer sees the
+    // new tail before sleeping, or we see it parked and ring the doorbell
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->parked.load(std::memory_order_relaxed)) {
+        shm_ring_wake(ring);
+    }
+    return true;
+}
+
+static inline bool shm_ring_empty(ShmRing* ring) {
+    return ring->head.load(std::memory_order_relaxed) == ring->tail.load(std::memory_order_acquire);
+}
+
+// Consumer side. Copies the oldest message into buf (truncated to cap) and
+// returns its length, or -1 if the ring is empty.
+static inline int shm_ring_pop(ShmRing* ring, char* buf, size_t cap) {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head == ring->tail.load(std::memory_order_acquire)) {
+        return -1;
+    }
+    ShmSlot& slot = ring->slots[head & (SHM_RING_SLOTS - 1)];
+    size_t len = slot.len < cap ? slot.len : cap;
+    memcpy(buf, slot.data, len);
+    ring->head.store(head + 1, std::memory_order_release);
+    return (int)len;
+}
+
+// Busy-poll until one of the rings has a message or the window runs out,
+// adapting the window to how that went
+static inline bool shm_spin_until_any(ShmRing** rings, int count, ShmSpin* spin) {
+    if (spin->window_ns <= 0) {
+        for (int r = 0; r < count; r++) {
+            if (!shm_ring_empty(rings[r])) {
+                return true;
+            }
+        }
+        return false;
+    }
+    long long deadline = shm_now_ns() + spin->window_ns;
+    do {
+        for (int i = 0; i < 64; i++) {
+            for (int r = 0; r < count; r++) {
+                if (!shm_ring_empty(rings[r])) {
+                    spin->window_ns *= 2;
+                    if (spin->window_ns > SHM_SPIN_MAX_NS) {
+                        spin->window_ns = SHM_SPIN_MAX_NS;
+                    }
+                    return true;
+                }
+            }
+            shm_cpu_relax();
+        }
+    } while (shm_now_ns() < deadline);
+    spin->window_ns /= 2;
+    if (spin->window_ns < SHM_SPIN_MIN_NS) {
+        spin->window_ns = SHM_SPIN_MIN_NS;
+    }
+    return false;
+}
+
+// Announce that the consumer is going to sleep. Returns the doorbell value to
+// wait on; the caller must check the ring once more before sleeping.
+static inline uint32_t shm_ring_park(ShmRing* ring) {
+    uint32_t seq = ring->doorbell.load();
+    ring->parked.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return seq;
+}
+
+static inline void shm_ring_unpark(ShmRing* ring) {
+    ring->parked.store(0, std::memory_order_relaxed);
+}
+
+// Blocking receive for a dedicated consumer thread: spin, then sleep
+static inline int shm_ring_wait_pop(ShmRing* ring, char* buf, size_t cap, ShmSpin* spin) {
+    while (1) {
+        int len = shm_ring_pop(ring, buf, cap);
+        if (len >= 0) {
+            return len;
+        }
+        if (shm_spin_until_any(&ring, 1, spin)) {
+            continue;
+        }
+        uint32_t seq = shm_ring_park(ring);
+        if (shm_ring_empty(ring)) {
+            shm_futex_wait(&ring->doorbell, seq, -1);
+        }
+        shm_ring_unpark(ring);
+    }
+}
+
+// Backend side: (re)create the channel. The backend keeps the descriptor
+// open with a shared flock on it for as long as it runs; the kernel drops the
+// lock however the process ends. Returns NULL with errno set on failure.
+static inline ShmChannel* shm_channel_create(const char* name) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (flock(fd, LOCK_SH) == -1 || ftruncate(fd, sizeof(ShmChannel)) == -1) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+    ShmChannel* channel = new (mem) ShmChannel();
+    channel->magic = SHM_MAGIC;
+    channel->requests.head = channel->requests.tail = 0;
+    channel->requests.parked = channel->requests.doorbell = 0;
+    channel->replies.head = channel->replies.tail = 0;
+    channel->replies.parked = channel->replies.doorbell = 0;
+    channel->alive.store(1);
+    return channel;
+}
+
+// A process that holds a shared flock on a segment while it runs (see
+// shm_channel_create()). One killed without its SIGINT cleanup leaves the
+// segment behind, but not its lock.
+static inline bool shm_owner_running(int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        flock(fd, LOCK_UN);
+        return false;
+    }
+    return errno == EWOULDBLOCK;
+}
+
+// Server M side: map a backend's channel, NULL if it is not serving one. The
+// descriptor stays open in *fd_out for shm_owner_running().
+static inline ShmChannel* shm_channel_open(const char* name, int* fd_out) {
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(ShmChannel) ||
+        !shm_owner_running(fd)) {
+        close(fd);
+        return NULL;
+    }
+    void* mem = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    ShmChannel* channel = (ShmChannel*)mem;
+    if (channel->magic != SHM_MAGIC || !channel->alive.load()) {
+        munmap(mem, sizeof(ShmChannel));
+        close(fd);
+        return NULL;
+    }
+    *fd_out = fd;
+    return channel;
+}
+
+// Backend side, on shutdown: tell Server M to go back to UDP. Only uses
+// syscalls, so it is safe from a signal handler.
+static inline void shm_channel_retire(ShmChannel* channel, const char* name) {
+    channel->alive.store(0);
+    shm_ring_wake(&channel->replies);
+    shm_unlink(name);
+}
+
+#endif
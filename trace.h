@@ -0,0 +1,111 @@
+// trace.h - Request tracing shared by Server M and the backends
+
+// Server M picks one client command in every --trace=N and gives it a trace
+// id. The id rides in the request tag of every backend message the command
+// sends ("#<request id>/<trace id hex> ..."); backends already echo the tag
+// back, and record a span from receive to send for any request that has one.
+//
+// Every process appends Chrome trace-event "complete" (ph "X") events, one
+// per line, to TRACE_FILE in the working directory. Timestamps are
+// CLOCK_MONOTONIC, which all processes on the host share, so the spans of
+// one command line up across processes. Server M creates the file with the
+// opening "["; the trace-event format allows the closing "]" to be missing,
+// so the file can be loaded while the servers are still running.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "shmring.h"
+
+#define TRACE_FILE "trace.json"
+#define TRACE_EVENT_MAX 1024
+
+// Statically initialized as { -1, 0, "<process name>" }
+struct TraceLog {
+    int fd;                     // -1 until opened
+    int pid;                    // set when opened
+    const char* process_name;
+};
+
+// Server M (create = true) starts a fresh file; a backend only appends to
+// one Server M has created. Returns false if there is no file to write to.
+static inline bool trace_log_open(TraceLog* log, bool create) {
+    if (log->fd != -1) {
+        return true;
+    }
+    int flags = O_WRONLY | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+    log->fd = open(TRACE_FILE, flags, 0644);
+    if (log->fd == -1) {
+        return false;
+    }
+    log->pid = (int)getpid();
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                       create ? "[\n" : "", log->pid, log->process_name);
+    if (write(log->fd, line, len) != len) {
+        close(log->fd);
+        log->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Trace id from a request tag ("#<id>/<hex>"), 0 when the request is not traced
+static inline unsigned long long trace_id_from_tag(const char* tag, size_t len) {
+    const char* slash = (const char*)memchr(tag, '/', len);
+    return slash == NULL ? 0 : strtoull(slash + 1, NULL, 16);
+}
+
+// Append `text` to `out` as the inside of a JSON string
+static inline void trace_json_escape(std::string& out, const char* text) {
+    for (const char* p = text; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += (char)c;
+        }
+    }
+}
+
+// One span of trace `trace_id`. Each trace gets its own row (tid) in every
+// process. `args` is extra JSON members ("\"key\":value,...") or empty.
+// Each event goes out in a single write(), so processes appending to the
+// same file do not interleave within a line.
+static inline void trace_span(TraceLog* log, unsigned long long trace_id, const char* name,
+                              long long start_ns, long long end_ns, const std::string& args) {
+    if (log->fd == -1 || trace_id == 0) {
+        return;
+    }
+    std::string event = "{\"name\":\"";
+    trace_json_escape(event, name);
+    char fields[256];
+    snprintf(fields, sizeof(fields),
+             "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+             "\"args\":{\"trace\":\"%llx\"",
+             log->process_name, log->pid, (unsigned)(trace_id & 0xffffffffu),
+             start_ns / 1000.0, (end_ns - start_ns) / 1000.0, trace_id);
+    event += fields;
+    if (!args.empty()) {
+        event += ",";
+        event += args;
+    }
+    event += "}},\n";
+    if (event.size() <= TRACE_EVENT_MAX && write(log->fd, event.data(), event.size()) == -1) {
+        perror("write trace");
+    }
+}
+
+#endif
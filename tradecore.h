@@ -0,0 +1,117 @@
+// tradecore.h - Socket-free trading logic shared by the client and servers
+
+// Everything here is pure computation on strings and maps: no sockets, no
+// globals, no logging. Keeping it out of the main()-bearing files lets the
+// microbenchmarks in bench.cpp link the exact code the servers run.
+
+#ifndef TRADECORE_H
+#define TRADECORE_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+
+// Split on `delimiter`, dropping empty fields
+static inline std::vector<std::string> split_string(const std::string& str, char delimiter) {
+    std::vector<std::string> tokens;
+    std::stringstream ss(str);
+    std::string token;
+
+    while (std::getline(ss, token, delimiter)) {
+        if (!token.empty()) {
+            tokens.push_back(token);
+        }
+    }
+
+    return tokens;
+}
+
+// Whole-string integer parse, false for junk, trailing characters or a value
+// out of int range (std::stoi would throw instead)
+static inline bool parse_int(const std::string& str, int* value) {
+    if (str.empty()) {
+        return false;
+    }
+    char* end = NULL;
+    errno = 0;
+    long parsed = strtol(str.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || parsed < -2147483647L - 1 || parsed > 2147483647L) {
+        return false;
+    }
+    *value = (int)parsed;
+    return true;
+}
+
+// The same for a double; overflow to infinity is rejected
+static inline bool parse_double(const std::string& str, double* value) {
+    if (str.empty()) {
+        return false;
+    }
+    char* end = NULL;
+    errno = 0;
+    double parsed = strtod(str.c_str(), &end);
+    if (errno == ERANGE || *end != '\0') {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+// Password encryption (offset by +3), in place. Letters wrap within their
+// case, digits within 0-9, and special characters remain unchanged.
+static inline void encrypt_password(char* password) {
+    for (int i = 0; password[i] != '\0'; i++) {
+        if (isalpha(password[i])) {
+            char base = islower(password[i]) ? 'a' : 'A';
+            password[i] = ((password[i] - base + 3) % 26) + base;
+        }
+        else if (isdigit(password[i])) {
+            password[i] = ((password[i] - '0' + 3) % 10) + '0';
+        }
+    }
+}
+
+// Data structure for a single stock holding
+struct StockHolding {
+    std::string stock_name;
+    int shares;
+    double avg_price;
+
+    // Default constructor needed for std::map
+    StockHolding() : stock_name(""), shares(0), avg_price(0.0) {}
+
+    StockHolding(std::string name, int qty, double price)
+        : stock_name(name), shares(qty), avg_price(price) {}
+};
+
+// Portfolio is a map of stock symbols to holdings
+typedef std::map<std::string, StockHolding> Portfolio;
+
+// Add shares at `price`, folding them into the average buy price
+static inline void apply_buy(Portfolio& portfolio, const std::string& stock_name, int num_shares, double price) {
+    if (portfolio.find(stock_name) == portfolio.end()) {
+        portfolio[stock_name] = StockHolding(stock_name, num_shares, price);
+    } else {
+        StockHolding& holding = portfolio[stock_name];
+
+        double old_value = holding.shares * holding.avg_price;
+        double new_value = num_shares * price;
+        int total_shares = holding.shares + num_shares;
+
+        holding.avg_price = (old_value + new_value) / total_shares;
+        holding.shares = total_shares;
+    }
+}
+
+// Remove shares the caller has checked are there, returns the realized profit/loss
+static inline double apply_sell(Portfolio& portfolio, const std::string& stock_name, int num_shares, double price) {
+    StockHolding& holding = portfolio[stock_name];
+    holding.shares -= num_shares;
+    return num_shares * (price - holding.avg_price);
+}
+
+#endif
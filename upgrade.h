@@ -0,0 +1,180 @@
+// upgrade.h - Socket handover from a running Server M to its replacement
+
+// `./serverM --upgrade` connects to the running Server M over the Unix
+// socket UPGRADE_SOCKET_PATH and receives its TCP listener and UDP socket
+// with SCM_RIGHTS. From then on the new process accepts every connection;
+// the old one finishes the commands in progress and hands each session over
+// (client socket, username and unread input) as soon as it is idle, then
+// exits. Clients never see their connection drop.
+//
+// The connection carries records, one per SOCK_SEQPACKET message: a kind
+// byte, then the payload, with any descriptors attached.
+//
+//   UPGRADE_LISTENERS    old -> new  "<first request id>", TCP and UDP sockets
+//   UPGRADE_CONNECTION   old -> new  an accepted connection that was waiting for a session slot
+//   UPGRADE_SESSION      old -> new  "<username>\n<unread input>", the client socket
+//   UPGRADE_DATAGRAM     either way  a backend reply that belongs to the other process
+//
+// Both processes share the UDP socket, so a backend reply can be read by
+// either. Request ids tell them apart: the new process numbers its requests
+// from the id in UPGRADE_LISTENERS on, and each side passes on the replies
+// to the other side's requests.
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPGRADE_SOCKET_PATH "serverM.upgrade"
+#define UPGRADE_MAX_PAYLOAD (16 * 1024)
+#define UPGRADE_MAX_FDS 2
+
+enum UpgradeKind {
+    UPGRADE_LISTENERS = 1,
+    UPGRADE_CONNECTION,
+    UPGRADE_SESSION,
+    UPGRADE_DATAGRAM
+};
+
+struct UpgradeRecord {
+    int kind;
+    char payload[UPGRADE_MAX_PAYLOAD];
+    size_t len;
+    int fds[UPGRADE_MAX_FDS];
+    int fd_count;
+};
+
+static inline void upgrade_socket_addr(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+// Non-blocking listener at `path`, replacing whatever is there. Only this
+// user may connect: whoever does gets the server's sockets.
+static inline int upgrade_listen(const char* path) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_un addr;
+    upgrade_socket_addr(&addr, path);
+    unlink(path);
+    mode_t old_mask = umask(077);
+    int ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret == -1 || listen(fd, 1) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static inline int upgrade_connect(const char* path) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_un addr;
+    upgrade_socket_addr(&addr, path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static inline bool upgrade_send(int sock, int kind, const char* payload, size_t len,
+                                const int* fds, int fd_count) {
+    char kind_byte = (char)kind;
+    struct iovec parts[2];
+    parts[0].iov_base = &kind_byte;
+    parts[0].iov_len = 1;
+    parts[1].iov_base = (void*)payload;
+    parts[1].iov_len = len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read one record. Returns 1 with a record, 0 at the end of the stream and
+// -1 on error (EAGAIN when `flags` has MSG_DONTWAIT and nothing is waiting).
+// Descriptors that come with a record belong to the caller.
+static inline int upgrade_recv(int sock, UpgradeRecord* record, int flags) {
+    char kind_byte = 0;
+    struct iovec parts[2];
+    parts[0].iov_base = &kind_byte;
+    parts[0].iov_len = 1;
+    parts[1].iov_base = record->payload;
+    parts[1].iov_len = sizeof(record->payload);
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return (int)n;
+    }
+
+    record->kind = (unsigned char)kind_byte;
+    record->len = (size_t)n - 1;
+    record->fd_count = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int received[UPGRADE_MAX_FDS];
+        memcpy(received, CMSG_DATA(cmsg), sizeof(int) * count);
+        for (int i = 0; i < count; i++) {
+            record->fds[record->fd_count++] = received[i];
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int i = 0; i < record->fd_count; i++) {
+            close(record->fds[i]);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 1;
+}
+
+#endif
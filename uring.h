@@ -0,0 +1,265 @@
+// uring.h - Minimal io_uring wrapper used by Server M's io_uring I/O backend
+
+// Talks to the kernel through the raw io_uring_setup/io_uring_enter syscalls
+// so the project keeps building without liburing. Only the pieces Server M
+// needs are here: ring setup/teardown, SQE preparation helpers, submission
+// with an optional timeout, and CQE reaping.
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+struct Uring {
+    int fd;
+    unsigned features;
+
+    // Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_pending;       // SQEs filled in but not yet handed to the kernel
+
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Mappings, kept for teardown
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+
+// Returns 0 on success or -errno (e.g. -ENOSYS/-EPERM when io_uring is unavailable)
+static inline int uring_init(Uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    ring->fd = fd;
+    ring->features = params.features;
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        ring->fd = -1;
+        return -err;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            int err = errno;
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            close(fd);
+            ring->fd = -1;
+            return -err;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int err = errno;
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        close(fd);
+        ring->fd = -1;
+        return -err;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = (char*)ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Identity-map the SQ index array once, slots are then used in order
+    for (unsigned i = 0; i <= *ring->sq_mask; i++) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+static inline void uring_exit(Uring* ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Next free SQE (zeroed), or NULL if the submission queue is full
+static inline struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+// Publish pending SQEs, then wait for at least min_complete completions.
+// timeout_ms < 0 waits forever. Returns the number submitted or -errno
+// (-ETIME on timeout, -EINTR when a signal arrived).
+static inline int uring_enter(Uring* ring, unsigned min_complete, int timeout_ms) {
+    unsigned to_submit = ring->sq_pending;
+    if (to_submit) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+    }
+
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void* argp = NULL;
+    size_t argsz = 0;
+    if (min_complete && timeout_ms >= 0 && (ring->features & IORING_FEAT_EXT_ARG)) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, argp, argsz);
+    return ret < 0 ? -errno : ret;
+}
+
+// Copy out the oldest completion, if any, and release its slot
+static inline bool uring_pop_cqe(Uring* ring, struct io_uring_cqe* out) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *out = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline void uring_prep_rw(struct io_uring_sqe* sqe, int op, int fd, const void* addr,
+                                 unsigned len, unsigned long long offset, unsigned long long user_data) {
+    sqe->opcode = (unsigned char)op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_multishot_accept(struct io_uring_sqe* sqe, int listen_fd,
+                                               unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_ACCEPT, listen_fd, NULL, 0, 0, user_data);
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+static inline void uring_prep_accept(struct io_uring_sqe* sqe, int listen_fd,
+                                     unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_ACCEPT, listen_fd, NULL, 0, 0, user_data);
+}
+
+// Hand nr buffers of len bytes starting at addr to buffer group bgid, ids from bid
+static inline void uring_prep_provide_buffers(struct io_uring_sqe* sqe, void* addr, unsigned len,
+                                              int nr, int bgid, int bid, unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_PROVIDE_BUFFERS, nr, addr, len, (unsigned)bid, user_data);
+    sqe->buf_group = (unsigned short)bgid;
+}
+
+// Receive into a kernel-selected buffer from group bgid, the id comes back in cqe->flags
+static inline void uring_prep_recv_select(struct io_uring_sqe* sqe, int fd, unsigned len, int bgid,
+                                          unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_RECV, fd, NULL, len, 0, user_data);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = (unsigned short)bgid;
+}
+
+// Keeps receiving into buffers from group bgid until it fails or runs out of
+// buffers; every CQE but the last has IORING_CQE_F_MORE set
+static inline void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, int bgid,
+                                             unsigned long long user_data) {
+    uring_prep_recv_select(sqe, fd, 0, bgid, user_data);
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, unsigned len,
+                                   int msg_flags, unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_SEND, fd, buf, len, 0, user_data);
+    sqe->msg_flags = (unsigned)msg_flags;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg,
+                                      unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_SENDMSG, fd, msg, 1, 0, user_data);
+}
+
+static inline void uring_prep_recvmsg(struct io_uring_sqe* sqe, int fd, struct msghdr* msg,
+                                      unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_RECVMSG, fd, msg, 1, 0, user_data);
+}
+
+// One readiness notification for fd, `events` as for poll(2)
+static inline void uring_prep_poll_add(struct io_uring_sqe* sqe, int fd, unsigned events,
+                                       unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_POLL_ADD, fd, NULL, 0, 0, user_data);
+    sqe->poll32_events = events;
+}
+
+// Cancel the request submitted with user_data `target`
+static inline void uring_prep_cancel(struct io_uring_sqe* sqe, unsigned long long target,
+                                     unsigned long long user_data) {
+    uring_prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, (const void*)(uintptr_t)target, 0, 0, user_data);
+}
+
+#endif